@@ -37,7 +37,32 @@
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
+#include "raybatch.h"
+#include "shapes/triangle.h"
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+#ifdef PBRT_HAVE_SSE
+#include <xmmintrin.h>
+#endif
+#ifdef PBRT_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef PBRT_HAVE_AVX
+#include <immintrin.h>
+#endif
 
 namespace pbrt {
 
@@ -45,8 +70,27 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_COUNTER("BVH/Wide nodes", wideBVHNodes);
+STAT_COUNTER("BVH/Spatial splits", spatialSplits);
+STAT_COUNTER("BVH/Duplicated references", duplicatedReferences);
+STAT_COUNTER("BVH/Restructured treelets", restructuredTreelets);
+STAT_INT_DISTRIBUTION("BVH/Nodes visited per benchmarked ray",
+                      benchmarkNodesVisited);
+STAT_INT_DISTRIBUTION("BVH/Cache lines touched per benchmarked ray",
+                      benchmarkLinesTouched);
+STAT_FLOAT_DISTRIBUTION("BVH/Build time (seconds)", buildSeconds);
+STAT_RATIO("BVH/Rays per batched node visit", batchNodeRays,
+           batchNodeVisits);
+STAT_RATIO("BVH/Triangles per triangle group", groupedTriangles,
+           triangleGroupCount);
 
 // BVHAccel Local Declarations
+// A primitive to be stored in the BVH: either _primitives[index]_, or, if
+// _triIndex_ is not -1, a triangle of _meshes[index]_.
+struct BVHItem {
+    int index, triIndex;
+};
+
 struct BVHPrimitiveInfo {
     BVHPrimitiveInfo() {}
     BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3f &bounds)
@@ -65,6 +109,7 @@ struct BVHBuildNode {
         nPrimitives = n;
         bounds = b;
         children[0] = children[1] = nullptr;
+        triangleLeaf = false;
         ++leafNodes;
         ++totalLeafNodes;
         totalPrimitives += n;
@@ -75,11 +120,16 @@ struct BVHBuildNode {
         bounds = Union(c0->bounds, c1->bounds);
         splitAxis = axis;
         nPrimitives = 0;
+        triangleLeaf = false;
         ++interiorNodes;
     }
     Bounds3f bounds;
     BVHBuildNode *children[2];
     int splitAxis, firstPrimOffset, nPrimitives;
+    // Set once leaves have been packed if the leaf holds _TriangleGroup_s
+    bool triangleLeaf;
+    // SAH cost of the subtree, used while optimizing treelets
+    Float cost;
 };
 
 struct MortonPrimitive {
@@ -95,14 +145,260 @@ struct LBVHTreelet {
 struct LinearBVHNode {
     Bounds3f bounds;
     union {
-        int primitivesOffset;   // leaf
-        int secondChildOffset;  // interior
+        int primitivesOffset;  // leaf
+        int childrenOffset;    // interior: both children are adjacent
     };
     uint16_t nPrimitives;  // 0 -> interior node
     uint8_t axis;          // interior node: xyz
-    uint8_t pad[1];        // ensure 32 byte total size
+    uint8_t triangleLeaf;  // leaf: primitives are _TriangleGroup_s
+};
+
+template <int N>
+inline int IntersectWideBounds(const Float bMin[3][N], const Float bMax[3][N],
+                               const Ray &ray, const Vector3f &invDir,
+                               const int dirIsNeg[3], Float tNear[N]);
+
+template <int N>
+struct WideBVHNode {
+    static PBRT_CONSTEXPR int Width = N;
+    // WideBVHNode Public Methods
+    void SetChildBounds(int nChildren, const Bounds3f childBounds[N]) {
+        for (int i = 0; i < N; ++i)
+            for (int a = 0; a < 3; ++a) {
+                // Unused child slots get empty bounds
+                bMin[a][i] = i < nChildren ? childBounds[i].pMin[a] : Infinity;
+                bMax[a][i] =
+                    i < nChildren ? childBounds[i].pMax[a] : -Infinity;
+            }
+    }
+    int IntersectChildren(const Ray &ray, const Vector3f &invDir,
+                          const int dirIsNeg[3], Float tNear[N]) const {
+        return IntersectWideBounds<N>(bMin, bMax, ray, invDir, dirIsNeg,
+                                      tNear);
+    }
+
+    // Child bounds are stored SoA so that all _N_ children can be tested
+    // with a single SIMD slab test; unused slots have empty bounds.
+    Float bMin[3][N], bMax[3][N];
+    int32_t offset[N];       // leaf: primitives offset; interior: node index
+    // 0 -> interior child (or unused if offset < 0); negative for leaves
+    // of _TriangleGroup_s
+    int32_t nPrimitives[N];
+};
+
+// Returns $2^e$ for the grid exponents stored in _QuantizedBVHNode_s
+inline Float PowerOfTwo(int e) {
+#ifdef PBRT_FLOAT_AS_DOUBLE
+    return std::ldexp(1., e);
+#else
+    return BitsToFloat(uint32_t(e + 127) << 23);
+#endif
+}
+
+// Compressed variant of _WideBVHNode_: each child box is stored with 8 bits
+// per coordinate on a grid with power-of-two spacing anchored at the
+// minimum corner of the node's bounds, which lets a 4-wide node fit in a
+// single 64-byte cache line. Decoded boxes always contain the exact ones.
+template <int N>
+struct QuantizedBVHNode {
+    static PBRT_CONSTEXPR int Width = N;
+    // QuantizedBVHNode Public Methods
+    void SetChildBounds(int nChildren, const Bounds3f childBounds[N]);
+    int IntersectChildren(const Ray &ray, const Vector3f &invDir,
+                          const int dirIsNeg[3], Float tNear[N]) const;
+    Float Decode(int axis, int q) const {
+        return origin[axis] + Float(q) * PowerOfTwo(exponent[axis]);
+    }
+
+    Float origin[3];
+    int8_t exponent[3];
+    uint8_t nChildren;
+    int32_t offset[N];
+    int16_t nPrimitives[N];
+    uint8_t qMin[3][N], qMax[3][N];
+};
+
+#ifndef PBRT_FLOAT_AS_DOUBLE
+static_assert(sizeof(QuantizedBVHNode<4>) == 64,
+              "QuantizedBVHNode<4> should fill one 64-byte cache line");
+#endif
+
+template <int N>
+void QuantizedBVHNode<N>::SetChildBounds(int nChildren,
+                                         const Bounds3f childBounds[N]) {
+    this->nChildren = nChildren;
+    Bounds3f bounds;
+    for (int i = 0; i < nChildren; ++i) bounds = Union(bounds, childBounds[i]);
+    for (int a = 0; a < 3; ++a) {
+        origin[a] = bounds.pMin[a];
+        // Start with the smallest grid spacing whose 255 steps can cover the
+        // bounds; coarsen it if rounding keeps any child from fitting
+        int exp;
+        std::frexp((bounds.pMax[a] - bounds.pMin[a]) / 255, &exp);
+        if (bounds.pMax[a] == bounds.pMin[a]) exp = -126;
+        for (exp = Clamp(exp, -126, 127);; ++exp) {
+            CHECK_LE(exp, 127);
+            exponent[a] = exp;
+            Float spacing = PowerOfTwo(exp);
+            bool fits = true;
+            for (int i = 0; i < N; ++i) {
+                if (i >= nChildren) {
+                    qMin[a][i] = qMax[a][i] = 0;
+                    continue;
+                }
+                Float cMin = childBounds[i].pMin[a];
+                Float cMax = childBounds[i].pMax[a];
+                int lo = Clamp(int(std::floor((cMin - origin[a]) / spacing)),
+                               0, 255);
+                int hi = Clamp(int(std::ceil((cMax - origin[a]) / spacing)),
+                               0, 255);
+                while (lo > 0 && Decode(a, lo) > cMin) --lo;
+                while (hi < 255 && Decode(a, hi) < cMax) ++hi;
+                qMin[a][i] = lo;
+                qMax[a][i] = hi;
+                if (Decode(a, hi) < cMax) fits = false;
+            }
+            if (fits) break;
+        }
+    }
+}
+
+template <int N>
+int QuantizedBVHNode<N>::IntersectChildren(const Ray &ray,
+                                           const Vector3f &invDir,
+                                           const int dirIsNeg[3],
+                                           Float tNear[N]) const {
+    // Decode child bounds and run the usual slab test on them
+    Float bMin[3][N], bMax[3][N];
+    for (int a = 0; a < 3; ++a) {
+        Float spacing = PowerOfTwo(exponent[a]);
+#ifdef PBRT_HAVE_SSE2
+        if (N % 4 == 0) {
+            const __m128 o = _mm_set1_ps(origin[a]),
+                         s = _mm_set1_ps(spacing);
+            const __m128i zero = _mm_setzero_si128();
+            for (int c = 0; c < N; c += 4) {
+                int32_t packedMin, packedMax;
+                std::memcpy(&packedMin, &qMin[a][c], sizeof(int32_t));
+                std::memcpy(&packedMax, &qMax[a][c], sizeof(int32_t));
+                __m128i lo = _mm_unpacklo_epi16(
+                    _mm_unpacklo_epi8(_mm_cvtsi32_si128(packedMin), zero),
+                    zero);
+                __m128i hi = _mm_unpacklo_epi16(
+                    _mm_unpacklo_epi8(_mm_cvtsi32_si128(packedMax), zero),
+                    zero);
+                _mm_storeu_ps(&bMin[a][c],
+                              _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(lo), s)));
+                _mm_storeu_ps(&bMax[a][c],
+                              _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(hi), s)));
+            }
+            continue;
+        }
+#endif  // PBRT_HAVE_SSE2
+        for (int i = 0; i < N; ++i) {
+            bMin[a][i] = origin[a] + Float(qMin[a][i]) * spacing;
+            bMax[a][i] = origin[a] + Float(qMax[a][i]) * spacing;
+        }
+    }
+    return IntersectWideBounds<N>(bMin, bMax, ray, invDir, dirIsNeg, tNear) &
+           ((1 << nChildren) - 1);
+}
+
+struct WideBVHStackEntry {
+    int offset, nPrimitives;
+    Float tNear;
+};
+
+// Per-ray counts gathered in the BVH's benchmark mode: the number of nodes
+// visited and the number of distinct cache lines of node and leaf data
+// read while tracing the ray.
+struct TraversalStats {
+    // TraversalStats Public Methods
+    void VisitNode(const void *node, size_t size) {
+        ++nodesVisited;
+        Touch(node, size);
+    }
+    void Touch(const void *data, size_t size) {
+        uintptr_t first = uintptr_t(data) / PBRT_L1_CACHE_LINE_SIZE;
+        uintptr_t last =
+            (uintptr_t(data) + size - 1) / PBRT_L1_CACHE_LINE_SIZE;
+        for (uintptr_t line = first; line <= last; ++line) {
+            // Lines beyond the first _maxLines_ are counted each time
+            if (std::find(lines, lines + nLines, line) != lines + nLines)
+                continue;
+            if (nLines < maxLines) lines[nLines++] = line;
+            ++linesTouched;
+        }
+    }
+    void Report() const {
+        ReportValue(benchmarkNodesVisited, nodesVisited);
+        ReportValue(benchmarkLinesTouched, linesTouched);
+    }
+
+    // TraversalStats Public Data
+    static PBRT_CONSTEXPR int maxLines = 512;
+    uintptr_t lines[maxLines];
+    int nLines = 0;
+    int64_t nodesVisited = 0, linesTouched = 0;
 };
 
+// Computes the keys of cached BVHs: a 64-bit FNV-1a style hash over 64-bit
+// words, each of which is first mixed so that all of its bits affect the
+// low bits of the hash.
+class BVHCacheHasher {
+  public:
+    // BVHCacheHasher Public Methods
+    template <typename T>
+    void Add(const T &value) {
+        Add(&value, sizeof(T));
+    }
+    void Add(const void *data, size_t bytes) {
+        const char *p = (const char *)data;
+        for (; bytes > 0; p += 8, bytes -= std::min<size_t>(bytes, 8)) {
+            uint64_t word = 0;
+            memcpy(&word, p, std::min<size_t>(bytes, 8));
+            hash = (hash ^ MixBits(word)) * 0x100000001b3ull;
+        }
+    }
+    uint64_t Hash() const { return MixBits(hash); }
+
+  private:
+    // BVHCacheHasher Private Methods
+    static uint64_t MixBits(uint64_t v) {
+        v ^= (v >> 31);
+        v *= 0x7fb5d329728ea185ull;
+        v ^= (v >> 27);
+        v *= 0x81dadef4bc2dd44dull;
+        v ^= (v >> 33);
+        return v;
+    }
+
+    // BVHCacheHasher Private Data
+    uint64_t hash = 0xcbf29ce484222325ull;
+};
+
+// Cached BVHs are stored in a file that starts with this header, followed
+// by the node array, the _TriangleGroup_s, and, for each entry of
+// _primitives_, the index of the primitive that was passed to the
+// constructor. Each array starts at a multiple of _cacheAlignment_ bytes so
+// that the file can be mapped into memory and used directly. The header
+// only holds trivially copyable types so that it can be copied bytewise.
+struct BVHCacheHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t fileBytes;
+    uint64_t nodesOffset, groupsOffset, primitivesOffset;
+    int32_t nNodes, nGroups, nPrimitives;
+    Float boundsMin[3], boundsMax[3];
+};
+
+static const char bvhCacheMagic[8] = {'p', 'b', 'r', 't', 'B', 'V', 'H', '1'};
+static PBRT_CONSTEXPR size_t cacheAlignment = 64;
+
+inline uint64_t AlignCacheOffset(uint64_t offset) {
+    return (offset + cacheAlignment - 1) & ~uint64_t(cacheAlignment - 1);
+}
+
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
     CHECK_LE(x, (1 << 10));
@@ -136,6 +432,239 @@ inline uint32_t EncodeMorton3(const Vector3f &v) {
     return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
 }
 
+template <int N>
+static int CollapseBVHNode(BVHBuildNode *node, BVHBuildNode *children[N]) {
+    if (node->nPrimitives > 0) {
+        children[0] = node;
+        return 1;
+    }
+    // Open the interior child with the largest surface area until _N_
+    // children have been collected
+    int nChildren = 2;
+    children[0] = node->children[0];
+    children[1] = node->children[1];
+    while (nChildren < N) {
+        int best = -1;
+        Float bestArea = -1;
+        for (int i = 0; i < nChildren; ++i) {
+            if (children[i]->nPrimitives > 0) continue;
+            Float area = children[i]->bounds.SurfaceArea();
+            if (area > bestArea) {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if (best == -1) break;
+        BVHBuildNode *open = children[best];
+        children[best] = open->children[0];
+        children[nChildren++] = open->children[1];
+    }
+    return nChildren;
+}
+
+template <int N>
+static int CountWideBVHNodes(BVHBuildNode *node) {
+    BVHBuildNode *children[N];
+    int nChildren = CollapseBVHNode<N>(node, children);
+    int count = 1;
+    for (int i = 0; i < nChildren; ++i)
+        if (children[i] != node && children[i]->nPrimitives == 0)
+            count += CountWideBVHNodes<N>(children[i]);
+    return count;
+}
+
+// Computes the ray's parametric entry point for each of the node's children
+// and returns a bitmask of the children that it intersects.
+template <int N>
+inline int IntersectWideBounds(const Float bMin[3][N], const Float bMax[3][N],
+                               const Ray &ray, const Vector3f &invDir,
+                               const int dirIsNeg[3], Float tNear[N]) {
+    const Float *bNear[3] = {dirIsNeg[0] ? bMax[0] : bMin[0],
+                            dirIsNeg[1] ? bMax[1] : bMin[1],
+                            dirIsNeg[2] ? bMax[2] : bMin[2]};
+    const Float *bFar[3] = {dirIsNeg[0] ? bMin[0] : bMax[0],
+                           dirIsNeg[1] ? bMin[1] : bMax[1],
+                           dirIsNeg[2] ? bMin[2] : bMax[2]};
+    // As in _Bounds3::IntersectP()_, far slab distances are scaled up
+    // slightly to ensure conservative results.
+    const Float scale = 1 + 2 * gamma(3);
+    int mask = 0;
+#ifdef PBRT_HAVE_AVX
+    if (N % 8 == 0) {
+        const __m256 o[3] = {_mm256_set1_ps(ray.o.x), _mm256_set1_ps(ray.o.y),
+                             _mm256_set1_ps(ray.o.z)};
+        const __m256 id[3] = {_mm256_set1_ps(invDir.x),
+                              _mm256_set1_ps(invDir.y),
+                              _mm256_set1_ps(invDir.z)};
+        const __m256 s = _mm256_set1_ps(scale);
+        for (int c = 0; c < N; c += 8) {
+            __m256 t0 = _mm256_setzero_ps(),
+                   t1 = _mm256_set1_ps(ray.tMax);
+            for (int a = 0; a < 3; ++a) {
+                __m256 tn = _mm256_mul_ps(
+                    _mm256_sub_ps(_mm256_loadu_ps(bNear[a] + c), o[a]), id[a]);
+                __m256 tf = _mm256_mul_ps(
+                    _mm256_mul_ps(
+                        _mm256_sub_ps(_mm256_loadu_ps(bFar[a] + c), o[a]),
+                        id[a]),
+                    s);
+                t0 = _mm256_max_ps(tn, t0);
+                t1 = _mm256_min_ps(tf, t1);
+            }
+            _mm256_storeu_ps(tNear + c, t0);
+            mask |= _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))
+                    << c;
+        }
+        return mask;
+    }
+#endif  // PBRT_HAVE_AVX
+#ifdef PBRT_HAVE_SSE
+    if (N % 4 == 0) {
+        const __m128 o[3] = {_mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y),
+                             _mm_set1_ps(ray.o.z)};
+        const __m128 id[3] = {_mm_set1_ps(invDir.x), _mm_set1_ps(invDir.y),
+                              _mm_set1_ps(invDir.z)};
+        const __m128 s = _mm_set1_ps(scale);
+        for (int c = 0; c < N; c += 4) {
+            __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(ray.tMax);
+            for (int a = 0; a < 3; ++a) {
+                __m128 tn =
+                    _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bNear[a] + c), o[a]),
+                               id[a]);
+                __m128 tf = _mm_mul_ps(
+                    _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bFar[a] + c), o[a]),
+                               id[a]),
+                    s);
+                // Operand order matters here: _mm_max_ps()/_mm_min_ps()
+                // return their second argument if either is NaN, which
+                // matches the scalar code's handling of $0 \cdot \infty$.
+                t0 = _mm_max_ps(tn, t0);
+                t1 = _mm_min_ps(tf, t1);
+            }
+            _mm_storeu_ps(tNear + c, t0);
+            mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << c;
+        }
+        return mask;
+    }
+#endif  // PBRT_HAVE_SSE
+    for (int c = 0; c < N; ++c) {
+        Float t0 = 0, t1 = ray.tMax;
+        for (int a = 0; a < 3; ++a) {
+            Float tn = (bNear[a][c] - ray.o[a]) * invDir[a];
+            Float tf = (bFar[a][c] - ray.o[a]) * invDir[a] * scale;
+            if (tn > t0) t0 = tn;
+            if (tf < t1) t1 = tf;
+        }
+        tNear[c] = t0;
+        if (t0 <= t1) mask |= 1 << c;
+    }
+    return mask;
+}
+
+template <typename Node>
+static bool IntersectWideBVH(
+    const Node *nodes,
+    const std::vector<std::shared_ptr<Primitive>> &primitives,
+    const TriangleGroup *groups,
+    const std::shared_ptr<TriangleMeshPrimitive> *meshes, const Ray &ray,
+    SurfaceInteraction *isect, TraversalStats *stats) {
+    PBRT_CONSTEXPR int N = Node::Width;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    // Follow ray through wide BVH nodes, visiting children front to back
+    WideBVHStackEntry toVisit[64 * (N - 1)];
+    int toVisitOffset = 0;
+    WideBVHStackEntry current = {0, 0, 0};
+    while (true) {
+        if (current.nPrimitives > 0) {
+            // Intersect ray with primitives in leaf
+            if (stats)
+                stats->Touch(&primitives[current.offset],
+                             current.nPrimitives * sizeof(primitives[0]));
+            for (int i = 0; i < current.nPrimitives; ++i)
+                if (primitives[current.offset + i]->Intersect(ray, isect))
+                    hit = true;
+        } else if (current.nPrimitives < 0) {
+            // Intersect ray with triangle groups in leaf
+            if (stats)
+                stats->Touch(&groups[current.offset],
+                             -current.nPrimitives * sizeof(TriangleGroup));
+            for (int i = 0; i < -current.nPrimitives; ++i)
+                if (groups[current.offset + i].Intersect(ray, isect, meshes))
+                    hit = true;
+        } else {
+            // Push intersected children so that the nearest is on top
+            const Node &node = nodes[current.offset];
+            if (stats) stats->VisitNode(&node, sizeof(Node));
+            Float tNear[N];
+            int mask = node.IntersectChildren(ray, invDir, dirIsNeg, tNear);
+            WideBVHStackEntry hits[N];
+            int nHits = 0;
+            for (int i = 0; i < N; ++i) {
+                if (!(mask & (1 << i))) continue;
+                WideBVHStackEntry e = {node.offset[i], node.nPrimitives[i],
+                                       tNear[i]};
+                int j = nHits++;
+                for (; j > 0 && hits[j - 1].tNear < e.tNear; --j)
+                    hits[j] = hits[j - 1];
+                hits[j] = e;
+            }
+            for (int i = 0; i < nHits; ++i) toVisit[toVisitOffset++] = hits[i];
+        }
+        // Pop next node, skipping those beyond the closest hit found so far
+        do {
+            if (toVisitOffset == 0) return hit;
+            current = toVisit[--toVisitOffset];
+        } while (current.tNear > ray.tMax);
+    }
+}
+
+template <typename Node>
+static bool IntersectPWideBVH(
+    const Node *nodes,
+    const std::vector<std::shared_ptr<Primitive>> &primitives,
+    const TriangleGroup *groups,
+    const std::shared_ptr<TriangleMeshPrimitive> *meshes, const Ray &ray,
+    TraversalStats *stats) {
+    PBRT_CONSTEXPR int N = Node::Width;
+    ProfilePhase p(Prof::AccelIntersectP);
+    Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    WideBVHStackEntry toVisit[64 * (N - 1)];
+    int toVisitOffset = 0;
+    WideBVHStackEntry current = {0, 0, 0};
+    while (true) {
+        if (current.nPrimitives > 0) {
+            if (stats)
+                stats->Touch(&primitives[current.offset],
+                             current.nPrimitives * sizeof(primitives[0]));
+            for (int i = 0; i < current.nPrimitives; ++i)
+                if (primitives[current.offset + i]->IntersectP(ray))
+                    return true;
+        } else if (current.nPrimitives < 0) {
+            if (stats)
+                stats->Touch(&groups[current.offset],
+                             -current.nPrimitives * sizeof(TriangleGroup));
+            for (int i = 0; i < -current.nPrimitives; ++i)
+                if (groups[current.offset + i].IntersectP(ray, meshes))
+                    return true;
+        } else {
+            const Node &node = nodes[current.offset];
+            if (stats) stats->VisitNode(&node, sizeof(Node));
+            Float tNear[N];
+            int mask = node.IntersectChildren(ray, invDir, dirIsNeg, tNear);
+            for (int i = 0; i < N; ++i)
+                if (mask & (1 << i))
+                    toVisit[toVisitOffset++] = {node.offset[i],
+                                                node.nPrimitives[i], tNear[i]};
+        }
+        if (toVisitOffset == 0) return false;
+        current = toVisit[--toVisitOffset];
+    }
+}
+
 static void RadixSort(std::vector<MortonPrimitive> *v) {
     std::vector<MortonPrimitive> tempVector(v->size());
     PBRT_CONSTEXPR int bitsPerPass = 6;
@@ -179,98 +708,372 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
     if (nPasses & 1) std::swap(*v, tempVector);
 }
 
+// Treelets are grown to this many leaves before searching for their
+// optimal topology; subtrees above _parallelTreeletDepth_ are optimized in
+// parallel.
+static PBRT_CONSTEXPR int maxTreeletLeaves = 7;
+static PBRT_CONSTEXPR int parallelTreeletDepth = 6;
+
+// Links the treelet nodes for the leaves in _subset_ according to
+// _bestPartition_, taking interior nodes from _interiors_.
+static BVHBuildNode *EmitTreelet(int subset, BVHBuildNode *const leaves[],
+                                 BVHBuildNode *const interiors[],
+                                 int *nextInterior, const int bestPartition[],
+                                 const Float cost[], const Bounds3f bounds[]) {
+    if ((subset & (subset - 1)) == 0) return leaves[Log2Int(subset)];
+    BVHBuildNode *node = interiors[(*nextInterior)++];
+    int p = bestPartition[subset];
+    BVHBuildNode *c0 = EmitTreelet(p, leaves, interiors, nextInterior,
+                                   bestPartition, cost, bounds);
+    BVHBuildNode *c1 = EmitTreelet(subset ^ p, leaves, interiors,
+                                   nextInterior, bestPartition, cost, bounds);
+    // Order children along the axis that separates them the most, as
+    // traversal expects
+    Vector3f d = (c1->bounds.pMin + c1->bounds.pMax) -
+                 (c0->bounds.pMin + c0->bounds.pMax);
+    int axis = MaxDimension(Abs(d));
+    if (d[axis] < 0) std::swap(c0, c1);
+    node->children[0] = c0;
+    node->children[1] = c1;
+    node->splitAxis = axis;
+    node->bounds = bounds[subset];
+    node->cost = cost[subset];
+    return node;
+}
+
+// Replaces the treelet rooted at interior node _root_ with the topology
+// over the same leaves that has the lowest SAH cost, following Karras and
+// Aila's treelet restructuring. The costs of the nodes below _root_ must be
+// up to date.
+static void RestructureTreelet(BVHBuildNode *root) {
+    // Grow treelet by expanding the leaf with the largest surface area
+    BVHBuildNode *leaves[maxTreeletLeaves];
+    BVHBuildNode *interiors[maxTreeletLeaves - 1];
+    int nLeaves = 2, nInteriors = 1;
+    leaves[0] = root->children[0];
+    leaves[1] = root->children[1];
+    interiors[0] = root;
+    while (nLeaves < maxTreeletLeaves) {
+        int best = -1;
+        Float bestArea = -1;
+        for (int i = 0; i < nLeaves; ++i) {
+            if (leaves[i]->nPrimitives > 0) continue;
+            Float area = leaves[i]->bounds.SurfaceArea();
+            if (area > bestArea) {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if (best == -1) break;
+        BVHBuildNode *expand = leaves[best];
+        interiors[nInteriors++] = expand;
+        leaves[best] = expand->children[0];
+        leaves[nLeaves++] = expand->children[1];
+    }
+    if (nLeaves < 3) return;
+
+    // Find the lowest-cost binary tree over each subset of the leaves
+    PBRT_CONSTEXPR int maxSubsets = 1 << maxTreeletLeaves;
+    int nSubsets = 1 << nLeaves;
+    Bounds3f bounds[maxSubsets];
+    Float cost[maxSubsets];
+    int bestPartition[maxSubsets];
+    for (int s = 1; s < nSubsets; ++s) {
+        int low = s & -s;
+        if (s == low) {
+            bounds[s] = leaves[Log2Int(s)]->bounds;
+            cost[s] = leaves[Log2Int(s)]->cost;
+            continue;
+        }
+        bounds[s] = Union(bounds[s ^ low], bounds[low]);
+        // Consider each partition once by keeping the lowest leaf in _p_
+        cost[s] = Infinity;
+        for (int p = (s - 1) & s; p; p = (p - 1) & s) {
+            if (!(p & low)) continue;
+            Float c = cost[p] + cost[s ^ p];
+            if (c < cost[s]) {
+                cost[s] = c;
+                bestPartition[s] = p;
+            }
+        }
+        cost[s] += bounds[s].SurfaceArea();
+    }
+
+    // Rebuild treelet if its cost improves enough to matter
+    if (cost[nSubsets - 1] >= root->cost * (1 - 1e-5f)) return;
+    ++restructuredTreelets;
+    int nextInterior = 0;
+    EmitTreelet(nSubsets - 1, leaves, interiors, &nextInterior, bestPartition,
+                cost, bounds);
+    CHECK_EQ(nextInterior, nInteriors);
+}
+
+// Restructures all treelets under _node_ bottom up, so that each treelet
+// is optimized after the subtrees below it.
+static void OptimizeTreelets(BVHBuildNode *node, int depth) {
+    Float area = node->bounds.SurfaceArea();
+    if (node->nPrimitives > 0) {
+        node->cost = node->nPrimitives * area;
+        return;
+    }
+    if (depth < parallelTreeletDepth) {
+        TaskGroup group;
+        group.Spawn([&]() { OptimizeTreelets(node->children[1], depth + 1); });
+        OptimizeTreelets(node->children[0], depth + 1);
+        group.Wait();
+    } else
+        for (int c = 0; c < 2; ++c)
+            OptimizeTreelets(node->children[c], depth + 1);
+    node->cost = area + node->children[0]->cost + node->children[1]->cost;
+    RestructureTreelet(node);
+}
+
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod, int width,
+                   NodeFormat nodeFormat, Float spatialSplitBudget,
+                   int treeletPasses, NodeLayout layout, bool benchmark,
+                   const std::string &cacheDirectory)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
+      width(width),
+      nodeFormat(nodeFormat),
+      spatialSplitBudget(spatialSplitBudget),
+      layout(layout),
+      benchmark(benchmark),
       primitives(std::move(p)) {
+    CHECK(width == 2 || width == 4 || width == 8);
+    CHECK(nodeFormat == NodeFormat::Full || width != 2);
     ProfilePhase _(Prof::AccelConstruction);
     if (primitives.empty()) return;
+    auto buildStart = std::chrono::steady_clock::now();
     // Build BVH from _primitives_
 
-    // Initialize _primitiveInfo_ array for primitives
-    std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-    for (size_t i = 0; i < primitives.size(); ++i)
-        primitiveInfo[i] = {i, primitives[i]->WorldBound()};
+    // Expand triangle meshes into individual build items in place, so that
+    // the tree matches the one built for separate triangle primitives
+    std::vector<BVHItem> items;
+    items.reserve(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        std::shared_ptr<TriangleMeshPrimitive> mesh =
+            std::dynamic_pointer_cast<TriangleMeshPrimitive>(primitives[i]);
+        if (!mesh) {
+            items.push_back({(int)i, -1});
+            continue;
+        }
+        int meshIndex = meshes.size();
+        meshes.push_back(mesh);
+        for (int t = 0; t < mesh->NumTriangles(); ++t)
+            items.push_back({meshIndex, t});
+    }
+    if (items.empty()) return;
+
+    // Use the BVH stored in _cacheDirectory_ if one was built there for the
+    // same geometry and parameters
+    uint64_t key = 0;
+    if (!cacheDirectory.empty()) {
+        key = cacheKey(treeletPasses);
+        cacheFilename = cacheDirectory +
+                        StringPrintf("/bvh-%016" PRIx64 ".cache", key);
+        if (readCache(cacheFilename, key)) {
+            Float seconds = std::chrono::duration<Float>(
+                                std::chrono::steady_clock::now() - buildStart)
+                                .count();
+            LOG(INFO) << StringPrintf("BVH for %d primitives loaded from "
+                                      "\"%s\" in %.3f s",
+                                      (int)items.size(), cacheFilename.c_str(),
+                                      seconds);
+            return;
+        }
+    }
+
+    // Initialize _primitiveInfo_ array for build items
+    std::vector<BVHPrimitiveInfo> primitiveInfo(items.size());
+    ParallelFor([&](int64_t i) {
+        primitiveInfo[i] = {(size_t)i, itemBound(items[i])};
+    }, items.size(), 4096);
 
-    // Build BVH tree for primitives using _primitiveInfo_
+    // Build BVH tree for items using _primitiveInfo_
     MemoryArena arena(1024 * 1024);
+    std::vector<MemoryArena> threadArenas(MaxThreadIndex());
     int totalNodes = 0;
-    std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
+    std::vector<int> orderedItems;
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
-        root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-    else
-        root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-                              &totalNodes, orderedPrims);
-    primitives.swap(orderedPrims);
+        root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedItems);
+    else if (splitMethod == SplitMethod::SBVH) {
+        // Allow spatial splits to add up to _spatialSplitBudget_ references
+        // per item
+        std::atomic<int> nodesCreated(0);
+        std::atomic<int> referenceBudget(
+            std::min<Float>(spatialSplitBudget * items.size(), 1 << 30));
+        Bounds3f rootBounds;
+        for (const BVHPrimitiveInfo &pi : primitiveInfo)
+            rootBounds = Union(rootBounds, pi.bounds);
+        orderedItems.reserve(items.size());
+        root = spatialSplitBuild(threadArenas, items, primitiveInfo,
+                                 rootBounds.SurfaceArea(), &nodesCreated,
+                                 &referenceBudget, &orderedItems);
+        totalNodes = nodesCreated;
+    } else {
+        std::atomic<int> nodesCreated(0);
+        root = recursiveBuild(threadArenas, primitiveInfo, 0, items.size(),
+                              &nodesCreated);
+        totalNodes = nodesCreated;
+        orderedItems.resize(items.size());
+        ParallelFor([&](int64_t i) {
+            orderedItems[i] = primitiveInfo[i].primitiveNumber;
+        }, items.size(), 4096);
+    }
     primitiveInfo.resize(0);
+
+    // Restructure treelets of the tree to reduce its SAH cost
+    for (int pass = 0; pass < treeletPasses; ++pass)
+        OptimizeTreelets(root, 0);
+
+    // Store leaf triangles in _TriangleGroup_s and other primitives in
+    // _primitives_
+    std::vector<std::shared_ptr<Primitive>> orderedPrims;
+    std::vector<TriangleGroup> groups;
+    if (packLeaves(arena, root, items, orderedItems, orderedPrims, groups,
+                   &totalNodes) >= 0)
+        packTriangleLeaf(root, items, orderedItems, groups, &totalNodes);
+    primitives.swap(orderedPrims);
+    triangleGroups = AllocAligned<TriangleGroup>(groups.size());
+    InterleavePages(triangleGroups, groups.size() * sizeof(TriangleGroup));
+    std::copy(groups.begin(), groups.end(), triangleGroups);
+    size_t arenaBytes = arena.TotalAllocated();
+    for (const MemoryArena &a : threadArenas) arenaBytes += a.TotalAllocated();
+    Float seconds = std::chrono::duration<Float>(
+                        std::chrono::steady_clock::now() - buildStart)
+                        .count();
+    ReportValue(buildSeconds, seconds);
     LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
-                              "primitives (%.2f MB), arena allocated %.2f MB",
-                              totalNodes, (int)primitives.size(),
+                              "primitives (%.2f MB) in %.3f s, arena "
+                              "allocated %.2f MB",
+                              totalNodes, (int)items.size(),
                               float(totalNodes * sizeof(LinearBVHNode)) /
                               (1024.f * 1024.f),
-                              float(arena.TotalAllocated()) /
-                              (1024.f * 1024.f));
+                              seconds, float(arenaBytes) / (1024.f * 1024.f));
 
-    // Compute representation of depth-first traversal of BVH tree
-    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
-                 primitives.size() * sizeof(primitives[0]);
-    nodes = AllocAligned<LinearBVHNode>(totalNodes);
-    int offset = 0;
-    flattenBVHTree(root, &offset);
-    CHECK_EQ(totalNodes, offset);
-}
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]) +
+                 meshes.size() * sizeof(meshes[0]) +
+                 groups.size() * sizeof(TriangleGroup);
+    bounds = root->bounds;
+    int offset = 0, nNodes;
+    if (width != 2) {
+        // Collapse binary BVH into _width_-wide nodes
+        nNodes = width == 4 ? CountWideBVHNodes<4>(root)
+                            : CountWideBVHNodes<8>(root);
+        if (nodeFormat == NodeFormat::Quantized && width == 4) {
+            treeBytes += nNodes * sizeof(QuantizedBVHNode<4>);
+            quantizedNodes4 = AllocAligned<QuantizedBVHNode<4>>(nNodes);
+            InterleavePages(quantizedNodes4,
+                            nNodes * sizeof(QuantizedBVHNode<4>));
+            flattenWideBVHTree(root, quantizedNodes4, &offset);
+        } else if (nodeFormat == NodeFormat::Quantized) {
+            treeBytes += nNodes * sizeof(QuantizedBVHNode<8>);
+            quantizedNodes8 = AllocAligned<QuantizedBVHNode<8>>(nNodes);
+            InterleavePages(quantizedNodes8,
+                            nNodes * sizeof(QuantizedBVHNode<8>));
+            flattenWideBVHTree(root, quantizedNodes8, &offset);
+        } else if (width == 4) {
+            treeBytes += nNodes * sizeof(WideBVHNode<4>);
+            wideNodes4 = AllocAligned<WideBVHNode<4>>(nNodes);
+            InterleavePages(wideNodes4, nNodes * sizeof(WideBVHNode<4>));
+            flattenWideBVHTree(root, wideNodes4, &offset);
+        } else {
+            treeBytes += nNodes * sizeof(WideBVHNode<8>);
+            wideNodes8 = AllocAligned<WideBVHNode<8>>(nNodes);
+            InterleavePages(wideNodes8, nNodes * sizeof(WideBVHNode<8>));
+            flattenWideBVHTree(root, wideNodes8, &offset);
+        }
+    } else {
+        // Flatten BVH tree, storing the children of each interior node in
+        // adjacent slots; slot 1 is unused so that sibling pairs are
+        // aligned to cache lines.
+        nNodes = totalNodes + 1;
+        treeBytes += nNodes * sizeof(LinearBVHNode);
+        nodes = AllocAligned<LinearBVHNode>(nNodes);
+        InterleavePages(nodes, nNodes * sizeof(LinearBVHNode));
+        nodes[1].bounds = Bounds3f();
+        nodes[1].nPrimitives = 0;
+        flattenBVHTree(root, &offset);
+    }
+    CHECK_EQ(nNodes, offset);
+
+    // Store leaf primitives in the order that their nodes are laid out
+    if (layout == NodeLayout::Clustered) reorderLeaves(groups, nNodes);
 
-Bounds3f BVHAccel::WorldBound() const {
-    return nodes ? nodes[0].bounds : Bounds3f();
+    // _orderedPrims_ now holds the primitives in their original order
+    if (!cacheFilename.empty())
+        writeCache(cacheFilename, key, orderedPrims, nNodes, groups.size());
 }
 
+Bounds3f BVHAccel::WorldBound() const { return bounds; }
+
 struct BucketInfo {
     int count = 0;
     Bounds3f bounds;
 };
 
+// Nodes with at least this many primitives have their subtrees built in
+// parallel; binning is parallelized for even larger ones.
+static PBRT_CONSTEXPR int parallelBuildThreshold = 4096;
+static PBRT_CONSTEXPR int parallelBinningThreshold = 131072;
+
+// Computes the bounds of the primitives in _[start, end)_ and the bounds of
+// their centroids, splitting the work across threads for large ranges.
+static void ComputeBounds(const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                          int start, int end, Bounds3f *bounds,
+                          Bounds3f *centroidBounds) {
+    if (end - start < parallelBinningThreshold) {
+        for (int i = start; i < end; ++i) {
+            *bounds = Union(*bounds, primitiveInfo[i].bounds);
+            *centroidBounds = Union(*centroidBounds, primitiveInfo[i].centroid);
+        }
+        return;
+    }
+    PBRT_CONSTEXPR int chunkSize = 16384;
+    int nChunks = (end - start + chunkSize - 1) / chunkSize;
+    std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+    ParallelFor([&](int64_t c) {
+        ComputeBounds(primitiveInfo, start + c * chunkSize,
+                      std::min<int>(end, start + (c + 1) * chunkSize),
+                      &chunkBounds[c], &chunkCentroidBounds[c]);
+    }, nChunks);
+    for (int c = 0; c < nChunks; ++c) {
+        *bounds = Union(*bounds, chunkBounds[c]);
+        *centroidBounds = Union(*centroidBounds, chunkCentroidBounds[c]);
+    }
+}
+
 BVHBuildNode *BVHAccel::recursiveBuild(
-    MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
-    int end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    std::vector<MemoryArena> &threadArenas,
+    std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+    std::atomic<int> *totalNodes) const {
     CHECK_NE(start, end);
-    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    BVHBuildNode *node = threadArenas[ThreadIndex].Alloc<BVHBuildNode>();
     (*totalNodes)++;
     // Compute bounds of all primitives in BVH node
-    Bounds3f bounds;
-    for (int i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(primitiveInfo, start, end, &bounds, &centroidBounds);
     int nPrimitives = end - start;
+    // Since primitives are partitioned in place, leaves refer directly to
+    // their range of _primitiveInfo_; the depth-first order of leaves
+    // matches the order of the primitives in the array.
     if (nPrimitives == 1) {
         // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
-        for (int i = start; i < end; ++i) {
-            int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
-        }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+        node->InitLeaf(start, nPrimitives, bounds);
         return node;
     } else {
-        // Compute bound of primitive centroids, choose split dimension _dim_
-        Bounds3f centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        // Choose split dimension _dim_
         int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
         int mid = (start + end) / 2;
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
-            for (int i = start; i < end; ++i) {
-                int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
-            }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+            node->InitLeaf(start, nPrimitives, bounds);
             return node;
         } else {
             // Partition primitives based on _splitMethod_
@@ -321,16 +1124,46 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                     BucketInfo buckets[nBuckets];
 
                     // Initialize _BucketInfo_ for SAH partition buckets
-                    for (int i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
+                    auto bucketIndex = [&](const BVHPrimitiveInfo &pi) {
+                        int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
                         if (b == nBuckets) b = nBuckets - 1;
                         CHECK_GE(b, 0);
                         CHECK_LT(b, nBuckets);
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
+                        return b;
+                    };
+                    if (nPrimitives < parallelBinningThreshold) {
+                        for (int i = start; i < end; ++i) {
+                            int b = bucketIndex(primitiveInfo[i]);
+                            buckets[b].count++;
+                            buckets[b].bounds = Union(buckets[b].bounds,
+                                                      primitiveInfo[i].bounds);
+                        }
+                    } else {
+                        // Bin primitives in parallel and merge the per-chunk
+                        // buckets
+                        PBRT_CONSTEXPR int chunkSize = 16384;
+                        int nChunks = (nPrimitives + chunkSize - 1) / chunkSize;
+                        std::vector<BucketInfo> chunkBuckets(nChunks * nBuckets);
+                        ParallelFor([&](int64_t c) {
+                            BucketInfo *cb = &chunkBuckets[c * nBuckets];
+                            int chunkEnd = std::min<int>(
+                                end, start + (c + 1) * chunkSize);
+                            for (int i = start + c * chunkSize; i < chunkEnd;
+                                 ++i) {
+                                int b = bucketIndex(primitiveInfo[i]);
+                                cb[b].count++;
+                                cb[b].bounds = Union(cb[b].bounds,
+                                                     primitiveInfo[i].bounds);
+                            }
+                        }, nChunks);
+                        for (int c = 0; c < nChunks; ++c)
+                            for (int b = 0; b < nBuckets; ++b) {
+                                const BucketInfo &cb =
+                                    chunkBuckets[c * nBuckets + b];
+                                buckets[b].count += cb.count;
+                                buckets[b].bounds =
+                                    Union(buckets[b].bounds, cb.bounds);
+                            }
                     }
 
                     // Compute costs for splitting after each bucket
@@ -369,42 +1202,303 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         BVHPrimitiveInfo *pmid = std::partition(
                             &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
                             [=](const BVHPrimitiveInfo &pi) {
-                                int b = nBuckets *
-                                        centroidBounds.Offset(pi.centroid)[dim];
-                                if (b == nBuckets) b = nBuckets - 1;
-                                CHECK_GE(b, 0);
-                                CHECK_LT(b, nBuckets);
-                                return b <= minCostSplitBucket;
+                                return bucketIndex(pi) <= minCostSplitBucket;
                             });
                         mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
-                        for (int i = start; i < end; ++i) {
-                            int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
-                        }
-                        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+                        node->InitLeaf(start, nPrimitives, bounds);
                         return node;
                     }
                 }
                 break;
             }
             }
-            node->InitInterior(dim,
-                               recursiveBuild(arena, primitiveInfo, start, mid,
-                                              totalNodes, orderedPrims),
-                               recursiveBuild(arena, primitiveInfo, mid, end,
-                                              totalNodes, orderedPrims));
+            // Build children, in parallel for large subtrees
+            BVHBuildNode *children[2];
+            if (nPrimitives < parallelBuildThreshold) {
+                children[0] = recursiveBuild(threadArenas, primitiveInfo,
+                                             start, mid, totalNodes);
+                children[1] = recursiveBuild(threadArenas, primitiveInfo, mid,
+                                             end, totalNodes);
+            } else {
+                TaskGroup group;
+                group.Spawn([&]() {
+                    children[1] = recursiveBuild(threadArenas, primitiveInfo,
+                                                 mid, end, totalNodes);
+                });
+                children[0] = recursiveBuild(threadArenas, primitiveInfo,
+                                             start, mid, totalNodes);
+                group.Wait();
+            }
+            node->InitInterior(dim, children[0], children[1]);
         }
     }
     return node;
 }
 
+// Spatial splits are only evaluated when the children of the best object
+// split overlap by more than this fraction of the root's surface area.
+static PBRT_CONSTEXPR Float spatialSplitAlpha = 1e-5;
+
+static PBRT_CONSTEXPR int nSpatialBins = 32;
+
+// Returns the lower boundary of spatial split bin _b_ along _axis_.
+inline Float SpatialSplitPlane(const Bounds3f &bounds, int axis, int b) {
+    if (b == nSpatialBins) return bounds.pMax[axis];
+    return Lerp(Float(b) / nSpatialBins, bounds.pMin[axis], bounds.pMax[axis]);
+}
+
+struct SpatialBin {
+    int entries = 0, exits = 0;
+    Bounds3f bounds;
+};
+
+inline bool IsEmpty(const Bounds3f &b) {
+    return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
+
+// Adds _offset_ to the primitive offsets of the leaves under _node_.
+static void OffsetLeaves(BVHBuildNode *node, int offset) {
+    if (node->nPrimitives > 0)
+        node->firstPrimOffset += offset;
+    else {
+        OffsetLeaves(node->children[0], offset);
+        OffsetLeaves(node->children[1], offset);
+    }
+}
+
+BVHBuildNode *BVHAccel::spatialSplitBuild(
+    std::vector<MemoryArena> &threadArenas, const std::vector<BVHItem> &items,
+    std::vector<BVHPrimitiveInfo> &refs, Float rootArea,
+    std::atomic<int> *totalNodes, std::atomic<int> *referenceBudget,
+    std::vector<int> *orderedItems) const {
+    CHECK(!refs.empty());
+    BVHBuildNode *node = threadArenas[ThreadIndex].Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    // Unlike _recursiveBuild()_, references may be duplicated, so leaves
+    // append their items to _orderedItems_ rather than referring to a
+    // range of _refs_.
+    int nRefs = refs.size();
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(refs, 0, nRefs, &bounds, &centroidBounds);
+    auto makeLeaf = [&]() {
+        node->InitLeaf(orderedItems->size(), nRefs, bounds);
+        for (const BVHPrimitiveInfo &ref : refs)
+            orderedItems->push_back(ref.primitiveNumber);
+        return node;
+    };
+    if (nRefs == 1) return makeLeaf();
+
+    // SAH costs below are scaled by the node's surface area, which keeps
+    // them finite for flat nodes.
+    Float area = bounds.SurfaceArea();
+
+    // Find best object split along the centroid bounds' largest extent
+    PBRT_CONSTEXPR int nBuckets = 12;
+    int dim = centroidBounds.MaximumExtent();
+    auto bucketIndex = [&](const BVHPrimitiveInfo &pi) {
+        int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
+        return Clamp(b, 0, nBuckets - 1);
+    };
+    Float objectCost = Infinity;
+    int objectSplitBucket = 0;
+    Bounds3f objectBounds[2];
+    if (centroidBounds.pMax[dim] > centroidBounds.pMin[dim]) {
+        BucketInfo buckets[nBuckets];
+        for (const BVHPrimitiveInfo &ref : refs) {
+            int b = bucketIndex(ref);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, ref.bounds);
+        }
+        // Sweep from the right to find the bounds above each split
+        Bounds3f above[nBuckets];
+        above[nBuckets - 1] = buckets[nBuckets - 1].bounds;
+        for (int i = nBuckets - 2; i >= 0; --i)
+            above[i] = Union(above[i + 1], buckets[i].bounds);
+        Bounds3f below;
+        int countBelow = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            below = Union(below, buckets[i].bounds);
+            countBelow += buckets[i].count;
+            int countAbove = nRefs - countBelow;
+            if (countBelow == 0 || countAbove == 0) continue;
+            Float cost = area + countBelow * below.SurfaceArea() +
+                         countAbove * above[i + 1].SurfaceArea();
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectSplitBucket = i;
+                objectBounds[0] = below;
+                objectBounds[1] = above[i + 1];
+            }
+        }
+    }
+
+    // Find best spatial split if the object split's children overlap
+    Float spatialCost = Infinity;
+    int spatialDim = 0, spatialSplitBin = 0;
+    Bounds3f overlap = pbrt::Intersect(objectBounds[0], objectBounds[1]);
+    if (objectCost == Infinity ||
+        (!IsEmpty(overlap) &&
+         overlap.SurfaceArea() > spatialSplitAlpha * rootArea)) {
+        for (int d = 0; d < 3; ++d) {
+            Float extent = bounds.pMax[d] - bounds.pMin[d];
+            if (extent == 0) continue;
+            auto binIndex = [&](Float x) {
+                int b = nSpatialBins * ((x - bounds.pMin[d]) / extent);
+                return Clamp(b, 0, nSpatialBins - 1);
+            };
+            // Chop references into the bins that they overlap
+            SpatialBin bins[nSpatialBins];
+            for (const BVHPrimitiveInfo &ref : refs) {
+                int b0 = binIndex(ref.bounds.pMin[d]);
+                int b1 = binIndex(ref.bounds.pMax[d]);
+                ++bins[b0].entries;
+                ++bins[b1].exits;
+                if (b0 == b1) {
+                    bins[b0].bounds = Union(bins[b0].bounds, ref.bounds);
+                    continue;
+                }
+                for (int b = b0; b <= b1; ++b)
+                    bins[b].bounds = Union(
+                        bins[b].bounds,
+                        clipItemBound(items[ref.primitiveNumber], ref.bounds,
+                                      d, SpatialSplitPlane(bounds, d, b),
+                                      SpatialSplitPlane(bounds, d, b + 1)));
+            }
+            // Evaluate the SAH cost of splitting at each bin boundary
+            Bounds3f above[nSpatialBins];
+            int exitsAbove[nSpatialBins];
+            above[nSpatialBins - 1] = bins[nSpatialBins - 1].bounds;
+            exitsAbove[nSpatialBins - 1] = bins[nSpatialBins - 1].exits;
+            for (int i = nSpatialBins - 2; i >= 0; --i) {
+                above[i] = Union(above[i + 1], bins[i].bounds);
+                exitsAbove[i] = exitsAbove[i + 1] + bins[i].exits;
+            }
+            Bounds3f below;
+            int entriesBelow = 0;
+            for (int i = 0; i < nSpatialBins - 1; ++i) {
+                below = Union(below, bins[i].bounds);
+                entriesBelow += bins[i].entries;
+                int countAbove = exitsAbove[i + 1];
+                if (entriesBelow == 0 || countAbove == 0 ||
+                    entriesBelow == nRefs || countAbove == nRefs)
+                    continue;
+                Float cost = area + entriesBelow * below.SurfaceArea() +
+                             countAbove * above[i + 1].SurfaceArea();
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialDim = d;
+                    spatialSplitBin = i;
+                }
+            }
+        }
+    }
+
+    // Create leaf if splitting isn't possible or worthwhile
+    Float leafCost = nRefs * area;
+    Float minCost = std::min(objectCost, spatialCost);
+    if (minCost == Infinity || (nRefs <= maxPrimsInNode && minCost >= leafCost))
+        return makeLeaf();
+
+    // Partition references into two sets
+    std::vector<BVHPrimitiveInfo> childRefs[2];
+    int splitAxis = dim;
+    if (spatialCost < objectCost) {
+        // Split references at bin boundary, duplicating the ones that
+        // straddle it if the budget allows
+        int d = spatialDim;
+        Float extent = bounds.pMax[d] - bounds.pMin[d];
+        auto binIndex = [&](Float x) {
+            int b = nSpatialBins * ((x - bounds.pMin[d]) / extent);
+            return Clamp(b, 0, nSpatialBins - 1);
+        };
+        int nStraddling = 0;
+        for (const BVHPrimitiveInfo &ref : refs)
+            if (binIndex(ref.bounds.pMin[d]) <= spatialSplitBin &&
+                binIndex(ref.bounds.pMax[d]) > spatialSplitBin)
+                ++nStraddling;
+        if (referenceBudget->fetch_sub(nStraddling) >= nStraddling) {
+            Float plane = SpatialSplitPlane(bounds, d, spatialSplitBin + 1);
+            int nDuplicated = 0;
+            for (const BVHPrimitiveInfo &ref : refs) {
+                int b0 = binIndex(ref.bounds.pMin[d]);
+                int b1 = binIndex(ref.bounds.pMax[d]);
+                if (b1 <= spatialSplitBin)
+                    childRefs[0].push_back(ref);
+                else if (b0 > spatialSplitBin)
+                    childRefs[1].push_back(ref);
+                else {
+                    const BVHItem &item = items[ref.primitiveNumber];
+                    Bounds3f b[2] = {
+                        clipItemBound(item, ref.bounds, d, ref.bounds.pMin[d],
+                                      plane),
+                        clipItemBound(item, ref.bounds, d, plane,
+                                      ref.bounds.pMax[d])};
+                    // Only one side may hold part of the primitive, even
+                    // though its bounds straddle the plane
+                    for (int c = 0; c < 2; ++c)
+                        if (!IsEmpty(b[c]))
+                            childRefs[c].push_back(
+                                BVHPrimitiveInfo(ref.primitiveNumber, b[c]));
+                    if (!IsEmpty(b[0]) && !IsEmpty(b[1])) ++nDuplicated;
+                }
+            }
+            *referenceBudget += nStraddling - nDuplicated;
+            if (childRefs[0].empty() || childRefs[1].empty() ||
+                childRefs[0].size() == size_t(nRefs) ||
+                childRefs[1].size() == size_t(nRefs)) {
+                // Fall back to the object split if the spatial split
+                // wouldn't reduce the number of references on both sides
+                childRefs[0].clear();
+                childRefs[1].clear();
+                *referenceBudget += nDuplicated;
+            } else {
+                ++spatialSplits;
+                duplicatedReferences += nDuplicated;
+                splitAxis = d;
+            }
+        } else
+            *referenceBudget += nStraddling;
+    }
+    if (childRefs[0].empty()) {
+        if (objectCost == Infinity) return makeLeaf();
+        for (const BVHPrimitiveInfo &ref : refs)
+            childRefs[bucketIndex(ref) > objectSplitBucket].push_back(ref);
+    }
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+
+    // Build children, in parallel for large subtrees
+    BVHBuildNode *children[2];
+    if (nRefs < parallelBuildThreshold) {
+        for (int c = 0; c < 2; ++c)
+            children[c] = spatialSplitBuild(threadArenas, items, childRefs[c],
+                                            rootArea, totalNodes,
+                                            referenceBudget, orderedItems);
+    } else {
+        std::vector<int> childItems[2];
+        auto buildChild = [&](int c) {
+            children[c] = spatialSplitBuild(threadArenas, items, childRefs[c],
+                                            rootArea, totalNodes,
+                                            referenceBudget, &childItems[c]);
+        };
+        TaskGroup group;
+        group.Spawn([&]() { buildChild(1); });
+        buildChild(0);
+        group.Wait();
+        for (int c = 0; c < 2; ++c) {
+            OffsetLeaves(children[c], orderedItems->size());
+            orderedItems->insert(orderedItems->end(), childItems[c].begin(),
+                                 childItems[c].end());
+        }
+    }
+    node->InitInterior(splitAxis, children[0], children[1]);
+    return node;
+}
+
 BVHBuildNode *BVHAccel::HLBVHBuild(
     MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-    int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) const {
+    int *totalNodes, std::vector<int> &orderedItems) const {
     // Compute bounding box of all primitive centroids
     Bounds3f bounds;
     for (const BVHPrimitiveInfo &pi : primitiveInfo)
@@ -447,8 +1541,8 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
     }
 
     // Create LBVHs for treelets in parallel
-    std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
-    orderedPrims.resize(primitives.size());
+    std::atomic<int> atomicTotal(0), orderedItemsOffset(0);
+    orderedItems.resize(primitiveInfo.size());
     ParallelFor([&](int i) {
         // Generate _i_th LBVH treelet
         int nodesCreated = 0;
@@ -456,8 +1550,8 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
         LBVHTreelet &tr = treeletsToBuild[i];
         tr.buildNodes =
             emitLBVH(tr.buildNodes, primitiveInfo, &mortonPrims[tr.startIndex],
-                     tr.nPrimitives, &nodesCreated, orderedPrims,
-                     &orderedPrimsOffset, firstBitIndex);
+                     tr.nPrimitives, &nodesCreated, orderedItems,
+                     &orderedItemsOffset, firstBitIndex);
         atomicTotal += nodesCreated;
     }, treeletsToBuild.size());
     *totalNodes = atomicTotal;
@@ -475,18 +1569,18 @@ BVHBuildNode *BVHAccel::emitLBVH(
     BVHBuildNode *&buildNodes,
     const std::vector<BVHPrimitiveInfo> &primitiveInfo,
     MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-    std::atomic<int> *orderedPrimsOffset, int bitIndex) const {
+    std::vector<int> &orderedItems, std::atomic<int> *orderedItemsOffset,
+    int bitIndex) const {
     CHECK_GT(nPrimitives, 0);
     if (bitIndex == -1 || nPrimitives < maxPrimsInNode) {
         // Create and return leaf node of LBVH treelet
         (*totalNodes)++;
         BVHBuildNode *node = buildNodes++;
         Bounds3f bounds;
-        int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
+        int firstPrimOffset = orderedItemsOffset->fetch_add(nPrimitives);
         for (int i = 0; i < nPrimitives; ++i) {
             int primitiveIndex = mortonPrims[i].primitiveIndex;
-            orderedPrims[firstPrimOffset + i] = primitives[primitiveIndex];
+            orderedItems[firstPrimOffset + i] = primitiveIndex;
             bounds = Union(bounds, primitiveInfo[primitiveIndex].bounds);
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
@@ -497,7 +1591,7 @@ BVHBuildNode *BVHAccel::emitLBVH(
         if ((mortonPrims[0].mortonCode & mask) ==
             (mortonPrims[nPrimitives - 1].mortonCode & mask))
             return emitLBVH(buildNodes, primitiveInfo, mortonPrims, nPrimitives,
-                            totalNodes, orderedPrims, orderedPrimsOffset,
+                            totalNodes, orderedItems, orderedItemsOffset,
                             bitIndex - 1);
 
         // Find LBVH split point for this dimension
@@ -524,11 +1618,11 @@ BVHBuildNode *BVHAccel::emitLBVH(
         BVHBuildNode *node = buildNodes++;
         BVHBuildNode *lbvh[2] = {
             emitLBVH(buildNodes, primitiveInfo, mortonPrims, splitOffset,
-                     totalNodes, orderedPrims, orderedPrimsOffset,
+                     totalNodes, orderedItems, orderedItemsOffset,
                      bitIndex - 1),
             emitLBVH(buildNodes, primitiveInfo, &mortonPrims[splitOffset],
-                     nPrimitives - splitOffset, totalNodes, orderedPrims,
-                     orderedPrimsOffset, bitIndex - 1)};
+                     nPrimitives - splitOffset, totalNodes, orderedItems,
+                     orderedItemsOffset, bitIndex - 1)};
         int axis = bitIndex % 3;
         node->InitInterior(axis, lbvh[0], lbvh[1]);
         return node;
@@ -637,29 +1731,801 @@ BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
     return node;
 }
 
-int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
-    LinearBVHNode *linearNode = &nodes[*offset];
+Bounds3f BVHAccel::itemBound(const BVHItem &item) const {
+    if (item.triIndex >= 0)
+        return meshes[item.index]->TriangleBound(item.triIndex);
+    return primitives[item.index]->WorldBound();
+}
+
+Bounds3f BVHAccel::clipItemBound(const BVHItem &item, const Bounds3f &bounds,
+                                 int axis, Float lo, Float hi) const {
+    Bounds3f clipped = bounds;
+    if (item.triIndex >= 0) {
+        // Bound the part of the triangle between the two planes
+        const TriangleMeshPrimitive &mesh = *meshes[item.index];
+        Point3f p[3] = {mesh.Vertex(item.triIndex, 0),
+                        mesh.Vertex(item.triIndex, 1),
+                        mesh.Vertex(item.triIndex, 2)};
+        clipped = Bounds3f();
+        for (int i = 0; i < 3; ++i) {
+            const Point3f &p0 = p[i], &p1 = p[(i + 1) % 3];
+            if (p0[axis] >= lo && p0[axis] <= hi)
+                clipped = Union(clipped, p0);
+            for (Float plane : {lo, hi}) {
+                if ((p0[axis] < plane && p1[axis] > plane) ||
+                    (p0[axis] > plane && p1[axis] < plane)) {
+                    Float t = (plane - p0[axis]) / (p1[axis] - p0[axis]);
+                    Point3f pc = Lerp(t, p0, p1);
+                    pc[axis] = plane;
+                    clipped = Union(clipped, pc);
+                }
+            }
+        }
+        // Conservatively account for round-off error in the edge
+        // intersection points
+        for (int a = 0; a < 3; ++a) {
+            if (a == axis) continue;
+            Float maxAbs = std::max({std::abs(p[0][a]), std::abs(p[1][a]),
+                                     std::abs(p[2][a])});
+            clipped.pMin[a] -= gamma(8) * maxAbs;
+            clipped.pMax[a] += gamma(8) * maxAbs;
+        }
+    }
+    clipped.pMin[axis] = std::max(clipped.pMin[axis], lo);
+    clipped.pMax[axis] = std::min(clipped.pMax[axis], hi);
+    return pbrt::Intersect(clipped, bounds);
+}
+
+// Appends the triangle items of the leaves under _node_ to _tris_ in
+// depth-first order and returns the number of nodes in the subtree.
+static int GatherTriangleItems(const BVHBuildNode *node,
+                               const std::vector<int> &orderedItems,
+                               std::vector<int> *tris) {
+    if (node->nPrimitives > 0) {
+        tris->insert(tris->end(), &orderedItems[node->firstPrimOffset],
+                     &orderedItems[node->firstPrimOffset] + node->nPrimitives);
+        --leafNodes;
+        --totalLeafNodes;
+        return 1;
+    }
+    --interiorNodes;
+    return 1 + GatherTriangleItems(node->children[0], orderedItems, tris) +
+           GatherTriangleItems(node->children[1], orderedItems, tris);
+}
+
+void BVHAccel::packTriangleLeaf(BVHBuildNode *node,
+                                const std::vector<BVHItem> &items,
+                                const std::vector<int> &orderedItems,
+                                std::vector<TriangleGroup> &groups,
+                                int *totalNodes) const {
+    // Replace subtree under _node_ with a single leaf
+    std::vector<int> tris;
+    *totalNodes -= GatherTriangleItems(node, orderedItems, &tris) - 1;
+    // Spatial splits may have placed a triangle in more than one of the
+    // leaves; keep only its first occurrence
+    for (size_t i = 1; i < tris.size(); ++i)
+        if (std::find(tris.begin(), tris.begin() + i, tris[i]) !=
+            tris.begin() + i)
+            tris.erase(tris.begin() + i--);
+    ++leafNodes;
+    ++totalLeafNodes;
+
+    // Pack the triangles into _TriangleGroup_s
+    int firstGroup = groups.size();
+    for (size_t i = 0; i < tris.size(); ++i) {
+        int lane = i % TriangleGroup::Width;
+        if (lane == 0) {
+            groups.push_back(TriangleGroup());
+            groups.back().Clear();
+            ++triangleGroupCount;
+        }
+        const BVHItem &item = items[tris[i]];
+        groups.back().SetTriangle(lane, item.index, *meshes[item.index],
+                                  item.triIndex);
+        ++groupedTriangles;
+    }
+    node->children[0] = node->children[1] = nullptr;
+    node->firstPrimOffset = firstGroup;
+    node->nPrimitives = groups.size() - firstGroup;
+    node->triangleLeaf = true;
+}
+
+// Leaves with more items than this are split by _packLeaves()_; builds
+// may create larger ones for primitives whose centroids coincide, but the
+// node layouts store leaves' primitive counts in 16 bits.
+static PBRT_CONSTEXPR int maxLeafItems = 255;
+
+// Turns leaf _node_ into an interior node with two leaf children that hold
+// its first _nFirst_ items and the remaining ones.
+void BVHAccel::splitLeaf(MemoryArena &arena, BVHBuildNode *node,
+                         const std::vector<BVHItem> &items,
+                         const std::vector<int> &orderedItems, int nFirst,
+                         int *totalNodes) const {
+    CHECK(nFirst > 0 && nFirst < node->nPrimitives);
+    const int *first = &orderedItems[node->firstPrimOffset];
+    Bounds3f bounds[2];
+    for (int i = 0; i < node->nPrimitives; ++i)
+        bounds[i >= nFirst] =
+            Union(bounds[i >= nFirst], itemBound(items[first[i]]));
+    // Leaves built with spatial splits may only cover part of their
+    // primitives
+    for (int c = 0; c < 2; ++c)
+        bounds[c] = pbrt::Intersect(bounds[c], node->bounds);
+    --leafNodes;
+    --totalLeafNodes;
+    totalPrimitives -= node->nPrimitives;
+    BVHBuildNode *children = arena.Alloc<BVHBuildNode>(2);
+    children[0].InitLeaf(node->firstPrimOffset, nFirst, bounds[0]);
+    children[1].InitLeaf(node->firstPrimOffset + nFirst,
+                         node->nPrimitives - nFirst, bounds[1]);
+    node->InitInterior(node->bounds.MaximumExtent(), &children[0],
+                       &children[1]);
+    *totalNodes += 2;
+}
+
+// Stores the primitives of the leaves under _node_ in _orderedPrims_ and
+// _groups_. Small subtrees that only hold triangles are merged into single
+// leaves so that their _TriangleGroup_s are filled; this returns the
+// number of triangles under _node_ if it is such a subtree that still
+// needs to be packed by the caller, and -1 otherwise.
+int BVHAccel::packLeaves(MemoryArena &arena, BVHBuildNode *node,
+                         const std::vector<BVHItem> &items,
+                         std::vector<int> &orderedItems,
+                         std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+                         std::vector<TriangleGroup> &groups,
+                         int *totalNodes) const {
+    if (node->nPrimitives > maxLeafItems)
+        splitLeaf(arena, node, items, orderedItems, node->nPrimitives / 2,
+                  totalNodes);
+    else if (node->nPrimitives > 0) {
+        // Move the leaf's triangles ahead of its other primitives
+        int *first = &orderedItems[node->firstPrimOffset];
+        int *last = first + node->nPrimitives;
+        int *mid = std::stable_partition(
+            first, last, [&](int i) { return items[i].triIndex >= 0; });
+        int nTriangles = mid - first;
+        if (nTriangles == 0) {
+            // Append leaf primitives to _orderedPrims_
+            int firstPrim = orderedPrims.size();
+            for (int *item = first; item != last; ++item)
+                orderedPrims.push_back(primitives[items[*item].index]);
+            node->firstPrimOffset = firstPrim;
+            return -1;
+        } else if (mid == last) {
+            if (nTriangles <= TriangleGroup::Width) return nTriangles;
+            packTriangleLeaf(node, items, orderedItems, groups, totalNodes);
+            return -1;
+        }
+
+        // Split leaf with both triangles and other primitives in two
+        splitLeaf(arena, node, items, orderedItems, nTriangles, totalNodes);
+    }
+
+    // Pack children of interior node, merging them if possible
+    int nTriangles[2];
+    for (int c = 0; c < 2; ++c)
+        nTriangles[c] = packLeaves(arena, node->children[c], items,
+                                   orderedItems, orderedPrims, groups,
+                                   totalNodes);
+    if (nTriangles[0] >= 0 && nTriangles[1] >= 0 &&
+        nTriangles[0] + nTriangles[1] <= TriangleGroup::Width)
+        return nTriangles[0] + nTriangles[1];
+    for (int c = 0; c < 2; ++c)
+        if (nTriangles[c] >= 0)
+            packTriangleLeaf(node->children[c], items, orderedItems, groups,
+                             totalNodes);
+    return -1;
+}
+
+// Nodes are grouped into blocks of this many bytes by the clustered layout.
+static PBRT_CONSTEXPR int clusterBlockBytes = 4096;
+
+// Initializes _linearNode_ for _node_, except for the offset of an interior
+// node's children.
+static void InitLinearNode(LinearBVHNode *linearNode,
+                           const BVHBuildNode *node) {
     linearNode->bounds = node->bounds;
-    int myOffset = (*offset)++;
     if (node->nPrimitives > 0) {
         CHECK(!node->children[0] && !node->children[1]);
         CHECK_LT(node->nPrimitives, 65536);
         linearNode->primitivesOffset = node->firstPrimOffset;
         linearNode->nPrimitives = node->nPrimitives;
+        linearNode->triangleLeaf = node->triangleLeaf;
     } else {
-        // Create interior flattened BVH node
         linearNode->axis = node->splitAxis;
         linearNode->nPrimitives = 0;
-        flattenBVHTree(node->children[0], offset);
-        linearNode->secondChildOffset =
-            flattenBVHTree(node->children[1], offset);
+        linearNode->triangleLeaf = 0;
+    }
+}
+
+// Initializes _wideNode_ for the children of _node_ once collapsed into
+// _children_; the offsets of interior children are left for the caller to
+// set. Returns the number of children.
+template <typename Node>
+static int InitWideNode(Node *wideNode, BVHBuildNode *node,
+                        BVHBuildNode *children[]) {
+    PBRT_CONSTEXPR int N = Node::Width;
+    ++wideBVHNodes;
+    int nChildren = CollapseBVHNode<N>(node, children);
+    Bounds3f childBounds[N];
+    for (int i = 0; i < nChildren; ++i) childBounds[i] = children[i]->bounds;
+    wideNode->SetChildBounds(nChildren, childBounds);
+    for (int i = 0; i < N; ++i) {
+        if (i >= nChildren) {
+            // Mark unused child slot
+            wideNode->offset[i] = -1;
+            wideNode->nPrimitives[i] = 0;
+            continue;
+        }
+        BVHBuildNode *child = children[i];
+        if (child->nPrimitives > 0) {
+            CHECK_LE(child->nPrimitives,
+                     std::numeric_limits<int16_t>::max());
+            wideNode->offset[i] = child->firstPrimOffset;
+            wideNode->nPrimitives[i] =
+                child->triangleLeaf ? -child->nPrimitives : child->nPrimitives;
+        } else
+            wideNode->nPrimitives[i] = 0;
+    }
+    return nChildren;
+}
+
+void BVHAccel::flattenBVHTree(BVHBuildNode *root, int *offset) {
+    InitLinearNode(&nodes[0], root);
+    *offset = 2;
+    // A node whose children have yet to be laid out, and the probability
+    // of visiting them relative to the root's, given by the node's area
+    struct PendingNode {
+        BVHBuildNode *node;
+        int index;
+        Float area;
+    };
+    std::vector<PendingNode> pending;
+    if (root->nPrimitives == 0)
+        pending.push_back({root, 0, root->bounds.SurfaceArea()});
+    if (layout == NodeLayout::DepthFirst) {
+        // Emit sibling pairs in depth-first order
+        while (!pending.empty()) {
+            PendingNode p = pending.back();
+            pending.pop_back();
+            nodes[p.index].childrenOffset = *offset;
+            for (int c = 1; c >= 0; --c) {
+                BVHBuildNode *child = p.node->children[c];
+                InitLinearNode(&nodes[*offset + c], child);
+                if (child->nPrimitives == 0)
+                    pending.push_back({child, *offset + c, 0});
+            }
+            *offset += 2;
+        }
+        return;
+    }
+
+    // Fill each block with the sibling pairs below its first pair that are
+    // most likely to be visited, then start new blocks from the rest
+    PBRT_CONSTEXPR int pairsPerBlock =
+        clusterBlockBytes / (2 * sizeof(LinearBVHNode));
+    auto byArea = [](const PendingNode &a, const PendingNode &b) {
+        return a.area < b.area;
+    };
+    while (!pending.empty()) {
+        std::vector<PendingNode> block(1, pending.back());
+        pending.pop_back();
+        for (int nPairs = 0; nPairs < pairsPerBlock && !block.empty();
+             ++nPairs) {
+            std::pop_heap(block.begin(), block.end(), byArea);
+            PendingNode p = block.back();
+            block.pop_back();
+            nodes[p.index].childrenOffset = *offset;
+            for (int c = 0; c < 2; ++c) {
+                BVHBuildNode *child = p.node->children[c];
+                InitLinearNode(&nodes[*offset + c], child);
+                if (child->nPrimitives > 0) continue;
+                block.push_back(
+                    {child, *offset + c, child->bounds.SurfaceArea()});
+                std::push_heap(block.begin(), block.end(), byArea);
+            }
+            *offset += 2;
+        }
+        // Lay out the blocks for the most likely subtrees first
+        std::sort(block.begin(), block.end(), byArea);
+        pending.insert(pending.end(), block.begin(), block.end());
+    }
+}
+
+template <typename Node>
+void BVHAccel::flattenWideBVHTree(BVHBuildNode *root, Node *wideNodes,
+                                  int *offset) {
+    PBRT_CONSTEXPR int N = Node::Width;
+    // A node that has yet to be laid out, with the slot in its parent that
+    // should store its offset
+    struct PendingNode {
+        BVHBuildNode *node;
+        int32_t *parentOffset;
+        Float area;
+    };
+    std::vector<PendingNode> pending(1, {root, nullptr, 0});
+    BVHBuildNode *children[N];
+    if (layout == NodeLayout::DepthFirst) {
+        // Emit nodes in depth-first order
+        while (!pending.empty()) {
+            PendingNode p = pending.back();
+            pending.pop_back();
+            if (p.parentOffset) *p.parentOffset = *offset;
+            Node *wideNode = &wideNodes[(*offset)++];
+            int nChildren = InitWideNode(wideNode, p.node, children);
+            for (int i = nChildren - 1; i >= 0; --i)
+                if (children[i] != p.node && children[i]->nPrimitives == 0)
+                    pending.push_back({children[i], &wideNode->offset[i], 0});
+        }
+        return;
+    }
+
+    // Group nodes into blocks as in _flattenBVHTree()_
+    PBRT_CONSTEXPR int nodesPerBlock =
+        sizeof(Node) < clusterBlockBytes ? clusterBlockBytes / sizeof(Node)
+                                         : 1;
+    auto byArea = [](const PendingNode &a, const PendingNode &b) {
+        return a.area < b.area;
+    };
+    while (!pending.empty()) {
+        std::vector<PendingNode> block(1, pending.back());
+        pending.pop_back();
+        for (int n = 0; n < nodesPerBlock && !block.empty(); ++n) {
+            std::pop_heap(block.begin(), block.end(), byArea);
+            PendingNode p = block.back();
+            block.pop_back();
+            if (p.parentOffset) *p.parentOffset = *offset;
+            Node *wideNode = &wideNodes[(*offset)++];
+            int nChildren = InitWideNode(wideNode, p.node, children);
+            for (int i = 0; i < nChildren; ++i) {
+                if (children[i] == p.node || children[i]->nPrimitives > 0)
+                    continue;
+                block.push_back({children[i], &wideNode->offset[i],
+                                 children[i]->bounds.SurfaceArea()});
+                std::push_heap(block.begin(), block.end(), byArea);
+            }
+        }
+        std::sort(block.begin(), block.end(), byArea);
+        pending.insert(pending.end(), block.begin(), block.end());
+    }
+}
+
+// Updates the leaf offsets of the wide nodes using _remap(offset,
+// nPrimitives)_.
+template <typename Node, typename F>
+static void RemapWideLeaves(Node *wideNodes, int nNodes, F remap) {
+    if (!wideNodes) return;
+    for (int n = 0; n < nNodes; ++n)
+        for (int i = 0; i < Node::Width; ++i)
+            if (wideNodes[n].nPrimitives[i] != 0)
+                wideNodes[n].offset[i] =
+                    remap(wideNodes[n].offset[i], wideNodes[n].nPrimitives[i]);
+}
+
+void BVHAccel::reorderLeaves(const std::vector<TriangleGroup> &groups,
+                             int nNodes) {
+    std::vector<std::shared_ptr<Primitive>> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    int nGroups = 0;
+    // Appends a leaf's primitives, or its _TriangleGroup_s if _nPrimitives_
+    // is negative, and returns their new offset
+    auto remap = [&](int offset, int nPrimitives) {
+        if (nPrimitives < 0) {
+            std::copy(&groups[offset], &groups[offset] - nPrimitives,
+                      &triangleGroups[nGroups]);
+            nGroups -= nPrimitives;
+            return nGroups + nPrimitives;
+        }
+        orderedPrims.insert(orderedPrims.end(), &primitives[offset],
+                            &primitives[offset] + nPrimitives);
+        return int(orderedPrims.size()) - nPrimitives;
+    };
+    if (nodes)
+        for (int n = 0; n < nNodes; ++n) {
+            LinearBVHNode &node = nodes[n];
+            if (node.nPrimitives > 0)
+                node.primitivesOffset =
+                    remap(node.primitivesOffset,
+                          node.triangleLeaf ? -node.nPrimitives
+                                            : node.nPrimitives);
+        }
+    RemapWideLeaves(wideNodes4, nNodes, remap);
+    RemapWideLeaves(wideNodes8, nNodes, remap);
+    RemapWideLeaves(quantizedNodes4, nNodes, remap);
+    RemapWideLeaves(quantizedNodes8, nNodes, remap);
+    CHECK_EQ(orderedPrims.size(), primitives.size());
+    CHECK_EQ(nGroups, (int)groups.size());
+    primitives.swap(orderedPrims);
+}
+
+uint64_t BVHAccel::cacheKey(int treeletPasses) const {
+    BVHCacheHasher hasher;
+    // Include the layout of the stored data so that caches aren't shared
+    // between incompatible builds
+    hasher.Add(bvhCacheMagic);
+    hasher.Add(sizeof(Float));
+    hasher.Add(sizeof(LinearBVHNode));
+    hasher.Add(sizeof(TriangleGroup));
+    hasher.Add(maxPrimsInNode);
+    hasher.Add(splitMethod);
+    hasher.Add(width);
+    hasher.Add(nodeFormat);
+    hasher.Add(spatialSplitBudget);
+    hasher.Add(treeletPasses);
+    hasher.Add(layout);
+
+    // The tree only depends on the bounds of the primitives, but the
+    // _TriangleGroup_s store copies of the mesh vertices.
+    hasher.Add(primitives.size());
+    for (const std::shared_ptr<Primitive> &prim : primitives) {
+        const TriangleMeshPrimitive *mesh =
+            dynamic_cast<const TriangleMeshPrimitive *>(prim.get());
+        if (!mesh) {
+            hasher.Add(prim->WorldBound());
+            continue;
+        }
+        hasher.Add(mesh->NumTriangles());
+        for (int t = 0; t < mesh->NumTriangles(); ++t)
+            for (int i = 0; i < 3; ++i) hasher.Add(mesh->Vertex(t, i));
+    }
+    return hasher.Hash();
+}
+
+// Returns the number of bytes used by each node of a BVH with the given
+// width and node format.
+static size_t BVHNodeBytes(int width, BVHAccel::NodeFormat nodeFormat) {
+    if (width == 2) return sizeof(LinearBVHNode);
+    if (nodeFormat == BVHAccel::NodeFormat::Quantized)
+        return width == 4 ? sizeof(QuantizedBVHNode<4>)
+                          : sizeof(QuantizedBVHNode<8>);
+    return width == 4 ? sizeof(WideBVHNode<4>) : sizeof(WideBVHNode<8>);
+}
+
+// Cached BVHs with interior nodes deeper than this are rejected so that
+// the fixed-size traversal stacks can't overflow.
+static PBRT_CONSTEXPR int maxCachedDepth = 62;
+
+// Returns whether the nodes of a cached BVH only refer to primitives,
+// _TriangleGroup_s, and nodes that exist, with each node's children stored
+// after it.
+static bool ValidCachedNodes(const LinearBVHNode *nodes, int nNodes,
+                             int nPrimitives, int nGroups) {
+    std::vector<int> depth(nNodes, 0);
+    for (int n = 0; n < nNodes; ++n) {
+        // Skip the unused slot between the root and its children
+        if (n == 1) continue;
+        const LinearBVHNode &node = nodes[n];
+        if (node.nPrimitives > 0) {
+            int64_t end = int64_t(node.primitivesOffset) + node.nPrimitives;
+            if (node.primitivesOffset < 0 ||
+                end > (node.triangleLeaf ? nGroups : nPrimitives))
+                return false;
+        } else {
+            int child = node.childrenOffset;
+            if (node.axis > 2 || child <= n || child >= nNodes - 1 ||
+                depth[n] >= maxCachedDepth)
+                return false;
+            depth[child] = std::max(depth[child], depth[n] + 1);
+            depth[child + 1] = std::max(depth[child + 1], depth[n] + 1);
+        }
+    }
+    return true;
+}
+
+// Returns whether traversal may visit child slot _i_ of _node_.
+template <int N>
+inline bool SlotUsed(const WideBVHNode<N> &node, int i) {
+    return node.bMin[0][i] != Infinity || node.bMax[0][i] != -Infinity;
+}
+
+template <int N>
+inline bool SlotUsed(const QuantizedBVHNode<N> &node, int i) {
+    return i < node.nChildren;
+}
+
+template <int N>
+inline bool ValidChildCount(const WideBVHNode<N> &node) {
+    return true;
+}
+
+template <int N>
+inline bool ValidChildCount(const QuantizedBVHNode<N> &node) {
+    return node.nChildren <= N;
+}
+
+template <typename Node>
+static bool ValidCachedNodes(const Node *nodes, int nNodes, int nPrimitives,
+                             int nGroups) {
+    std::vector<int> depth(nNodes, 0);
+    for (int n = 0; n < nNodes; ++n) {
+        const Node &node = nodes[n];
+        if (!ValidChildCount(node)) return false;
+        for (int i = 0; i < Node::Width; ++i) {
+            if (!SlotUsed(node, i)) continue;
+            int offset = node.offset[i], count = node.nPrimitives[i];
+            if (count != 0) {
+                int64_t end = int64_t(offset) + std::abs(count);
+                if (offset < 0 || end > (count < 0 ? nGroups : nPrimitives))
+                    return false;
+            } else {
+                if (offset <= n || offset >= nNodes ||
+                    depth[n] >= maxCachedDepth)
+                    return false;
+                depth[offset] = std::max(depth[offset], depth[n] + 1);
+            }
+        }
+    }
+    return true;
+}
+
+// Returns whether each of the cached _TriangleGroup_s refers to existing
+// triangles of _meshes_.
+static bool ValidCachedGroups(
+    const TriangleGroup *groups, int nGroups,
+    const std::vector<std::shared_ptr<TriangleMeshPrimitive>> &meshes) {
+    for (int g = 0; g < nGroups; ++g) {
+        const TriangleGroup &group = groups[g];
+        if (group.nTriangles < 1 || group.nTriangles > TriangleGroup::Width)
+            return false;
+        for (int lane = 0; lane < group.nTriangles; ++lane) {
+            int m = group.meshIndex[lane], t = group.triIndex[lane];
+            if (m < 0 || m >= (int)meshes.size() || t < 0 ||
+                t >= meshes[m]->NumTriangles())
+                return false;
+        }
+    }
+    return true;
+}
+
+bool BVHAccel::readCache(const std::string &filename, uint64_t key) {
+    // Map the file into memory, or read it if mapping isn't available
+    void *data;
+    size_t len;
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat stat;
+    if (fstat(fd, &stat) != 0 ||
+        stat.st_size < (off_t)sizeof(BVHCacheHeader)) {
+        close(fd);
+        return false;
     }
-    return myOffset;
+    len = stat.st_size;
+    data = mmap(0, len, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        Warning("%s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+    auto release = [&]() {
+        if (munmap(data, len) != 0)
+            Warning("munmap: %s", strerror(errno));
+    };
+#else
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < (long)sizeof(BVHCacheHeader)) {
+        fclose(f);
+        return false;
+    }
+    len = size;
+    data = AllocAligned<uint8_t>(len);
+    bool readOK = fread(data, 1, len, f) == len;
+    fclose(f);
+    auto release = [&]() { FreeAligned(data); };
+    if (!readOK) {
+        Warning("%s: unable to read BVH cache", filename.c_str());
+        release();
+        return false;
+    }
+#endif
+
+    // Make sure that the file holds a complete BVH for the given key
+    const uint8_t *bytes = (const uint8_t *)data;
+    BVHCacheHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    size_t nodeBytes = BVHNodeBytes(width, nodeFormat);
+    int nInputPrims = primitives.size();
+    // Returns whether an array of _count_ items of _size_ bytes at _offset_
+    // is aligned and inside the file
+    auto arrayFits = [&](uint64_t offset, int32_t count, size_t size) {
+        return offset % cacheAlignment == 0 && offset <= len &&
+               uint64_t(count) * size <= len - offset;
+    };
+    bool valid =
+        memcmp(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic)) == 0 &&
+        header.key == key && header.fileBytes == len && header.nNodes > 0 &&
+        header.nGroups >= 0 && header.nPrimitives >= 0 &&
+        arrayFits(header.nodesOffset, header.nNodes, nodeBytes) &&
+        arrayFits(header.groupsOffset, header.nGroups, sizeof(TriangleGroup)) &&
+        arrayFits(header.primitivesOffset, header.nPrimitives, sizeof(int32_t));
+    const int32_t *primIndices =
+        (const int32_t *)(bytes + header.primitivesOffset);
+    for (int i = 0; valid && i < header.nPrimitives; ++i)
+        valid = primIndices[i] >= 0 && primIndices[i] < nInputPrims;
+
+    // Make sure that traversal only reaches nodes, primitives, and triangles
+    // that exist
+    const void *nodeData = bytes + header.nodesOffset;
+    const TriangleGroup *groups =
+        (const TriangleGroup *)(bytes + header.groupsOffset);
+    if (valid) {
+        int n = header.nNodes, p = header.nPrimitives, g = header.nGroups;
+        if (width == 2)
+            valid = n >= 2 &&
+                    ValidCachedNodes((const LinearBVHNode *)nodeData, n, p, g);
+        else if (nodeFormat == NodeFormat::Quantized && width == 4)
+            valid = ValidCachedNodes((const QuantizedBVHNode<4> *)nodeData, n,
+                                     p, g);
+        else if (nodeFormat == NodeFormat::Quantized)
+            valid = ValidCachedNodes((const QuantizedBVHNode<8> *)nodeData, n,
+                                     p, g);
+        else if (width == 4)
+            valid =
+                ValidCachedNodes((const WideBVHNode<4> *)nodeData, n, p, g);
+        else
+            valid =
+                ValidCachedNodes((const WideBVHNode<8> *)nodeData, n, p, g);
+        valid = valid && ValidCachedGroups(groups, g, meshes);
+    }
+    if (!valid) {
+        Warning("%s: ignoring stale or corrupt BVH cache", filename.c_str());
+        release();
+        return false;
+    }
+
+    // Use the nodes and _TriangleGroup_s in place and reorder _primitives_
+    if (width == 2)
+        nodes = (LinearBVHNode *)nodeData;
+    else if (nodeFormat == NodeFormat::Quantized && width == 4)
+        quantizedNodes4 = (QuantizedBVHNode<4> *)nodeData;
+    else if (nodeFormat == NodeFormat::Quantized)
+        quantizedNodes8 = (QuantizedBVHNode<8> *)nodeData;
+    else if (width == 4)
+        wideNodes4 = (WideBVHNode<4> *)nodeData;
+    else
+        wideNodes8 = (WideBVHNode<8> *)nodeData;
+    triangleGroups = (TriangleGroup *)groups;
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(header.nPrimitives);
+    for (int i = 0; i < header.nPrimitives; ++i)
+        orderedPrims[i] = primitives[primIndices[i]];
+    primitives.swap(orderedPrims);
+    for (int a = 0; a < 3; ++a) {
+        bounds.pMin[a] = header.boundsMin[a];
+        bounds.pMax[a] = header.boundsMax[a];
+    }
+    cacheData = data;
+    cacheBytes = len;
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]) +
+                 meshes.size() * sizeof(meshes[0]) + len;
+    return true;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+void BVHAccel::writeCache(
+    const std::string &filename, uint64_t key,
+    const std::vector<std::shared_ptr<Primitive>> &inputPrims, int nNodes,
+    int nGroups) const {
+    // Find the index of each of _primitives_ in _inputPrims_
+    std::unordered_map<const Primitive *, int32_t> inputIndex;
+    for (size_t i = 0; i < inputPrims.size(); ++i)
+        inputIndex[inputPrims[i].get()] = i;
+    std::vector<int32_t> primIndices(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        primIndices[i] = inputIndex[primitives[i].get()];
+
+    BVHCacheHeader header{};
+    memcpy(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic));
+    header.key = key;
+    header.nNodes = nNodes;
+    header.nGroups = nGroups;
+    header.nPrimitives = primitives.size();
+    for (int a = 0; a < 3; ++a) {
+        header.boundsMin[a] = bounds.pMin[a];
+        header.boundsMax[a] = bounds.pMax[a];
+    }
+    size_t nodeBytes = nNodes * BVHNodeBytes(width, nodeFormat);
+    header.nodesOffset = AlignCacheOffset(sizeof(header));
+    header.groupsOffset = AlignCacheOffset(header.nodesOffset + nodeBytes);
+    header.primitivesOffset = AlignCacheOffset(
+        header.groupsOffset + nGroups * sizeof(TriangleGroup));
+    header.fileBytes =
+        header.primitivesOffset + primIndices.size() * sizeof(int32_t);
+    const void *nodeData = nodes ? (const void *)nodes
+                         : wideNodes4 ? (const void *)wideNodes4
+                         : wideNodes8 ? (const void *)wideNodes8
+                         : quantizedNodes4 ? (const void *)quantizedNodes4
+                                           : (const void *)quantizedNodes8;
+
+    // Write to a temporary file and rename it so that other processes
+    // never see a partially written cache
+    std::string tempFilename = filename + ".tmp";
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if (!f) {
+        Warning("%s: %s", tempFilename.c_str(), strerror(errno));
+        return;
+    }
+    auto writeAt = [&](uint64_t offset, const void *data, size_t size) {
+        static const char zeros[cacheAlignment] = {};
+        long pad = offset - ftell(f);
+        return fwrite(zeros, 1, pad, f) == size_t(pad) &&
+               fwrite(data, 1, size, f) == size;
+    };
+    bool writeOK =
+        writeAt(0, &header, sizeof(header)) &&
+        writeAt(header.nodesOffset, nodeData, nodeBytes) &&
+        writeAt(header.groupsOffset, triangleGroups,
+                nGroups * sizeof(TriangleGroup)) &&
+        writeAt(header.primitivesOffset, primIndices.data(),
+                primIndices.size() * sizeof(int32_t));
+    if (fclose(f) != 0) writeOK = false;
+    if (!writeOK || rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        Warning("%s: unable to write BVH cache", filename.c_str());
+        remove(tempFilename.c_str());
+    }
+}
+
+BVHAccel::~BVHAccel() {
+    if (cacheData) {
+        // The nodes and _TriangleGroup_s are stored in _cacheData_
+#ifdef PBRT_HAVE_MMAP
+        if (munmap(cacheData, cacheBytes) != 0)
+            Warning("munmap: %s", strerror(errno));
+#else
+        FreeAligned(cacheData);
+#endif
+        return;
+    }
+    FreeAligned(triangleGroups);
+    FreeAligned(nodes);
+    FreeAligned(wideNodes4);
+    FreeAligned(wideNodes8);
+    FreeAligned(quantizedNodes4);
+    FreeAligned(quantizedNodes8);
+}
+
+void BVHAccel::touchLeaf(const LinearBVHNode *node,
+                         TraversalStats *stats) const {
+    if (node->triangleLeaf)
+        stats->Touch(&triangleGroups[node->primitivesOffset],
+                     node->nPrimitives * sizeof(TriangleGroup));
+    else
+        stats->Touch(&primitives[node->primitivesOffset],
+                     node->nPrimitives * sizeof(primitives[0]));
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    if (!benchmark) return traverse(ray, isect, nullptr);
+    TraversalStats stats;
+    bool hit = traverse(ray, isect, &stats);
+    stats.Report();
+    return hit;
+}
+
+bool BVHAccel::IntersectP(const Ray &ray) const {
+    if (!benchmark) return traverseP(ray, nullptr);
+    TraversalStats stats;
+    bool hit = traverseP(ray, &stats);
+    stats.Report();
+    return hit;
+}
+
+bool BVHAccel::traverse(const Ray &ray, SurfaceInteraction *isect,
+                        TraversalStats *stats) const {
+    if (wideNodes4)
+        return IntersectWideBVH(wideNodes4, primitives, triangleGroups,
+                                meshes.data(), ray, isect, stats);
+    if (wideNodes8)
+        return IntersectWideBVH(wideNodes8, primitives, triangleGroups,
+                                meshes.data(), ray, isect, stats);
+    if (quantizedNodes4)
+        return IntersectWideBVH(quantizedNodes4, primitives, triangleGroups,
+                                meshes.data(), ray, isect, stats);
+    if (quantizedNodes8)
+        return IntersectWideBVH(quantizedNodes8, primitives, triangleGroups,
+                                meshes.data(), ray, isect, stats);
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersect);
     bool hit = false;
@@ -670,26 +2536,32 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     int nodesToVisit[64];
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
+        if (stats) stats->VisitNode(node, sizeof(*node));
         // Check ray against BVH node
         if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             if (node->nPrimitives > 0) {
                 // Intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->nPrimitives; ++i)
-                    if (primitives[node->primitivesOffset + i]->Intersect(
-                            ray, isect))
-                        hit = true;
+                if (stats) touchLeaf(node, stats);
+                if (node->triangleLeaf) {
+                    for (int i = 0; i < node->nPrimitives; ++i)
+                        if (triangleGroups[node->primitivesOffset + i]
+                                .Intersect(ray, isect, meshes.data()))
+                            hit = true;
+                } else {
+                    for (int i = 0; i < node->nPrimitives; ++i)
+                        if (primitives[node->primitivesOffset + i]->Intersect(
+                                ray, isect))
+                            hit = true;
+                }
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
                 // Put far BVH node on _nodesToVisit_ stack, advance to near
                 // node
-                if (dirIsNeg[node->axis]) {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
-                } else {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
-                }
+                int nearChild = dirIsNeg[node->axis];
+                nodesToVisit[toVisitOffset++] =
+                    node->childrenOffset + 1 - nearChild;
+                currentNodeIndex = node->childrenOffset + nearChild;
             }
         } else {
             if (toVisitOffset == 0) break;
@@ -699,7 +2571,19 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     return hit;
 }
 
-bool BVHAccel::IntersectP(const Ray &ray) const {
+bool BVHAccel::traverseP(const Ray &ray, TraversalStats *stats) const {
+    if (wideNodes4)
+        return IntersectPWideBVH(wideNodes4, primitives, triangleGroups,
+                                 meshes.data(), ray, stats);
+    if (wideNodes8)
+        return IntersectPWideBVH(wideNodes8, primitives, triangleGroups,
+                                 meshes.data(), ray, stats);
+    if (quantizedNodes4)
+        return IntersectPWideBVH(quantizedNodes4, primitives, triangleGroups,
+                                 meshes.data(), ray, stats);
+    if (quantizedNodes8)
+        return IntersectPWideBVH(quantizedNodes8, primitives, triangleGroups,
+                                 meshes.data(), ray, stats);
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
@@ -708,26 +2592,31 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
     int toVisitOffset = 0, currentNodeIndex = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
+        if (stats) stats->VisitNode(node, sizeof(*node));
         if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             // Process BVH node _node_ for traversal
             if (node->nPrimitives > 0) {
-                for (int i = 0; i < node->nPrimitives; ++i) {
-                    if (primitives[node->primitivesOffset + i]->IntersectP(
-                            ray)) {
-                        return true;
+                if (stats) touchLeaf(node, stats);
+                if (node->triangleLeaf) {
+                    for (int i = 0; i < node->nPrimitives; ++i)
+                        if (triangleGroups[node->primitivesOffset + i]
+                                .IntersectP(ray, meshes.data()))
+                            return true;
+                } else {
+                    for (int i = 0; i < node->nPrimitives; ++i) {
+                        if (primitives[node->primitivesOffset + i]->IntersectP(
+                                ray)) {
+                            return true;
+                        }
                     }
                 }
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
-                if (dirIsNeg[node->axis]) {
-                    /// second child first
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
-                } else {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
-                }
+                int nearChild = dirIsNeg[node->axis];
+                nodesToVisit[toVisitOffset++] =
+                    node->childrenOffset + 1 - nearChild;
+                currentNodeIndex = node->childrenOffset + nearChild;
             }
         } else {
             if (toVisitOffset == 0) break;
@@ -737,8 +2626,255 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
     return false;
 }
 
+// Returns the subset of the rays in _mask_ that intersect _bounds_, using the
+// same robust slab test as _Bounds3::IntersectP()_. All of the rays must
+// have the direction signs given by _dirIsNeg_.
+static RayMask IntersectBatchBounds(const Bounds3f &bounds,
+                                    const RayBatch &rays,
+                                    const Float invDir[3][MaxRayBatchSize],
+                                    const int dirIsNeg[3],
+                                    const RayMask &mask) {
+    ++batchNodeVisits;
+    RayMask result;
+    const Float scale = 1 + 2 * gamma(3);
+    const Float *o[3] = {rays.ox, rays.oy, rays.oz};
+    for (int w = 0; w < RayMask::nWords; ++w) {
+        uint32_t bits = mask.Word(w), hits = 0;
+        if (!bits) continue;
+#ifdef PBRT_HAVE_SSE
+        // Test four rays at a time; lanes of rays not in _mask_ are ignored
+        for (int c = 0; c < 32; c += 4) {
+            if (!((bits >> c) & 0xf)) continue;
+            int i = 32 * w + c;
+            __m128 tMin, tMax, reject = _mm_setzero_ps();
+            for (int axis = 0; axis < 3; ++axis) {
+                __m128 oa = _mm_loadu_ps(&o[axis][i]);
+                __m128 id = _mm_loadu_ps(&invDir[axis][i]);
+                __m128 t0 = _mm_mul_ps(
+                    _mm_sub_ps(_mm_set1_ps(bounds[dirIsNeg[axis]][axis]), oa),
+                    id);
+                __m128 t1 = _mm_mul_ps(
+                    _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(
+                                              bounds[1 - dirIsNeg[axis]][axis]),
+                                          oa),
+                               id),
+                    _mm_set1_ps(scale));
+                if (axis == 0) {
+                    tMin = t0;
+                    tMax = t1;
+                    continue;
+                }
+                reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmpgt_ps(tMin, t1),
+                                                     _mm_cmpgt_ps(t0, tMax)));
+                // As in _IntersectWideBounds()_, operand order matches the
+                // scalar code's handling of NaNs.
+                tMin = _mm_max_ps(t0, tMin);
+                tMax = _mm_min_ps(t1, tMax);
+            }
+            __m128 hit = _mm_andnot_ps(
+                reject,
+                _mm_and_ps(_mm_cmplt_ps(tMin, _mm_loadu_ps(&rays.tMax[i])),
+                           _mm_cmpgt_ps(tMax, _mm_setzero_ps())));
+            hits |= (uint32_t)_mm_movemask_ps(hit) << c;
+        }
+        hits &= bits;
+#else
+        for (uint32_t b = bits; b; b &= b - 1) {
+            int i = 32 * w + CountTrailingZeros(b);
+            Float tMin = 0, tMax = 0;
+            bool reject = false;
+            for (int axis = 0; axis < 3; ++axis) {
+                Float t0 = (bounds[dirIsNeg[axis]][axis] - o[axis][i]) *
+                           invDir[axis][i];
+                Float t1 = (bounds[1 - dirIsNeg[axis]][axis] - o[axis][i]) *
+                           invDir[axis][i];
+                t1 *= scale;
+                if (axis == 0) {
+                    tMin = t0;
+                    tMax = t1;
+                    continue;
+                }
+                if (tMin > t1 || t0 > tMax) {
+                    reject = true;
+                    break;
+                }
+                if (t0 > tMin) tMin = t0;
+                if (t1 < tMax) tMax = t1;
+            }
+            if (!reject && tMin < rays.tMax[i] && tMax > 0)
+                hits |= 1u << (i & 31);
+        }
+#endif  // PBRT_HAVE_SSE
+        int nRays = 0;
+        for (uint32_t b = bits; b; b &= b - 1) ++nRays;
+        batchNodeRays += nRays;
+        result.SetWord(w, hits);
+    }
+    return result;
+}
+
+// Packet traversal only pays off for batches of many rays that travel in
+// the same octant, for which the child visiting order is right for all of
+// them; other batches are traced one ray at a time.
+static PBRT_CONSTEXPR int minPacketRays = 64;
+
+// Returns true if the batch's active rays should be traced as a packet,
+// and initializes _dirIsNeg_ with the sign of their directions.
+static bool IsCoherentBatch(const RayBatch &rays, int dirIsNeg[3]) {
+    if (rays.active.Count() < minPacketRays) return false;
+    // Compare sign bits, consistent with the signs of $1/d$
+    int first = rays.active.First();
+    dirIsNeg[0] = std::signbit(rays.dx[first]);
+    dirIsNeg[1] = std::signbit(rays.dy[first]);
+    dirIsNeg[2] = std::signbit(rays.dz[first]);
+    bool coherent = true;
+    rays.active.ForEach([&](int i) {
+        if (std::signbit(rays.dx[i]) != dirIsNeg[0] ||
+            std::signbit(rays.dy[i]) != dirIsNeg[1] ||
+            std::signbit(rays.dz[i]) != dirIsNeg[2])
+            coherent = false;
+    });
+    return coherent;
+}
+
+// Initializes _invDir_ with the reciprocals of the directions of the
+// batch's active rays. The entries of other rays are zero, so that SIMD
+// bounds tests, which compute lanes of inactive rays along with active
+// ones and then discard them, don't compute with uninitialized values.
+static void BatchInverseDirections(const RayBatch &rays,
+                                   Float invDir[3][MaxRayBatchSize]) {
+    for (int axis = 0; axis < 3; ++axis)
+        for (int i = 0; i < MaxRayBatchSize; ++i) invDir[axis][i] = 0;
+    rays.active.ForEach([&](int i) {
+        invDir[0][i] = 1 / rays.dx[i];
+        invDir[1][i] = 1 / rays.dy[i];
+        invDir[2][i] = 1 / rays.dz[i];
+    });
+}
+
+void BVHAccel::IntersectBatch(RayBatch &rays,
+                              SurfaceInteraction *isects) const {
+    int dirIsNeg[3];
+    if (!nodes || benchmark || !IsCoherentBatch(rays, dirIsNeg)) {
+        // Trace rays individually, as for wide BVH layouts and in benchmark
+        // mode
+        Primitive::IntersectBatch(rays, isects);
+        return;
+    }
+    ProfilePhase p(Prof::AccelIntersect);
+    Float invDir[3][MaxRayBatchSize];
+    BatchInverseDirections(rays, invDir);
+    // Follow the batch through BVH nodes, keeping the subset of its rays
+    // that reach each node in a _RayMask_
+    const RayMask active = rays.active;
+    struct {
+        int nodeIndex;
+        RayMask mask;
+    } nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    RayMask mask = active;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        RayMask nodeMask = IntersectBatchBounds(node->bounds, rays, invDir,
+                                                dirIsNeg, mask);
+        if (nodeMask.Any()) {
+            if (node->nPrimitives > 0) {
+                // Intersect node's rays with primitives in leaf BVH node
+                rays.active = nodeMask;
+                if (node->triangleLeaf)
+                    TriangleGroup::IntersectBatch(
+                        &triangleGroups[node->primitivesOffset],
+                        node->nPrimitives, rays, isects, meshes.data());
+                else {
+                    for (int i = 0; i < node->nPrimitives; ++i)
+                        primitives[node->primitivesOffset + i]->IntersectBatch(
+                            rays, isects);
+                }
+                if (toVisitOffset == 0) break;
+                --toVisitOffset;
+                currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+                mask = nodesToVisit[toVisitOffset].mask;
+            } else {
+                // Put far BVH node on _nodesToVisit_ stack, advance to near
+                // node
+                int nearChild = dirIsNeg[node->axis];
+                nodesToVisit[toVisitOffset].mask = nodeMask;
+                nodesToVisit[toVisitOffset++].nodeIndex =
+                    node->childrenOffset + 1 - nearChild;
+                currentNodeIndex = node->childrenOffset + nearChild;
+                mask = nodeMask;
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+            mask = nodesToVisit[toVisitOffset].mask;
+        }
+    }
+    rays.active = active;
+}
+
+void BVHAccel::IntersectPBatch(RayBatch &rays) const {
+    int dirIsNeg[3];
+    if (!nodes || benchmark || !IsCoherentBatch(rays, dirIsNeg)) {
+        Primitive::IntersectPBatch(rays);
+        return;
+    }
+    ProfilePhase p(Prof::AccelIntersectP);
+    Float invDir[3][MaxRayBatchSize];
+    BatchInverseDirections(rays, invDir);
+    // Rays are dropped from the traversal as soon as they are found to be
+    // occluded; _unoccluded_ tracks the rays still being traced
+    RayMask unoccluded = rays.active;
+    struct {
+        int nodeIndex;
+        RayMask mask;
+    } nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    RayMask mask = unoccluded;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        RayMask nodeMask = IntersectBatchBounds(node->bounds, rays, invDir,
+                                                dirIsNeg, mask);
+        if (nodeMask.Any()) {
+            if (node->nPrimitives > 0) {
+                rays.active = nodeMask;
+                if (node->triangleLeaf)
+                    TriangleGroup::IntersectPBatch(
+                        &triangleGroups[node->primitivesOffset],
+                        node->nPrimitives, rays, meshes.data());
+                else {
+                    for (int i = 0;
+                         i < node->nPrimitives && rays.active.Any(); ++i)
+                        primitives[node->primitivesOffset + i]
+                            ->IntersectPBatch(rays);
+                }
+                unoccluded &= ~(nodeMask & ~rays.active);
+                if (toVisitOffset == 0 || !unoccluded.Any()) break;
+                --toVisitOffset;
+                currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+                mask = nodesToVisit[toVisitOffset].mask & unoccluded;
+            } else {
+                int nearChild = dirIsNeg[node->axis];
+                nodesToVisit[toVisitOffset].mask = nodeMask;
+                nodesToVisit[toVisitOffset++].nodeIndex =
+                    node->childrenOffset + 1 - nearChild;
+                currentNodeIndex = node->childrenOffset + nearChild;
+                mask = nodeMask;
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+            mask = nodesToVisit[toVisitOffset].mask & unoccluded;
+        }
+    }
+    rays.active = unoccluded;
+}
+
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
-    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) {
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps,
+    int width) {
     std::string splitMethodName = ps.FindOneString("splitmethod", "sah");
     BVHAccel::SplitMethod splitMethod;
     if (splitMethodName == "sah")
@@ -749,6 +2885,8 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
         splitMethod = BVHAccel::SplitMethod::Middle;
     else if (splitMethodName == "equal")
         splitMethod = BVHAccel::SplitMethod::EqualCounts;
+    else if (splitMethodName == "sbvh")
+        splitMethod = BVHAccel::SplitMethod::SBVH;
     else {
         Warning("BVH split method \"%s\" unknown.  Using \"sah\".",
                 splitMethodName.c_str());
@@ -756,7 +2894,47 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     }
 
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+
+    std::string nodeFormatName = ps.FindOneString("nodeformat", "full");
+    BVHAccel::NodeFormat nodeFormat;
+    if (nodeFormatName == "full")
+        nodeFormat = BVHAccel::NodeFormat::Full;
+    else if (nodeFormatName == "quantized")
+        nodeFormat = BVHAccel::NodeFormat::Quantized;
+    else {
+        Warning("BVH node format \"%s\" unknown.  Using \"full\".",
+                nodeFormatName.c_str());
+        nodeFormat = BVHAccel::NodeFormat::Full;
+    }
+    // Quantized nodes share one grid among several children, so binary BVHs
+    // use them with 4-wide nodes
+    if (nodeFormat == BVHAccel::NodeFormat::Quantized && width == 2)
+        width = 4;
+    // Maximum number of references added by "sbvh" spatial splits, as a
+    // fraction of the number of primitives
+    Float spatialSplitBudget = ps.FindOneFloat("spatialsplitbudget", .3f);
+    // Number of treelet restructuring passes run after the build
+    int treeletPasses = ps.FindOneInt("treeletpasses", 0);
+
+    std::string layoutName = ps.FindOneString("layout", "depthfirst");
+    BVHAccel::NodeLayout layout;
+    if (layoutName == "depthfirst")
+        layout = BVHAccel::NodeLayout::DepthFirst;
+    else if (layoutName == "clustered")
+        layout = BVHAccel::NodeLayout::Clustered;
+    else {
+        Warning("BVH layout \"%s\" unknown.  Using \"depthfirst\".",
+                layoutName.c_str());
+        layout = BVHAccel::NodeLayout::DepthFirst;
+    }
+    // Report nodes visited and cache lines touched per ray
+    bool benchmark = ps.FindOneBool("benchmark", false);
+    // Directory in which built BVHs are stored and looked up
+    std::string cacheDirectory = ps.FindOneFilename("cachedir", "");
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, width, nodeFormat,
+                                      spatialSplitBudget, treeletPasses,
+                                      layout, benchmark, cacheDirectory);
 }
 
 }  // namespace pbrt
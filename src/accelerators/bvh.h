@@ -47,55 +47,128 @@ namespace pbrt {
 struct BVHBuildNode;
 
 // BVHAccel Forward Declarations
+struct BVHItem;
 struct BVHPrimitiveInfo;
 struct MortonPrimitive;
 struct LinearBVHNode;
+template <int N>
+struct WideBVHNode;
+template <int N>
+struct QuantizedBVHNode;
+struct TriangleGroup;
+struct TraversalStats;
+class TriangleMeshPrimitive;
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
   public:
     // BVHAccel Public Types
-    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts };
+    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts, SBVH };
+    enum class NodeFormat { Full, Quantized };
+    enum class NodeLayout { DepthFirst, Clustered };
 
     // BVHAccel Public Methods
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH, int width = 2,
+             NodeFormat nodeFormat = NodeFormat::Full,
+             Float spatialSplitBudget = .3f, int treeletPasses = 0,
+             NodeLayout layout = NodeLayout::DepthFirst,
+             bool benchmark = false, const std::string &cacheDirectory = "");
     Bounds3f WorldBound() const;
     ~BVHAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    void IntersectBatch(RayBatch &rays, SurfaceInteraction *isects) const;
+    void IntersectPBatch(RayBatch &rays) const;
+    // Returns the file in which the BVH is cached, if a cache directory was
+    // given, and whether the BVH was loaded from it.
+    const std::string &CacheFilename() const { return cacheFilename; }
+    bool LoadedFromCache() const { return cacheData != nullptr; }
 
   private:
     // BVHAccel Private Methods
-    BVHBuildNode *recursiveBuild(
-        MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int start, int end, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
+    BVHBuildNode *recursiveBuild(std::vector<MemoryArena> &threadArenas,
+                                 std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                                 int start, int end,
+                                 std::atomic<int> *totalNodes) const;
+    BVHBuildNode *spatialSplitBuild(std::vector<MemoryArena> &threadArenas,
+                                    const std::vector<BVHItem> &items,
+                                    std::vector<BVHPrimitiveInfo> &refs,
+                                    Float rootArea,
+                                    std::atomic<int> *totalNodes,
+                                    std::atomic<int> *referenceBudget,
+                                    std::vector<int> *orderedItems) const;
     BVHBuildNode *HLBVHBuild(
         MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims) const;
+        int *totalNodes, std::vector<int> &orderedItems) const;
     BVHBuildNode *emitLBVH(
         BVHBuildNode *&buildNodes,
         const std::vector<BVHPrimitiveInfo> &primitiveInfo,
         MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-        std::atomic<int> *orderedPrimsOffset, int bitIndex) const;
+        std::vector<int> &orderedItems, std::atomic<int> *orderedItemsOffset,
+        int bitIndex) const;
     BVHBuildNode *buildUpperSAH(MemoryArena &arena,
                                 std::vector<BVHBuildNode *> &treeletRoots,
                                 int start, int end, int *totalNodes) const;
-    int flattenBVHTree(BVHBuildNode *node, int *offset);
+    Bounds3f itemBound(const BVHItem &item) const;
+    Bounds3f clipItemBound(const BVHItem &item, const Bounds3f &bounds,
+                           int axis, Float lo, Float hi) const;
+    void splitLeaf(MemoryArena &arena, BVHBuildNode *node,
+                   const std::vector<BVHItem> &items,
+                   const std::vector<int> &orderedItems, int nFirst,
+                   int *totalNodes) const;
+    int packLeaves(MemoryArena &arena, BVHBuildNode *node,
+                   const std::vector<BVHItem> &items,
+                   std::vector<int> &orderedItems,
+                   std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+                   std::vector<TriangleGroup> &groups, int *totalNodes) const;
+    void packTriangleLeaf(BVHBuildNode *node, const std::vector<BVHItem> &items,
+                          const std::vector<int> &orderedItems,
+                          std::vector<TriangleGroup> &groups,
+                          int *totalNodes) const;
+    void flattenBVHTree(BVHBuildNode *root, int *offset);
+    template <typename Node>
+    void flattenWideBVHTree(BVHBuildNode *root, Node *wideNodes, int *offset);
+    void reorderLeaves(const std::vector<TriangleGroup> &groups, int nNodes);
+    bool traverse(const Ray &ray, SurfaceInteraction *isect,
+                  TraversalStats *stats) const;
+    bool traverseP(const Ray &ray, TraversalStats *stats) const;
+    void touchLeaf(const LinearBVHNode *node, TraversalStats *stats) const;
+    uint64_t cacheKey(int treeletPasses) const;
+    bool readCache(const std::string &filename, uint64_t key);
+    void writeCache(const std::string &filename, uint64_t key,
+                    const std::vector<std::shared_ptr<Primitive>> &inputPrims,
+                    int nNodes, int nGroups) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const int width;
+    const NodeFormat nodeFormat;
+    const Float spatialSplitBudget;
+    const NodeLayout layout;
+    const bool benchmark;
+    Bounds3f bounds;
     std::vector<std::shared_ptr<Primitive>> primitives;
+    std::vector<std::shared_ptr<TriangleMeshPrimitive>> meshes;
+    TriangleGroup *triangleGroups = nullptr;
     LinearBVHNode *nodes = nullptr;
+    WideBVHNode<4> *wideNodes4 = nullptr;
+    WideBVHNode<8> *wideNodes8 = nullptr;
+    QuantizedBVHNode<4> *quantizedNodes4 = nullptr;
+    QuantizedBVHNode<8> *quantizedNodes8 = nullptr;
+    // If the BVH was loaded from a cache file, its nodes and
+    // _TriangleGroup_s point into this buffer instead of being allocated
+    // separately.
+    std::string cacheFilename;
+    void *cacheData = nullptr;
+    size_t cacheBytes = 0;
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
-    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps);
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps,
+    int width = 2);
 
 }  // namespace pbrt
 
@@ -0,0 +1,294 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// accelerators/instances.cpp*
+#include "accelerators/instances.h"
+#include "interaction.h"
+#include "parallel.h"
+#include "stats.h"
+#include <algorithm>
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Instance BVH", instanceBVHBytes);
+STAT_COUNTER("Scene/Instances in top-level BVH", nTopLevelInstances);
+
+// InstanceAccel Local Declarations
+struct InstanceBVHNode {
+    Bounds3f bounds;
+    int32_t offset;       // leaf: first instance; interior: second child
+    uint16_t nInstances;  // 0 -> interior node
+    uint8_t axis;         // interior node: xyz
+};
+
+struct InstanceBuildInfo {
+    Bounds3f bounds;
+    Point3f centroid;
+    InstanceAccel::Instance instance;
+};
+
+// Leaves of the top-level BVH hold at most this many instances, which are
+// split using the SAH evaluated at _nInstanceBuckets_ candidate planes.
+static PBRT_CONSTEXPR int maxInstancesInNode = 4;
+static PBRT_CONSTEXPR int nInstanceBuckets = 16;
+
+// InstanceAccel Method Definitions
+InstanceAccel::InstanceAccel(std::vector<std::shared_ptr<Primitive>> o,
+                             std::vector<Transform> w2i,
+                             std::vector<Instance> inst)
+    : objects(std::move(o)),
+      worldToInstance(std::move(w2i)),
+      instances(std::move(inst)) {
+    ProfilePhase _(Prof::AccelConstruction);
+    objectBounds.reserve(objects.size());
+    for (const std::shared_ptr<Primitive> &object : objects)
+        objectBounds.push_back(object->WorldBound());
+    nTopLevelInstances += instances.size();
+    if (instances.empty()) return;
+
+    // Build the top-level BVH over the instances' world-space bounds
+    std::vector<InstanceBuildInfo> buildInfo(instances.size());
+    ParallelFor([&](int64_t i) {
+        Bounds3f b = instanceBound(instances[i]);
+        buildInfo[i] = {b, .5f * b.pMin + .5f * b.pMax, instances[i]};
+    }, instances.size(), 4096);
+    nodes = AllocAligned<InstanceBVHNode>(2 * instances.size() - 1);
+    InterleavePages(nodes,
+                    (2 * instances.size() - 1) * sizeof(InstanceBVHNode));
+    recursiveBuild(buildInfo, 0, instances.size(), &nNodes);
+    bounds = nodes[0].bounds;
+    // Store the instances in the order that the leaves reference them
+    for (size_t i = 0; i < instances.size(); ++i)
+        instances[i] = buildInfo[i].instance;
+    instanceBVHBytes += nNodes * sizeof(InstanceBVHNode) +
+                        instances.size() * sizeof(Instance) +
+                        worldToInstance.size() * sizeof(Transform) +
+                        objects.size() *
+                            (sizeof(objects[0]) + sizeof(Bounds3f));
+}
+
+InstanceAccel::~InstanceAccel() { FreeAligned(nodes); }
+
+Bounds3f InstanceAccel::instanceBound(const Instance &instance) const {
+    return Inverse(worldToInstance[instance.transformIndex])(
+        objectBounds[instance.objectIndex]);
+}
+
+int InstanceAccel::recursiveBuild(std::vector<InstanceBuildInfo> &buildInfo,
+                                  int start, int end, int *offset) {
+    int nodeIndex = (*offset)++;
+    InstanceBVHNode *node = &nodes[nodeIndex];
+    Bounds3f centroidBounds;
+    node->bounds = Bounds3f();
+    for (int i = start; i < end; ++i) {
+        node->bounds = Union(node->bounds, buildInfo[i].bounds);
+        centroidBounds = Union(centroidBounds, buildInfo[i].centroid);
+    }
+    int n = end - start;
+    if (n <= maxInstancesInNode) {
+        node->offset = start;
+        node->nInstances = n;
+        return nodeIndex;
+    }
+
+    // Partition the instances using the SAH, falling back to equal counts
+    // if the centroids coincide or all fall in a single bucket
+    int axis = centroidBounds.MaximumExtent();
+    int mid = start;
+    if (centroidBounds.pMax[axis] > centroidBounds.pMin[axis]) {
+        auto bucketIndex = [&](const InstanceBuildInfo &info) {
+            int b = nInstanceBuckets *
+                    centroidBounds.Offset(info.centroid)[axis];
+            return std::min(b, nInstanceBuckets - 1);
+        };
+        int counts[nInstanceBuckets] = {};
+        Bounds3f bucketBounds[nInstanceBuckets];
+        for (int i = start; i < end; ++i) {
+            int b = bucketIndex(buildInfo[i]);
+            ++counts[b];
+            bucketBounds[b] = Union(bucketBounds[b], buildInfo[i].bounds);
+        }
+        // Sweep from the right to find the areas of the buckets' suffixes
+        Float suffixArea[nInstanceBuckets];
+        Bounds3f b;
+        for (int i = nInstanceBuckets - 1; i > 0; --i) {
+            b = Union(b, bucketBounds[i]);
+            suffixArea[i] = b.SurfaceArea();
+        }
+        Float minCost = Infinity;
+        int minBucket = -1, count0 = 0;
+        b = Bounds3f();
+        for (int i = 0; i < nInstanceBuckets - 1; ++i) {
+            b = Union(b, bucketBounds[i]);
+            count0 += counts[i];
+            if (count0 == 0 || count0 == n) continue;
+            Float cost = count0 * b.SurfaceArea() +
+                         (n - count0) * suffixArea[i + 1];
+            if (cost < minCost) {
+                minCost = cost;
+                minBucket = i;
+            }
+        }
+        if (minBucket >= 0)
+            mid = std::partition(&buildInfo[start], &buildInfo[end - 1] + 1,
+                                 [&](const InstanceBuildInfo &info) {
+                                     return bucketIndex(info) <= minBucket;
+                                 }) -
+                  &buildInfo[0];
+    }
+    if (mid == start || mid == end) {
+        mid = (start + end) / 2;
+        std::nth_element(&buildInfo[start], &buildInfo[mid],
+                         &buildInfo[end - 1] + 1,
+                         [axis](const InstanceBuildInfo &a,
+                                const InstanceBuildInfo &b) {
+                             return a.centroid[axis] < b.centroid[axis];
+                         });
+    }
+
+    // The first child immediately follows its parent
+    recursiveBuild(buildInfo, start, mid, offset);
+    node->offset = recursiveBuild(buildInfo, mid, end, offset);
+    node->nInstances = 0;
+    node->axis = axis;
+    return nodeIndex;
+}
+
+void InstanceAccel::SetTransform(int transformIndex,
+                                 const Transform &w2i) {
+    CHECK(transformIndex >= 0 && transformIndex < (int)worldToInstance.size());
+    worldToInstance[transformIndex] = w2i;
+}
+
+void InstanceAccel::Refit() {
+    ProfilePhase _(Prof::AccelConstruction);
+    // Recompute the leaf bounds in parallel, then update the interior
+    // nodes, whose children always follow them in _nodes_
+    ParallelFor([&](int64_t i) {
+        InstanceBVHNode &node = nodes[i];
+        if (node.nInstances == 0) return;
+        node.bounds = Bounds3f();
+        for (int j = 0; j < node.nInstances; ++j)
+            node.bounds = Union(node.bounds,
+                                instanceBound(instances[node.offset + j]));
+    }, nNodes, 1024);
+    for (int i = nNodes - 1; i >= 0; --i)
+        if (nodes[i].nInstances == 0)
+            nodes[i].bounds =
+                Union(nodes[i + 1].bounds, nodes[nodes[i].offset].bounds);
+    bounds = nNodes > 0 ? nodes[0].bounds : Bounds3f();
+}
+
+bool InstanceAccel::intersectInstance(const Instance &instance, const Ray &r,
+                                      SurfaceInteraction *isect) const {
+    // Transform _r_ into the instance's space and intersect its object
+    const Transform &w2i = worldToInstance[instance.transformIndex];
+    Ray ray = w2i(r);
+    if (!objects[instance.objectIndex]->Intersect(ray, isect)) return false;
+    r.tMax = ray.tMax;
+    // Transform instance's intersection data to world space
+    if (!w2i.IsIdentity()) *isect = Inverse(w2i)(*isect);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0);
+    return true;
+}
+
+bool InstanceAccel::Intersect(const Ray &ray,
+                              SurfaceInteraction *isect) const {
+    if (!nodes) return false;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    // Follow ray through the top-level BVH to find instance intersections
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const InstanceBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            if (node->nInstances > 0) {
+                for (int i = 0; i < node->nInstances; ++i)
+                    if (intersectInstance(instances[node->offset + i], ray,
+                                          isect))
+                        hit = true;
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else if (dirIsNeg[node->axis]) {
+                nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                currentNodeIndex = node->offset;
+            } else {
+                nodesToVisit[toVisitOffset++] = node->offset;
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return hit;
+}
+
+bool InstanceAccel::IntersectP(const Ray &ray) const {
+    if (!nodes) return false;
+    ProfilePhase p(Prof::AccelIntersectP);
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const InstanceBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            if (node->nInstances > 0) {
+                for (int i = 0; i < node->nInstances; ++i) {
+                    const Instance &instance = instances[node->offset + i];
+                    if (objects[instance.objectIndex]->IntersectP(
+                            worldToInstance[instance.transformIndex](ray)))
+                        return true;
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else if (dirIsNeg[node->axis]) {
+                nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                currentNodeIndex = node->offset;
+            } else {
+                nodesToVisit[toVisitOffset++] = node->offset;
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return false;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,99 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_INSTANCES_H
+#define PBRT_ACCELERATORS_INSTANCES_H
+
+// accelerators/instances.h*
+#include "pbrt.h"
+#include "primitive.h"
+#include "transform.h"
+
+namespace pbrt {
+
+// InstanceAccel Forward Declarations
+struct InstanceBVHNode;
+struct InstanceBuildInfo;
+
+// Two-level acceleration structure for object instances with static
+// transformations: each instance is a small record that refers to a shared
+// bottom-level aggregate and to one of a table of transformations, and a
+// top-level BVH is built over the instances' world-space bounds.
+class InstanceAccel : public Aggregate {
+  public:
+    // InstanceAccel Public Types
+    struct Instance {
+        int32_t objectIndex;     // index into _objects_
+        int32_t transformIndex;  // index into _worldToInstance_
+    };
+
+    // InstanceAccel Public Methods
+    InstanceAccel(std::vector<std::shared_ptr<Primitive>> objects,
+                  std::vector<Transform> worldToInstance,
+                  std::vector<Instance> instances);
+    ~InstanceAccel();
+    Bounds3f WorldBound() const { return bounds; }
+    bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &ray) const;
+    // Replaces one of the instance transformations; _Refit()_ must be
+    // called before the accelerator is used again.
+    void SetTransform(int transformIndex, const Transform &worldToInstance);
+    // Updates the bounds of the top-level BVH's nodes without changing its
+    // topology.
+    void Refit();
+
+  private:
+    // InstanceAccel Private Methods
+    int recursiveBuild(std::vector<InstanceBuildInfo> &buildInfo, int start,
+                       int end, int *offset);
+    Bounds3f instanceBound(const Instance &instance) const;
+    bool intersectInstance(const Instance &instance, const Ray &r,
+                           SurfaceInteraction *isect) const;
+
+    // InstanceAccel Private Data
+    std::vector<std::shared_ptr<Primitive>> objects;
+    std::vector<Bounds3f> objectBounds;
+    std::vector<Transform> worldToInstance;
+    std::vector<Instance> instances;
+    InstanceBVHNode *nodes = nullptr;
+    int nNodes = 0;
+    Bounds3f bounds;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_INSTANCES_H
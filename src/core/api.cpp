@@ -34,14 +34,17 @@
 #include "api.h"
 #include "parallel.h"
 #include "paramset.h"
+#include "parser.h"
 #include "spectrum.h"
 #include "scene.h"
 #include "film.h"
 #include "medium.h"
 #include "stats.h"
+#include "texcache.h"
 
 // API Additional Headers
 #include "accelerators/bvh.h"
+#include "accelerators/instances.h"
 #include "accelerators/kdtreeaccel.h"
 #include "cameras/environment.h"
 #include "cameras/orthographic.h"
@@ -155,11 +158,22 @@ struct TransformSet {
     Transform t[MaxTransforms];
 };
 
+// Primitives for a shape that is being created by a scene loading task;
+// once the task has finished, they're inserted into _prims_ at _position_
+struct LoadingPrimitives {
+    std::vector<std::shared_ptr<Primitive>> *prims;
+    size_t position;
+    std::vector<std::shared_ptr<Primitive>> loaded;
+};
+
 struct RenderOptions {
     // RenderOptions Public Methods
     Integrator *MakeIntegrator() const;
     Scene *MakeScene();
     Camera *MakeCamera() const;
+    void FinishLoading();
+    // Waits only for the primitives that are loading into _prims_
+    void FinishLoading(std::vector<std::shared_ptr<Primitive>> *prims);
 
     // RenderOptions Public Data
     Float transformStartTime = 0, transformEndTime = 1;
@@ -181,6 +195,18 @@ struct RenderOptions {
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>> *currentInstance = nullptr;
+    // Uses of object instances with static transformations; they are
+    // stored in an _InstanceAccel_ rather than as _TransformedPrimitive_s.
+    std::vector<std::shared_ptr<Primitive>> instanceObjects;
+    std::map<const Primitive *, int> instanceObjectIndices;
+    std::vector<Transform> instanceTransforms;
+    std::map<const Transform *, int> instanceTransformIndices;
+    std::vector<InstanceAccel::Instance> instanceUses;
+    std::vector<std::unique_ptr<LoadingPrimitives>> loadingPrimitives;
+    // The tasks that are loading primitives, grouped by their destination
+    std::map<std::vector<std::shared_ptr<Primitive>> *,
+             std::unique_ptr<TaskGroup>>
+        loadingTasks;
     bool haveScatteringMedia = false;
 };
 
@@ -373,9 +399,12 @@ static std::vector<GraphicsState> pushedGraphicsStates;
 static std::vector<TransformSet> pushedTransforms;
 static std::vector<uint32_t> pushedActiveTransformBits;
 static TransformCache transformCache;
+static TaskGroup sceneLoadingTasks;
 int catIndentCount = 0;
 
 // API Forward Declarations
+static void SpawnSceneLoadingTask(TaskGroup &group,
+                                  std::function<void()> func);
 std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
                                                const Transform *ObjectToWorld,
                                                const Transform *WorldToObject,
@@ -778,6 +807,10 @@ std::shared_ptr<Primitive> MakeAccelerator(
     std::shared_ptr<Primitive> accel;
     if (name == "bvh")
         accel = CreateBVHAccelerator(std::move(prims), paramSet);
+    else if (name == "bvh4")
+        accel = CreateBVHAccelerator(std::move(prims), paramSet, 4);
+    else if (name == "bvh8")
+        accel = CreateBVHAccelerator(std::move(prims), paramSet, 8);
     else if (name == "kdtree")
         accel = CreateKdTreeAccelerator(std::move(prims), paramSet);
     else
@@ -896,6 +929,7 @@ void pbrtCleanup() {
     else if (currentApiState == APIState::WorldBlock)
         Error("pbrtCleanup() called while inside world block.");
     currentApiState = APIState::Uninitialized;
+    sceneLoadingTasks.Wait();
     ParallelCleanup();
     CleanupProfiler();
 }
@@ -1330,6 +1364,79 @@ void pbrtAreaLightSource(const std::string &name, const ParamSet &params) {
     }
 }
 
+// Meshes are only turned into _TriangleMeshPrimitive_s if they will end up
+// in a _BVHAccel_, which is the only aggregate that handles them
+// efficiently.
+static bool UseTriangleMeshPrimitives() {
+    return renderOptions->AcceleratorName != "kdtree";
+}
+
+// "trianglemesh" and "plymesh" shapes can be read as a _TriangleMesh_ and
+// turned into a _TriangleMeshPrimitive_ without creating a _Triangle_ for
+// each of their triangles.
+static bool IsTriangleMeshShape(const std::string &name) {
+    return (name == "trianglemesh" || name == "plymesh") && !PbrtOptions.cat &&
+           !PbrtOptions.toPly;
+}
+
+static std::shared_ptr<TriangleMesh> MakeTriangleMesh(
+    const std::string &name, const Transform *ObjToWorld,
+    const ParamSet &params, GraphicsState::FloatTextureMap *floatTextures) {
+    if (name == "plymesh")
+        return ReadPLYMesh(ObjToWorld, params, floatTextures);
+    return CreateTriangleMeshData(ObjToWorld, params, floatTextures);
+}
+
+// Reads the file of a "plymesh" shape in a scene loading task. Its
+// primitives are added to the scene or the current instance in the same
+// order as if the file had been read here.
+static void LoadPLYMesh(const Transform *ObjToWorld,
+                        const Transform *WorldToObj, const ParamSet &params) {
+    std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
+    MediumInterface mi = graphicsState.CreateMediumInterface();
+    bool reverseOrientation = graphicsState.reverseOrientation;
+    bool useMeshPrimitive = UseTriangleMeshPrimitives();
+    // Give the task its own map with the alpha textures that the shape uses,
+    // so that it doesn't read _graphicsState_'s map while later _Texture_
+    // statements modify it
+    auto floatTextures = std::make_shared<GraphicsState::FloatTextureMap>();
+    for (const char *alphaParam : {"alpha", "shadowalpha"}) {
+        auto iter = graphicsState.floatTextures->find(
+            params.FindTexture(alphaParam));
+        if (iter != graphicsState.floatTextures->end())
+            floatTextures->insert(*iter);
+    }
+
+    std::vector<std::shared_ptr<Primitive>> *prims =
+        renderOptions->currentInstance ? renderOptions->currentInstance
+                                       : &renderOptions->primitives;
+    renderOptions->loadingPrimitives.push_back(
+        std::unique_ptr<LoadingPrimitives>(
+            new LoadingPrimitives{prims, prims->size(), {}}));
+    LoadingPrimitives *loading = renderOptions->loadingPrimitives.back().get();
+    std::unique_ptr<TaskGroup> &tasks = renderOptions->loadingTasks[prims];
+    if (!tasks) tasks.reset(new TaskGroup);
+    ParamSet ps = params;
+    SpawnSceneLoadingTask(*tasks, [=]() {
+        std::shared_ptr<TriangleMesh> mesh =
+            ReadPLYMesh(ObjToWorld, ps, &*floatTextures);
+        ps.ReportUnused();
+        if (!mesh) return;
+        if (useMeshPrimitive) {
+            std::shared_ptr<Primitive> meshPrim = CreateTriangleMeshPrimitive(
+                ObjToWorld, WorldToObj, reverseOrientation, mesh, mtl, mi);
+            if (meshPrim) loading->loaded.push_back(meshPrim);
+        } else {
+            std::vector<std::shared_ptr<Shape>> shapes = CreateTriangles(
+                ObjToWorld, WorldToObj, reverseOrientation, mesh);
+            loading->loaded.reserve(shapes.size());
+            for (auto s : shapes)
+                loading->loaded.push_back(
+                    std::make_shared<GeometricPrimitive>(s, mtl, nullptr, mi));
+        }
+    });
+}
+
 void pbrtShape(const std::string &name, const ParamSet &params) {
     VERIFY_WORLD("Shape");
     std::vector<std::shared_ptr<Primitive>> prims;
@@ -1346,24 +1453,50 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         // Create shapes for shape _name_
         Transform *ObjToWorld = transformCache.Lookup(curTransform[0]);
         Transform *WorldToObj = transformCache.Lookup(Inverse(curTransform[0]));
-        std::vector<std::shared_ptr<Shape>> shapes =
-            MakeShapes(name, ObjToWorld, WorldToObj,
-                       graphicsState.reverseOrientation, params);
-        if (shapes.empty()) return;
+        if (name == "plymesh" && graphicsState.areaLight == "" &&
+            !PbrtOptions.cat && !PbrtOptions.toPly) {
+            LoadPLYMesh(ObjToWorld, WorldToObj, params);
+            return;
+        }
+        bool useMeshPrimitive =
+            graphicsState.areaLight == "" && UseTriangleMeshPrimitives();
+        std::shared_ptr<TriangleMesh> mesh;
+        std::vector<std::shared_ptr<Shape>> shapes;
+        if (useMeshPrimitive && IsTriangleMeshShape(name)) {
+            mesh = MakeTriangleMesh(name, ObjToWorld, params,
+                                    &*graphicsState.floatTextures);
+            if (!mesh || mesh->nTriangles == 0) return;
+        } else {
+            shapes = MakeShapes(name, ObjToWorld, WorldToObj,
+                                graphicsState.reverseOrientation, params);
+            if (shapes.empty()) return;
+        }
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
-        prims.reserve(shapes.size());
-        for (auto s : shapes) {
-            // Possibly create area light for shape
-            std::shared_ptr<AreaLight> area;
-            if (graphicsState.areaLight != "") {
-                area = MakeAreaLight(graphicsState.areaLight, curTransform[0],
-                                     mi, graphicsState.areaLightParams, s);
-                if (area) areaLights.push_back(area);
+        std::shared_ptr<Primitive> meshPrim;
+        if (mesh)
+            meshPrim = CreateTriangleMeshPrimitive(
+                ObjToWorld, WorldToObj, graphicsState.reverseOrientation, mesh,
+                mtl, mi);
+        else if (useMeshPrimitive)
+            meshPrim = CreateTriangleMeshPrimitive(shapes, mtl, mi);
+        if (meshPrim)
+            prims.push_back(meshPrim);
+        else {
+            prims.reserve(shapes.size());
+            for (auto s : shapes) {
+                // Possibly create area light for shape
+                std::shared_ptr<AreaLight> area;
+                if (graphicsState.areaLight != "") {
+                    area = MakeAreaLight(graphicsState.areaLight,
+                                         curTransform[0], mi,
+                                         graphicsState.areaLightParams, s);
+                    if (area) areaLights.push_back(area);
+                }
+                prims.push_back(
+                    std::make_shared<GeometricPrimitive>(s, mtl, area, mi));
             }
-            prims.push_back(
-                std::make_shared<GeometricPrimitive>(s, mtl, area, mi));
         }
     } else {
         // Initialize _prims_ and _areaLights_ for animated shape
@@ -1374,18 +1507,35 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
                 "Ignoring currently set area light when creating "
                 "animated shape");
         Transform *identity = transformCache.Lookup(Transform());
-        std::vector<std::shared_ptr<Shape>> shapes = MakeShapes(
-            name, identity, identity, graphicsState.reverseOrientation, params);
-        if (shapes.empty()) return;
+        std::shared_ptr<TriangleMesh> mesh;
+        std::vector<std::shared_ptr<Shape>> shapes;
+        if (IsTriangleMeshShape(name)) {
+            mesh = MakeTriangleMesh(name, identity, params,
+                                    &*graphicsState.floatTextures);
+            if (!mesh || mesh->nTriangles == 0) return;
+        } else {
+            shapes = MakeShapes(name, identity, identity,
+                                graphicsState.reverseOrientation, params);
+            if (shapes.empty()) return;
+        }
 
         // Create _GeometricPrimitive_(s) for animated shape
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
-        prims.reserve(shapes.size());
-        for (auto s : shapes)
-            prims.push_back(
-                std::make_shared<GeometricPrimitive>(s, mtl, nullptr, mi));
+        std::shared_ptr<Primitive> meshPrim =
+            mesh ? CreateTriangleMeshPrimitive(identity, identity,
+                                               graphicsState.reverseOrientation,
+                                               mesh, mtl, mi)
+                 : CreateTriangleMeshPrimitive(shapes, mtl, mi);
+        if (meshPrim)
+            prims.push_back(meshPrim);
+        else {
+            prims.reserve(shapes.size());
+            for (auto s : shapes)
+                prims.push_back(
+                    std::make_shared<GeometricPrimitive>(s, mtl, nullptr, mi));
+        }
 
         // Create single _TransformedPrimitive_ for _prims_
 
@@ -1399,7 +1549,7 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         AnimatedTransform animatedObjectToWorld(
             ObjToWorld[0], renderOptions->transformStartTime, ObjToWorld[1],
             renderOptions->transformEndTime);
-        if (prims.size() > 1) {
+        if (prims.size() > 1 || meshPrim) {
             std::shared_ptr<Primitive> bvh = std::make_shared<BVHAccel>(prims);
             prims.clear();
             prims.push_back(bvh);
@@ -1526,6 +1676,9 @@ void pbrtObjectBegin(const std::string &name) {
     pbrtAttributeBegin();
     if (renderOptions->currentInstance)
         Error("ObjectBegin called inside of instance definition");
+    // Shapes may still be loading into an instance that's being redefined
+    if (renderOptions->instances.find(name) != renderOptions->instances.end())
+        renderOptions->FinishLoading(&renderOptions->instances[name]);
     renderOptions->instances[name] = std::vector<std::shared_ptr<Primitive>>();
     renderOptions->currentInstance = &renderOptions->instances[name];
     if (PbrtOptions.cat || PbrtOptions.toPly)
@@ -1563,11 +1716,14 @@ void pbrtObjectInstance(const std::string &name) {
         Error("Unable to find instance named \"%s\"", name.c_str());
         return;
     }
+    // The instance's shapes may still be loading
     std::vector<std::shared_ptr<Primitive>> &in =
         renderOptions->instances[name];
+    renderOptions->FinishLoading(&in);
     if (in.empty()) return;
     ++nObjectInstancesUsed;
-    if (in.size() > 1) {
+    if (in.size() > 1 ||
+        std::dynamic_pointer_cast<TriangleMeshPrimitive>(in[0])) {
         // Create aggregate for instance _Primitive_s
         std::shared_ptr<Primitive> accel(
             MakeAccelerator(renderOptions->AcceleratorName, std::move(in),
@@ -1583,6 +1739,23 @@ void pbrtObjectInstance(const std::string &name) {
         transformCache.Lookup(curTransform[0]),
         transformCache.Lookup(curTransform[1])
     };
+    if (InstanceToWorld[0] == InstanceToWorld[1]) {
+        // Add a use of the instance to the tables for _InstanceAccel_
+        auto objectIter =
+            renderOptions->instanceObjectIndices.insert(std::make_pair(
+                in[0].get(), (int)renderOptions->instanceObjects.size()));
+        if (objectIter.second) renderOptions->instanceObjects.push_back(in[0]);
+        auto transformIter =
+            renderOptions->instanceTransformIndices.insert(std::make_pair(
+                InstanceToWorld[0],
+                (int)renderOptions->instanceTransforms.size()));
+        if (transformIter.second)
+            renderOptions->instanceTransforms.push_back(
+                Inverse(*InstanceToWorld[0]));
+        renderOptions->instanceUses.push_back(
+            {objectIter.first->second, transformIter.first->second});
+        return;
+    }
     AnimatedTransform animatedInstanceToWorld(
         InstanceToWorld[0], renderOptions->transformStartTime,
         InstanceToWorld[1], renderOptions->transformEndTime);
@@ -1591,6 +1764,28 @@ void pbrtObjectInstance(const std::string &name) {
     renderOptions->primitives.push_back(prim);
 }
 
+void RunSceneLoadingTask(std::function<void()> func) {
+    SpawnSceneLoadingTask(sceneLoadingTasks, std::move(func));
+}
+
+static void SpawnSceneLoadingTask(TaskGroup &group,
+                                  std::function<void()> func) {
+    if (currentApiState != APIState::WorldBlock || PbrtOptions.cat ||
+        PbrtOptions.toPly) {
+        func();
+        return;
+    }
+    // Report errors from the task at the statement that started it
+    bool haveLoc = parserLoc != nullptr;
+    Loc loc = haveLoc ? *parserLoc : Loc();
+    group.Spawn([=]() mutable {
+        Loc *savedLoc = parserLoc;
+        parserLoc = haveLoc ? &loc : nullptr;
+        func();
+        parserLoc = savedLoc;
+    });
+}
+
 void pbrtWorldEnd() {
     VERIFY_WORLD("WorldEnd");
     // Ensure there are no pushed graphics states
@@ -1603,6 +1798,7 @@ void pbrtWorldEnd() {
         Warning("Missing end to pbrtTransformBegin()");
         pushedTransforms.pop_back();
     }
+    renderOptions->FinishLoading();
 
     // Create scene and render
     if (PbrtOptions.cat || PbrtOptions.toPly) {
@@ -1633,6 +1829,7 @@ void pbrtWorldEnd() {
     currentApiState = APIState::OptionsBlock;
     ImageTexture<Float, Float>::ClearCache();
     ImageTexture<RGBSpectrum, Spectrum>::ClearCache();
+    FreeTextureTileCache();
     renderOptions.reset(new RenderOptions);
 
     if (!PbrtOptions.cat && !PbrtOptions.toPly) {
@@ -1652,7 +1849,70 @@ void pbrtWorldEnd() {
                                  namedCoordinateSystems.end());
 }
 
+// Inserts the primitives that were loaded for _prims_, which are ordered
+// by their position, where their shapes were declared.
+static void InsertLoadedPrimitives(
+    std::vector<std::shared_ptr<Primitive>> &prims,
+    const std::vector<LoadingPrimitives *> &loadingPrims) {
+    size_t nPrims = prims.size();
+    for (const LoadingPrimitives *loading : loadingPrims)
+        nPrims += loading->loaded.size();
+    std::vector<std::shared_ptr<Primitive>> merged;
+    merged.reserve(nPrims);
+    auto next = std::make_move_iterator(prims.begin());
+    for (LoadingPrimitives *loading : loadingPrims) {
+        auto end = std::make_move_iterator(prims.begin() + loading->position);
+        merged.insert(merged.end(), next, end);
+        merged.insert(merged.end(),
+                      std::make_move_iterator(loading->loaded.begin()),
+                      std::make_move_iterator(loading->loaded.end()));
+        next = end;
+    }
+    merged.insert(merged.end(), next, std::make_move_iterator(prims.end()));
+    prims = std::move(merged);
+}
+
+void RenderOptions::FinishLoading() {
+    sceneLoadingTasks.Wait();
+    for (auto &tasks : loadingTasks) tasks.second->Wait();
+    loadingTasks.clear();
+    if (loadingPrimitives.empty()) return;
+
+    // Insert the loaded primitives where their shapes were declared, one
+    // destination at a time
+    std::map<std::vector<std::shared_ptr<Primitive>> *,
+             std::vector<LoadingPrimitives *>> loadingByPrims;
+    for (const std::unique_ptr<LoadingPrimitives> &loading : loadingPrimitives)
+        loadingByPrims[loading->prims].push_back(loading.get());
+    for (auto &entry : loadingByPrims)
+        InsertLoadedPrimitives(*entry.first, entry.second);
+    loadingPrimitives.clear();
+}
+
+void RenderOptions::FinishLoading(
+    std::vector<std::shared_ptr<Primitive>> *prims) {
+    auto tasks = loadingTasks.find(prims);
+    if (tasks == loadingTasks.end()) return;
+    tasks->second->Wait();
+    loadingTasks.erase(tasks);
+
+    std::vector<LoadingPrimitives *> loadingPrims;
+    for (const std::unique_ptr<LoadingPrimitives> &loading : loadingPrimitives)
+        if (loading->prims == prims) loadingPrims.push_back(loading.get());
+    InsertLoadedPrimitives(*prims, loadingPrims);
+    loadingPrimitives.erase(
+        std::remove_if(loadingPrimitives.begin(), loadingPrimitives.end(),
+                       [&](const std::unique_ptr<LoadingPrimitives> &loading) {
+                           return loading->prims == prims;
+                       }),
+        loadingPrimitives.end());
+}
+
 Scene *RenderOptions::MakeScene() {
+    if (!instanceUses.empty())
+        primitives.push_back(std::make_shared<InstanceAccel>(
+            std::move(instanceObjects), std::move(instanceTransforms),
+            std::move(instanceUses)));
     std::shared_ptr<Primitive> accelerator =
         MakeAccelerator(AcceleratorName, std::move(primitives), AcceleratorParams);
     if (!accelerator) accelerator = std::make_shared<BVHAccel>(primitives);
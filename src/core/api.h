@@ -40,6 +40,7 @@
 
 // core/api.h*
 #include "pbrt.h"
+#include <functional>
 
 namespace pbrt {
 
@@ -91,6 +92,12 @@ void pbrtWorldEnd();
 void pbrtParseFile(std::string filename);
 void pbrtParseString(std::string str);
 
+// Runs _func_, which reads or builds some part of the scene, on the thread
+// pool while parsing continues. pbrtWorldEnd() waits for all such tasks to
+// finish before it creates the scene; outside of the world block, _func_
+// runs immediately.
+void RunSceneLoadingTask(std::function<void()> func);
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_API_H
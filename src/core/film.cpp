@@ -44,11 +44,18 @@ STAT_MEMORY_COUNTER("Memory/Film pixels", filmPixelMemory);
 // Film Method Definitions
 Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
            std::unique_ptr<Filter> filt, Float diagonal,
-           const std::string &filename, Float scale, Float maxSampleLuminance)
+           const std::string &filename, Float scale, Float maxSampleLuminance,
+           int tileSize, TileOrder tileOrder, bool splitTiles,
+           Float adaptiveThreshold, int adaptiveMinSamples)
     : fullResolution(resolution),
       diagonal(diagonal * .001),
       filter(std::move(filt)),
       filename(filename),
+      tileSize(tileSize),
+      tileOrder(tileOrder),
+      splitTiles(splitTiles),
+      adaptiveThreshold(adaptiveThreshold),
+      adaptiveMinSamples(adaptiveMinSamples),
       scale(scale),
       maxSampleLuminance(maxSampleLuminance) {
     // Compute film image bounds
@@ -64,6 +71,17 @@ Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
     // Allocate film image storage
     pixels = std::unique_ptr<Pixel[]>(new Pixel[croppedPixelBounds.Area()]);
     filmPixelMemory += croppedPixelBounds.Area() * sizeof(Pixel);
+    if (adaptiveThreshold > 0) {
+        pixelVariance.reset(
+            new VarianceEstimator[croppedPixelBounds.Area()]);
+        filmPixelMemory +=
+            croppedPixelBounds.Area() * sizeof(VarianceEstimator);
+    }
+    int nRowLocks =
+        (croppedPixelBounds.Diagonal().y + rowsPerLock - 1) / rowsPerLock;
+    rowLocks.reset(new std::mutex[std::max(1, nRowLocks)]);
+    nSplatBuffers = MaxThreadIndex();
+    splatBuffers.reset(new SplatBuffer[nSplatBuffers]);
 
     // Precompute filter weight table
     int offset = 0;
@@ -100,33 +118,111 @@ std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i &sampleBounds) {
     Point2i p1 = (Point2i)Floor(floatBounds.pMax - halfPixel + filter->radius) +
                  Point2i(1, 1);
     Bounds2i tilePixelBounds = Intersect(Bounds2i(p0, p1), croppedPixelBounds);
-    return std::unique_ptr<FilmTile>(new FilmTile(
-        tilePixelBounds, filter->radius, filterTable, filterTableWidth,
-        maxSampleLuminance));
+    std::unique_ptr<FilmTile> tile;
+    {
+        std::lock_guard<std::mutex> lock(freeTilesMutex);
+        if (!freeTiles.empty()) {
+            tile = std::move(freeTiles.back());
+            freeTiles.pop_back();
+        }
+    }
+    if (tile)
+        tile->Reset(tilePixelBounds);
+    else
+        tile.reset(new FilmTile(tilePixelBounds, filter->radius, filterTable,
+                                filterTableWidth, maxSampleLuminance,
+                                (bool)pixelVariance));
+    tile->sampleBounds = sampleBounds;
+    return tile;
 }
 
 void Film::Clear() {
+    for (int i = 0; i < nSplatBuffers; ++i) {
+        std::lock_guard<std::mutex> lock(splatBuffers[i].mutex);
+        splatBuffers[i].splats.clear();
+    }
+    haveSplats = false;
     for (Point2i p : croppedPixelBounds) {
         Pixel &pixel = GetPixel(p);
         for (int c = 0; c < 3; ++c)
             pixel.splatXYZ[c] = pixel.xyz[c] = 0;
         pixel.filterWeightSum = 0;
     }
+    if (pixelVariance)
+        for (int i = 0; i < croppedPixelBounds.Area(); ++i)
+            pixelVariance[i] = VarianceEstimator();
 }
 
 void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
     ProfilePhase p(Prof::MergeFilmTile);
+    if (!deferredBounds.empty()) {
+        // Hold on to the tile if its merge is deferred
+        std::lock_guard<std::mutex> lock(deferredTilesMutex);
+        auto iter = std::find(deferredBounds.begin(), deferredBounds.end(),
+                              tile->sampleBounds);
+        if (iter != deferredBounds.end()) {
+            deferredTiles[iter - deferredBounds.begin()] = std::move(tile);
+            return;
+        }
+    }
     VLOG(1) << "Merging film tile " << tile->pixelBounds;
-    std::lock_guard<std::mutex> lock(mutex);
-    for (Point2i pixel : tile->GetPixelBounds()) {
-        // Merge _pixel_ into _Film::pixels_
-        const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
-        Pixel &mergePixel = GetPixel(pixel);
-        Float xyz[3];
-        tilePixel.contribSum.ToXYZ(xyz);
-        for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
-        mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+    Bounds2i tileBounds = tile->GetPixelBounds();
+    int y = tileBounds.pMin.y;
+    while (y < tileBounds.pMax.y) {
+        // Merge the tile's rows that share a lock with row _y_
+        int block = (y - croppedPixelBounds.pMin.y) / rowsPerLock;
+        int blockEnd = std::min(
+            tileBounds.pMax.y,
+            croppedPixelBounds.pMin.y + (block + 1) * rowsPerLock);
+        std::lock_guard<std::mutex> lock(rowLocks[block]);
+        for (; y < blockEnd; ++y)
+            for (int x = tileBounds.pMin.x; x < tileBounds.pMax.x; ++x) {
+                // Merge _pixel_ into _Film::pixels_
+                Point2i pixel(x, y);
+                const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
+                Pixel &mergePixel = GetPixel(pixel);
+                Float xyz[3];
+                tilePixel.contribSum.ToXYZ(xyz);
+                for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
+                mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+                if (pixelVariance)
+                    pixelVariance[&mergePixel - &pixels[0]].Merge(
+                        tilePixel.sampleVariance);
+            }
     }
+
+    // Keep the tile for reuse; about one per thread is in use at a time
+    std::lock_guard<std::mutex> lock(freeTilesMutex);
+    if ((int)freeTiles.size() < MaxThreadIndex())
+        freeTiles.push_back(std::move(tile));
+}
+
+void Film::DeferTileMerges(const std::vector<Bounds2i> &tileSampleBounds) {
+    MergeDeferredTiles();
+    deferredBounds = tileSampleBounds;
+    deferredTiles.resize(deferredBounds.size());
+}
+
+void Film::MergeDeferredTiles() {
+    std::vector<std::unique_ptr<FilmTile>> tiles = std::move(deferredTiles);
+    deferredBounds.clear();
+    deferredTiles.clear();
+    for (std::unique_ptr<FilmTile> &tile : tiles)
+        if (tile) MergeFilmTile(std::move(tile));
+}
+
+bool Film::PixelConverged(Point2i p) const {
+    if (!pixelVariance) return false;
+    p = Point2i(Clamp(p.x, croppedPixelBounds.pMin.x,
+                      croppedPixelBounds.pMax.x - 1),
+                Clamp(p.y, croppedPixelBounds.pMin.y,
+                      croppedPixelBounds.pMax.y - 1));
+    int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
+    int offset = (p.x - croppedPixelBounds.pMin.x) +
+                 (p.y - croppedPixelBounds.pMin.y) * width;
+    // Errors are measured relative to the pixel's mean luminance; very
+    // dark pixels are compared to a small fixed luminance instead
+    return pixelVariance[offset].RelativeError(.01f) < adaptiveThreshold;
 }
 
 void Film::SetImage(const Spectrum *img) const {
@@ -159,13 +255,61 @@ void Film::AddSplat(const Point2f &p, Spectrum v) {
     if (!InsideExclusive((Point2i)p, croppedPixelBounds)) return;
     if (v.y() > maxSampleLuminance)
         v *= maxSampleLuminance / v.y();
-    Float xyz[3];
-    v.ToXYZ(xyz);
-    Pixel &pixel = GetPixel((Point2i)p);
-    for (int i = 0; i < 3; ++i) pixel.splatXYZ[i].Add(xyz[i]);
+    Splat splat;
+    v.ToXYZ(splat.xyz);
+    Vector2i pi = (Point2i)p - croppedPixelBounds.pMin;
+    splat.offset = pi.x + pi.y * croppedPixelBounds.Diagonal().x;
+
+    // Add the splat to this thread's buffer, flushing it if full
+    SplatBuffer &buffer =
+        splatBuffers[std::min(ThreadIndex, nSplatBuffers - 1)];
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.splats.push_back(splat);
+    if (buffer.splats.size() >= (size_t)splatBatchSize)
+        addSplats(buffer.splats);
+}
+
+void Film::addSplats(std::vector<Splat> &splats) {
+    if (splats.empty()) return;
+    haveSplats = true;
+    // Sort splats by pixel so that each row lock is taken once; the stable
+    // sort preserves the order in which each pixel's splats are summed.
+    std::stable_sort(splats.begin(), splats.end(),
+                     [](const Splat &a, const Splat &b) {
+                         return a.offset < b.offset;
+                     });
+    int width = croppedPixelBounds.Diagonal().x;
+    size_t i = 0;
+    while (i < splats.size()) {
+        int block = splats[i].offset / width / rowsPerLock;
+        std::lock_guard<std::mutex> lock(rowLocks[block]);
+        for (; i < splats.size() &&
+               splats[i].offset / width / rowsPerLock == block;
+             ++i) {
+            Pixel &pixel = pixels[splats[i].offset];
+            for (int c = 0; c < 3; ++c) pixel.splatXYZ[c] += splats[i].xyz[c];
+        }
+    }
+    splats.clear();
+}
+
+void Film::FlushSplats() {
+    for (int i = 0; i < nSplatBuffers; ++i) {
+        std::lock_guard<std::mutex> lock(splatBuffers[i].mutex);
+        addSplats(splatBuffers[i].splats);
+    }
 }
 
 void Film::WriteImage(Float splatScale) {
+    if (PbrtOptions.nSampleSplits > 0) {
+        WritePartialFilm(
+            StringPrintf("%s.%d.film", filename.c_str(),
+                         PbrtOptions.sampleSplit),
+            croppedPixelBounds, splatScale);
+        return;
+    }
+    FlushSplats();
+
     // Convert image to RGB and compute final pixel values
     LOG(INFO) <<
         "Converting image to RGB and computing final weighted pixel values";
@@ -203,10 +347,304 @@ void Film::WriteImage(Float splatScale) {
         ++offset;
     }
 
-    // Write RGB image
+    // Write RGB image to a temporary file with the same extension and
+    // rename it, so that checkpoints written during progressive rendering
+    // replace the previous image atomically
     LOG(INFO) << "Writing image " << filename << " with bounds " <<
         croppedPixelBounds;
-    pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution);
+    size_t dot = filename.rfind('.');
+    if (dot == std::string::npos) dot = filename.size();
+    std::string tempFilename =
+        filename.substr(0, dot) + ".tmp" + filename.substr(dot);
+    pbrt::WriteImage(tempFilename, &rgb[0], croppedPixelBounds,
+                     fullResolution);
+    if (rename(tempFilename.c_str(), filename.c_str()) != 0 && errno != ENOENT)
+        Error("%s: unable to rename to \"%s\": %s", tempFilename.c_str(),
+              filename.c_str(), strerror(errno));
+}
+
+// Film checkpoint files start with this header, followed by the _Pixel_s
+// of _croppedPixelBounds_, the number of samples taken in each pixel of
+// the sample bounds and, with adaptive sampling, the pixels'
+// _VarianceEstimator_s.
+struct FilmCheckpointHeader {
+    char magic[8];
+    int32_t floatSize;
+    int32_t pixelSize;
+    int32_t varianceSize, pad;
+    int32_t croppedPixelBounds[4], sampleBounds[4];
+    int64_t samplesPerPixel, samplesTaken;
+};
+
+static const char filmCheckpointMagic[8] = {'p', 'b', 'r', 't',
+                                            'C', 'K', 'P', '1'};
+
+static FilmCheckpointHeader MakeCheckpointHeader(const Bounds2i &pixelBounds,
+                                                 const Bounds2i &sampleBounds,
+                                                 int pixelSize,
+                                                 int varianceSize,
+                                                 int64_t samplesPerPixel) {
+    FilmCheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, filmCheckpointMagic, sizeof(header.magic));
+    header.floatSize = sizeof(Float);
+    header.pixelSize = pixelSize;
+    header.varianceSize = varianceSize;
+    const Bounds2i *bounds[2] = {&pixelBounds, &sampleBounds};
+    int32_t *dst[2] = {header.croppedPixelBounds, header.sampleBounds};
+    for (int i = 0; i < 2; ++i) {
+        dst[i][0] = bounds[i]->pMin.x;
+        dst[i][1] = bounds[i]->pMin.y;
+        dst[i][2] = bounds[i]->pMax.x;
+        dst[i][3] = bounds[i]->pMax.y;
+    }
+    header.samplesPerPixel = samplesPerPixel;
+    return header;
+}
+
+bool Film::WriteCheckpoint(const std::string &filename,
+                           int64_t samplesPerPixel, int64_t samplesTaken,
+                           const std::vector<int64_t> &pixelSamples) {
+    FlushSplats();
+    Bounds2i sampleBounds = GetSampleBounds();
+    CHECK_EQ(pixelSamples.size(), (size_t)sampleBounds.Area());
+    int varianceSize = pixelVariance ? sizeof(VarianceEstimator) : 0;
+    FilmCheckpointHeader header =
+        MakeCheckpointHeader(croppedPixelBounds, sampleBounds, sizeof(Pixel),
+                             varianceSize, samplesPerPixel);
+    header.samplesTaken = samplesTaken;
+
+    // Write to a temporary file and rename it so that an interruption
+    // never leaves a partially written checkpoint
+    LOG(INFO) << "Writing film checkpoint " << filename << " after " <<
+        samplesTaken << " samples per pixel";
+    std::string tempFilename = filename + ".tmp";
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if (!f) {
+        Error("%s: %s", tempFilename.c_str(), strerror(errno));
+        return false;
+    }
+    size_t nPixels = croppedPixelBounds.Area();
+    bool writeOK =
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(pixels.get(), sizeof(Pixel), nPixels, f) == nPixels &&
+        fwrite(pixelSamples.data(), sizeof(int64_t), pixelSamples.size(),
+               f) == pixelSamples.size() &&
+        (!pixelVariance ||
+         fwrite(pixelVariance.get(), sizeof(VarianceEstimator), nPixels, f) ==
+             nPixels);
+    if (fclose(f) != 0) writeOK = false;
+    if (!writeOK || rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        Error("%s: unable to write film checkpoint", filename.c_str());
+        remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Film::ReadCheckpoint(const std::string &filename,
+                          int64_t samplesPerPixel, int64_t *samplesTaken,
+                          std::vector<int64_t> *pixelSamples) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        Warning("%s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+    // Make sure that the checkpoint is for a film like this one
+    Bounds2i sampleBounds = GetSampleBounds();
+    int varianceSize = pixelVariance ? sizeof(VarianceEstimator) : 0;
+    FilmCheckpointHeader expected =
+        MakeCheckpointHeader(croppedPixelBounds, sampleBounds, sizeof(Pixel),
+                             varianceSize, samplesPerPixel);
+    FilmCheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) {
+        Warning("%s: not a film checkpoint", filename.c_str());
+        fclose(f);
+        return false;
+    }
+    int64_t taken = header.samplesTaken;
+    header.samplesTaken = 0;
+    if (memcmp(&header, &expected, sizeof(header)) != 0) {
+        Warning("%s: checkpoint was written for a different film, sampler "
+                "or build of pbrt", filename.c_str());
+        fclose(f);
+        return false;
+    }
+
+    size_t nPixels = croppedPixelBounds.Area();
+    std::vector<int64_t> samples(sampleBounds.Area());
+    bool readOK =
+        fread(pixels.get(), sizeof(Pixel), nPixels, f) == nPixels &&
+        fread(samples.data(), sizeof(int64_t), samples.size(), f) ==
+            samples.size() &&
+        (!pixelVariance ||
+         fread(pixelVariance.get(), sizeof(VarianceEstimator), nPixels, f) ==
+             nPixels);
+    fclose(f);
+    if (!readOK) {
+        Warning("%s: checkpoint is truncated", filename.c_str());
+        Clear();
+        return false;
+    }
+    *samplesTaken = taken;
+    *pixelSamples = std::move(samples);
+    LOG(INFO) << "Read film checkpoint " << filename << " after " <<
+        taken << " samples per pixel";
+    return true;
+}
+
+// Partial film files start with this header, followed by the rows of
+// _Pixel_s in _region_. _sampleSplit_ and _nSampleSplits_ give the part of
+// the pixels' samples that the film holds; without --samplesplit, it holds
+// part 0 of 1.
+struct PartialFilmHeader {
+    char magic[8];
+    int32_t floatSize;
+    int32_t pixelSize;
+    int32_t fullResolution[2];
+    int32_t croppedPixelBounds[4], region[4];
+    int32_t sampleSplit, nSampleSplits;
+    double scale, splatScale;
+};
+
+static const char partialFilmMagic[8] = {'p', 'b', 'r', 't',
+                                         'P', 'R', 'T', '2'};
+
+bool Film::WritePartialFilm(const std::string &filename, Bounds2i region,
+                            Float splatScale) {
+    FlushSplats();
+    region = haveSplats ? croppedPixelBounds
+                        : Intersect(region, croppedPixelBounds);
+    if (region.pMin.x >= region.pMax.x || region.pMin.y >= region.pMax.y)
+        region = Bounds2i(croppedPixelBounds.pMin, croppedPixelBounds.pMin);
+    PartialFilmHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, partialFilmMagic, sizeof(header.magic));
+    header.floatSize = sizeof(Float);
+    header.pixelSize = sizeof(Pixel);
+    header.fullResolution[0] = fullResolution.x;
+    header.fullResolution[1] = fullResolution.y;
+    header.sampleSplit =
+        PbrtOptions.nSampleSplits > 0 ? PbrtOptions.sampleSplit : 0;
+    header.nSampleSplits = std::max(PbrtOptions.nSampleSplits, 1);
+    header.scale = scale;
+    header.splatScale = splatScale;
+    const Bounds2i *bounds[2] = {&croppedPixelBounds, &region};
+    int32_t *dst[2] = {header.croppedPixelBounds, header.region};
+    for (int i = 0; i < 2; ++i) {
+        dst[i][0] = bounds[i]->pMin.x;
+        dst[i][1] = bounds[i]->pMin.y;
+        dst[i][2] = bounds[i]->pMax.x;
+        dst[i][3] = bounds[i]->pMax.y;
+    }
+
+    // Write to a temporary file and rename it, so that other processes
+    // never see a partially written film
+    LOG(INFO) << "Writing partial film " << filename << " with bounds " <<
+        region;
+    std::string tempFilename = filename + ".tmp";
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if (!f) {
+        Error("%s: %s", tempFilename.c_str(), strerror(errno));
+        return false;
+    }
+    bool writeOK = fwrite(&header, sizeof(header), 1, f) == 1;
+    size_t width = region.pMax.x - region.pMin.x;
+    for (int y = region.pMin.y; writeOK && y < region.pMax.y; ++y)
+        writeOK = fwrite(&GetPixel(Point2i(region.pMin.x, y)), sizeof(Pixel),
+                         width, f) == width;
+    if (fclose(f) != 0) writeOK = false;
+    if (!writeOK || rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        Error("%s: unable to write partial film", filename.c_str());
+        remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Opens a partial film and reads its header, leaving the file positioned
+// at its pixels.
+static FILE *OpenPartialFilm(const std::string &filename,
+                             PartialFilmHeader *header) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        Error("%s: %s", filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+    if (fread(header, sizeof(*header), 1, f) != 1 ||
+        memcmp(header->magic, partialFilmMagic, sizeof(header->magic)) != 0) {
+        Error("%s: not a partial film", filename.c_str());
+        fclose(f);
+        return nullptr;
+    }
+    return f;
+}
+
+bool Film::MergePartialFilm(const std::string &filename) {
+    PartialFilmHeader header;
+    FILE *f = OpenPartialFilm(filename, &header);
+    if (!f) return false;
+    Bounds2i bounds(Point2i(header.croppedPixelBounds[0],
+                            header.croppedPixelBounds[1]),
+                    Point2i(header.croppedPixelBounds[2],
+                            header.croppedPixelBounds[3]));
+    Bounds2i region(Point2i(header.region[0], header.region[1]),
+                    Point2i(header.region[2], header.region[3]));
+    if (header.floatSize != sizeof(Float) ||
+        header.pixelSize != sizeof(Pixel) ||
+        header.fullResolution[0] != fullResolution.x ||
+        header.fullResolution[1] != fullResolution.y ||
+        bounds != croppedPixelBounds ||
+        Union(region, croppedPixelBounds) != croppedPixelBounds) {
+        Error("%s: partial film was written for a different film or build "
+              "of pbrt", filename.c_str());
+        fclose(f);
+        return false;
+    }
+
+    // Add the partial film's pixel sums to _pixels_, row by row
+    std::vector<Pixel> row(region.pMax.x - region.pMin.x);
+    for (int y = region.pMin.y; y < region.pMax.y; ++y) {
+        if (fread(row.data(), sizeof(Pixel), row.size(), f) != row.size()) {
+            Error("%s: partial film is truncated", filename.c_str());
+            fclose(f);
+            return false;
+        }
+        for (size_t i = 0; i < row.size(); ++i) {
+            Pixel &pixel = GetPixel(Point2i(region.pMin.x + i, y));
+            for (int c = 0; c < 3; ++c) {
+                pixel.xyz[c] += row[i].xyz[c];
+                pixel.splatXYZ[c] += row[i].splatXYZ[c];
+            }
+            pixel.filterWeightSum += row[i].filterWeightSum;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+bool ReadPartialFilmInfo(const std::string &filename, Point2i *resolution,
+                         Bounds2f *cropWindow, Float *scale,
+                         Float *splatScale, int *sampleSplit,
+                         int *nSampleSplits) {
+    PartialFilmHeader header;
+    FILE *f = OpenPartialFilm(filename, &header);
+    if (!f) return false;
+    fclose(f);
+    *resolution = Point2i(header.fullResolution[0], header.fullResolution[1]);
+    // Choose a crop window that gives the same _croppedPixelBounds_,
+    // keeping well clear of rounding up to the next pixel
+    Point2f pMin((header.croppedPixelBounds[0] - .5f) / resolution->x,
+                 (header.croppedPixelBounds[1] - .5f) / resolution->y);
+    Point2f pMax((header.croppedPixelBounds[2] - .5f) / resolution->x,
+                 (header.croppedPixelBounds[3] - .5f) / resolution->y);
+    *cropWindow = Bounds2f(pMin, pMax);
+    *scale = header.scale;
+    *splatScale = header.splatScale;
+    *sampleSplit = header.sampleSplit;
+    *nSampleSplits = header.nSampleSplits;
+    return true;
 }
 
 Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
@@ -246,8 +684,35 @@ Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
     Float diagonal = params.FindOneFloat("diagonal", 35.);
     Float maxSampleLuminance = params.FindOneFloat("maxsampleluminance",
                                                    Infinity);
+
+    // Get image tile scheduling parameters
+    int tileSize = params.FindOneInt("tilesize", 16);
+    if (tileSize < 1) {
+        Warning("\"tilesize\" must be at least 1. Using 16.");
+        tileSize = 16;
+    }
+    std::string order = params.FindOneString("tileorder", "hilbert");
+    TileOrder tileOrder = TileOrder::Hilbert;
+    if (order == "scanline")
+        tileOrder = TileOrder::Scanline;
+    else if (order == "spiral")
+        tileOrder = TileOrder::Spiral;
+    else if (order != "hilbert")
+        Warning("Tile order \"%s\" unknown. Using \"hilbert\".",
+                order.c_str());
+    bool splitTiles = params.FindOneBool("splittiles", true);
+
+    // Get adaptive sampling parameters
+    Float adaptiveThreshold = params.FindOneFloat("adaptivethreshold", 0.);
+    int adaptiveMinSamples = params.FindOneInt("adaptiveminsamples", 16);
+    if (adaptiveMinSamples < 2) {
+        Warning("\"adaptiveminsamples\" must be at least 2 to estimate "
+                "variance. Using 2.");
+        adaptiveMinSamples = 2;
+    }
     return new Film(Point2i(xres, yres), crop, std::move(filter), diagonal,
-                    filename, scale, maxSampleLuminance);
+                    filename, scale, maxSampleLuminance, tileSize, tileOrder,
+                    splitTiles, adaptiveThreshold, adaptiveMinSamples);
 }
 
 }  // namespace pbrt
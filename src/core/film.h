@@ -48,12 +48,50 @@
 
 namespace pbrt {
 
+// VarianceEstimator Declarations
+// Running mean and variance of a set of values, using Welford's algorithm;
+// estimators for disjoint sets of values can be merged.
+struct VarianceEstimator {
+    // VarianceEstimator Public Methods
+    void Add(Float x) {
+        ++n;
+        Float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+    void Merge(const VarianceEstimator &ve) {
+        if (ve.n == 0) return;
+        int64_t nSum = n + ve.n;
+        Float delta = ve.mean - mean;
+        mean += delta * ve.n / nSum;
+        m2 += ve.m2 + delta * delta * ((Float)n * ve.n / nSum);
+        n = nSum;
+    }
+    Float Variance() const { return n > 1 ? m2 / (n - 1) : 0; }
+    // Returns the standard error of the mean relative to the mean, which
+    // is clamped to _minMean_ to avoid dividing by (nearly) zero.
+    Float RelativeError(Float minMean) const {
+        if (n == 0) return Infinity;
+        return std::sqrt(Variance() / n) / std::max(mean, minMean);
+    }
+
+    // VarianceEstimator Public Data
+    Float mean = 0, m2 = 0;
+    int64_t n = 0;
+};
+
 // FilmTilePixel Declarations
 struct FilmTilePixel {
     Spectrum contribSum = 0.f;
     Float filterWeightSum = 0.f;
+    // Luminance of the samples taken in the pixel, for adaptive sampling
+    VarianceEstimator sampleVariance;
 };
 
+// Order in which integrators render the film's image tiles; see
+// _TileScheduler_.
+enum class TileOrder { Scanline, Hilbert, Spiral };
+
 // Film Declarations
 class Film {
   public:
@@ -61,15 +99,48 @@ class Film {
     Film(const Point2i &resolution, const Bounds2f &cropWindow,
          std::unique_ptr<Filter> filter, Float diagonal,
          const std::string &filename, Float scale,
-         Float maxSampleLuminance = Infinity);
+         Float maxSampleLuminance = Infinity, int tileSize = 16,
+         TileOrder tileOrder = TileOrder::Hilbert, bool splitTiles = true,
+         Float adaptiveThreshold = 0, int adaptiveMinSamples = 16);
     Bounds2i GetSampleBounds() const;
     Bounds2f GetPhysicalExtent() const;
     std::unique_ptr<FilmTile> GetFilmTile(const Bounds2i &sampleBounds);
     void MergeFilmTile(std::unique_ptr<FilmTile> tile);
+    // Until MergeDeferredTiles() is called, MergeFilmTile() holds on to the
+    // tiles for the given sample bounds and then merges them in that order,
+    // so that pixel sums don't depend on the order tiles were finished in.
+    void DeferTileMerges(const std::vector<Bounds2i> &tileSampleBounds);
+    void MergeDeferredTiles();
+    // With adaptive sampling, returns whether the relative error of the
+    // luminance of _p_'s samples is below the adaptive threshold. Sample
+    // pixels outside of the image use the closest pixel inside of it.
+    bool PixelConverged(Point2i p) const;
     void SetImage(const Spectrum *img) const;
     void AddSplat(const Point2f &p, Spectrum v);
+    void FlushSplats();
+    // With --samplesplit, writes the film's sums to a partial film,
+    // _filename_._k_.film for part _k_, instead of writing the image.
     void WriteImage(Float splatScale = 1);
     void Clear();
+    // Checkpoints store the film's pixel sums along with the number of
+    // samples taken so far in every pixel, _samplesTaken_, and in each
+    // pixel of _GetSampleBounds()_, _pixelSamples_, so that an interrupted
+    // render can be resumed.
+    bool WriteCheckpoint(const std::string &filename, int64_t samplesPerPixel,
+                         int64_t samplesTaken,
+                         const std::vector<int64_t> &pixelSamples);
+    bool ReadCheckpoint(const std::string &filename, int64_t samplesPerPixel,
+                        int64_t *samplesTaken,
+                        std::vector<int64_t> *pixelSamples);
+    // Partial films store the pixel sums of the pixels in _region_, or of
+    // all pixels if there have been splats since the last Clear(), so that
+    // the parts of an image rendered by different processes can be added
+    // together with MergePartialFilm(). _splatScale_ is recorded for
+    // writing the image once all parts have been merged, and so is the
+    // --samplesplit part that the film holds.
+    bool WritePartialFilm(const std::string &filename, Bounds2i region,
+                          Float splatScale = 1);
+    bool MergePartialFilm(const std::string &filename);
 
     // Film Public Data
     const Point2i fullResolution;
@@ -77,24 +148,62 @@ class Film {
     std::unique_ptr<Filter> filter;
     const std::string filename;
     Bounds2i croppedPixelBounds;
+    const int tileSize;
+    const TileOrder tileOrder;
+    const bool splitTiles;
+    // If nonzero, _SamplerIntegrator_ stops taking samples in pixels once
+    // _PixelConverged()_, after taking at least _adaptiveMinSamples_
+    const Float adaptiveThreshold;
+    const int adaptiveMinSamples;
 
   private:
     // Film Private Data
     struct Pixel {
-        Pixel() { xyz[0] = xyz[1] = xyz[2] = filterWeightSum = 0; }
+        Pixel() {
+            xyz[0] = xyz[1] = xyz[2] = filterWeightSum = 0;
+            splatXYZ[0] = splatXYZ[1] = splatXYZ[2] = 0;
+        }
         Float xyz[3];
         Float filterWeightSum;
-        AtomicFloat splatXYZ[3];
+        Float splatXYZ[3];
         Float pad;
     };
     std::unique_ptr<Pixel[]> pixels;
+    // Variance of each pixel's samples, if sampling adaptively
+    std::unique_ptr<VarianceEstimator[]> pixelVariance;
     static PBRT_CONSTEXPR int filterTableWidth = 16;
     Float filterTable[filterTableWidth * filterTableWidth];
-    std::mutex mutex;
+    // Rows of _pixels_ are protected by one mutex per block of
+    // _rowsPerLock_ rows, so that tiles in different parts of the image
+    // can be merged concurrently.
+    static PBRT_CONSTEXPR int rowsPerLock = 8;
+    std::unique_ptr<std::mutex[]> rowLocks;
+    // Splats are buffered per thread and added to _pixels_ in batches of
+    // _splatBatchSize_; each buffer's mutex is only contended when
+    // _FlushSplats()_ runs while rendering is in progress.
+    struct Splat {
+        int offset;
+        Float xyz[3];
+    };
+    struct SplatBuffer {
+        std::mutex mutex;
+        std::vector<Splat> splats;
+    };
+    static PBRT_CONSTEXPR int splatBatchSize = 1024;
+    std::unique_ptr<SplatBuffer[]> splatBuffers;
+    int nSplatBuffers;
+    std::atomic<bool> haveSplats{false};
+    std::mutex deferredTilesMutex;
+    std::vector<Bounds2i> deferredBounds;
+    std::vector<std::unique_ptr<FilmTile>> deferredTiles;
+    // Merged tiles, whose pixel storage _GetFilmTile()_ reuses
+    std::mutex freeTilesMutex;
+    std::vector<std::unique_ptr<FilmTile>> freeTiles;
     const Float scale;
     const Float maxSampleLuminance;
 
     // Film Private Methods
+    void addSplats(std::vector<Splat> &splats);
     Pixel &GetPixel(const Point2i &p) {
         CHECK(InsideExclusive(p, croppedPixelBounds));
         int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
@@ -109,13 +218,14 @@ class FilmTile {
     // FilmTile Public Methods
     FilmTile(const Bounds2i &pixelBounds, const Vector2f &filterRadius,
              const Float *filterTable, int filterTableSize,
-             Float maxSampleLuminance)
+             Float maxSampleLuminance, bool trackVariance = false)
         : pixelBounds(pixelBounds),
           filterRadius(filterRadius),
           invFilterRadius(1 / filterRadius.x, 1 / filterRadius.y),
           filterTable(filterTable),
           filterTableSize(filterTableSize),
-          maxSampleLuminance(maxSampleLuminance) {
+          maxSampleLuminance(maxSampleLuminance),
+          trackVariance(trackVariance) {
         pixels = std::vector<FilmTilePixel>(std::max(0, pixelBounds.Area()));
     }
     void AddSample(const Point2f &pFilm, Spectrum L,
@@ -123,6 +233,12 @@ class FilmTile {
         ProfilePhase _(Prof::AddFilmSample);
         if (L.y() > maxSampleLuminance)
             L *= maxSampleLuminance / L.y();
+        if (trackVariance) {
+            // Record the sample's luminance in the pixel it was taken in
+            Point2i pPixel = (Point2i)Floor(pFilm);
+            if (InsideExclusive(pPixel, pixelBounds))
+                GetPixel(pPixel).sampleVariance.Add(L.y() * sampleWeight);
+        }
         // Compute sample's raster bounds
         Point2f pFilmDiscrete = pFilm - Vector2f(0.5f, 0.5f);
         Point2i p0 = (Point2i)Ceil(pFilmDiscrete - filterRadius);
@@ -176,17 +292,33 @@ class FilmTile {
     Bounds2i GetPixelBounds() const { return pixelBounds; }
 
   private:
+    // FilmTile Private Methods
+    void Reset(const Bounds2i &bounds) {
+        pixelBounds = bounds;
+        pixels.assign(std::max(0, pixelBounds.Area()), FilmTilePixel());
+    }
+
     // FilmTile Private Data
-    const Bounds2i pixelBounds;
+    Bounds2i pixelBounds;
+    // Sample bounds that the tile was created for by _Film::GetFilmTile()_
+    Bounds2i sampleBounds;
     const Vector2f filterRadius, invFilterRadius;
     const Float *filterTable;
     const int filterTableSize;
     std::vector<FilmTilePixel> pixels;
     const Float maxSampleLuminance;
+    const bool trackVariance;
     friend class Film;
 };
 
 Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter);
+// Reads the parameters of the image that a partial film was written for,
+// so that a film for merging it and the image's other parts can be made,
+// and which of the image's _nSampleSplits_ parts it is.
+bool ReadPartialFilmInfo(const std::string &filename, Point2i *resolution,
+                         Bounds2f *cropWindow, Float *scale,
+                         Float *splatScale, int *sampleSplit,
+                         int *nSampleSplits);
 
 }  // namespace pbrt
 
@@ -41,11 +41,50 @@
 #include "integrator.h"
 #include "progressreporter.h"
 #include "camera.h"
+#include "raybatch.h"
 #include "stats.h"
+#include <errno.h>
+#ifndef PBRT_IS_WINDOWS
+#include <signal.h>
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 
 STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
+STAT_COUNTER("Integrator/Image tiles split", nSplitTiles);
+STAT_COUNTER("Integrator/Spool work units rendered", nSpoolUnitsRendered);
+STAT_PERCENT("Integrator/Converged pixels skipped in adaptive passes",
+             nConvergedPixels, nAdaptivePixels);
+
+// Integrator Local Declarations
+// Camera rays traced together, with the pixel and sample number that each
+// was generated for; _next_ is the index of the next one to use.
+struct CameraRayBatch {
+    // CameraRayBatch Public Methods
+    void Reset() {
+        rays.Clear();
+        next = 0;
+    }
+    // Returns the index of the ray for sample _sampleNum_ of _pixel_ if it
+    // is the next one in the batch, and -1 otherwise.
+    int Find(const Point2i &pixel, int64_t sampleNum) const {
+        if (next == rays.Size() || pixels[next] != pixel ||
+            sampleNumbers[next] != sampleNum)
+            return -1;
+        return next;
+    }
+
+    // CameraRayBatch Public Data
+    RayBatch rays;
+    Point2i pixels[MaxRayBatchSize];
+    int64_t sampleNumbers[MaxRayBatchSize];
+    CameraSample cameraSamples[MaxRayBatchSize];
+    RayDifferential cameraRays[MaxRayBatchSize];
+    Float rayWeights[MaxRayBatchSize];
+    SurfaceInteraction isects[MaxRayBatchSize];
+    int next = 0;
+};
 
 // Integrator Method Definitions
 Integrator::~Integrator() {}
@@ -224,43 +263,573 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
         new Distribution1D(&lightPower[0], lightPower.size()));
 }
 
-// SamplerIntegrator Method Definitions
-void SamplerIntegrator::Render(const Scene &scene) {
-    Preprocess(scene, *sampler);
-    // Render image tiles in parallel
+// Returns the _d_th point along the Hilbert curve that fills an $n \times n$
+// grid, where _n_ is a power of two.
+static Point2i HilbertCurvePoint(int n, int d) {
+    Point2i p(0, 0);
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        // Rotate the quadrant so that the curve's pieces join up
+        if (ry == 0) {
+            if (rx == 1) {
+                p.x = s - 1 - p.x;
+                p.y = s - 1 - p.y;
+            }
+            std::swap(p.x, p.y);
+        }
+        p.x += s * rx;
+        p.y += s * ry;
+        d /= 4;
+    }
+    return p;
+}
+
+// Returns the host name and process ID that identify this process in the
+// claim files that it creates.
+static std::string ClaimOwner() {
+#ifdef PBRT_IS_WINDOWS
+    return "";
+#else
+    char host[256] = {};
+    gethostname(host, sizeof(host) - 1);
+    return StringPrintf("%s %d\n", host, (int)getpid());
+#endif
+}
+
+// Creates _filename_, returning false if it already existed or, setting
+// _*failed_, if it couldn't be created.
+static bool ClaimFile(const std::string &filename, bool *failed) {
+    FILE *f = fopen(filename.c_str(), "wx");
+    if (!f) {
+        if (errno != EEXIST) {
+            Error("%s: %s", filename.c_str(), strerror(errno));
+            *failed = true;
+        }
+        return false;
+    }
+    fputs(ClaimOwner().c_str(), f);
+    fclose(f);
+    return true;
+}
+
+// Returns whether the process that created the claim file _filename_ has
+// died. Only processes on this host can be checked.
+static bool ClaimerDied(const std::string &filename) {
+#ifdef PBRT_IS_WINDOWS
+    return false;
+#else
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    char host[256];
+    int pid;
+    // The claimer may not have written its name yet
+    bool named = fscanf(f, "%255s %d", host, &pid) == 2;
+    fclose(f);
+    char ourHost[256] = {};
+    gethostname(ourHost, sizeof(ourHost) - 1);
+    return named && strcmp(host, ourHost) == 0 && kill(pid, 0) == -1 &&
+           errno == ESRCH;
+#endif
+}
+
+// Processes sharing a spool directory claim work units and the final merge
+// by creating _filename_. If the process that created it has died, the
+// claim is taken over by creating _filename_.1, and so forth, so that
+// only one process takes over each claim. Returns whether this process
+// holds the claim.
+static bool Claim(const std::string &filename, bool *failed) {
+    for (int attempt = 0;; ++attempt) {
+        std::string attemptFilename =
+            attempt == 0 ? filename : StringPrintf("%s.%d", filename.c_str(),
+                                                   attempt);
+        if (ClaimFile(attemptFilename, failed)) return true;
+        if (*failed || !ClaimerDied(attemptFilename)) return false;
+        LOG(INFO) << "Taking over \"" << attemptFilename
+                  << "\" from a process that has died";
+    }
+}
+
+static bool FileExists(const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    fclose(f);
+    return true;
+}
+
+// ImageTile Method Definitions
+ImageTile::ImageTile(TileScheduler *scheduler, TaskGroup *splits,
+                     const Bounds2i &bounds, int seed)
+    : bounds(bounds), seed(seed), scheduler(scheduler), splits(splits) {}
+
+bool ImageTile::Owns(const Point2i &pixel) {
+    if (pixel.y >= bounds.pMax.y) return false;
+    int rowsLeft = bounds.pMax.y - pixel.y;
+    if (!scheduler->splitTiles || pixel.x != bounds.pMin.x ||
+        pixel.y == bounds.pMin.y || rowsLeft < 2 ||
+        scheduler->nextTile < (int)scheduler->tiles.size())
+        return true;
+
+    // Split the tile if its remaining rows will take longer than an
+    // average tile, judging by how long its rows have taken so far
+    int64_t pixels = scheduler->renderedPixels;
+    if (pixels == 0) return true;
+    Float averageTime =
+        (Float)scheduler->renderedNanoseconds * scheduler->tilePixels / pixels;
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - startTime)
+                          .count();
+    Float remainingTime =
+        (Float)elapsed * rowsLeft / (pixel.y - bounds.pMin.y);
+    if (remainingTime <= averageTime) return true;
 
+    // Hand the lower half of the remaining rows to another thread
+    int ySplit = pixel.y + (rowsLeft + 1) / 2;
+    Bounds2i splitBounds(Point2i(bounds.pMin.x, ySplit), bounds.pMax);
+    bounds.pMax.y = ySplit;
+    VLOG(1) << "Splitting image tile at row " << ySplit << "; " <<
+        remainingTime << " ns left vs. average tile " << averageTime << " ns";
+    ++nSplitTiles;
+    TileScheduler *tileScheduler = scheduler;
+    TaskGroup *tileSplits = splits;
+    int tileSeed = seed;
+    splits->Spawn([=]() {
+        ImageTile split(tileScheduler, tileSplits, splitBounds, tileSeed);
+        tileScheduler->renderTile(split);
+    });
+    return true;
+}
+
+int ImageTile::RowSeed(int y) const {
+    const Bounds2i &sampleBounds = scheduler->sampleBounds;
+    int tileX = (bounds.pMin.x - sampleBounds.pMin.x) /
+                scheduler->film->tileSize;
+    return (y - sampleBounds.pMin.y) * scheduler->nTilesX + tileX;
+}
+
+// TileScheduler Method Definitions
+TileScheduler::TileScheduler(Film *film, const Bounds2i &sampleBounds)
+    : film(film),
+      spoolDirectory(PbrtOptions.spoolDirectory),
+      sampleBounds(sampleBounds),
+      splitTiles(film->splitTiles && MaxThreadIndex() > 1 &&
+                 spoolDirectory.empty()),
+      tilePixels((int64_t)film->tileSize * film->tileSize) {
     // Compute number of tiles, _nTiles_, to use for parallel rendering
-    Bounds2i sampleBounds = camera->film->GetSampleBounds();
     Vector2i sampleExtent = sampleBounds.Diagonal();
-    const int tileSize = 16;
+    const int tileSize = film->tileSize;
     Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
                    (sampleExtent.y + tileSize - 1) / tileSize);
-    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
-    {
-        ParallelFor2D([&](Point2i tile) {
+    nTilesX = nTiles.x;
+
+    // Order the tiles according to _film->tileOrder_
+    std::vector<Point2i> order;
+    switch (film->tileOrder) {
+    case TileOrder::Scanline:
+        for (int y = 0; y < nTiles.y; ++y)
+            for (int x = 0; x < nTiles.x; ++x) order.push_back(Point2i(x, y));
+        break;
+    case TileOrder::Hilbert: {
+        int n = RoundUpPow2(std::max(nTiles.x, nTiles.y));
+        for (int d = 0; d < n * n; ++d) {
+            Point2i t = HilbertCurvePoint(n, d);
+            if (t.x < nTiles.x && t.y < nTiles.y) order.push_back(t);
+        }
+        break;
+    }
+    case TileOrder::Spiral: {
+        // Sort tiles by the square ring around the center that they lie
+        // on, and then by angle within each ring
+        for (int y = 0; y < nTiles.y; ++y)
+            for (int x = 0; x < nTiles.x; ++x) order.push_back(Point2i(x, y));
+        Point2f center((nTiles.x - 1) * .5f, (nTiles.y - 1) * .5f);
+        auto ring = [&](const Point2i &t) {
+            return std::max(std::abs(t.x - center.x),
+                            std::abs(t.y - center.y));
+        };
+        auto angle = [&](const Point2i &t) {
+            return std::atan2(t.y - center.y, t.x - center.x);
+        };
+        std::stable_sort(order.begin(), order.end(),
+                         [&](const Point2i &a, const Point2i &b) {
+                             Float ra = ring(a), rb = ring(b);
+                             return ra < rb ||
+                                    (ra == rb && angle(a) < angle(b));
+                         });
+        break;
+    }
+    }
+
+    for (Point2i t : order) {
+        // Compute sample bounds for tile _t_
+        int x0 = sampleBounds.pMin.x + t.x * tileSize;
+        int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+        int y0 = sampleBounds.pMin.y + t.y * tileSize;
+        int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+        tiles.push_back(ImageTile(this, nullptr,
+                                  Bounds2i(Point2i(x0, y0), Point2i(x1, y1)),
+                                  t.y * nTiles.x + t.x));
+    }
+    nSpoolUnits = std::min<int>(tiles.size(), maxSpoolUnits);
+}
+
+void TileScheduler::ForEachTile(std::function<void(ImageTile &)> f,
+                                const std::string &title) {
+    func = std::move(f);
+    if (spoolDirectory.empty()) {
+        renderTiles(0, tiles.size(), title);
+        return;
+    }
+
+    // Render the spool's unfinished work units that no live process has
+    // claimed; since claimers may die at any time, look again until none
+    // could be claimed
+    Vector2i filterRadius((int)std::ceil(film->filter->radius.x) + 1,
+                          (int)std::ceil(film->filter->radius.y) + 1);
+    bool failed = false, claimed = true;
+    while (claimed && !failed) {
+        claimed = false;
+        for (int unit = 0; unit < nSpoolUnits && !failed; ++unit) {
+            if (FileExists(spoolFilename(unit, "film")) ||
+                !Claim(spoolFilename(unit, "claim"), &failed))
+                continue;
+            claimed = true;
+            renderSpoolUnit(unit, filterRadius, title);
+        }
+    }
+}
+
+void TileScheduler::renderSpoolUnit(int unit, const Vector2i &filterRadius,
+                                    const std::string &title) {
+    int begin = (int64_t)unit * tiles.size() / nSpoolUnits;
+    int end = (int64_t)(unit + 1) * tiles.size() / nSpoolUnits;
+    std::vector<Bounds2i> unitTiles;
+    Bounds2i unitPixelBounds;
+    for (int i = begin; i < end; ++i) {
+        const Bounds2i &b = tiles[i].bounds;
+        unitTiles.push_back(b);
+        unitPixelBounds = Union(
+            unitPixelBounds,
+            Bounds2i(b.pMin - filterRadius, b.pMax + filterRadius));
+    }
+    LOG(INFO) << "Rendering spool unit " << unit << ": tiles [" << begin
+              << ", " << end << ")";
+    film->Clear();
+    film->DeferTileMerges(unitTiles);
+    renderTiles(begin, end,
+                StringPrintf("%s (unit %d/%d)", title.c_str(), unit + 1,
+                             nSpoolUnits));
+    film->MergeDeferredTiles();
+    film->WritePartialFilm(spoolFilename(unit, "film"), unitPixelBounds);
+    ++nSpoolUnitsRendered;
+}
+
+bool TileScheduler::MergeSpool() {
+    if (spoolDirectory.empty()) return true;
+    // Leave the image to another process if it's still rendering a unit
+    for (int unit = 0; unit < nSpoolUnits; ++unit)
+        if (!FileExists(spoolFilename(unit, "film"))) {
+            LOG(INFO) << "Spool unit " << unit << " isn't finished; leaving "
+                      << "the image to another process";
+            return false;
+        }
+    bool failed = false;
+    if (!Claim(spoolDirectory + "/merge.claim", &failed)) return false;
+
+    film->Clear();
+    for (int unit = 0; unit < nSpoolUnits; ++unit)
+        if (!film->MergePartialFilm(spoolFilename(unit, "film"))) {
+            Error("Unable to merge the films in spool \"%s\"",
+                  spoolDirectory.c_str());
+            return false;
+        }
+    return true;
+}
+
+void TileScheduler::renderTiles(int begin, int end,
+                                const std::string &title) {
+    nextTile = begin;
+    renderedPixels = renderedNanoseconds = 0;
+    int64_t nPixels = 0;
+    for (int i = begin; i < end; ++i) nPixels += tiles[i].bounds.Area();
+    ProgressReporter progress(nPixels, title);
+    reporter = &progress;
+    ParallelFor([&](int64_t) {
+        // Render the next tile in order, along with any pieces split off
+        ImageTile tile = tiles[nextTile++];
+        TaskGroup splits;
+        tile.splits = &splits;
+        renderTile(tile);
+        splits.Wait();
+    }, end - begin);
+    progress.Done();
+    reporter = nullptr;
+}
+
+void TileScheduler::renderTile(ImageTile &tile) {
+    tile.startTime = std::chrono::steady_clock::now();
+    func(tile);
+    // Record how long the tile's pixels took for _ImageTile::Owns()_
+    renderedNanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - tile.startTime)
+            .count();
+    renderedPixels += tile.bounds.Area();
+    reporter->Update(tile.bounds.Area());
+}
+
+std::string TileScheduler::spoolFilename(int unit,
+                                         const char *extension) const {
+    return StringPrintf("%s/unit-%04d.%s", spoolDirectory.c_str(), unit,
+                        extension);
+}
+
+// RenderPasses Method Definitions
+RenderPasses::RenderPasses(Film *film, int64_t samplesPerPixel,
+                           bool adaptive)
+    : film(film),
+      samplesPerPixel(samplesPerPixel),
+      adaptive(adaptive && PbrtOptions.spoolDirectory.empty() &&
+               PbrtOptions.nSampleSplits == 0),
+      progressive(this->adaptive || PbrtOptions.progressive ||
+                  PbrtOptions.resume || PbrtOptions.checkpointPasses > 0 ||
+                  PbrtOptions.checkpointSeconds > 0 ||
+                  PbrtOptions.timeLimit > 0),
+      sampleBounds(film->GetSampleBounds()),
+      checkpointFilename(film->filename + ".checkpoint") {
+    if (adaptive && !this->adaptive)
+        Warning("Adaptive sampling isn't supported with --spool or "
+                "--samplesplit. Taking all samples in every pixel.");
+    splitStart = 0;
+    splitEnd = samplesPerPixel;
+    if (PbrtOptions.nSampleSplits > 0) {
+        splitStart = samplesPerPixel * PbrtOptions.sampleSplit /
+                     PbrtOptions.nSampleSplits;
+        splitEnd = samplesPerPixel * (PbrtOptions.sampleSplit + 1) /
+                   PbrtOptions.nSampleSplits;
+        end = splitStart;
+    }
+    if (progressive) pixelSamples.resize(sampleBounds.Area(), 0);
+    if (PbrtOptions.resume &&
+        !film->ReadCheckpoint(checkpointFilename, samplesPerPixel,
+                              &samplesTaken, &pixelSamples)) {
+        Warning("Unable to resume from checkpoint \"%s\". Rendering from "
+                "the first sample.", checkpointFilename.c_str());
+        samplesTaken = 0;
+        std::fill(pixelSamples.begin(), pixelSamples.end(), 0);
+    }
+    startTime = checkpointTime = std::chrono::steady_clock::now();
+}
+
+bool RenderPasses::Next() {
+    if (pass >= 0) {
+        samplesTaken = completedSamples();
+        if (end == splitEnd || outOfTime()) return false;
+    }
+    // Advance to the next pass, skipping those finished before resuming
+    do {
+        ++pass;
+        start = end;
+        if (adaptive && start == 0)
+            end = std::min<int64_t>(samplesPerPixel, film->adaptiveMinSamples);
+        else if (progressive)
+            end = std::min(samplesPerPixel, std::max<int64_t>(1, 2 * start));
+        else
+            end = splitEnd;
+    } while (end <= samplesTaken && end < splitEnd);
+    LOG(INFO) << "Starting rendering pass " << pass << ": samples [" << start
+              << ", " << end << ")";
+
+    // Find the pixels that have converged before the pass starts, so that
+    // tiles don't read film pixels while others are being merged into them
+    if (adaptive && start > 0) {
+        converged.resize(sampleBounds.Area());
+        int width = sampleBounds.Diagonal().x;
+        for (Point2i pixel : sampleBounds) {
+            Vector2i p = pixel - sampleBounds.pMin;
+            bool c = film->PixelConverged(pixel);
+            converged[p.y * width + p.x] = c;
+            if (c) ++nConvergedPixels;
+            ++nAdaptivePixels;
+        }
+    }
+    return start < end && end > samplesTaken;
+}
+
+bool RenderPasses::StartTile() {
+    if (!outOfTime()) return true;
+    tilesSkipped = true;
+    return false;
+}
+
+int64_t RenderPasses::FirstSample(const Point2i &pixel) const {
+    if (pixelSamples.empty()) return start;
+    Vector2i p = pixel - sampleBounds.pMin;
+    int offset = p.y * sampleBounds.Diagonal().x + p.x;
+    // Skip the pixel if its film pixel had converged
+    if (!converged.empty() && converged[offset]) return end;
+    return std::max(start, pixelSamples[offset]);
+}
+
+void RenderPasses::FinishPixel(const Point2i &pixel) {
+    if (pixelSamples.empty()) return;
+    Vector2i p = pixel - sampleBounds.pMin;
+    pixelSamples[p.y * sampleBounds.Diagonal().x + p.x] = end;
+}
+
+bool RenderPasses::CheckpointDue() {
+    if (!progressive || end == samplesPerPixel || outOfTime()) return false;
+    if ((PbrtOptions.checkpointPasses > 0 &&
+         pass + 1 - checkpointPass >= PbrtOptions.checkpointPasses) ||
+        (PbrtOptions.checkpointSeconds > 0 &&
+         elapsedSeconds(checkpointTime) >= PbrtOptions.checkpointSeconds)) {
+        checkpointPass = pass + 1;
+        checkpointTime = std::chrono::steady_clock::now();
+        return true;
+    }
+    return false;
+}
+
+void RenderPasses::WriteCheckpoint() {
+    if (progressive)
+        film->WriteCheckpoint(checkpointFilename, samplesPerPixel,
+                              completedSamples(), pixelSamples);
+}
+
+void RenderPasses::Finish() {
+    if (!progressive) return;
+    if (completedSamples() < samplesPerPixel)
+        WriteCheckpoint();
+    else
+        remove(checkpointFilename.c_str());
+}
+
+bool RenderPasses::outOfTime() const {
+    return PbrtOptions.timeLimit > 0 &&
+           elapsedSeconds(startTime) >= PbrtOptions.timeLimit;
+}
+
+std::string RenderPasses::ProgressTitle() const {
+    if (!progressive) return "Rendering";
+    return StringPrintf("Rendering pass %d (%d spp)", pass + 1, (int)end);
+}
+
+Float RenderPasses::elapsedSeconds(
+    std::chrono::steady_clock::time_point since) const {
+    return std::chrono::duration<Float>(std::chrono::steady_clock::now() -
+                                        since)
+        .count();
+}
+
+// SamplerIntegrator Method Definitions
+void SamplerIntegrator::Render(const Scene &scene) {
+    Preprocess(scene, *sampler);
+    // Render image tiles in parallel, in one or more passes
+    TileScheduler scheduler(camera->film, camera->film->GetSampleBounds());
+    RenderPasses passes(camera->film, sampler->samplesPerPixel,
+                        camera->film->adaptiveThreshold > 0);
+    MemoryArenaPool arenas;
+    // Allocate storage for batched camera rays for each thread, if used;
+    // samplers that can return to a pixel's samples let batches span
+    // several of a tile's pixels, so that packets of rays are traced even
+    // at low sampling rates
+    std::unique_ptr<CameraRayBatch[]> cameraBatches;
+    if (BatchCameraRays())
+        cameraBatches.reset(new CameraRayBatch[MaxThreadIndex()]);
+    const bool batchAcrossPixels = sampler->RepeatsPixelSamples();
+    // Each thread clones the sampler for the first tile it renders and
+    // reseeds that clone for later ones
+    std::vector<std::unique_ptr<Sampler>> threadSamplers(MaxThreadIndex());
+    while (passes.Next()) {
+        scheduler.ForEachTile([&](ImageTile &tile) {
             // Render section of image corresponding to _tile_
+            if (!passes.StartTile()) return;
 
-            // Allocate _MemoryArena_ for tile
-            MemoryArena arena;
+            // Use this thread's _MemoryArena_ for the tile
+            MemoryArena &arena = arenas.ThreadArena();
 
             // Get sampler instance for tile
-            int seed = tile.y * nTiles.x + tile.x;
-            std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-
-            // Compute sample bounds for tile
-            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+            CHECK_LT(ThreadIndex, (int)threadSamplers.size());
+            std::unique_ptr<Sampler> &threadSampler =
+                threadSamplers[ThreadIndex];
+            if (threadSampler)
+                threadSampler->Reseed(tile.seed);
+            else
+                threadSampler = sampler->Clone(tile.seed);
+            Sampler *tileSampler = threadSampler.get();
+
+            // Get sample bounds for tile
+            Bounds2i tileBounds = tile.bounds;
             LOG(INFO) << "Starting image tile " << tileBounds;
 
             // Get _FilmTile_ for tile
             std::unique_ptr<FilmTile> filmTile =
                 camera->film->GetFilmTile(tileBounds);
 
+            // Returns the first sample of _pixel_ to take in this pass, or
+            // _passes.end_ if it is skipped
+            auto firstPixelSample = [&](const Point2i &pixel) {
+                if (!InsideExclusive(pixel, pixelBounds)) return passes.end;
+                return passes.FirstSample(pixel);
+            };
+            int64_t endSample =
+                std::min(passes.end, tileSampler->samplesPerPixel);
+
+            CameraRayBatch *cameraBatch = nullptr;
+            if (cameraBatches) {
+                cameraBatch = &cameraBatches[ThreadIndex];
+                cameraBatch->Reset();
+            }
+            auto traceCameraRays = [&](const Point2i &pixel,
+                                       int64_t firstSample) {
+                // Generate and trace up to _MaxRayBatchSize_ camera rays
+                // for the samples that the loop below takes next, then
+                // return _tileSampler_ to the current sample. Unless the
+                // sampler can return to a pixel, the batch ends with it.
+                CameraRayBatch &batch = *cameraBatch;
+                batch.Reset();
+                Point2i p = pixel;
+                int64_t s = firstSample;
+                while (true) {
+                    for (; s < endSample && !batch.rays.Full(); ++s) {
+                        tileSampler->SetSampleNumber(s);
+                        int i = batch.rays.Size();
+                        batch.pixels[i] = p;
+                        batch.sampleNumbers[i] = s;
+                        batch.cameraSamples[i] =
+                            tileSampler->GetCameraSample(p);
+                        batch.rayWeights[i] = camera->GenerateRayDifferential(
+                            batch.cameraSamples[i], &batch.cameraRays[i]);
+                        batch.cameraRays[i].ScaleDifferentials(
+                            1 / std::sqrt((Float)tileSampler->samplesPerPixel));
+                        batch.rays.Add(batch.cameraRays[i]);
+                        if (batch.rayWeights[i] <= 0)
+                            batch.rays.active.Unset(i);
+                    }
+                    if (!batchAcrossPixels || batch.rays.Full()) break;
+
+                    // Advance to the next pixel that the loop below renders
+                    do {
+                        if (++p.x == tile.bounds.pMax.x) {
+                            p.x = tile.bounds.pMin.x;
+                            ++p.y;
+                        }
+                        if (p.y >= tile.bounds.pMax.y) break;
+                        s = firstPixelSample(p);
+                    } while (s >= passes.end);
+                    if (p.y >= tile.bounds.pMax.y) break;
+                    tileSampler->StartPixel(p);
+                }
+                scene.IntersectBatch(batch.rays, batch.isects);
+                if (p != pixel) tileSampler->StartPixel(pixel);
+                tileSampler->SetSampleNumber(firstSample);
+            };
+
             // Loop over pixels in tile to render them
             for (Point2i pixel : tileBounds) {
+                if (!tile.Owns(pixel)) break;
+                if (pixel.x == tileBounds.pMin.x)
+                    tileSampler->Reseed(tile.RowSeed(pixel.y));
                 {
                     ProfilePhase pp(Prof::StartPixel);
                     tileSampler->StartPixel(pixel);
@@ -270,25 +839,56 @@ void SamplerIntegrator::Render(const Scene &scene) {
                 // the usage of RNG values from (most) Samplers that use
                 // RNGs consistent, which improves reproducability /
                 // debugging.
-                if (!InsideExclusive(pixel, pixelBounds))
-                    continue;
+                int64_t firstSample = firstPixelSample(pixel);
+                if (firstSample >= passes.end) continue;
+                if (firstSample > 0) tileSampler->SetSampleNumber(firstSample);
 
                 do {
+                    // Trace the next batch of camera rays if needed
+                    int batchIndex = -1;
+                    if (cameraBatch) {
+                        int64_t sampleNum = tileSampler->CurrentSampleNumber();
+                        batchIndex = cameraBatch->Find(pixel, sampleNum);
+                        if (batchIndex == -1) {
+                            traceCameraRays(pixel, sampleNum);
+                            batchIndex = cameraBatch->Find(pixel, sampleNum);
+                        }
+                        ++cameraBatch->next;
+                    }
+
                     // Initialize _CameraSample_ for current sample
                     CameraSample cameraSample =
                         tileSampler->GetCameraSample(pixel);
 
                     // Generate camera ray for current sample
                     RayDifferential ray;
-                    Float rayWeight =
-                        camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(
-                        1 / std::sqrt((Float)tileSampler->samplesPerPixel));
+                    Float rayWeight;
+                    if (cameraBatch) {
+                        // Use the sample and ray that were traced in the batch
+                        cameraSample = cameraBatch->cameraSamples[batchIndex];
+                        ray = cameraBatch->cameraRays[batchIndex];
+                        rayWeight = cameraBatch->rayWeights[batchIndex];
+                    } else {
+                        rayWeight =
+                            camera->GenerateRayDifferential(cameraSample, &ray);
+                        ray.ScaleDifferentials(
+                            1 / std::sqrt((Float)tileSampler->samplesPerPixel));
+                    }
                     ++nCameraRays;
 
                     // Evaluate radiance along camera ray
                     Spectrum L(0.f);
-                    if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
+                    if (rayWeight > 0) {
+                        if (cameraBatch) {
+                            bool hit = cameraBatch->rays.hit.IsSet(batchIndex);
+                            if (hit)
+                                ray.tMax = cameraBatch->rays.tMax[batchIndex];
+                            L = LiFromHit(ray, hit,
+                                          cameraBatch->isects[batchIndex],
+                                          scene, *tileSampler, arena);
+                        } else
+                            L = Li(ray, scene, *tileSampler, arena);
+                    }
 
                     // Issue warning if unexpected radiance value returned
                     if (L.HasNaNs()) {
@@ -322,20 +922,35 @@ void SamplerIntegrator::Render(const Scene &scene) {
                     // Free _MemoryArena_ memory from computing image sample
                     // value
                     arena.Reset();
-                } while (tileSampler->StartNextSample());
+                } while (tileSampler->StartNextSample() &&
+                         tileSampler->CurrentSampleNumber() < passes.end);
+                passes.FinishPixel(pixel);
             }
-            LOG(INFO) << "Finished image tile " << tileBounds;
+            LOG(INFO) << "Finished image tile " << tile.bounds;
 
             // Merge image tile into _Film_
             camera->film->MergeFilmTile(std::move(filmTile));
-            reporter.Update();
-        }, nTiles);
-        reporter.Done();
+        }, passes.ProgressTitle());
+        if (passes.CheckpointDue()) {
+            camera->film->WriteImage();
+            passes.WriteCheckpoint();
+        }
     }
     LOG(INFO) << "Rendering finished";
 
-    // Save final image after rendering
+    // Save final image after rendering, unless another process will write
+    // it after merging the spool's work units
+    if (!scheduler.MergeSpool()) return;
     camera->film->WriteImage();
+    passes.Finish();
+}
+
+Spectrum SamplerIntegrator::LiFromHit(const RayDifferential &ray,
+                                      bool foundIntersection,
+                                      SurfaceInteraction &isect,
+                                      const Scene &scene, Sampler &sampler,
+                                      MemoryArena &arena) const {
+    return Li(ray, scene, sampler, arena);
 }
 
 Spectrum SamplerIntegrator::SpecularReflect(
@@ -46,6 +46,8 @@
 #include "reflection.h"
 #include "sampler.h"
 #include "material.h"
+#include "parallel.h"
+#include <chrono>
 
 namespace pbrt {
 
@@ -73,6 +75,182 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uShading,
 std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
     const Scene &scene);
 
+// ImageTile Declarations
+class TileScheduler;
+class ImageTile {
+  public:
+    // ImageTile Public Methods
+    // Returns whether the caller should render _pixel_; tile pixels must be
+    // visited in scanline order. At the start of each row, the tile's
+    // remaining rows may be handed to another thread, after which this
+    // returns false.
+    bool Owns(const Point2i &pixel);
+    // Returns the seed to reseed the tile's sampler with at the start of
+    // row _y_, so that each row is sampled the same way whichever thread
+    // renders it.
+    int RowSeed(int y) const;
+
+    // ImageTile Public Data
+    Bounds2i bounds;
+    int seed;
+
+  private:
+    // ImageTile Private Methods
+    ImageTile(TileScheduler *scheduler, TaskGroup *splits,
+              const Bounds2i &bounds, int seed);
+    friend class TileScheduler;
+
+    // ImageTile Private Data
+    TileScheduler *scheduler;
+    TaskGroup *splits;
+    std::chrono::steady_clock::time_point startTime;
+};
+
+// TileScheduler Declarations
+// Hands out the tiles of a film's sample bounds in the film's tile order;
+// the Hilbert curve and spiral orders keep consecutive tiles close to each
+// other, and the spiral starts at the image center. Once no tiles are left
+// to start, a tile whose remaining rows are expected to take longer than an
+// average tile is split in two, so that idle threads can help with the last
+// few expensive tiles.
+//
+// With --spool, runs of consecutive tiles form work units that the pbrt
+// processes rendering the scene share: a process claims a unit by creating
+// <dir>/unit-<n>.claim and writes the unit's partial film to
+// <dir>/unit-<n>.film, and the process that finds all units' films written
+// merges them into the film, in order. Tiles aren't split then and are
+// merged into the film in order, so that the image doesn't depend on how
+// many processes rendered it. The spool directory should be empty when
+// rendering starts.
+//
+// Claim files hold their creator's host name and process ID. A process
+// takes over the claims of processes on its own host that have died
+// before writing their unit's film, so running pbrt with the same spool
+// again finishes an image that a crashed process left. Claims made on
+// other hosts can't be checked; to render such a unit again, remove its
+// unit-<n>.claim* files (or merge.claim*, if the merging process died).
+//
+// Progress is reported in pixels, so pieces split off of tiles are counted
+// as they finish.
+class TileScheduler {
+  public:
+    // TileScheduler Public Methods
+    TileScheduler(Film *film, const Bounds2i &sampleBounds);
+    // Calls _func_ in parallel for each tile and for each piece split off
+    // of a tile, updating a progress bar with the given title as tiles
+    // finish. With --spool, only the tiles of the units that this process
+    // claims are rendered, and each unit's film is written to the spool.
+    void ForEachTile(std::function<void(ImageTile &)> func,
+                     const std::string &title = "Rendering");
+    // With --spool, merges the partial films of all work units into the
+    // film if they have all been rendered; returns false if the image
+    // should be left to another process instead.
+    bool MergeSpool();
+
+  private:
+    // TileScheduler Private Methods
+    void renderTiles(int begin, int end, const std::string &title);
+    void renderSpoolUnit(int unit, const Vector2i &filterRadius,
+                         const std::string &title);
+    void renderTile(ImageTile &tile);
+    std::string spoolFilename(int unit, const char *extension) const;
+    friend class ImageTile;
+
+    // TileScheduler Private Data
+    Film *film;
+    const std::string spoolDirectory;
+    static PBRT_CONSTEXPR int maxSpoolUnits = 64;
+    int nSpoolUnits;
+    const Bounds2i sampleBounds;
+    const bool splitTiles;
+    int nTilesX;
+    std::vector<ImageTile> tiles;
+    std::function<void(ImageTile &)> func;
+    ProgressReporter *reporter = nullptr;
+    std::atomic<int> nextTile;
+    std::atomic<int64_t> renderedPixels, renderedNanoseconds;
+    const int64_t tilePixels;
+};
+
+// RenderPasses Declarations
+// Divides the samples of each pixel into the passes in which integrators
+// render the image's tiles: a single pass normally, or, with
+// --progressive or adaptive sampling, passes that each double the number
+// of samples taken so far. With adaptive sampling, each pass after the
+// first skips the pixels whose film pixels had converged when it started.
+// Also decides when to write checkpoints, which --resume continues from,
+// and when to stop because the --timelimit has been reached. With
+// --samplesplit, the single pass takes only the part's range of samples.
+//
+// A resumed render takes the same samples as an uninterrupted one, with
+// any number of threads. Its image is identical if no filter footprint
+// crosses a tile boundary, as with a box filter of radius 1/2; otherwise,
+// tiles add to their shared pixels in whichever order they finish, so
+// images only agree up to floating-point rounding, just like two
+// uninterrupted renders.
+class RenderPasses {
+  public:
+    // RenderPasses Public Methods
+    RenderPasses(Film *film, int64_t samplesPerPixel, bool adaptive);
+    // Starts the next pass, returning false if there are no more.
+    bool Next();
+    // Returns false if the time limit has been reached and the tile
+    // shouldn't be rendered, which leaves the pass incomplete.
+    bool StartTile();
+    // Returns the first sample to take in _pixel_ in the current pass; it
+    // may be past _start_ if the pass was interrupted and then resumed, or
+    // _end_ if the pixel has converged.
+    int64_t FirstSample(const Point2i &pixel) const;
+    void FinishPixel(const Point2i &pixel);
+    // Returns whether to write a checkpoint after the current pass; the
+    // last pass is always followed by writing the final image.
+    bool CheckpointDue();
+    // Writes the film's state and the samples taken in each pixel so far;
+    // the image should be written separately.
+    void WriteCheckpoint();
+    // Called after the final image has been written: keeps a checkpoint
+    // if rendering stopped early, or removes it otherwise.
+    void Finish();
+    std::string ProgressTitle() const;
+    // Returns the number of samples per pixel in the image that is written
+    // after the current pass; with --samplesplit, in the image merged from
+    // all parts.
+    int64_t ImageSamples() const {
+        return PbrtOptions.nSampleSplits > 0 ? samplesPerPixel : end;
+    }
+
+    // RenderPasses Public Data
+    // Range of sample indices taken in each pixel in the current pass
+    int64_t start = 0, end = 0;
+
+  private:
+    // RenderPasses Private Methods
+    Float elapsedSeconds(std::chrono::steady_clock::time_point since) const;
+    bool outOfTime() const;
+    int64_t completedSamples() const {
+        return tilesSkipped ? samplesTaken : end;
+    }
+
+    // RenderPasses Private Data
+    Film *film;
+    const int64_t samplesPerPixel;
+    const bool adaptive, progressive;
+    const Bounds2i sampleBounds;
+    const std::string checkpointFilename;
+    // Range of sample indices to take in each pixel, with --samplesplit
+    int64_t splitStart, splitEnd;
+    int pass = -1, checkpointPass = 0;
+    // Number of samples taken in all pixels before the current pass, and
+    // in each pixel of _sampleBounds_, if progressive
+    int64_t samplesTaken = 0;
+    std::vector<int64_t> pixelSamples;
+    // Whether each pixel of _sampleBounds_ had converged when the current
+    // pass started, with adaptive sampling
+    std::vector<bool> converged;
+    std::atomic<bool> tilesSkipped{false};
+    std::chrono::steady_clock::time_point startTime, checkpointTime;
+};
+
 // SamplerIntegrator Declarations
 class SamplerIntegrator : public Integrator {
   public:
@@ -86,6 +264,16 @@ class SamplerIntegrator : public Integrator {
     virtual Spectrum Li(const RayDifferential &ray, const Scene &scene,
                         Sampler &sampler, MemoryArena &arena,
                         int depth = 0) const = 0;
+    // Integrators that return true here have their camera rays traced in
+    // _RayBatch_es by Render(), which then calls LiFromHit() with each
+    // ray's closest intersection. A batch spans consecutive pixels of a
+    // tile if the sampler's RepeatsPixelSamples() is true, and otherwise
+    // holds the rays of a single pixel.
+    virtual bool BatchCameraRays() const { return false; }
+    virtual Spectrum LiFromHit(const RayDifferential &ray,
+                               bool foundIntersection,
+                               SurfaceInteraction &isect, const Scene &scene,
+                               Sampler &sampler, MemoryArena &arena) const;
     Spectrum SpecularReflect(const RayDifferential &ray,
                              const SurfaceInteraction &isect,
                              const Scene &scene, Sampler &sampler,
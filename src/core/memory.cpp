@@ -33,9 +33,17 @@
 
 // core/memory.cpp*
 #include "memory.h"
+#include "parallel.h"
+#include "stats.h"
 
 namespace pbrt {
 
+STAT_MEMORY_COUNTER("Memory/Memory arena blocks", arenaBlockMemory);
+STAT_PERCENT("Memory/Memory arena blocks reused", nArenaBlocksReused,
+             nArenaBlockRequests);
+STAT_INT_DISTRIBUTION("Memory/Pooled memory arena bytes per thread",
+                      pooledArenaBytes);
+
 // Memory Allocation Functions
 void *AllocAligned(size_t size) {
 #if defined(PBRT_HAVE__ALIGNED_MALLOC)
@@ -58,4 +66,81 @@ void FreeAligned(void *ptr) {
 #endif
 }
 
+void InterleavePages(void *ptr, size_t bytes) {
+    // Smaller allocations are likely to share pages that have already been
+    // touched
+    PBRT_CONSTEXPR size_t pageSize = 4096, minBytes = 1 << 20;
+    if (NumNumaNodes() <= 1 || bytes < minBytes) return;
+    // Each task touches a run of pages; since idle threads steal whichever
+    // tasks are left, the runs are spread over all of the threads' nodes.
+    PBRT_CONSTEXPR int pagesPerTask = 16;
+    char *start = (char *)ptr;
+    int64_t nPages = (bytes + pageSize - 1) / pageSize;
+    ParallelFor([&](int64_t t) {
+        int64_t endPage = std::min(nPages, (t + 1) * pagesPerTask);
+        for (int64_t page = t * pagesPerTask; page < endPage; ++page) {
+            // Write the byte's current value so that the page is
+            // allocated without changing its contents
+            volatile char *p = start + page * pageSize;
+            *p = *p;
+        }
+    }, (nPages + pagesPerTask - 1) / pagesPerTask);
+}
+
+// MemoryArena Method Definitions
+void MemoryArena::startBlock(size_t nBytes) {
+    // Add current block to _usedBlocks_ list
+    if (currentBlock) {
+        usedBlocks.push_back(std::make_pair(currentAllocSize, currentBlock));
+        currentBlock = nullptr;
+        currentAllocSize = 0;
+    }
+
+    // Get new block of memory for _MemoryArena_
+    ++nArenaBlockRequests;
+
+    // Try to get memory block from _availableBlocks_
+    for (auto iter = availableBlocks.begin(); iter != availableBlocks.end();
+         ++iter) {
+        if (iter->first >= nBytes) {
+            currentAllocSize = iter->first;
+            currentBlock = iter->second;
+            availableBlocks.erase(iter);
+            ++nArenaBlocksReused;
+            break;
+        }
+    }
+    if (!currentBlock) {
+        currentAllocSize = std::max(nBytes, blockSize);
+        currentBlock = AllocAligned<uint8_t>(currentAllocSize);
+        arenaBlockMemory += currentAllocSize;
+    }
+    currentBlockPos = 0;
+}
+
+// MemoryArenaPool Method Definitions
+MemoryArenaPool::MemoryArenaPool()
+    : arenas(AllocAligned<MemoryArena>(MaxThreadIndex())),
+      nArenas(MaxThreadIndex()) {
+    for (int i = 0; i < nArenas; ++i) new (&arenas[i]) MemoryArena;
+}
+
+MemoryArenaPool::~MemoryArenaPool() {
+    for (int i = 0; i < nArenas; ++i) {
+        if (arenas[i].TotalAllocated() > 0)
+            ReportValue(pooledArenaBytes, arenas[i].TotalAllocated());
+        arenas[i].~MemoryArena();
+    }
+    FreeAligned(arenas);
+}
+
+MemoryArena &MemoryArenaPool::ThreadArena() {
+    CHECK_LT(ThreadIndex, nArenas);
+    return arenas[ThreadIndex];
+}
+
+void MemoryArenaPool::Reset() {
+    for (int i = 0; i < nArenas; ++i) arenas[i].Reset();
+}
+
 }  // namespace pbrt
@@ -40,7 +40,6 @@
 
 // core/memory.h*
 #include "pbrt.h"
-#include <list>
 #include <cstddef>
 
 namespace pbrt {
@@ -54,6 +53,11 @@ T *AllocAligned(size_t count) {
 }
 
 void FreeAligned(void *);
+// Touches the pages of newly allocated memory from all of the worker
+// threads, so that first-touch page placement spreads large read-mostly
+// arrays over the NUMA nodes that the threads are pinned to. Does nothing
+// unless threads are pinned to more than one node.
+void InterleavePages(void *ptr, size_t bytes);
 class
 #ifdef PBRT_HAVE_ALIGNAS
 alignas(PBRT_L1_CACHE_LINE_SIZE)
@@ -81,33 +85,7 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
         static_assert(IsPowerOf2(align), "Minimum alignment not a power of two");
 #endif
         nBytes = (nBytes + align - 1) & ~(align - 1);
-        if (currentBlockPos + nBytes > currentAllocSize) {
-            // Add current block to _usedBlocks_ list
-            if (currentBlock) {
-                usedBlocks.push_back(
-                    std::make_pair(currentAllocSize, currentBlock));
-                currentBlock = nullptr;
-                currentAllocSize = 0;
-            }
-
-            // Get new block of memory for _MemoryArena_
-
-            // Try to get memory block from _availableBlocks_
-            for (auto iter = availableBlocks.begin();
-                 iter != availableBlocks.end(); ++iter) {
-                if (iter->first >= nBytes) {
-                    currentAllocSize = iter->first;
-                    currentBlock = iter->second;
-                    availableBlocks.erase(iter);
-                    break;
-                }
-            }
-            if (!currentBlock) {
-                currentAllocSize = std::max(nBytes, blockSize);
-                currentBlock = AllocAligned<uint8_t>(currentAllocSize);
-            }
-            currentBlockPos = 0;
-        }
+        if (currentBlockPos + nBytes > currentAllocSize) startBlock(nBytes);
         void *ret = currentBlock + currentBlockPos;
         currentBlockPos += nBytes;
         return ret;
@@ -121,7 +99,9 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
     }
     void Reset() {
         currentBlockPos = 0;
-        availableBlocks.splice(availableBlocks.begin(), usedBlocks);
+        availableBlocks.insert(availableBlocks.end(), usedBlocks.begin(),
+                               usedBlocks.end());
+        usedBlocks.clear();
     }
     size_t TotalAllocated() const {
         size_t total = currentAllocSize;
@@ -133,11 +113,45 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
   private:
     MemoryArena(const MemoryArena &) = delete;
     MemoryArena &operator=(const MemoryArena &) = delete;
+    // MemoryArena Private Methods
+    void startBlock(size_t nBytes);
+
     // MemoryArena Private Data
     const size_t blockSize;
     size_t currentBlockPos = 0, currentAllocSize = 0;
     uint8_t *currentBlock = nullptr;
-    std::list<std::pair<size_t, uint8_t *>> usedBlocks, availableBlocks;
+    // Vectors rather than lists, so that once their capacity suffices,
+    // moving blocks between them never allocates memory
+    std::vector<std::pair<size_t, uint8_t *>> usedBlocks, availableBlocks;
+};
+
+// MemoryArenaPool Declarations
+// Holds a _MemoryArena_ for each thread, so that the memory blocks of a
+// thread's arena are reused by all of the work the thread does, e.g. all of
+// the image tiles that it renders in all passes, rather than allocated and
+// freed for each piece of work. The arenas' sizes, which are their
+// high-water marks, are reported in the statistics when the pool is
+// destroyed.
+class MemoryArenaPool {
+  public:
+    // MemoryArenaPool Public Methods
+    MemoryArenaPool();
+    ~MemoryArenaPool();
+    // Returns the calling thread's arena; work should Reset() it when done
+    // and must not use it after the thread has started other work.
+    MemoryArena &ThreadArena();
+    // Resets all threads' arenas, for work whose allocations outlive the
+    // tasks that made them.
+    void Reset();
+
+  private:
+    MemoryArenaPool(const MemoryArenaPool &) = delete;
+    MemoryArenaPool &operator=(const MemoryArenaPool &) = delete;
+    // MemoryArenaPool Private Data
+    // Allocated with _AllocAligned()_ rather than held in a _std::vector_,
+    // whose allocator needn't respect _MemoryArena_'s cache line alignment
+    MemoryArena *arenas;
+    const int nArenas;
 };
 
 template <typename T, int logBlockSize>
@@ -148,6 +162,7 @@ class BlockedArray {
         : uRes(uRes), vRes(vRes), uBlocks(RoundUp(uRes) >> logBlockSize) {
         int nAlloc = RoundUp(uRes) * RoundUp(vRes);
         data = AllocAligned<T>(nAlloc);
+        InterleavePages(data, nAlloc * sizeof(T));
         for (int i = 0; i < nAlloc; ++i) new (&data[i]) T();
         if (d)
             for (int v = 0; v < vRes; ++v)
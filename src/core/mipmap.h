@@ -44,6 +44,7 @@
 #include "texture.h"
 #include "stats.h"
 #include "parallel.h"
+#include "texcache.h"
 
 namespace pbrt {
 
@@ -58,17 +59,55 @@ struct ResampleWeight {
     Float weight[4];
 };
 
+// Tiled MIPMap Helper Functions
+inline int TiledChannels(const Float *) { return 1; }
+inline int TiledChannels(const RGBSpectrum *) { return 3; }
+inline void FromTiled(const float *v, int nChannels, Float *texel) {
+    if (nChannels == 1)
+        *texel = v[0];
+    else {
+        Float rgb[3] = {v[0], v[1], v[2]};
+        *texel = RGBSpectrum::FromRGB(rgb).y();
+    }
+}
+inline void FromTiled(const float *v, int nChannels, RGBSpectrum *texel) {
+    if (nChannels == 1)
+        *texel = RGBSpectrum(v[0]);
+    else {
+        Float rgb[3] = {v[0], v[1], v[2]};
+        *texel = RGBSpectrum::FromRGB(rgb);
+    }
+}
+inline void ToTiled(Float texel, float *v) { v[0] = texel; }
+inline void ToTiled(const RGBSpectrum &texel, float *v) {
+    Float rgb[3];
+    texel.ToRGB(rgb);
+    for (int c = 0; c < 3; ++c) v[c] = rgb[c];
+}
+
 // MIPMap Declarations
 template <typename T>
 class MIPMap {
   public:
     // MIPMap Public Methods
+    // If _encoding_ isn't _TexelEncoding::Float_, the levels' texels are
+    // stored with that encoding once the pyramid has been built
     MIPMap(const Point2i &resolution, const T *data, bool doTri = false,
-           Float maxAniso = 8.f, ImageWrap wrapMode = ImageWrap::Repeat);
+           Float maxAniso = 8.f, ImageWrap wrapMode = ImageWrap::Repeat,
+           TexelEncoding encoding = TexelEncoding::Float);
+    // Creates a _MIPMap_ whose texels are taken from _tiles_ and multiplied
+    // by _scale_
+    MIPMap(std::shared_ptr<const TiledTexture> tiles, bool doTri = false,
+           Float maxAniso = 8.f, ImageWrap wrapMode = ImageWrap::Repeat,
+           Float scale = 1);
     int Width() const { return resolution[0]; }
     int Height() const { return resolution[1]; }
-    int Levels() const { return pyramid.size(); }
-    const T &Texel(int level, int s, int t) const;
+    int Levels() const { return levelResolution.size(); }
+    T Texel(int level, int s, int t) const;
+    // Writes the pyramid to a tiled MIP file that can be read back through
+    // a _TextureTileCache_
+    bool WriteTiled(const std::string &filename, uint64_t stamp,
+                    TexelEncoding encoding = TexelEncoding::Float) const;
     T Lookup(const Point2f &st, Float width = 0.f) const;
     T Lookup(const Point2f &st, Vector2f dstdx, Vector2f dstdy) const;
 
@@ -101,13 +140,18 @@ class MIPMap {
     }
     T triangle(int level, const Point2f &st) const;
     T EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const;
+    static void initWeightLut();
 
     // MIPMap Private Data
     const bool doTrilinear;
     const Float maxAnisotropy;
     const ImageWrap wrapMode;
     Point2i resolution;
+    std::vector<Point2i> levelResolution;
+    // The levels' texels are either in _pyramid_ or decoded from _tiles_
     std::vector<std::unique_ptr<BlockedArray<T>>> pyramid;
+    std::shared_ptr<const TiledTexture> tiles;
+    Float tileScale = 1;
     static PBRT_CONSTEXPR int WeightLUTSize = 128;
     static Float weightLut[WeightLUTSize];
 };
@@ -115,7 +159,8 @@ class MIPMap {
 // MIPMap Method Definitions
 template <typename T>
 MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
-                  Float maxAnisotropy, ImageWrap wrapMode)
+                  Float maxAnisotropy, ImageWrap wrapMode,
+                  TexelEncoding encoding)
     : doTrilinear(doTrilinear),
       maxAnisotropy(maxAnisotropy),
       wrapMode(wrapMode),
@@ -189,11 +234,13 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
     pyramid[0].reset(
         new BlockedArray<T>(resolution[0], resolution[1],
                             resampledImage ? resampledImage.get() : img));
+    levelResolution.push_back(resolution);
     for (int i = 1; i < nLevels; ++i) {
         // Initialize $i$th MIPMap level from $i-1$st level
         int sRes = std::max(1, pyramid[i - 1]->uSize() / 2);
         int tRes = std::max(1, pyramid[i - 1]->vSize() / 2);
         pyramid[i].reset(new BlockedArray<T>(sRes, tRes));
+        levelResolution.push_back(Point2i(sRes, tRes));
 
         // Filter four texels from finer level of pyramid
         ParallelFor([&](int t) {
@@ -206,6 +253,37 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
         }, tRes, 16);
     }
 
+    // Store the pyramid's texels compactly if requested
+    if (encoding != TexelEncoding::Float) {
+        tiles = EncodeTiledTexture(
+            TiledChannels((T *)nullptr), encoding, levelResolution,
+            [&](int level, Point2i st, float *texel) {
+                ToTiled(Texel(level, st.x, st.y), texel);
+            });
+        pyramid.clear();
+        mipMapMemory += tiles->MemoryBytes();
+    } else
+        mipMapMemory += (4 * resolution[0] * resolution[1] * sizeof(T)) / 3;
+    initWeightLut();
+}
+
+template <typename T>
+MIPMap<T>::MIPMap(std::shared_ptr<const TiledTexture> tiles,
+                  bool doTrilinear, Float maxAnisotropy, ImageWrap wrapMode,
+                  Float scale)
+    : doTrilinear(doTrilinear),
+      maxAnisotropy(maxAnisotropy),
+      wrapMode(wrapMode),
+      tiles(std::move(tiles)),
+      tileScale(scale) {
+    for (int i = 0; i < this->tiles->Levels(); ++i)
+        levelResolution.push_back(this->tiles->LevelResolution(i));
+    resolution = levelResolution[0];
+    initWeightLut();
+}
+
+template <typename T>
+void MIPMap<T>::initWeightLut() {
     // Initialize EWA filter weights if needed
     if (weightLut[0] == 0.) {
         for (int i = 0; i < WeightLUTSize; ++i) {
@@ -214,31 +292,46 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
             weightLut[i] = std::exp(-alpha * r2) - std::exp(-alpha);
         }
     }
-    mipMapMemory += (4 * resolution[0] * resolution[1] * sizeof(T)) / 3;
 }
 
 template <typename T>
-const T &MIPMap<T>::Texel(int level, int s, int t) const {
-    CHECK_LT(level, pyramid.size());
-    const BlockedArray<T> &l = *pyramid[level];
+T MIPMap<T>::Texel(int level, int s, int t) const {
+    CHECK_LT(level, Levels());
+    const Point2i &res = levelResolution[level];
     // Compute texel $(s,t)$ accounting for boundary conditions
     switch (wrapMode) {
     case ImageWrap::Repeat:
-        s = Mod(s, l.uSize());
-        t = Mod(t, l.vSize());
+        s = Mod(s, res.x);
+        t = Mod(t, res.y);
         break;
     case ImageWrap::Clamp:
-        s = Clamp(s, 0, l.uSize() - 1);
-        t = Clamp(t, 0, l.vSize() - 1);
+        s = Clamp(s, 0, res.x - 1);
+        t = Clamp(t, 0, res.y - 1);
         break;
     case ImageWrap::Black: {
-        static const T black = 0.f;
-        if (s < 0 || s >= (int)l.uSize() || t < 0 || t >= (int)l.vSize())
-            return black;
+        if (s < 0 || s >= res.x || t < 0 || t >= res.y) return T(0.f);
         break;
     }
     }
-    return l(s, t);
+    if (tiles) {
+        float v[3];
+        tiles->Texel(level, s, t, v);
+        T texel;
+        FromTiled(v, tiles->Channels(), &texel);
+        return tileScale * texel;
+    }
+    return (*pyramid[level])(s, t);
+}
+
+template <typename T>
+bool MIPMap<T>::WriteTiled(const std::string &filename, uint64_t stamp,
+                           TexelEncoding encoding) const {
+    return WriteTiledTexture(
+        filename, TiledChannels((T *)nullptr), encoding, levelResolution,
+        stamp,
+        [&](int level, Point2i st, float *texel) {
+            ToTiled(Texel(level, st.x, st.y), texel);
+        });
 }
 
 template <typename T>
@@ -263,8 +356,8 @@ T MIPMap<T>::Lookup(const Point2f &st, Float width) const {
 template <typename T>
 T MIPMap<T>::triangle(int level, const Point2f &st) const {
     level = Clamp(level, 0, Levels() - 1);
-    Float s = st[0] * pyramid[level]->uSize() - 0.5f;
-    Float t = st[1] * pyramid[level]->vSize() - 0.5f;
+    Float s = st[0] * levelResolution[level].x - 0.5f;
+    Float t = st[1] * levelResolution[level].y - 0.5f;
     int s0 = std::floor(s), t0 = std::floor(t);
     Float ds = s - s0, dt = t - t0;
     return (1 - ds) * (1 - dt) * Texel(level, s0, t0) +
@@ -306,12 +399,13 @@ template <typename T>
 T MIPMap<T>::EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const {
     if (level >= Levels()) return Texel(Levels() - 1, 0, 0);
     // Convert EWA coordinates to appropriate scale for level
-    st[0] = st[0] * pyramid[level]->uSize() - 0.5f;
-    st[1] = st[1] * pyramid[level]->vSize() - 0.5f;
-    dst0[0] *= pyramid[level]->uSize();
-    dst0[1] *= pyramid[level]->vSize();
-    dst1[0] *= pyramid[level]->uSize();
-    dst1[1] *= pyramid[level]->vSize();
+    const Point2i &res = levelResolution[level];
+    st[0] = st[0] * res.x - 0.5f;
+    st[1] = st[1] * res.y - 0.5f;
+    dst0[0] *= res.x;
+    dst0[1] *= res.y;
+    dst1[0] *= res.x;
+    dst1[1] *= res.y;
 
     // Compute ellipse coefficients to bound EWA filter region
     Float A = dst0[1] * dst0[1] + dst1[1] * dst1[1] + 1;
@@ -35,22 +35,40 @@
 #include "parallel.h"
 #include "memory.h"
 #include "stats.h"
-#include <list>
+#include <cstdio>
+#include <deque>
 #include <thread>
 #include <condition_variable>
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace pbrt {
 
+STAT_PERCENT("Parallel/Stolen tasks", nStolenTasks, nTasksRun);
+
 // Parallel Local Definitions
 static std::vector<std::thread> threads;
-static bool shutdownThreads = false;
-class ParallelForLoop;
-static ParallelForLoop *workList = nullptr;
-static std::mutex workListMutex;
+static std::atomic<bool> shutdownThreads{false};
+class TaskQueue;
+// Each thread has its own queue of tasks, indexed by _ThreadIndex_.
+static std::vector<std::unique_ptr<TaskQueue>> taskQueues;
+// NUMA node of each thread's CPU if threads are pinned, and zero otherwise
+static std::vector<int> threadNodes;
+static int nNumaNodes = 1;
+
+// Threads that run out of tasks sleep on _sleepCondition_. It's notified
+// when tasks are added while threads are sleeping and when the last task
+// of a _TaskGroup_ finishes; _wakeVersion_ is incremented each time.
+static std::mutex sleepMutex;
+static std::condition_variable sleepCondition;
+static std::atomic<int> nSleeping{0};
+static uint64_t wakeVersion = 0;
 
 // Bookkeeping variables to help with the implementation of
 // MergeWorkerThreadStats().
-static std::atomic<bool> reportWorkerStats{false};
+static std::atomic<int> reportGeneration{0};
 // Number of workers that still need to report their stats.
 static std::atomic<int> reporterCount;
 // After kicking the workers to report their stats, the main thread waits
@@ -62,36 +80,84 @@ class ParallelForLoop {
   public:
     // ParallelForLoop Public Methods
     ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex,
-                    int chunkSize, uint64_t profilerState)
-        : func1D(std::move(func1D)),
-          maxIndex(maxIndex),
-          chunkSize(chunkSize),
-          profilerState(profilerState) {}
-    ParallelForLoop(const std::function<void(Point2i)> &f, const Point2i &count,
-                    uint64_t profilerState)
-        : func2D(f),
-          maxIndex(count.x * count.y),
-          chunkSize(1),
-          profilerState(profilerState) {
+                    int chunkSize)
+        : func1D(std::move(func1D)), maxIndex(maxIndex), chunkSize(chunkSize) {}
+    ParallelForLoop(std::function<void(Point2i)> f, const Point2i &count)
+        : func2D(std::move(f)), maxIndex(count.x * count.y), chunkSize(1) {
         nX = count.x;
     }
+    void Run(int64_t index) const {
+        if (func1D) {
+            func1D(index);
+        }
+        // Handle other types of loops
+        else {
+            CHECK(func2D);
+            func2D(Point2i(index % nX, index / nX));
+        }
+    }
 
-  public:
-    // ParallelForLoop Private Data
+    // ParallelForLoop Public Data
     std::function<void(int64_t)> func1D;
     std::function<void(Point2i)> func2D;
     const int64_t maxIndex;
     const int chunkSize;
-    uint64_t profilerState;
-    int64_t nextIndex = 0;
-    int activeWorkers = 0;
-    ParallelForLoop *next = nullptr;
     int nX = -1;
+};
+
+// A unit of work in a _TaskQueue_: either a function spawned in a
+// _TaskGroup_ or, if _loop_ isn't null, iterations _[begin, end)_ of a
+// parallel loop.
+struct Task {
+    // Task Public Methods
+    void Run();
+
+    // Task Public Data
+    std::function<void()> func;
+    const ParallelForLoop *loop = nullptr;
+    int64_t begin = 0, end = 0;
+    TaskGroup *group = nullptr;
+    uint64_t profilerState = 0;
+};
 
-    // ParallelForLoop Private Methods
-    bool Finished() const {
-        return nextIndex >= maxIndex && activeWorkers == 0;
+// Double-ended queue of tasks: its thread adds and removes tasks at the
+// back, so that it works on the most recently split and smallest pieces of
+// work, while other threads steal the oldest and largest ones from the
+// front. Each queue has its own lock, so threads only contend when
+// stealing from the same queue.
+class TaskQueue {
+  public:
+    // TaskQueue Public Methods
+    void Push(Task task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        ++size;
+    }
+    bool Pop(Task *task) {
+        if (size == 0) return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty()) return false;
+        *task = std::move(tasks.back());
+        tasks.pop_back();
+        --size;
+        return true;
     }
+    bool Steal(Task *task) {
+        if (size == 0) return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty()) return false;
+        *task = std::move(tasks.front());
+        tasks.pop_front();
+        --size;
+        return true;
+    }
+    bool Empty() const { return size == 0; }
+
+  private:
+    // TaskQueue Private Data
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    std::atomic<int> size{0};
 };
 
 void Barrier::Wait() {
@@ -107,11 +173,182 @@ void Barrier::Wait() {
         cv.wait(lock, [this] { return count == 0; });
 }
 
-static std::condition_variable workListCondition;
+// Wakes up sleeping threads, if there are any. _all_ should be true if
+// waking an arbitrary one of them isn't sufficient.
+static void WakeSleepingThreads(bool all) {
+    if (nSleeping == 0) return;
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    ++wakeVersion;
+    if (all)
+        sleepCondition.notify_all();
+    else
+        sleepCondition.notify_one();
+}
+
+static void PushTask(Task task) {
+    taskQueues[ThreadIndex]->Push(std::move(task));
+    WakeSleepingThreads(false);
+}
+
+void Task::Run() {
+    uint64_t oldState = ProfilerState;
+    ProfilerState = profilerState;
+    if (loop) {
+        // Split off the upper half of the iterations until a single chunk
+        // is left, so that idle threads can steal them
+        while (end - begin > loop->chunkSize) {
+            int64_t nChunks = (end - begin + loop->chunkSize - 1) /
+                              loop->chunkSize;
+            int64_t mid = begin + nChunks / 2 * loop->chunkSize;
+            Task upper;
+            upper.loop = loop;
+            upper.begin = mid;
+            upper.end = end;
+            upper.group = group;
+            upper.profilerState = profilerState;
+            ++group->pending;
+            PushTask(std::move(upper));
+            end = mid;
+        }
+        for (int64_t index = begin; index < end; ++index) loop->Run(index);
+    } else
+        func();
+    ProfilerState = oldState;
+    ++nTasksRun;
+    // _group_ may be destroyed as soon as its last task finishes
+    if (--group->pending == 0) WakeSleepingThreads(true);
+}
+
+// Runs a task from the calling thread's queue or, if it's empty, one
+// stolen from another thread. Returns false if no task was found.
+static bool RunTask() {
+    Task task;
+    int nQueues = taskQueues.size();
+    if (!taskQueues[ThreadIndex]->Pop(&task)) {
+        // Start at a different queue each time so that thieves spread out
+        static PBRT_THREAD_LOCAL uint32_t victimOffset = 0;
+        victimOffset = victimOffset * 1664525u + 1013904223u;
+        int start = (victimOffset >> 8) % nQueues;
+        // Steal from threads on the same NUMA node first, so that tasks
+        // tend to stay close to the memory that they first touched
+        int node = threadNodes[ThreadIndex];
+        bool stolen = false;
+        for (int pass = 0; pass < (nNumaNodes > 1 ? 2 : 1) && !stolen; ++pass)
+            for (int i = 0; i < nQueues && !stolen; ++i) {
+                int victim = (start + i) % nQueues;
+                bool sameNode = threadNodes[victim] == node;
+                if (victim == ThreadIndex ||
+                    (nNumaNodes > 1 && sameNode != (pass == 0)))
+                    continue;
+                stolen = taskQueues[victim]->Steal(&task);
+            }
+        if (!stolen) return false;
+        ++nStolenTasks;
+    }
+    task.Run();
+    return true;
+}
+
+// Blocks the calling thread until more tasks may be available or _done()_
+// returns true. _done()_ must only depend on state whose changes are
+// followed by a call to _WakeSleepingThreads()_ or _sleepCondition_ being
+// notified.
+template <typename F>
+static void SleepUntilWork(F done) {
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    uint64_t version = wakeVersion;
+    ++nSleeping;
+    lock.unlock();
+    // Check again after announcing that this thread is going to sleep, so
+    // that tasks added in the meantime aren't missed
+    bool haveWork = done();
+    for (const std::unique_ptr<TaskQueue> &queue : taskQueues)
+        haveWork |= !queue->Empty();
+    lock.lock();
+    if (!haveWork)
+        sleepCondition.wait(
+            lock, [&]() { return wakeVersion != version || done(); });
+    --nSleeping;
+}
+
+// Idle threads look for tasks to steal this many times before sleeping.
+static PBRT_CONSTEXPR int nStealAttempts = 16;
+
+void TaskGroup::Spawn(std::function<void()> func) {
+    // Run _func_ immediately if not using threads
+    if (threads.empty()) {
+        func();
+        return;
+    }
+    Task task;
+    task.func = std::move(func);
+    task.group = this;
+    task.profilerState = CurrentProfilerState();
+    ++pending;
+    PushTask(std::move(task));
+}
+
+void TaskGroup::Wait() {
+    // Help out with pending tasks, which may come from other groups, until
+    // all of the group's tasks have finished
+    while (pending > 0) {
+        bool ranTask = false;
+        for (int i = 0; i < nStealAttempts && !ranTask && pending > 0; ++i)
+            ranTask = RunTask();
+        if (!ranTask && pending > 0)
+            SleepUntilWork([this]() { return pending == 0; });
+    }
+}
+
+// Returns the CPUs of each of the system's NUMA nodes, or a single node
+// with all of the CPUs if the topology isn't known.
+static std::vector<std::vector<int>> NumaNodeCPUs() {
+    std::vector<std::vector<int>> nodes;
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    // Parse Linux's lists of CPU ranges, e.g. "0-7,16-23"; node numbers
+    // may have gaps
+    for (int node = 0; node < 1024; ++node) {
+        FILE *f = fopen(
+            StringPrintf("/sys/devices/system/node/node%d/cpulist", node)
+                .c_str(),
+            "r");
+        if (!f) continue;
+        std::vector<int> cpus;
+        int first, last;
+        while (fscanf(f, "%d", &first) == 1) {
+            last = first;
+            int ch = fgetc(f);
+            if (ch == '-' && fscanf(f, "%d", &last) == 1) ch = fgetc(f);
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+            if (ch != ',') break;
+        }
+        fclose(f);
+        if (!cpus.empty()) nodes.push_back(cpus);
+    }
+#endif
+    if (nodes.empty()) {
+        nodes.resize(1);
+        for (int cpu = 0; cpu < NumSystemCores(); ++cpu)
+            nodes[0].push_back(cpu);
+    }
+    return nodes;
+}
+
+static void PinThread(int cpu) {
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        Warning("Unable to pin thread to CPU %d", cpu);
+#endif
+}
 
-static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
+static void workerThreadFunc(int tIndex, int cpu,
+                             std::shared_ptr<Barrier> barrier) {
     LOG(INFO) << "Started execution in worker thread " << tIndex;
     ThreadIndex = tIndex;
+    if (cpu >= 0) PinThread(cpu);
 
     // Give the profiler a chance to do per-thread initialization for
     // the worker thread before the profiling system actually stops running.
@@ -126,56 +363,26 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     // the threads have cleared it.
     barrier.reset();
 
-    std::unique_lock<std::mutex> lock(workListMutex);
+    int reportedGeneration = 0;
+    auto done = [&]() {
+        return shutdownThreads || reportGeneration != reportedGeneration;
+    };
     while (!shutdownThreads) {
-        if (reportWorkerStats) {
+        if (reportGeneration != reportedGeneration) {
             ReportThreadStats();
+            reportedGeneration = reportGeneration;
+            std::lock_guard<std::mutex> lock(reportDoneMutex);
             if (--reporterCount == 0)
                 // Once all worker threads have merged their stats, wake up
                 // the main thread.
                 reportDoneCondition.notify_one();
-            // Now sleep again.
-            workListCondition.wait(lock);
-        } else if (!workList) {
-            // Sleep until there are more tasks to run
-            workListCondition.wait(lock);
-        } else {
-            // Get work from _workList_ and run loop iterations
-            ParallelForLoop &loop = *workList;
-
-            // Run a chunk of loop iterations for _loop_
-
-            // Find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd =
-                std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-            loop.activeWorkers++;
-
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            for (int64_t index = indexStart; index < indexEnd; ++index) {
-                uint64_t oldState = ProfilerState;
-                ProfilerState = loop.profilerState;
-                if (loop.func1D) {
-                    loop.func1D(index);
-                }
-                // Handle other types of loops
-                else {
-                    CHECK(loop.func2D);
-                    loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-                }
-                ProfilerState = oldState;
-            }
-            lock.lock();
-
-            // Update _loop_ to reflect completion of iterations
-            loop.activeWorkers--;
-            if (loop.Finished()) workListCondition.notify_all();
+            continue;
         }
+        // Run tasks, sleeping if none are available
+        bool ranTask = false;
+        for (int i = 0; i < nStealAttempts && !ranTask; ++i)
+            ranTask = RunTask();
+        if (!ranTask) SleepUntilWork(done);
     }
     LOG(INFO) << "Exiting worker thread " << tIndex;
 }
@@ -191,51 +398,18 @@ void ParallelFor(std::function<void(int64_t)> func, int64_t count,
         return;
     }
 
-    // Create and enqueue _ParallelForLoop_ for this loop
-    ParallelForLoop loop(std::move(func), count, chunkSize,
-                         CurrentProfilerState());
-    workListMutex.lock();
-    loop.next = workList;
-    workList = &loop;
-    workListMutex.unlock();
-
-    // Notify worker threads of work to be done
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+    // Run the loop as a task that is recursively split as other threads
+    // steal its iterations
+    ParallelForLoop loop(std::move(func), count, chunkSize);
+    TaskGroup group;
+    Task task;
+    task.loop = &loop;
+    task.end = count;
+    task.group = &group;
+    task.profilerState = CurrentProfilerState();
+    ++group.pending;
+    PushTask(std::move(task));
+    group.Wait();
 }
 
 PBRT_THREAD_LOCAL int ThreadIndex;
@@ -253,59 +427,58 @@ void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
         return;
     }
 
-    ParallelForLoop loop(std::move(func), count, CurrentProfilerState());
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
-        loop.next = workList;
-        workList = &loop;
-    }
-
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+    ParallelForLoop loop(std::move(func), count);
+    TaskGroup group;
+    Task task;
+    task.loop = &loop;
+    task.end = loop.maxIndex;
+    task.group = &group;
+    task.profilerState = CurrentProfilerState();
+    ++group.pending;
+    PushTask(std::move(task));
+    group.Wait();
 }
 
 int NumSystemCores() {
     return std::max(1u, std::thread::hardware_concurrency());
 }
 
+int NumNumaNodes() { return nNumaNodes; }
+
 void ParallelInit() {
     CHECK_EQ(threads.size(), 0);
     int nThreads = MaxThreadIndex();
     ThreadIndex = 0;
+    for (int i = 0; i < nThreads; ++i)
+        taskQueues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue));
+
+    // Assign threads to CPUs in turn from each NUMA node, so that all of
+    // the nodes' memory bandwidth is used even with fewer threads than CPUs
+    std::vector<int> threadCPUs(nThreads, -1);
+    threadNodes.assign(nThreads, 0);
+    if (PbrtOptions.pinThreads) {
+#ifndef PBRT_HAVE_PTHREAD_AFFINITY
+        Warning("Pinning threads is not supported on this system.");
+#else
+        std::vector<std::vector<int>> nodeCPUs = NumaNodeCPUs();
+        std::vector<std::pair<int, int>> cpus;  // (CPU, node)
+        size_t maxNodeCPUs = 0;
+        for (const std::vector<int> &node : nodeCPUs)
+            maxNodeCPUs = std::max(maxNodeCPUs, node.size());
+        for (size_t i = 0; i < maxNodeCPUs; ++i)
+            for (size_t node = 0; node < nodeCPUs.size(); ++node)
+                if (i < nodeCPUs[node].size())
+                    cpus.push_back({nodeCPUs[node][i], (int)node});
+        for (int i = 0; i < nThreads && !cpus.empty(); ++i) {
+            threadCPUs[i] = cpus[i % cpus.size()].first;
+            threadNodes[i] = cpus[i % cpus.size()].second;
+        }
+        nNumaNodes = std::min<int>(nodeCPUs.size(), nThreads);
+        if (threadCPUs[0] >= 0) PinThread(threadCPUs[0]);
+        LOG(INFO) << "Pinned " << nThreads << " threads to CPUs on "
+                  << nNumaNodes << " NUMA nodes";
+#endif
+    }
 
     // Create a barrier so that we can be sure all worker threads get past
     // their call to ProfilerWorkerThreadInit() before we return from this
@@ -316,40 +489,45 @@ void ParallelInit() {
     // Launch one fewer worker thread than the total number we want doing
     // work, since the main thread helps out, too.
     for (int i = 0; i < nThreads - 1; ++i)
-        threads.push_back(std::thread(workerThreadFunc, i + 1, barrier));
+        threads.push_back(
+            std::thread(workerThreadFunc, i + 1, threadCPUs[i + 1], barrier));
 
     barrier->Wait();
 }
 
 void ParallelCleanup() {
-    if (threads.empty()) return;
+    if (threads.empty()) {
+        taskQueues.clear();
+        return;
+    }
 
     {
-        std::lock_guard<std::mutex> lock(workListMutex);
+        std::lock_guard<std::mutex> lock(sleepMutex);
         shutdownThreads = true;
-        workListCondition.notify_all();
+        sleepCondition.notify_all();
     }
 
     for (std::thread &thread : threads) thread.join();
     threads.erase(threads.begin(), threads.end());
+    taskQueues.clear();
+    nNumaNodes = 1;
     shutdownThreads = false;
 }
 
 void MergeWorkerThreadStats() {
-    std::unique_lock<std::mutex> lock(workListMutex);
     std::unique_lock<std::mutex> doneLock(reportDoneMutex);
     // Set up state so that the worker threads will know that we would like
     // them to report their thread-specific stats when they wake up.
-    reportWorkerStats = true;
     reporterCount = threads.size();
-
-    // Wake up the worker threads.
-    workListCondition.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        ++reportGeneration;
+        // Wake up the worker threads.
+        sleepCondition.notify_all();
+    }
 
     // Wait for all of them to merge their stats.
-    reportDoneCondition.wait(lock, []() { return reporterCount == 0; });
-
-    reportWorkerStats = false;
+    reportDoneCondition.wait(doneLock, []() { return reporterCount == 0; });
 }
 
 }  // namespace pbrt
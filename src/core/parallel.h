@@ -98,12 +98,41 @@ class Barrier {
     int count;
 };
 
+// Set of tasks that may run in parallel with the thread that spawns them,
+// for example to build the subtrees of a tree concurrently. Tasks are kept
+// in per-thread queues and stolen by idle threads; threads that wait for a
+// group run other pending tasks in the meantime, so tasks can spawn and
+// wait for tasks of their own. Since a waiting thread may run unrelated
+// tasks, tasks must not hold locks while waiting.
+struct Task;
+class TaskGroup {
+  public:
+    // TaskGroup Public Methods
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+    ~TaskGroup() { Wait(); }
+    void Spawn(std::function<void()> func);
+    // Returns once all of the tasks spawned in the group have finished.
+    void Wait();
+
+  private:
+    // TaskGroup Private Data
+    friend struct Task;
+    friend void ParallelFor(std::function<void(int64_t)>, int64_t, int);
+    friend void ParallelFor2D(std::function<void(Point2i)>, const Point2i &);
+    std::atomic<int> pending{0};
+};
+
 void ParallelFor(std::function<void(int64_t)> func, int64_t count,
                  int chunkSize = 1);
 extern PBRT_THREAD_LOCAL int ThreadIndex;
 void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count);
 int MaxThreadIndex();
 int NumSystemCores();
+// Returns the number of NUMA nodes that threads are pinned to, or 1 if
+// they aren't pinned.
+int NumNumaNodes();
 
 void ParallelInit();
 void ParallelCleanup();
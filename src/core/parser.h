@@ -57,8 +57,10 @@ struct Loc {
     int line = 1, column = 0;
 };
 
-// If not nullptr, stores the current file location of the parser.
-extern Loc *parserLoc;
+// If not nullptr, stores the current file location of the parser. It is
+// per-thread so that scene loading tasks can report the location of the
+// statement that started them.
+extern PBRT_THREAD_LOCAL Loc *parserLoc;
 
 // Reimplement enough of absl/std::string_view as needed for the below
 // (Bringing on the abseil dependency at this point just for this seems
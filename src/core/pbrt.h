@@ -76,6 +76,21 @@
   #define PBRT_L1_CACHE_LINE_SIZE 64
 #endif
 
+// SIMD instruction sets usable for single-precision kernels; code using
+// them includes the corresponding intrinsics headers itself.
+#if !defined(PBRT_FLOAT_AS_DOUBLE) &&                            \
+    (defined(__SSE__) || defined(_M_X64) ||                      \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+  #define PBRT_HAVE_SSE
+  #if defined(__SSE2__) || defined(_M_X64) ||                   \
+      (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define PBRT_HAVE_SSE2
+  #endif
+  #ifdef __AVX__
+    #define PBRT_HAVE_AVX
+  #endif
+#endif
+
 #include <stdint.h>
 #if defined(PBRT_IS_MSVC)
 #include <float.h>
@@ -108,6 +123,8 @@ template <typename T>
 class Normal3;
 class Ray;
 class RayDifferential;
+class RayMask;
+class RayBatch;
 template <typename T>
 class Bounds2;
 template <typename T>
@@ -176,8 +193,32 @@ struct Options {
         cropWindow[1][1] = 1;
     }
     int nThreads = 0;
+    // Pin threads to CPUs, spreading them over the NUMA nodes
+    bool pinThreads = false;
     bool quickRender = false;
     bool quiet = false;
+    // Render in passes that double the number of samples per pixel,
+    // writing the image every _checkpointPasses_ passes or
+    // _checkpointSeconds_ seconds (if nonzero) and stopping after
+    // _timeLimit_ seconds (if nonzero); _resume_ continues from the last
+    // checkpoint
+    bool progressive = false, resume = false;
+    int checkpointPasses = 0;
+    Float checkpointSeconds = 0, timeLimit = 0;
+    // If set, the image's tiles are divided into work units that processes
+    // rendering the same scene claim from this directory; see
+    // _TileScheduler_
+    std::string spoolDirectory;
+    // If _nSampleSplits_ is nonzero, only the samples with indices in
+    // [k*spp/n, (k+1)*spp/n) are taken in each pixel, for k = _sampleSplit_
+    // and n = _nSampleSplits_, and the film is written as a partial film
+    int sampleSplit = 0, nSampleSplits = 0;
+    // If nonzero, image textures are converted to tiled MIP files in
+    // _textureCacheDirectory_ (the system temporary directory if empty)
+    // and their tiles are read on demand, keeping at most about
+    // _textureCacheBytes_ of them in memory
+    size_t textureCacheBytes = 0;
+    std::string textureCacheDirectory;
     bool cat = false, toPly = false;
     std::string imageFile;
     // x0, x1, y0, y1
@@ -238,6 +279,45 @@ inline double BitsToFloat(uint64_t ui) {
     return f;
 }
 
+// Converts _f_ to a 16-bit IEEE half-precision value, rounding to nearest
+// even; values too large for a half become infinity.
+inline uint16_t FloatToHalf(float f) {
+    uint32_t ui = FloatToBits(f);
+    uint32_t sign = ui & 0x80000000u;
+    ui ^= sign;
+    uint16_t h;
+    if (ui >= (127u + 16) << 23)
+        // Infinity, NaN, or too large
+        h = ui > 255u << 23 ? 0x7e00 : 0x7c00;
+    else if (ui < 113u << 23) {
+        // Denormalized half; let floating-point addition do the rounding
+        const uint32_t magic = ((127u - 15) + (23 - 10) + 1) << 23;
+        h = FloatToBits(BitsToFloat(ui) + BitsToFloat(magic)) - magic;
+    } else {
+        // Normalized half; rebias the exponent and round the mantissa
+        uint32_t mantissaOdd = (ui >> 13) & 1;
+        ui += ((uint32_t)(15 - 127) << 23) + 0xfff + mantissaOdd;
+        h = ui >> 13;
+    }
+    return h | (sign >> 16);
+}
+
+inline float HalfToFloat(uint16_t h) {
+    const uint32_t exponentMask = 0x7c00u << 13;
+    uint32_t ui = (h & 0x7fffu) << 13;
+    uint32_t exponent = ui & exponentMask;
+    ui += (127u - 15) << 23;
+    if (exponent == exponentMask)
+        // Infinity or NaN
+        ui += (128u - 16) << 23;
+    else if (exponent == 0) {
+        // Zero or denormalized half
+        ui += 1u << 23;
+        ui = FloatToBits(BitsToFloat(ui) - BitsToFloat(113u << 23));
+    }
+    return BitsToFloat(ui | (uint32_t(h & 0x8000u) << 16));
+}
+
 inline float NextFloatUp(float v) {
     // Handle infinity and negative zero for _NextFloatUp()_
     if (std::isinf(v) && v > 0.) return v;
@@ -35,6 +35,7 @@
 #include "primitive.h"
 #include "light.h"
 #include "interaction.h"
+#include "raybatch.h"
 #include "stats.h"
 
 namespace pbrt {
@@ -43,6 +44,26 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+void Primitive::IntersectBatch(RayBatch &rays,
+                               SurfaceInteraction *isects) const {
+    rays.active.ForEach([&](int i) {
+        Ray ray = rays.GetRay(i);
+        if (Intersect(ray, &isects[i])) {
+            rays.tMax[i] = ray.tMax;
+            rays.hit.Set(i);
+        }
+    });
+}
+
+void Primitive::IntersectPBatch(RayBatch &rays) const {
+    rays.active.ForEach([&](int i) {
+        if (IntersectP(rays.GetRay(i))) {
+            rays.hit.Set(i);
+            rays.active.Unset(i);
+        }
+    });
+}
+
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
@@ -129,6 +150,31 @@ bool GeometricPrimitive::Intersect(const Ray &r,
     return true;
 }
 
+void GeometricPrimitive::IntersectBatch(RayBatch &rays,
+                                        SurfaceInteraction *isects) const {
+    RayMask hits;
+    shape->IntersectBatch(rays, isects, &hits);
+    hits.ForEach([&](int i) {
+        SurfaceInteraction *isect = &isects[i];
+        isect->primitive = this;
+        CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+        // Initialize _SurfaceInteraction::mediumInterface_ after _Shape_
+        // intersection
+        if (mediumInterface.IsMediumTransition())
+            isect->mediumInterface = mediumInterface;
+        else
+            isect->mediumInterface = MediumInterface(rays.medium[i]);
+    });
+    rays.hit |= hits;
+}
+
+void GeometricPrimitive::IntersectPBatch(RayBatch &rays) const {
+    RayMask hits;
+    shape->IntersectPBatch(rays, &hits);
+    rays.hit |= hits;
+    rays.active &= ~hits;
+}
+
 const AreaLight *GeometricPrimitive::GetAreaLight() const {
     return areaLight.get();
 }
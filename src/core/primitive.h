@@ -55,6 +55,11 @@ class Primitive {
     virtual Bounds3f WorldBound() const = 0;
     virtual bool Intersect(const Ray &r, SurfaceInteraction *) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
+    // Batched versions of Intersect() and IntersectP() for the active rays
+    // in _rays_; the default implementations trace the rays one at a time.
+    virtual void IntersectBatch(RayBatch &rays,
+                                SurfaceInteraction *isects) const;
+    virtual void IntersectPBatch(RayBatch &rays) const;
     virtual const AreaLight *GetAreaLight() const = 0;
     virtual const Material *GetMaterial() const = 0;
     virtual void ComputeScatteringFunctions(SurfaceInteraction *isect,
@@ -70,6 +75,9 @@ class GeometricPrimitive : public Primitive {
     virtual Bounds3f WorldBound() const;
     virtual bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
     virtual bool IntersectP(const Ray &r) const;
+    virtual void IntersectBatch(RayBatch &rays,
+                                SurfaceInteraction *isects) const;
+    virtual void IntersectPBatch(RayBatch &rays) const;
     GeometricPrimitive(const std::shared_ptr<Shape> &shape,
                        const std::shared_ptr<Material> &material,
                        const std::shared_ptr<AreaLight> &areaLight,
@@ -0,0 +1,173 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_RAYBATCH_H
+#define PBRT_CORE_RAYBATCH_H
+
+// core/raybatch.h*
+#include "pbrt.h"
+#include "geometry.h"
+
+namespace pbrt {
+
+// RayBatch Constants
+// A 16x16 image tile's worth of rays; a multiple of 32 so that _RayMask_
+// words are fully used.
+static PBRT_CONSTEXPR int MaxRayBatchSize = 256;
+
+// RayMask Declarations
+class RayMask {
+  public:
+    // RayMask Public Methods
+    RayMask() { Clear(); }
+    void Clear() {
+        for (int i = 0; i < nWords; ++i) bits[i] = 0;
+    }
+    void Set(int i) { bits[i >> 5] |= 1u << (i & 31); }
+    void Unset(int i) { bits[i >> 5] &= ~(1u << (i & 31)); }
+    bool IsSet(int i) const { return (bits[i >> 5] & (1u << (i & 31))) != 0; }
+    bool Any() const {
+        for (int i = 0; i < nWords; ++i)
+            if (bits[i]) return true;
+        return false;
+    }
+    int Count() const {
+        int count = 0;
+        for (int i = 0; i < nWords; ++i)
+            for (uint32_t w = bits[i]; w; w &= w - 1) ++count;
+        return count;
+    }
+    // Returns the index of the first set bit, or -1 if the mask is empty.
+    int First() const {
+        for (int i = 0; i < nWords; ++i)
+            if (bits[i]) return 32 * i + CountTrailingZeros(bits[i]);
+        return -1;
+    }
+    // Calls _func_ with the index of each set bit in increasing order.
+    // The mask's value on entry is used, so _func_ may modify it.
+    template <typename F>
+    void ForEach(F func) const {
+        for (int i = 0; i < nWords; ++i)
+            for (uint32_t w = bits[i]; w; w &= w - 1)
+                func(32 * i + CountTrailingZeros(w));
+    }
+    RayMask operator~() const {
+        RayMask m;
+        for (int i = 0; i < nWords; ++i) m.bits[i] = ~bits[i];
+        return m;
+    }
+    RayMask &operator&=(const RayMask &m) {
+        for (int i = 0; i < nWords; ++i) bits[i] &= m.bits[i];
+        return *this;
+    }
+    RayMask &operator|=(const RayMask &m) {
+        for (int i = 0; i < nWords; ++i) bits[i] |= m.bits[i];
+        return *this;
+    }
+    RayMask operator&(const RayMask &m) const {
+        RayMask r = *this;
+        return r &= m;
+    }
+    RayMask operator|(const RayMask &m) const {
+        RayMask r = *this;
+        return r |= m;
+    }
+    // Word _i_ holds the bits for rays $32i$ through $32i+31$.
+    uint32_t Word(int i) const { return bits[i]; }
+    void SetWord(int i, uint32_t w) { bits[i] = w; }
+
+    // RayMask Public Data
+    static PBRT_CONSTEXPR int nWords = MaxRayBatchSize / 32;
+
+  private:
+    // RayMask Private Data
+    uint32_t bits[nWords];
+};
+
+// RayBatch Declarations
+// A _RayBatch_ stores up to _MaxRayBatchSize_ rays in structure-of-arrays
+// form so that they can be traced through the scene together. Batched
+// intersection routines consider only the rays in _active_; closest-hit
+// queries set _hit_ and update _tMax_ for the rays they intersect, and
+// occlusion queries set _hit_ and clear _active_ for occluded rays.
+class RayBatch {
+  public:
+    // RayBatch Public Methods
+    int Size() const { return nRays; }
+    bool Full() const { return nRays == MaxRayBatchSize; }
+    int Add(const Ray &ray) {
+        CHECK_LT(nRays, MaxRayBatchSize);
+        int i = nRays++;
+        ox[i] = ray.o.x;
+        oy[i] = ray.o.y;
+        oz[i] = ray.o.z;
+        dx[i] = ray.d.x;
+        dy[i] = ray.d.y;
+        dz[i] = ray.d.z;
+        tMax[i] = ray.tMax;
+        time[i] = ray.time;
+        medium[i] = ray.medium;
+        active.Set(i);
+        hit.Unset(i);
+        return i;
+    }
+    Ray GetRay(int i) const {
+        DCHECK_LT(i, nRays);
+        return Ray(Point3f(ox[i], oy[i], oz[i]), Vector3f(dx[i], dy[i], dz[i]),
+                   tMax[i], time[i], medium[i]);
+    }
+    void Clear() {
+        nRays = 0;
+        active.Clear();
+        hit.Clear();
+    }
+
+    // RayBatch Public Data
+    Float ox[MaxRayBatchSize], oy[MaxRayBatchSize], oz[MaxRayBatchSize];
+    Float dx[MaxRayBatchSize], dy[MaxRayBatchSize], dz[MaxRayBatchSize];
+    Float tMax[MaxRayBatchSize], time[MaxRayBatchSize];
+    const Medium *medium[MaxRayBatchSize];
+    RayMask active, hit;
+
+  private:
+    // RayBatch Private Data
+    int nRays = 0;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_RAYBATCH_H
@@ -63,7 +63,14 @@ class Sampler {
     const Point2f *Get2DArray(int n);
     virtual bool StartNextSample();
     virtual std::unique_ptr<Sampler> Clone(int seed) = 0;
+    // Restarts the sampler's random number sequence as if it had been
+    // cloned with _seed_; samplers that don't use one ignore this.
+    virtual void Reseed(int seed) {}
     virtual bool SetSampleNumber(int64_t sampleNum);
+    // Returns true if StartPixel() and SetSampleNumber() reproduce a
+    // pixel's samples at any time, whatever was sampled in between, so
+    // that callers may look ahead at other pixels' samples.
+    virtual bool RepeatsPixelSamples() const { return false; }
     std::string StateString() const {
       return StringPrintf("(%d,%d), sample %" PRId64, currentPixel.x,
                           currentPixel.y, currentPixelSampleIndex);
@@ -92,6 +99,7 @@ class PixelSampler : public Sampler {
     PixelSampler(int64_t samplesPerPixel, int nSampledDimensions);
     bool StartNextSample();
     bool SetSampleNumber(int64_t);
+    void Reseed(int seed) { rng.SetSequence(seed); }
     Float Get1D();
     Point2f Get2D();
 
@@ -109,6 +117,7 @@ class GlobalSampler : public Sampler {
     bool StartNextSample();
     void StartPixel(const Point2i &);
     bool SetSampleNumber(int64_t sampleNum);
+    bool RepeatsPixelSamples() const { return true; }
     Float Get1D();
     Point2f Get2D();
     GlobalSampler(int64_t samplesPerPixel) : Sampler(samplesPerPixel) {}
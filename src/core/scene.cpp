@@ -33,6 +33,7 @@
 
 // core/scene.cpp*
 #include "scene.h"
+#include "raybatch.h"
 #include "stats.h"
 
 namespace pbrt {
@@ -54,6 +55,16 @@ bool Scene::IntersectP(const Ray &ray) const {
     return aggregate->IntersectP(ray);
 }
 
+void Scene::IntersectBatch(RayBatch &rays, SurfaceInteraction *isects) const {
+    nIntersectionTests += rays.active.Count();
+    aggregate->IntersectBatch(rays, isects);
+}
+
+void Scene::IntersectPBatch(RayBatch &rays) const {
+    nShadowTests += rays.active.Count();
+    aggregate->IntersectPBatch(rays);
+}
+
 bool Scene::IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                         Spectrum *Tr) const {
     *Tr = Spectrum(1.f);
@@ -33,6 +33,7 @@
 
 // core/shape.cpp*
 #include "shape.h"
+#include "raybatch.h"
 #include "stats.h"
 #include "lowdiscrepancy.h"
 
@@ -53,6 +54,24 @@ Shape::Shape(const Transform *ObjectToWorld, const Transform *WorldToObject,
 
 Bounds3f Shape::WorldBound() const { return (*ObjectToWorld)(ObjectBound()); }
 
+void Shape::IntersectBatch(RayBatch &rays, SurfaceInteraction *isects,
+                           RayMask *hits, bool testAlphaTexture) const {
+    rays.active.ForEach([&](int i) {
+        Float tHit;
+        if (Intersect(rays.GetRay(i), &tHit, &isects[i], testAlphaTexture)) {
+            rays.tMax[i] = tHit;
+            hits->Set(i);
+        }
+    });
+}
+
+void Shape::IntersectPBatch(const RayBatch &rays, RayMask *hits,
+                            bool testAlphaTexture) const {
+    rays.active.ForEach([&](int i) {
+        if (IntersectP(rays.GetRay(i), testAlphaTexture)) hits->Set(i);
+    });
+}
+
 Interaction Shape::Sample(const Interaction &ref, const Point2f &u,
                           Float *pdf) const {
     Interaction intr = Sample(u, pdf);
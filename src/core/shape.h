@@ -63,6 +63,14 @@ class Shape {
                             bool testAlphaTexture = true) const {
         return Intersect(ray, nullptr, nullptr, testAlphaTexture);
     }
+    // Batched versions of Intersect() and IntersectP(): the active rays in
+    // _rays_ that intersect the shape are recorded in _hits_, and
+    // IntersectBatch() also updates their _tMax_ and _isects_ entries.
+    virtual void IntersectBatch(RayBatch &rays, SurfaceInteraction *isects,
+                                RayMask *hits,
+                                bool testAlphaTexture = true) const;
+    virtual void IntersectPBatch(const RayBatch &rays, RayMask *hits,
+                                 bool testAlphaTexture = true) const;
     virtual Float Area() const = 0;
     // Sample a point on the surface of the shape and return the PDF with
     // respect to area on the surface.
@@ -0,0 +1,536 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// core/texcache.cpp*
+#include "texcache.h"
+#include "fileutil.h"
+#include "memory.h"
+#include "parallel.h"
+#include "stats.h"
+#include "stringprint.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#ifdef PBRT_IS_WINDOWS
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include <atomic>
+#include <list>
+#include <unordered_map>
+
+namespace pbrt {
+
+STAT_PERCENT("Texture/Texel lookups served by thread tile micro-caches",
+             nMicroCacheHits, nTileLookups);
+STAT_PERCENT("Texture/Tile cache misses", nTileMisses, nTileRequests);
+STAT_COUNTER("Texture/Tiles evicted from cache", nTilesEvicted);
+STAT_MEMORY_COUNTER("Memory/Texture tiles read", tileBytesRead);
+STAT_MEMORY_COUNTER("Memory/Mapped tiled textures", mappedTextureBytes);
+
+// Texel Encoding Definitions
+float SRGB8ToLinear[256];
+static struct SRGB8ToLinearInit {
+    SRGB8ToLinearInit() {
+        for (int i = 0; i < 256; ++i)
+            SRGB8ToLinear[i] = InverseGammaCorrect(i / 255.f);
+    }
+} srgb8ToLinearInit;
+
+// Tiled Texture File Format
+static const char tiledTextureMagic[8] = {'p', 'b', 'r', 't',
+                                          'T', 'X', 'T', '1'};
+struct TiledTextureHeader {
+    char magic[8];
+    int32_t nChannels, logTileSize, nLevels, encoding;
+    uint64_t stamp;
+};
+struct TiledTextureLevel {
+    int32_t resolution[2];
+    uint64_t offset;
+};
+static PBRT_CONSTEXPR int TiledTextureLogTileSize = 6;
+static PBRT_CONSTEXPR int TiledTextureMaxLevels = 32;
+
+// Returns an ID for the process that is unique among running processes.
+static int ProcessId() {
+#ifdef PBRT_IS_WINDOWS
+    return _getpid();
+#else
+    return getpid();
+#endif
+}
+
+// TiledTexture Method Definitions
+TiledTexture::~TiledTexture() {
+#ifdef PBRT_HAVE_MMAP
+    if (fd != -1) close(fd);
+    if (data && dataMapped) {
+        if (munmap((void *)data, totalBytes) != 0)
+            Warning("munmap: %s", strerror(errno));
+        return;
+    }
+#else
+    if (file) fclose(file);
+#endif
+    if (data) FreeAligned((void *)data);
+}
+
+std::shared_ptr<TiledTexture> TiledTexture::readHeader(
+    const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return nullptr;
+    TiledTextureHeader header;
+    std::shared_ptr<TiledTexture> tex(new TiledTexture);
+    bool valid = fread(&header, sizeof(header), 1, f) == 1 &&
+                 memcmp(header.magic, tiledTextureMagic,
+                        sizeof(header.magic)) == 0 &&
+                 (header.nChannels == 1 || header.nChannels == 3) &&
+                 header.encoding >= 0 && header.encoding <= 2 &&
+                 header.logTileSize >= 2 && header.logTileSize <= 12 &&
+                 header.nLevels >= 1 &&
+                 header.nLevels <= TiledTextureMaxLevels;
+    struct stat stat;
+    valid = valid && ::stat(filename.c_str(), &stat) == 0;
+    if (valid) {
+        tex->filename = filename;
+        tex->nChannels = header.nChannels;
+        tex->logTileSize = header.logTileSize;
+        tex->encoding = TexelEncoding(header.encoding);
+        tex->stamp = header.stamp;
+        tex->totalBytes = stat.st_size;
+
+        // Make sure that each level's tiles follow the previous level's and
+        // lie within the file, so that corrupt or truncated files are never
+        // read past their end
+        int tileSize = 1 << header.logTileSize;
+        uint64_t end =
+            sizeof(header) + header.nLevels * sizeof(TiledTextureLevel);
+        for (int i = 0; valid && i < header.nLevels; ++i) {
+            TiledTextureLevel level;
+            valid = fread(&level, sizeof(level), 1, f) == 1 &&
+                    level.resolution[0] >= 1 && level.resolution[1] >= 1;
+            Point2i res(level.resolution[0], level.resolution[1]);
+            Point2i nTiles((res.x + tileSize - 1) / tileSize,
+                           (res.y + tileSize - 1) / tileSize);
+            valid = valid && nTiles.x <= 65536 && nTiles.y <= 65536;
+            uint64_t levelBytes =
+                uint64_t(nTiles.x) * nTiles.y * tex->tileBytes();
+            valid = valid && level.offset >= end &&
+                    level.offset <= tex->totalBytes &&
+                    levelBytes <= tex->totalBytes - level.offset;
+            end = level.offset + levelBytes;
+            tex->levels.push_back({res, nTiles, level.offset});
+        }
+    }
+    fclose(f);
+    if (!valid && tex->levels.size() > 0)
+        Warning("%s: corrupt or truncated tiled texture", filename.c_str());
+    return valid ? tex : nullptr;
+}
+
+std::shared_ptr<TiledTexture> TiledTexture::layOut(
+    int nChannels, TexelEncoding encoding, int logTileSize,
+    const std::vector<Point2i> &levelResolution, uint64_t offset) {
+    // Place the levels' tiles one after the other, starting at _offset_
+    std::shared_ptr<TiledTexture> tex(new TiledTexture);
+    tex->nChannels = nChannels;
+    tex->encoding = encoding;
+    tex->logTileSize = logTileSize;
+    tex->stamp = 0;
+    int tileSize = 1 << logTileSize;
+    for (Point2i res : levelResolution) {
+        Point2i nTiles((res.x + tileSize - 1) / tileSize,
+                       (res.y + tileSize - 1) / tileSize);
+        tex->levels.push_back({res, nTiles, offset});
+        offset += uint64_t(nTiles.x) * nTiles.y * tex->tileBytes();
+    }
+    tex->totalBytes = offset;
+    return tex;
+}
+
+void TiledTexture::encodeTileRow(int level, int ty,
+                                 const TexelFunction &getTexel,
+                                 uint8_t *row) const {
+    // Fill the tiles in parallel; texels past the edges of the level are
+    // zero
+    const Level &l = levels[level];
+    int tileSize = 1 << logTileSize;
+    ParallelFor([&](int64_t tx) {
+        uint8_t *tile = row + tx * tileBytes();
+        for (int y = 0; y < tileSize; ++y)
+            for (int x = 0; x < tileSize; ++x) {
+                Point2i st(tx * tileSize + x, ty * tileSize + y);
+                float v[3] = {0, 0, 0};
+                if (st.x < l.resolution.x && st.y < l.resolution.y)
+                    getTexel(level, st, v);
+                EncodeTexel(v, nChannels, encoding,
+                            tile + (y * tileSize + x) * texelBytes());
+            }
+    }, l.nTiles.x, std::max(1, 1024 >> (2 * logTileSize)));
+}
+
+void TiledTexture::readTile(int level, int tx, int ty,
+                            uint8_t *texels) const {
+    size_t bytes = tileBytes();
+    uint64_t offset = tileOffset(level, tx, ty);
+    bool readOK = true;
+#ifdef PBRT_HAVE_MMAP
+    for (size_t done = 0; readOK && done < bytes;) {
+        ssize_t n = pread(fd, texels + done, bytes - done, offset + done);
+        if (n > 0)
+            done += n;
+        else if (n == 0 || errno != EINTR)
+            readOK = false;
+    }
+#else
+    std::lock_guard<std::mutex> lock(fileMutex);
+#ifdef PBRT_IS_WINDOWS
+    readOK = _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    readOK = fseek(file, (long)offset, SEEK_SET) == 0;
+#endif
+    readOK = readOK && fread(texels, 1, bytes, file) == bytes;
+#endif
+    tileBytesRead += bytes;
+    if (!readOK) {
+        if (!reportedError.exchange(true))
+            Error("%s: unable to read texture tile: %s", filename.c_str(),
+                  strerror(errno));
+        memset(texels, 0, bytes);
+    }
+}
+
+// TextureTileCache Private Declarations
+struct TextureTileCache::Tile {
+    Tile(size_t bytes) : texels(new uint8_t[bytes]) {}
+    std::unique_ptr<uint8_t[]> texels;
+};
+
+struct TextureTileCache::Shard {
+    struct Entry {
+        std::shared_ptr<const Tile> tile;
+        size_t bytes;
+        std::list<uint64_t>::iterator lruIter;
+    };
+    std::mutex mutex;
+    // Keys of the shard's tiles, most recently used first
+    std::list<uint64_t> lru;
+    std::unordered_map<uint64_t, Entry> tiles;
+    size_t bytes = 0;
+};
+
+struct TextureTileCache::MicroCache {
+    static PBRT_CONSTEXPR int Size = 16;
+    MicroCache() {
+        for (int i = 0; i < Size; ++i) keys[i] = ~uint64_t(0);
+    }
+    uint64_t keys[Size];
+    std::shared_ptr<const Tile> tiles[Size];
+};
+
+// Returns a well-mixed hash of a tile's key, used to choose its shard and
+// its slot in the micro-caches.
+static inline uint64_t MixTileKey(uint64_t key) {
+    key ^= key >> 31;
+    key *= 0x7fb5d329728ea185ull;
+    key ^= key >> 27;
+    key *= 0x81dadef4bc2dd44dull;
+    return key ^ (key >> 33);
+}
+
+// TextureTileCache Method Definitions
+TextureTileCache::TextureTileCache(size_t maxBytes)
+    : maxShardBytes(maxBytes / nShards),
+      shards(new Shard[nShards]),
+      nMicroCaches(MaxThreadIndex()),
+      microCaches(new MicroCache[nMicroCaches]) {}
+
+TextureTileCache::~TextureTileCache() {}
+
+std::shared_ptr<const TiledTexture> TextureTileCache::AddTexture(
+    const std::string &filename, int nChannels, uint64_t stamp) {
+    std::shared_ptr<TiledTexture> tex = TiledTexture::readHeader(filename);
+    if (!tex ||
+        (nChannels != 0 &&
+         (tex->nChannels != nChannels || tex->stamp != stamp)))
+        return nullptr;
+#ifdef PBRT_HAVE_MMAP
+    tex->fd = open(filename.c_str(), O_RDONLY);
+    if (tex->fd == -1) return nullptr;
+#else
+    tex->file = fopen(filename.c_str(), "rb");
+    if (!tex->file) return nullptr;
+#endif
+
+    std::lock_guard<std::mutex> lock(texturesMutex);
+    CHECK_LT(textures.size(), 1 << 23);
+    tex->cache = this;
+    tex->id = textures.size();
+    textures.push_back(tex);
+    return tex;
+}
+
+const uint8_t *TextureTileCache::Texel(const TiledTexture *tex, int level,
+                                       int s, int t) {
+    // Find the tile holding texel $(s,t)$ in the thread's micro-cache
+    int tx = s >> tex->logTileSize, ty = t >> tex->logTileSize;
+    uint64_t key = (uint64_t(tex->id) << 40) | (uint64_t(level) << 32) |
+                   (uint64_t(ty) << 16) | uint64_t(tx);
+    CHECK_LT(ThreadIndex, nMicroCaches);
+    MicroCache &micro = microCaches[ThreadIndex];
+    int slot = MixTileKey(key) & (MicroCache::Size - 1);
+    ++nTileLookups;
+    if (micro.keys[slot] == key)
+        ++nMicroCacheHits;
+    else {
+        micro.tiles[slot] = getTile(tex, key, level, tx, ty);
+        micro.keys[slot] = key;
+    }
+    int mask = (1 << tex->logTileSize) - 1;
+    int offset = ((t & mask) << tex->logTileSize) + (s & mask);
+    return &micro.tiles[slot]->texels[offset * tex->texelBytes()];
+}
+
+std::shared_ptr<const TextureTileCache::Tile> TextureTileCache::getTile(
+    const TiledTexture *tex, uint64_t key, int level, int tx, int ty) {
+    ++nTileRequests;
+    Shard &shard = shards[MixTileKey(key) % nShards];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto iter = shard.tiles.find(key);
+        if (iter != shard.tiles.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru,
+                             iter->second.lruIter);
+            return iter->second.tile;
+        }
+    }
+
+    // Read the tile without holding the shard's lock, so that lookups of
+    // other tiles in the shard don't wait for the disk
+    ++nTileMisses;
+    size_t bytes = tex->tileBytes();
+    std::shared_ptr<Tile> tile = std::make_shared<Tile>(bytes);
+    tex->readTile(level, tx, ty, tile->texels.get());
+
+    // Add the tile to the shard, unless another thread got there first, and
+    // evict least recently used tiles to stay within the budget. Tiles that
+    // are still in threads' micro-caches are freed once they leave them.
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.tiles.find(key);
+    if (iter != shard.tiles.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, iter->second.lruIter);
+        return iter->second.tile;
+    }
+    shard.lru.push_front(key);
+    shard.tiles[key] = {tile, bytes, shard.lru.begin()};
+    shard.bytes += bytes;
+    while (shard.bytes > maxShardBytes && shard.lru.size() > 1) {
+        auto evict = shard.tiles.find(shard.lru.back());
+        shard.bytes -= evict->second.bytes;
+        shard.tiles.erase(evict);
+        shard.lru.pop_back();
+        ++nTilesEvicted;
+    }
+    return tile;
+}
+
+// Tiled Texture Function Definitions
+static std::mutex tileCacheMutex;
+static std::unique_ptr<TextureTileCache> tileCache;
+
+TextureTileCache *GetTextureTileCache() {
+    if (PbrtOptions.textureCacheBytes == 0) return nullptr;
+    std::lock_guard<std::mutex> lock(tileCacheMutex);
+    if (!tileCache)
+        tileCache.reset(new TextureTileCache(PbrtOptions.textureCacheBytes));
+    return tileCache.get();
+}
+
+void FreeTextureTileCache() {
+    std::lock_guard<std::mutex> lock(tileCacheMutex);
+    tileCache.reset();
+}
+
+std::shared_ptr<const TiledTexture> MapTiledTexture(
+    const std::string &filename) {
+    std::shared_ptr<TiledTexture> tex = TiledTexture::readHeader(filename);
+    if (!tex) return nullptr;
+
+    // Map the file into memory, or read it if mapping isn't available
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return nullptr;
+    void *data =
+        mmap(0, tex->totalBytes, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        Warning("%s: %s", filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+    tex->data = (const uint8_t *)data;
+    tex->dataMapped = true;
+#else
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return nullptr;
+    uint8_t *data = AllocAligned<uint8_t>(tex->totalBytes);
+    tex->data = data;
+    bool readOK = fread(data, 1, tex->totalBytes, f) == tex->totalBytes;
+    fclose(f);
+    if (!readOK) {
+        Warning("%s: unable to read tiled texture", filename.c_str());
+        return nullptr;
+    }
+#endif
+    mappedTextureBytes += tex->totalBytes;
+    return tex;
+}
+
+bool WriteTiledTexture(const std::string &filename, int nChannels,
+                       TexelEncoding encoding,
+                       const std::vector<Point2i> &levelResolution,
+                       uint64_t stamp, const TexelFunction &getTexel) {
+    CHECK(!levelResolution.empty() &&
+          levelResolution.size() <= TiledTextureMaxLevels);
+    CHECK(nChannels == 1 || nChannels == 3);
+    TiledTextureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, tiledTextureMagic, sizeof(header.magic));
+    header.nChannels = nChannels;
+    header.logTileSize = TiledTextureLogTileSize;
+    header.nLevels = levelResolution.size();
+    header.encoding = int32_t(encoding);
+    header.stamp = stamp;
+
+    // Lay out the levels' tiles after the header and the table of levels
+    std::shared_ptr<TiledTexture> tex =
+        TiledTexture::layOut(nChannels, encoding, TiledTextureLogTileSize,
+                             levelResolution,
+                             sizeof(header) + levelResolution.size() *
+                                                  sizeof(TiledTextureLevel));
+    std::vector<TiledTextureLevel> levels;
+    for (const TiledTexture::Level &l : tex->levels)
+        levels.push_back({{l.resolution.x, l.resolution.y}, l.offset});
+
+    // Write to a temporary file and rename it, so that readers never see a
+    // partially written file. The temporary file's name is unique to the
+    // process and the call, and it is created exclusively, so processes
+    // that convert the same texture at once don't collide and temporary
+    // files left behind by crashed processes don't block conversion.
+    static std::atomic<int> nTempFiles(0);
+    std::string tempFilename;
+    FILE *f = nullptr;
+    for (int i = 0; !f && i < 16; ++i) {
+        tempFilename = StringPrintf("%s.%d-%d.tmp", filename.c_str(),
+                                    ProcessId(), nTempFiles++);
+        f = fopen(tempFilename.c_str(), "wbx");
+        if (!f && errno != EEXIST) break;
+    }
+    if (!f) {
+        Warning("%s: %s", tempFilename.c_str(), strerror(errno));
+        return false;
+    }
+    bool writeOK = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                   fwrite(levels.data(), sizeof(levels[0]), levels.size(),
+                          f) == levels.size();
+    for (int i = 0; writeOK && i < tex->Levels(); ++i) {
+        // Encode and write the level a row of tiles at a time
+        Point2i nTiles = tex->levels[i].nTiles;
+        std::vector<uint8_t> row(nTiles.x * tex->tileBytes());
+        for (int ty = 0; writeOK && ty < nTiles.y; ++ty) {
+            tex->encodeTileRow(i, ty, getTexel, row.data());
+            writeOK = fwrite(row.data(), 1, row.size(), f) == row.size();
+        }
+    }
+    if (fclose(f) != 0) writeOK = false;
+    if (!writeOK || rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        Warning("%s: unable to write tiled texture", filename.c_str());
+        remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<const TiledTexture> EncodeTiledTexture(
+    int nChannels, TexelEncoding encoding,
+    const std::vector<Point2i> &levelResolution,
+    const TexelFunction &getTexel) {
+    // Use 4x4 tiles, like _BlockedArray_'s blocks
+    std::shared_ptr<TiledTexture> tex = TiledTexture::layOut(
+        nChannels, encoding, 2, levelResolution, 0);
+    uint8_t *data = AllocAligned<uint8_t>(tex->totalBytes);
+    tex->data = data;
+    for (int i = 0; i < tex->Levels(); ++i) {
+        const TiledTexture::Level &l = tex->levels[i];
+        for (int ty = 0; ty < l.nTiles.y; ++ty)
+            tex->encodeTileRow(i, ty, getTexel,
+                               data + tex->tileOffset(i, 0, ty));
+    }
+    return tex;
+}
+
+std::string TiledTextureCacheFilename(const std::string &description) {
+    // Hash _description_ with FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : description) {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3ull;
+    }
+
+    std::string directory = PbrtOptions.textureCacheDirectory;
+    if (directory.empty()) {
+#ifdef PBRT_IS_WINDOWS
+        const char *temp = getenv("TEMP");
+#else
+        const char *temp = getenv("TMPDIR");
+#endif
+        directory = temp ? temp : "/tmp";
+    }
+    return directory + StringPrintf("/tex-%016" PRIx64 ".tiled", hash);
+}
+
+uint64_t TextureSourceStamp(const std::string &filename) {
+    struct stat stat;
+    if (::stat(filename.c_str(), &stat) != 0) return 0;
+    return (uint64_t(stat.st_mtime) << 24) ^ uint64_t(stat.st_size);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,272 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_TEXCACHE_H
+#define PBRT_CORE_TEXCACHE_H
+
+// core/texcache.h*
+#include "pbrt.h"
+#include "geometry.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string.h>
+
+namespace pbrt {
+
+class TextureTileCache;
+
+// Texel Encoding Declarations
+enum class TexelEncoding { Float = 0, Half = 1, SRGB8 = 2 };
+extern float SRGB8ToLinear[256];
+
+inline int TexelEncodingBytes(TexelEncoding encoding) {
+    return encoding == TexelEncoding::Float ? 4
+                                            : (encoding == TexelEncoding::Half
+                                                   ? 2 : 1);
+}
+
+inline void EncodeTexel(const float *v, int nChannels, TexelEncoding encoding,
+                        uint8_t *texel) {
+    for (int c = 0; c < nChannels; ++c) {
+        if (encoding == TexelEncoding::Float)
+            memcpy(texel + 4 * c, &v[c], sizeof(float));
+        else if (encoding == TexelEncoding::Half) {
+            uint16_t h = FloatToHalf(v[c]);
+            memcpy(texel + 2 * c, &h, sizeof(h));
+        } else
+            texel[c] = Clamp(
+                std::round(255.f * GammaCorrect(Clamp(v[c], 0, 1))), 0, 255);
+    }
+}
+
+inline void DecodeTexel(const uint8_t *texel, int nChannels,
+                        TexelEncoding encoding, float *v) {
+    for (int c = 0; c < nChannels; ++c) {
+        if (encoding == TexelEncoding::Float)
+            memcpy(&v[c], texel + 4 * c, sizeof(float));
+        else if (encoding == TexelEncoding::Half) {
+            uint16_t h;
+            memcpy(&h, texel + 2 * c, sizeof(h));
+            v[c] = HalfToFloat(h);
+        } else
+            v[c] = SRGB8ToLinear[texel[c]];
+    }
+}
+
+// TiledTexture Declarations
+typedef std::function<void(int level, Point2i st, float *texel)>
+    TexelFunction;
+
+// A _TiledTexture_ is an open tiled MIP file: each level of a MIP pyramid
+// stored as square tiles of encoded texels. Its tiles are either read on
+// demand through a _TextureTileCache_ or all in memory: either in place in
+// a file mapped with _MapTiledTexture()_ or in a pyramid encoded with
+// _EncodeTiledTexture()_.
+class TiledTexture {
+  public:
+    // TiledTexture Public Methods
+    ~TiledTexture();
+    int Levels() const { return levels.size(); }
+    Point2i LevelResolution(int level) const {
+        return levels[level].resolution;
+    }
+    int Channels() const { return nChannels; }
+    TexelEncoding Encoding() const { return encoding; }
+    // Returns the number of bytes of texels that are held in memory for
+    // the texture, not counting tiles in a tile cache
+    size_t MemoryBytes() const { return data ? totalBytes : 0; }
+    // Decodes the _Channels()_ values of texel $(s,t)$, which must be
+    // inside the level
+    void Texel(int level, int s, int t, float *v) const;
+
+  private:
+    friend class TextureTileCache;
+    friend std::shared_ptr<const TiledTexture> MapTiledTexture(
+        const std::string &filename);
+    friend std::shared_ptr<const TiledTexture> EncodeTiledTexture(
+        int nChannels, TexelEncoding encoding,
+        const std::vector<Point2i> &levelResolution,
+        const TexelFunction &getTexel);
+    friend bool WriteTiledTexture(const std::string &filename, int nChannels,
+                                  TexelEncoding encoding,
+                                  const std::vector<Point2i> &levelResolution,
+                                  uint64_t stamp,
+                                  const TexelFunction &getTexel);
+    // TiledTexture Private Methods
+    TiledTexture() {}
+    static std::shared_ptr<TiledTexture> readHeader(
+        const std::string &filename);
+    static std::shared_ptr<TiledTexture> layOut(
+        int nChannels, TexelEncoding encoding, int logTileSize,
+        const std::vector<Point2i> &levelResolution, uint64_t offset);
+    int texelBytes() const {
+        return nChannels * TexelEncodingBytes(encoding);
+    }
+    size_t tileBytes() const {
+        return size_t(texelBytes()) << (2 * logTileSize);
+    }
+    uint64_t tileOffset(int level, int tx, int ty) const {
+        const Level &l = levels[level];
+        return l.offset + (uint64_t(ty) * l.nTiles.x + tx) * tileBytes();
+    }
+    void readTile(int level, int tx, int ty, uint8_t *texels) const;
+    void encodeTileRow(int level, int ty, const TexelFunction &getTexel,
+                       uint8_t *row) const;
+
+    // TiledTexture Private Data
+    struct Level {
+        Point2i resolution, nTiles;
+        uint64_t offset;
+    };
+    std::string filename;
+    int nChannels, logTileSize;
+    TexelEncoding encoding;
+    uint64_t stamp;
+    std::vector<Level> levels;
+    // The size of the file, or of _data_ for encoded pyramids
+    uint64_t totalBytes = 0;
+    // Set for textures read through a tile cache
+    TextureTileCache *cache = nullptr;
+    int id;
+#ifdef PBRT_HAVE_MMAP
+    int fd = -1;
+#else
+    FILE *file = nullptr;
+    mutable std::mutex fileMutex;
+#endif
+    mutable std::atomic<bool> reportedError{false};
+    // Set for textures whose tiles are all in memory; _dataMapped_ records
+    // whether _data_ is a memory-mapped file
+    const uint8_t *data = nullptr;
+    bool dataMapped = false;
+};
+
+// TextureTileCache Declarations
+
+// Keeps the recently used tiles of _TiledTexture_s in memory, up to a
+// budget. Tiles are held in a shared LRU cache that is split into
+// independently locked shards; in front of it, each thread has a small
+// micro-cache of the tiles that it used last, so that most lookups take
+// no locks at all.
+class TextureTileCache {
+  public:
+    // TextureTileCache Public Methods
+    TextureTileCache(size_t maxBytes);
+    ~TextureTileCache();
+    // Opens a tiled MIP file written by _WriteTiledTexture()_, returning
+    // _nullptr_ if it is missing, can't be read, or, if _nChannels_ is
+    // nonzero, doesn't match _nChannels_ and _stamp_.
+    std::shared_ptr<const TiledTexture> AddTexture(
+        const std::string &filename, int nChannels = 0, uint64_t stamp = 0);
+    // Returns the encoded texel $(s,t)$ of _tex_. The pointer stays valid
+    // until the calling thread's next lookup.
+    const uint8_t *Texel(const TiledTexture *tex, int level, int s, int t);
+
+  private:
+    // TextureTileCache Private Declarations
+    struct Tile;
+    struct Shard;
+    struct MicroCache;
+
+    // TextureTileCache Private Methods
+    std::shared_ptr<const Tile> getTile(const TiledTexture *tex,
+                                        uint64_t key, int level, int tx,
+                                        int ty);
+
+    // TextureTileCache Private Data
+    static PBRT_CONSTEXPR int nShards = 64;
+    const size_t maxShardBytes;
+    std::unique_ptr<Shard[]> shards;
+    int nMicroCaches;
+    std::unique_ptr<MicroCache[]> microCaches;
+    std::mutex texturesMutex;
+    std::vector<std::shared_ptr<TiledTexture>> textures;
+};
+
+inline void TiledTexture::Texel(int level, int s, int t, float *v) const {
+    const uint8_t *texel;
+    if (data) {
+        int mask = (1 << logTileSize) - 1;
+        int offset = ((t & mask) << logTileSize) + (s & mask);
+        texel = data + tileOffset(level, s >> logTileSize,
+                                    t >> logTileSize) +
+                offset * texelBytes();
+    } else
+        texel = cache->Texel(this, level, s, t);
+    DecodeTexel(texel, nChannels, encoding, v);
+}
+
+// Tiled Texture Function Declarations
+
+// Returns the tile cache that image textures are read through, creating it
+// with a budget of _PbrtOptions.textureCacheBytes_ the first time it's
+// needed, or _nullptr_ if the texture cache isn't enabled.
+TextureTileCache *GetTextureTileCache();
+void FreeTextureTileCache();
+
+// Maps a whole tiled MIP file into memory, returning _nullptr_ if it can't
+// be read.
+std::shared_ptr<const TiledTexture> MapTiledTexture(
+    const std::string &filename);
+
+// Writes a tiled MIP file with the given level resolutions and texel
+// encoding, calling _getTexel_ to get the _nChannels_ values of each texel
+// of each level.
+bool WriteTiledTexture(const std::string &filename, int nChannels,
+                       TexelEncoding encoding,
+                       const std::vector<Point2i> &levelResolution,
+                       uint64_t stamp, const TexelFunction &getTexel);
+
+// Encodes a MIP pyramid in memory in the same way, with small tiles that
+// keep neighboring texels close together.
+std::shared_ptr<const TiledTexture> EncodeTiledTexture(
+    int nChannels, TexelEncoding encoding,
+    const std::vector<Point2i> &levelResolution,
+    const TexelFunction &getTexel);
+
+// Returns the file in the texture cache directory for the tiled MIP
+// pyramid described by _description_.
+std::string TiledTextureCacheFilename(const std::string &description);
+
+// Returns a value that changes whenever _filename_ is modified, based on
+// its size and modification time.
+uint64_t TextureSourceStamp(const std::string &filename);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_TEXCACHE_H
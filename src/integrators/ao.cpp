@@ -37,6 +37,7 @@
 #include "paramset.h"
 #include "camera.h"
 #include "film.h"
+#include "raybatch.h"
 #include "scene.h"
 
 namespace pbrt {
@@ -58,17 +59,27 @@ Spectrum AOIntegrator::Li(const RayDifferential &r, const Scene &scene,
                           Sampler &sampler, MemoryArena &arena,
                           int depth) const {
     ProfilePhase p(Prof::SamplerIntegratorLi);
+    // Intersect _r_ with scene and store intersection in _isect_
+    SurfaceInteraction isect;
+    bool foundIntersection = scene.Intersect(r, &isect);
+    return LiFromHit(r, foundIntersection, isect, scene, sampler, arena);
+}
+
+Spectrum AOIntegrator::LiFromHit(const RayDifferential &r,
+                                 bool foundIntersection,
+                                 SurfaceInteraction &isect, const Scene &scene,
+                                 Sampler &sampler, MemoryArena &arena) const {
+    ProfilePhase p(Prof::SamplerIntegratorLi);
     Spectrum L(0.f);
     RayDifferential ray(r);
 
-    // Intersect _ray_ with scene and store intersection in _isect_
-    SurfaceInteraction isect;
  retry:
-    if (scene.Intersect(ray, &isect)) {
+    if (foundIntersection) {
         isect.ComputeScatteringFunctions(ray, arena, true);
         if (!isect.bsdf) {
             VLOG(2) << "Skipping intersection due to null bsdf";
             ray = isect.SpawnRay(ray.d);
+            foundIntersection = scene.Intersect(ray, &isect);
             goto retry;
         }
 
@@ -78,7 +89,10 @@ Spectrum AOIntegrator::Li(const RayDifferential &r, const Scene &scene,
         Vector3f s = Normalize(isect.dpdu);
         Vector3f t = Cross(isect.n, s);
 
+        // Trace the occlusion rays together, _MaxRayBatchSize_ at a time
         const Point2f *u = sampler.Get2DArray(nSamples);
+        RayBatch &rays = *arena.Alloc<RayBatch>();
+        Float *weights = arena.Alloc<Float>(MaxRayBatchSize);
         for (int i = 0; i < nSamples; ++i) {
             Vector3f wi;
             Float pdf;
@@ -95,8 +109,14 @@ Spectrum AOIntegrator::Li(const RayDifferential &r, const Scene &scene,
                           s.y * wi.x + t.y * wi.y + n.y * wi.z,
                           s.z * wi.x + t.z * wi.y + n.z * wi.z);
 
-            if (!scene.IntersectP(isect.SpawnRay(wi)))
-                L += Dot(wi, n) / (pdf * nSamples);
+            int j = rays.Add(isect.SpawnRay(wi));
+            weights[j] = Dot(wi, n) / (pdf * nSamples);
+            if (rays.Full() || i == nSamples - 1) {
+                scene.IntersectPBatch(rays);
+                for (int k = 0; k < rays.Size(); ++k)
+                    if (!rays.hit.IsSet(k)) L += weights[k];
+                rays.Clear();
+            }
         }
     }
     return L;
@@ -54,6 +54,10 @@ class AOIntegrator : public SamplerIntegrator {
                  const Bounds2i &pixelBounds);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
+    bool BatchCameraRays() const { return true; }
+    Spectrum LiFromHit(const RayDifferential &ray, bool foundIntersection,
+                       SurfaceInteraction &isect, const Scene &scene,
+                       Sampler &sampler, MemoryArena &arena) const;
  private:
     bool cosSample;
     int nSamples;
@@ -37,7 +37,6 @@
 #include "integrator.h"
 #include "lightdistrib.h"
 #include "paramset.h"
-#include "progressreporter.h"
 #include "sampler.h"
 #include "stats.h"
 
@@ -313,12 +312,7 @@ void BDPTIntegrator::Render(const Scene &scene) {
 
     // Partition the image into tiles
     Film *film = camera->film;
-    const Bounds2i sampleBounds = film->GetSampleBounds();
-    const Vector2i sampleExtent = sampleBounds.Diagonal();
-    const int tileSize = 16;
-    const int nXTiles = (sampleExtent.x + tileSize - 1) / tileSize;
-    const int nYTiles = (sampleExtent.y + tileSize - 1) / tileSize;
-    ProgressReporter reporter(nXTiles * nYTiles, "Rendering");
+    TileScheduler scheduler(film, film->GetSampleBounds());
 
     // Allocate buffers for debug visualization
     const int bufferCount = (1 + maxDepth) * (6 + maxDepth) / 2;
@@ -341,26 +335,35 @@ void BDPTIntegrator::Render(const Scene &scene) {
         }
     }
 
-    // Render and write the output image to disk
-    if (scene.lights.size() > 0) {
-        ParallelFor2D([&](const Point2i tile) {
+    // Render and write the output image to disk. Passes always finish, even
+    // past the time limit, since splats are scaled by the number of samples
+    // taken in every pixel.
+    if (film->adaptiveThreshold > 0)
+        Warning("The \"bdpt\" integrator doesn't support adaptive "
+                "sampling. Taking %d samples in every pixel.",
+                (int)sampler->samplesPerPixel);
+    RenderPasses passes(film, sampler->samplesPerPixel, false);
+    MemoryArenaPool arenas;
+    while (scene.lights.size() > 0 && passes.Next()) {
+        scheduler.ForEachTile([&](ImageTile &tile) {
             // Render a single tile using BDPT
-            MemoryArena arena;
-            int seed = tile.y * nXTiles + tile.x;
-            std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+            MemoryArena &arena = arenas.ThreadArena();
+            std::unique_ptr<Sampler> tileSampler = sampler->Clone(tile.seed);
+            Bounds2i tileBounds = tile.bounds;
             LOG(INFO) << "Starting image tile " << tileBounds;
 
             std::unique_ptr<FilmTile> filmTile =
                 camera->film->GetFilmTile(tileBounds);
             for (Point2i pPixel : tileBounds) {
+                if (!tile.Owns(pPixel)) break;
+                if (pPixel.x == tileBounds.pMin.x)
+                    tileSampler->Reseed(tile.RowSeed(pPixel.y));
                 tileSampler->StartPixel(pPixel);
                 if (!InsideExclusive(pPixel, pixelBounds))
                     continue;
+                int64_t firstSample = passes.FirstSample(pPixel);
+                if (firstSample >= passes.end) continue;
+                if (firstSample > 0) tileSampler->SetSampleNumber(firstSample);
                 do {
                     // Generate a single sample using BDPT
                     Point2f pFilm = (Point2f)pPixel + tileSampler->Get2D();
@@ -423,19 +426,26 @@ void BDPTIntegrator::Render(const Scene &scene) {
                         ", (y: " << L.y() << ")";
                     filmTile->AddSample(pFilm, L);
                     arena.Reset();
-                } while (tileSampler->StartNextSample());
+                } while (tileSampler->StartNextSample() &&
+                         tileSampler->CurrentSampleNumber() < passes.end);
+                passes.FinishPixel(pPixel);
             }
             film->MergeFilmTile(std::move(filmTile));
-            reporter.Update();
-            LOG(INFO) << "Finished image tile " << tileBounds;
-        }, Point2i(nXTiles, nYTiles));
-        reporter.Done();
+            LOG(INFO) << "Finished image tile " << tile.bounds;
+        }, passes.ProgressTitle());
+        if (passes.CheckpointDue()) {
+            film->WriteImage(1.0f / passes.ImageSamples());
+            passes.WriteCheckpoint();
+        }
     }
-    film->WriteImage(1.0f / sampler->samplesPerPixel);
+    if (!scheduler.MergeSpool()) return;
+    film->WriteImage(1.0f / std::max<int64_t>(1, passes.ImageSamples()));
+    passes.Finish();
 
     // Write buffers for debug visualization
     if (visualizeStrategies || visualizeWeights) {
-        const Float invSampleCount = 1.0f / sampler->samplesPerPixel;
+        const Float invSampleCount =
+            1.0f / std::max<int64_t>(1, passes.ImageSamples());
         for (size_t i = 0; i < weightFilms.size(); ++i)
             if (weightFilms[i]) weightFilms[i]->WriteImage(invSampleCount);
     }
@@ -163,6 +163,9 @@ Spectrum MLTIntegrator::L(const Scene &scene, MemoryArena &arena,
 }
 
 void MLTIntegrator::Render(const Scene &scene) {
+    if (!PbrtOptions.spoolDirectory.empty())
+        Warning("The \"mlt\" integrator doesn't support --spool. "
+                "Rendering the whole image.");
     std::unique_ptr<Distribution1D> lightDistr =
         ComputeLightPowerDistribution(scene);
 
@@ -175,16 +178,16 @@ void MLTIntegrator::Render(const Scene &scene) {
         lightToIndex[scene.lights[i].get()] = i;
 
     // Generate bootstrap samples and compute normalization constant $b$
+    MemoryArenaPool threadArenas;
     int nBootstrapSamples = nBootstrap * (maxDepth + 1);
     std::vector<Float> bootstrapWeights(nBootstrapSamples, 0);
     if (scene.lights.size() > 0) {
         ProgressReporter progress(nBootstrap / 256,
                                   "Generating bootstrap paths");
-        std::vector<MemoryArena> bootstrapThreadArenas(MaxThreadIndex());
         int chunkSize = Clamp(nBootstrap / 128, 1, 8192);
         ParallelFor([&](int i) {
             // Generate _i_th bootstrap sample
-            MemoryArena &arena = bootstrapThreadArenas[ThreadIndex];
+            MemoryArena &arena = threadArenas.ThreadArena();
             for (int depth = 0; depth <= maxDepth; ++depth) {
                 int rngIndex = i * (maxDepth + 1) + depth;
                 MLTSampler sampler(mutationsPerPixel, rngIndex, sigma,
@@ -201,20 +204,31 @@ void MLTIntegrator::Render(const Scene &scene) {
     Distribution1D bootstrap(&bootstrapWeights[0], nBootstrapSamples);
     Float b = bootstrap.funcInt * (maxDepth + 1);
 
-    // Run _nChains_ Markov chains in parallel
+    // Run _nChains_ Markov chains in parallel; with --samplesplit, only
+    // this part's range of them
     Film &film = *camera->film;
     int64_t nTotalMutations =
         (int64_t)mutationsPerPixel * (int64_t)film.GetSampleBounds().Area();
+    int64_t firstChain = 0, endChain = nChains;
+    if (PbrtOptions.nSampleSplits > 0) {
+        firstChain = nChains * PbrtOptions.sampleSplit /
+                     PbrtOptions.nSampleSplits;
+        endChain = nChains * (PbrtOptions.sampleSplit + 1) /
+                   PbrtOptions.nSampleSplits;
+    }
     if (scene.lights.size() > 0) {
         const int progressFrequency = 32768;
-        ProgressReporter progress(nTotalMutations / progressFrequency,
-                                  "Rendering");
-        ParallelFor([&](int i) {
+        ProgressReporter progress(
+            (endChain * nTotalMutations / nChains -
+             firstChain * nTotalMutations / nChains) / progressFrequency,
+            "Rendering");
+        ParallelFor([&](int64_t chain) {
+            int i = firstChain + chain;
             int64_t nChainMutations =
                 std::min((i + 1) * nTotalMutations / nChains, nTotalMutations) -
                 i * nTotalMutations / nChains;
             // Follow {i}th Markov chain for _nChainMutations_
-            MemoryArena arena;
+            MemoryArena &arena = threadArenas.ThreadArena();
 
             // Select initial state from the set of bootstrap samples
             RNG rng(i);
@@ -257,7 +271,7 @@ void MLTIntegrator::Render(const Scene &scene) {
                     progress.Update();
                 arena.Reset();
             }
-        }, nChains);
+        }, endChain - firstChain);
         progress.Done();
     }
 
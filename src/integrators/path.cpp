@@ -65,6 +65,17 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                             Sampler &sampler, MemoryArena &arena,
                             int depth) const {
     ProfilePhase p(Prof::SamplerIntegratorLi);
+    SurfaceInteraction isect;
+    bool foundIntersection = scene.Intersect(r, &isect);
+    return LiFromHit(r, foundIntersection, isect, scene, sampler, arena);
+}
+
+Spectrum PathIntegrator::LiFromHit(const RayDifferential &r,
+                                   bool firstFoundIntersection,
+                                   SurfaceInteraction &firstIsect,
+                                   const Scene &scene, Sampler &sampler,
+                                   MemoryArena &arena) const {
+    ProfilePhase p(Prof::SamplerIntegratorLi);
     Spectrum L(0.f), beta(1.f);
     RayDifferential ray(r);
     bool specularBounce = false;
@@ -77,15 +88,20 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
     // avoid terminating refracted rays that are about to be refracted back
     // out of a medium and thus have their beta value increased.
     Float etaScale = 1;
+    bool firstRay = true;
 
     for (bounces = 0;; ++bounces) {
         // Find next path vertex and accumulate contribution
         VLOG(2) << "Path tracer bounce " << bounces << ", current L = " << L
                 << ", beta = " << beta;
 
-        // Intersect _ray_ with scene and store intersection in _isect_
-        SurfaceInteraction isect;
-        bool foundIntersection = scene.Intersect(ray, &isect);
+        // Intersect _ray_ with scene and store intersection in _isect_;
+        // the first ray's intersection has already been found
+        SurfaceInteraction newIsect;
+        SurfaceInteraction &isect = firstRay ? firstIsect : newIsect;
+        bool foundIntersection = firstRay ? firstFoundIntersection
+                                          : scene.Intersect(ray, &isect);
+        firstRay = false;
 
         // Possibly add emitted light at intersection
         if (bounces == 0 || specularBounce) {
@@ -57,6 +57,10 @@ class PathIntegrator : public SamplerIntegrator {
     void Preprocess(const Scene &scene, Sampler &sampler);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
+    bool BatchCameraRays() const { return true; }
+    Spectrum LiFromHit(const RayDifferential &ray, bool foundIntersection,
+                       SurfaceInteraction &isect, const Scene &scene,
+                       Sampler &sampler, MemoryArena &arena) const;
 
   private:
     // PathIntegrator Private Data
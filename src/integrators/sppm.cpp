@@ -110,6 +110,9 @@ inline unsigned int hash(const Point3i &p, int hashSize) {
 // SPPM Method Definitions
 void SPPMIntegrator::Render(const Scene &scene) {
     ProfilePhase p(Prof::IntegratorRender);
+    if (!PbrtOptions.spoolDirectory.empty() || PbrtOptions.nSampleSplits > 0)
+        Warning("The \"sppm\" integrator doesn't support --spool or "
+                "--samplesplit. Rendering the whole image.");
     // Initialize _pixelBounds_ and _pixels_ array for SPPM
     Bounds2i pixelBounds = camera->film->croppedPixelBounds;
     int nPixels = pixelBounds.Area();
@@ -130,13 +133,13 @@ void SPPMIntegrator::Render(const Scene &scene) {
     Point2i nTiles((pixelExtent.x + tileSize - 1) / tileSize,
                    (pixelExtent.y + tileSize - 1) / tileSize);
     ProgressReporter progress(2 * nIterations, "Rendering");
+    MemoryArenaPool perThreadArenas, photonShootArenas;
     for (int iter = 0; iter < nIterations; ++iter) {
         // Generate SPPM visible points
-        std::vector<MemoryArena> perThreadArenas(MaxThreadIndex());
         {
             ProfilePhase _(Prof::SPPMCameraPass);
             ParallelFor2D([&](Point2i tile) {
-                MemoryArena &arena = perThreadArenas[ThreadIndex];
+                MemoryArena &arena = perThreadArenas.ThreadArena();
                 // Follow camera paths for _tile_ in image for SPPM
                 int tileIndex = tile.y * nTiles.x + tile.x;
                 std::unique_ptr<Sampler> tileSampler = sampler.Clone(tileIndex);
@@ -267,7 +270,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
 
             // Add visible points to SPPM grid
             ParallelFor([&](int pixelIndex) {
-                MemoryArena &arena = perThreadArenas[ThreadIndex];
+                MemoryArena &arena = perThreadArenas.ThreadArena();
                 SPPMPixel &pixel = pixels[pixelIndex];
                 if (!pixel.vp.beta.IsBlack()) {
                     // Add pixel's visible point to applicable grid cells
@@ -303,9 +306,8 @@ void SPPMIntegrator::Render(const Scene &scene) {
         // Trace photons and accumulate contributions
         {
             ProfilePhase _(Prof::SPPMPhotonPass);
-            std::vector<MemoryArena> photonShootArenas(MaxThreadIndex());
             ParallelFor([&](int photonIndex) {
-                MemoryArena &arena = photonShootArenas[ThreadIndex];
+                MemoryArena &arena = photonShootArenas.ThreadArena();
                 // Follow photon path for _photonIndex_
                 uint64_t haltonIndex =
                     (uint64_t)iter * (uint64_t)photonsPerIteration +
@@ -441,6 +443,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
                 p.vp.bsdf = nullptr;
             }, nPixels, 4096);
         }
+        perThreadArenas.Reset();
 
         // Periodically store SPPM image in film and write image
         if (iter + 1 == nIterations || ((iter + 1) % writeFrequency) == 0) {
@@ -46,13 +46,46 @@ static void usage(const char *msg = nullptr) {
 
     fprintf(stderr, R"(usage: pbrt [<options>] <filename.pbrt...>
 Rendering options:
+  --checkpointpasses <num> Write the image and a checkpoint after every <num>
+                       progressive rendering passes. Implies --progressive.
+  --checkpointtime <sec> Write the image and a checkpoint after each
+                       progressive rendering pass that ends at least <sec>
+                       seconds after the last write. Implies --progressive.
   --cropwindow <x0,x1,y0,y1> Specify an image crop window.
   --help               Print this help text.
   --nthreads <num>     Use specified number of threads for rendering.
   --outfile <filename> Write the final image to the given filename.
+  --pinthreads         Pin rendering threads to CPUs and spread them and
+                       the scene's largest arrays over the NUMA nodes.
+  --progressive        Render in passes that double the number of samples
+                       taken in each pixel, so that a preview of the whole
+                       image is available early.
   --quick              Automatically reduce a number of quality settings to
                        render more quickly.
   --quiet              Suppress all text output other than error messages.
+  --resume             Continue rendering from the checkpoint that was
+                       written next to the output image, <image>.checkpoint.
+                       Implies --progressive.
+  --samplesplit <k> <n> Take the kth of n equal ranges of the samples in
+                       each pixel and write the film's unnormalized sums to
+                       <image>.<k>.film instead of the image; "imgtool
+                       merge" combines the n parts. Can't be used with
+                       --progressive or --spool.
+  --spool <dir>        Render the image together with other pbrt processes
+                       that are given the same <dir>, which they share the
+                       image's tiles through. The last process to finish
+                       writes the image. Running pbrt again with the same
+                       <dir> finishes the work that crashed processes on
+                       the same host left. Can't be used with --progressive.
+  --texturecache <MB>  Read image textures' MIP maps in tiles on demand,
+                       keeping at most about <MB> megabytes of tiles in
+                       memory. Textures are converted to tiled files the
+                       first time they're used.
+  --texturecachedir <dir> Write the tiled texture files to <dir>.
+                       Default: system temp directory.
+  --timelimit <sec>    Stop starting new image tiles after <sec> seconds
+                       and write the image and a checkpoint. Implies
+                       --progressive.
 
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
@@ -113,6 +146,55 @@ int main(int argc, char *argv[]) {
             FLAGS_minloglevel = atoi(argv[++i]);
         } else if (!strncmp(argv[i], "--minloglevel=", 14)) {
             FLAGS_minloglevel = atoi(&argv[i][14]);
+        } else if (!strcmp(argv[i], "--pinthreads") ||
+                   !strcmp(argv[i], "-pinthreads")) {
+            options.pinThreads = true;
+        } else if (!strcmp(argv[i], "--progressive") ||
+                   !strcmp(argv[i], "-progressive")) {
+            options.progressive = true;
+        } else if (!strcmp(argv[i], "--resume") ||
+                   !strcmp(argv[i], "-resume")) {
+            options.resume = true;
+        } else if (!strcmp(argv[i], "--checkpointpasses") ||
+                   !strcmp(argv[i], "-checkpointpasses")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpointpasses argument");
+            options.checkpointPasses = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--checkpointtime") ||
+                   !strcmp(argv[i], "-checkpointtime")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpointtime argument");
+            options.checkpointSeconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--timelimit") ||
+                   !strcmp(argv[i], "-timelimit")) {
+            if (i + 1 == argc)
+                usage("missing value after --timelimit argument");
+            options.timeLimit = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--samplesplit") ||
+                   !strcmp(argv[i], "-samplesplit")) {
+            if (i + 2 >= argc)
+                usage("missing value after --samplesplit argument");
+            options.sampleSplit = atoi(argv[++i]);
+            options.nSampleSplits = atoi(argv[++i]);
+            if (options.nSampleSplits < 1 || options.sampleSplit < 0 ||
+                options.sampleSplit >= options.nSampleSplits)
+                usage("--samplesplit <k> <n> requires 0 <= k < n");
+        } else if (!strcmp(argv[i], "--spool") || !strcmp(argv[i], "-spool")) {
+            if (i + 1 == argc)
+                usage("missing value after --spool argument");
+            options.spoolDirectory = argv[++i];
+        } else if (!strcmp(argv[i], "--texturecache") ||
+                   !strcmp(argv[i], "-texturecache")) {
+            if (i + 1 == argc)
+                usage("missing value after --texturecache argument");
+            double mb = atof(argv[++i]);
+            if (mb <= 0) usage("--texturecache requires a positive size");
+            options.textureCacheBytes = mb * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--texturecachedir") ||
+                   !strcmp(argv[i], "-texturecachedir")) {
+            if (i + 1 == argc)
+                usage("missing value after --texturecachedir argument");
+            options.textureCacheDirectory = argv[++i];
         } else if (!strcmp(argv[i], "--quick") || !strcmp(argv[i], "-quick")) {
             options.quickRender = true;
         } else if (!strcmp(argv[i], "--quiet") || !strcmp(argv[i], "-quiet")) {
@@ -137,6 +219,15 @@ int main(int argc, char *argv[]) {
         } else
             filenames.push_back(argv[i]);
     }
+    bool progressive = options.progressive || options.resume ||
+                       options.checkpointPasses > 0 ||
+                       options.checkpointSeconds > 0 || options.timeLimit > 0;
+    if (!options.spoolDirectory.empty() && progressive)
+        usage("--spool can't be combined with progressive rendering");
+    if (options.nSampleSplits > 0 &&
+        (progressive || !options.spoolDirectory.empty()))
+        usage("--samplesplit can't be combined with progressive rendering "
+              "or --spool");
 
     // Print welcome banner
     if (!options.quiet && !options.cat && !options.toPly) {
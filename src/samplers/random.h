@@ -51,6 +51,7 @@ class RandomSampler : public Sampler {
     Float Get1D();
     Point2f Get2D();
     std::unique_ptr<Sampler> Clone(int seed);
+    void Reseed(int seed) { rng.SetSequence(seed); }
 
   private:
     RNG rng;
@@ -32,16 +32,29 @@
 
 
 // shapes/plymesh.cpp*
-#include "shapes/triangle.h"
+#include "shapes/plymesh.h"
 #include "textures/constant.h"
 #include "paramset.h"
+#include "stats.h"
 #include "ext/rply.h"
 
+#include <errno.h>
 #include <iostream>
+#include <sstream>
+#include <string.h>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 using namespace std;
 
+STAT_PERCENT("Scene/PLY files read through memory mapping", nMappedPLYFiles,
+             nPLYFiles);
+
 struct CallbackContext {
     Point3f *p;
     Normal3f *n;
@@ -154,20 +167,451 @@ int rply_face_callback(p_ply_argument argument) {
     return 1;
 }
 
+// Binary PLY Declarations
+enum class PLYType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32,
+                     Float64 };
+
+struct PLYProperty {
+    std::string name;
+    PLYType type;
+    // List properties store a count of type _countType_ followed by that
+    // many values of type _type_
+    bool isList = false;
+    PLYType countType;
+    // Byte offset of a scalar property from the start of the element's
+    // record, or from the end of the record's list if it follows one
+    size_t offset = 0;
+};
+
+struct PLYElement {
+    std::string name;
+    long count;
+    std::vector<PLYProperty> properties;
+    const PLYProperty *Find(const char *name) const {
+        for (const PLYProperty &prop : properties)
+            if (prop.name == name) return &prop;
+        return nullptr;
+    }
+};
+
+// Mesh data converted from a binary PLY file by _ConvertBinaryPLY()_
+struct PLYMesh {
+    int nVertices = 0;
+    std::vector<int> indices, faceIndices;
+    std::unique_ptr<Point3f[]> p;
+    std::unique_ptr<Normal3f[]> n;
+    std::unique_ptr<Point2f[]> uv;
+};
+
+// Binary PLY Utility Functions
+static bool ParsePLYType(const std::string &name, PLYType *type) {
+    static const struct {
+        const char *name;
+        PLYType type;
+    } types[] = {{"char", PLYType::Int8},      {"int8", PLYType::Int8},
+                 {"uchar", PLYType::UInt8},    {"uint8", PLYType::UInt8},
+                 {"short", PLYType::Int16},    {"int16", PLYType::Int16},
+                 {"ushort", PLYType::UInt16},  {"uint16", PLYType::UInt16},
+                 {"int", PLYType::Int32},      {"int32", PLYType::Int32},
+                 {"uint", PLYType::UInt32},    {"uint32", PLYType::UInt32},
+                 {"float", PLYType::Float32},  {"float32", PLYType::Float32},
+                 {"double", PLYType::Float64}, {"float64", PLYType::Float64}};
+    for (const auto &t : types)
+        if (name == t.name) {
+            *type = t.type;
+            return true;
+        }
+    return false;
+}
+
+static size_t PLYTypeBytes(PLYType type) {
+    switch (type) {
+    case PLYType::Int8:
+    case PLYType::UInt8:
+        return 1;
+    case PLYType::Int16:
+    case PLYType::UInt16:
+        return 2;
+    case PLYType::Int32:
+    case PLYType::UInt32:
+    case PLYType::Float32:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+template <typename T>
+static inline T LoadPLYValue(const uint8_t *ptr) {
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    return value;
+}
+
+static inline int64_t LoadPLYInt(const uint8_t *ptr, PLYType type) {
+    switch (type) {
+    case PLYType::Int8:
+        return LoadPLYValue<int8_t>(ptr);
+    case PLYType::UInt8:
+        return LoadPLYValue<uint8_t>(ptr);
+    case PLYType::Int16:
+        return LoadPLYValue<int16_t>(ptr);
+    case PLYType::UInt16:
+        return LoadPLYValue<uint16_t>(ptr);
+    case PLYType::Int32:
+        return LoadPLYValue<int32_t>(ptr);
+    case PLYType::UInt32:
+        return LoadPLYValue<uint32_t>(ptr);
+    case PLYType::Float32:
+        return (int64_t)LoadPLYValue<float>(ptr);
+    default:
+        return (int64_t)LoadPLYValue<double>(ptr);
+    }
+}
+
+template <typename T>
+static void ConvertPLYValues(const uint8_t *src, size_t srcStride, int n,
+                             Float *dst, int dstStride) {
+    for (int i = 0; i < n; ++i)
+        dst[i * dstStride] = (Float)LoadPLYValue<T>(src + i * srcStride);
+}
+
+// Converts the _n_ values of _prop_ in the _stride_-byte records at _data_
+// to every _dstStride_th element of _dst_.
+static void ConvertPLYProperty(const uint8_t *data, size_t stride, int n,
+                               const PLYProperty &prop, Float *dst,
+                               int dstStride) {
+    const uint8_t *src = data + prop.offset;
+    switch (prop.type) {
+    case PLYType::Int8:
+        ConvertPLYValues<int8_t>(src, stride, n, dst, dstStride);
+        break;
+    case PLYType::UInt8:
+        ConvertPLYValues<uint8_t>(src, stride, n, dst, dstStride);
+        break;
+    case PLYType::Int16:
+        ConvertPLYValues<int16_t>(src, stride, n, dst, dstStride);
+        break;
+    case PLYType::UInt16:
+        ConvertPLYValues<uint16_t>(src, stride, n, dst, dstStride);
+        break;
+    case PLYType::Int32:
+        ConvertPLYValues<int32_t>(src, stride, n, dst, dstStride);
+        break;
+    case PLYType::UInt32:
+        ConvertPLYValues<uint32_t>(src, stride, n, dst, dstStride);
+        break;
+    case PLYType::Float32:
+        ConvertPLYValues<float>(src, stride, n, dst, dstStride);
+        break;
+    case PLYType::Float64:
+        ConvertPLYValues<double>(src, stride, n, dst, dstStride);
+        break;
+    }
+}
+
+// Converts the vertex properties _props_ to _nComponents_-element points
+// or normals; when the records hold just those properties as floats, the
+// whole array is copied at once.
+static void ConvertPLYVertices(const uint8_t *data, const PLYElement &vertex,
+                               size_t stride, const PLYProperty *props[],
+                               int nComponents, Float *dst) {
+    bool packed = sizeof(Float) == sizeof(float) &&
+                  stride == nComponents * sizeof(float);
+    for (int c = 0; c < nComponents; ++c)
+        packed &= props[c]->type == PLYType::Float32 &&
+                  props[c]->offset == c * sizeof(float);
+    if (packed)
+        memcpy(dst, data, vertex.count * stride);
+    else
+        for (int c = 0; c < nComponents; ++c)
+            ConvertPLYProperty(data, stride, vertex.count, *props[c], dst + c,
+                               nComponents);
+}
+
+// Parses the header of a PLY file, returning the offset of the first
+// element's data, or zero if it isn't a binary little-endian file.
+static size_t ParsePLYHeader(const char *data, size_t length,
+                             std::vector<PLYElement> *elements) {
+    const char *endHeader = "\nend_header\n";
+    const char *end = std::search(data, data + length, endHeader,
+                                  endHeader + strlen(endHeader));
+    if (end == data + length) return 0;
+    std::istringstream header(std::string(data, end));
+    std::string line, keyword;
+    if (!std::getline(header, line) || line != "ply" ||
+        !std::getline(header, line) ||
+        line != "format binary_little_endian 1.0")
+        return 0;
+    while (std::getline(header, line)) {
+        std::istringstream tokens(line);
+        tokens >> keyword;
+        if (keyword == "element") {
+            PLYElement element;
+            if (!(tokens >> element.name >> element.count)) return 0;
+            elements->push_back(element);
+        } else if (keyword == "property") {
+            if (elements->empty()) return 0;
+            PLYProperty prop;
+            std::string type;
+            if (!(tokens >> type)) return 0;
+            if (type == "list") {
+                std::string countType;
+                prop.isList = true;
+                if (!(tokens >> countType >> type) ||
+                    !ParsePLYType(countType, &prop.countType))
+                    return 0;
+            }
+            if (!ParsePLYType(type, &prop.type) || !(tokens >> prop.name))
+                return 0;
+            elements->back().properties.push_back(prop);
+        } else if (keyword != "comment" && keyword != "obj_info")
+            return 0;
+    }
+    return end - data + strlen(endHeader);
+}
+
+// Converts the vertex and face arrays of the PLY file in the _length_
+// bytes at _data_ in bulk. This handles the common layout of binary
+// little-endian files that start with "vertex" and "face" elements, where
+// faces are given by a single "vertex_indices" list; false is returned
+// for other files, which should be read with rply instead. _*error_ is
+// set if the file has that layout but couldn't be read.
+static bool ConvertBinaryPLY(const std::string &filename, const uint8_t *data,
+                             size_t length, PLYMesh *mesh, bool *error) {
+    // PLY files store binary values in their declared byte order
+    const uint16_t one = 1;
+    if (*(const uint8_t *)&one != 1) return false;
+    const uint8_t *dataEnd = data + length;
+
+    // Check that the file has the supported layout
+    std::vector<PLYElement> elements;
+    size_t headerBytes = ParsePLYHeader((const char *)data, length, &elements);
+    if (headerBytes == 0 || elements.size() < 2 ||
+        elements[0].name != "vertex" || elements[1].name != "face")
+        return false;
+    const PLYElement &vertex = elements[0], &face = elements[1];
+    if (vertex.count <= 0 || vertex.count > std::numeric_limits<int>::max() ||
+        face.count <= 0 || face.count > std::numeric_limits<int>::max() / 6)
+        return false;
+    size_t vertexStride = 0;
+    for (PLYProperty &prop : elements[0].properties) {
+        if (prop.isList) return false;
+        prop.offset = vertexStride;
+        vertexStride += PLYTypeBytes(prop.type);
+    }
+    const PLYProperty *vertexIndices = nullptr;
+    size_t faceBytesBefore = 0, faceBytesAfter = 0;
+    for (PLYProperty &prop : elements[1].properties) {
+        if (prop.isList) {
+            if (vertexIndices || prop.name != "vertex_indices" ||
+                prop.countType == PLYType::Float32 ||
+                prop.countType == PLYType::Float64)
+                return false;
+            vertexIndices = &prop;
+        } else if (vertexIndices) {
+            prop.offset = faceBytesAfter;
+            faceBytesAfter += PLYTypeBytes(prop.type);
+        } else {
+            prop.offset = faceBytesBefore;
+            faceBytesBefore += PLYTypeBytes(prop.type);
+        }
+    }
+    if (!vertexIndices) return false;
+    const PLYProperty *faceIndices = face.Find("face_indices");
+    bool faceIndicesAfter = faceIndices && faceIndices > vertexIndices;
+
+    // Convert vertex positions, normals, and $(u,v)$s
+    const uint8_t *vertexData = data + headerBytes;
+    if (vertexStride * vertex.count > length - headerBytes) {
+        Error("%s: unable to read the contents of PLY file", filename.c_str());
+        *error = true;
+        return true;
+    }
+    const PLYProperty *p[3] = {vertex.Find("x"), vertex.Find("y"),
+                               vertex.Find("z")};
+    if (!p[0] || !p[1] || !p[2]) {
+        Error("%s: Vertex coordinate property not found!", filename.c_str());
+        *error = true;
+        return true;
+    }
+    mesh->nVertices = vertex.count;
+    mesh->p.reset(new Point3f[vertex.count]);
+    ConvertPLYVertices(vertexData, vertex, vertexStride, p, 3,
+                       &mesh->p[0].x);
+    const PLYProperty *n[3] = {vertex.Find("nx"), vertex.Find("ny"),
+                               vertex.Find("nz")};
+    if (n[0] && n[1] && n[2]) {
+        mesh->n.reset(new Normal3f[vertex.count]);
+        ConvertPLYVertices(vertexData, vertex, vertexStride, n, 3,
+                           &mesh->n[0].x);
+    }
+    // Look for $(u,v)$s with the same names as when reading with rply
+    const char *uvNames[][2] = {
+        {"u", "v"}, {"s", "t"}, {"texture_u", "texture_v"},
+        {"texture_s", "texture_t"}};
+    for (const auto &names : uvNames) {
+        const PLYProperty *uv[2] = {vertex.Find(names[0]),
+                                    vertex.Find(names[1])};
+        if (uv[0] && uv[1]) {
+            mesh->uv.reset(new Point2f[vertex.count]);
+            ConvertPLYVertices(vertexData, vertex, vertexStride, uv, 2,
+                               &mesh->uv[0].x);
+            break;
+        }
+    }
+
+    // Convert faces to vertex indices, splitting quads into two triangles
+    const uint8_t *faceData = vertexData + vertexStride * vertex.count;
+    size_t countBytes = PLYTypeBytes(vertexIndices->countType);
+    size_t indexBytes = PLYTypeBytes(vertexIndices->type);
+    PLYType countType = vertexIndices->countType;
+    PLYType indexType = vertexIndices->type;
+    mesh->indices.reserve(3 * face.count);
+    if (faceIndices) mesh->faceIndices.reserve(face.count);
+    for (long i = 0; i < face.count; ++i) {
+        const uint8_t *record = faceData;
+        if ((size_t)(dataEnd - record) < faceBytesBefore + countBytes) {
+            Error("%s: unable to read the contents of PLY file",
+                  filename.c_str());
+            *error = true;
+            return true;
+        }
+        const uint8_t *list = record + faceBytesBefore;
+        int64_t count = LoadPLYInt(list, countType);
+        const uint8_t *listEnd = list + countBytes;
+        if (count < 0 || (size_t)(dataEnd - listEnd) <
+                             count * indexBytes + faceBytesAfter) {
+            Error("%s: unable to read the contents of PLY file",
+                  filename.c_str());
+            *error = true;
+            return true;
+        }
+        faceData = listEnd + count * indexBytes + faceBytesAfter;
+
+        if (count != 3 && count != 4) {
+            Warning("plymesh: Ignoring face with %i vertices (only triangles "
+                    "and quads are supported!)", (int)count);
+            continue;
+        }
+        int v[4];
+        for (int j = 0; j < count; ++j) {
+            int64_t index = LoadPLYInt(listEnd + j * indexBytes, indexType);
+            if (index < 0 || index >= vertex.count) {
+                Error("plymesh: Vertex reference %i is out of bounds! "
+                      "Valid range is [0..%i)", (int)index, (int)vertex.count);
+                *error = true;
+                return true;
+            }
+            v[j] = index;
+        }
+        mesh->indices.insert(mesh->indices.end(), v, v + 3);
+        if (count == 4) {
+            CHECK(!faceIndices) << "face_indices not yet supported for quads";
+            int quad[3] = {v[3], v[0], v[2]};
+            mesh->indices.insert(mesh->indices.end(), quad, quad + 3);
+        }
+        if (faceIndices)
+            mesh->faceIndices.push_back(LoadPLYInt(
+                (faceIndicesAfter ? listEnd + count * indexBytes : record) +
+                    faceIndices->offset,
+                faceIndices->type));
+    }
+    return true;
+}
+
+// Reads a PLY file with _ConvertBinaryPLY()_ after mapping it into memory.
+static bool ReadMappedPLY(const std::string &filename, PLYMesh *mesh,
+                          bool *error) {
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat stat;
+    if (fstat(fd, &stat) != 0 || stat.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t length = stat.st_size;
+    void *data = mmap(0, length, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    bool converted =
+        ConvertBinaryPLY(filename, (const uint8_t *)data, length, mesh, error);
+    munmap(data, length);
+    if (converted) ++nMappedPLYFiles;
+    return converted;
+#else
+    return false;
+#endif  // PBRT_HAVE_MMAP
+}
+
+// Looks up the shape's alpha textures, if any.
+static void FindAlphaTextures(
+    const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures,
+    std::shared_ptr<Texture<Float>> *alphaTex,
+    std::shared_ptr<Texture<Float>> *shadowAlphaTex) {
+    std::string alphaTexName = params.FindTexture("alpha");
+    if (alphaTexName != "") {
+        if (floatTextures->find(alphaTexName) != floatTextures->end())
+            *alphaTex = floatTextures->at(alphaTexName);
+        else
+            Error("Couldn't find float texture \"%s\" for \"alpha\" parameter",
+                  alphaTexName.c_str());
+    } else if (params.FindOneFloat("alpha", 1.f) == 0.f) {
+        alphaTex->reset(new ConstantTexture<Float>(0.f));
+    }
+
+    std::string shadowAlphaTexName = params.FindTexture("shadowalpha");
+    if (shadowAlphaTexName != "") {
+        if (floatTextures->find(shadowAlphaTexName) != floatTextures->end())
+            *shadowAlphaTex = floatTextures->at(shadowAlphaTexName);
+        else
+            Error(
+                "Couldn't find float texture \"%s\" for \"shadowalpha\" "
+                "parameter",
+                shadowAlphaTexName.c_str());
+    } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
+        shadowAlphaTex->reset(new ConstantTexture<Float>(0.f));
+}
+
 std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
     std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
+    std::shared_ptr<TriangleMesh> mesh =
+        ReadPLYMesh(o2w, params, floatTextures);
+    if (!mesh) return std::vector<std::shared_ptr<Shape>>();
+    return CreateTriangles(o2w, w2o, reverseOrientation, mesh);
+}
+
+std::shared_ptr<TriangleMesh> ReadPLYMesh(
+    const Transform *o2w, const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
     const std::string filename = params.FindOneFilename("filename", "");
+    ++nPLYFiles;
+    PLYMesh mappedMesh;
+    bool mappedError = false;
+    if (ReadMappedPLY(filename, &mappedMesh, &mappedError)) {
+        if (mappedError) return nullptr;
+        std::shared_ptr<Texture<Float>> alphaTex, shadowAlphaTex;
+        FindAlphaTextures(params, floatTextures, &alphaTex, &shadowAlphaTex);
+        return std::make_shared<TriangleMesh>(
+            *o2w, std::move(mappedMesh.indices), mappedMesh.nVertices,
+            std::move(mappedMesh.p), std::move(mappedMesh.n),
+            std::move(mappedMesh.uv), alphaTex, shadowAlphaTex,
+            std::move(mappedMesh.faceIndices));
+    }
+
     p_ply ply = ply_open(filename.c_str(), rply_message_callback, 0, nullptr);
     if (!ply) {
         Error("Couldn't open PLY file \"%s\"", filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     if (!ply_read_header(ply)) {
         Error("Unable to read the header of PLY file \"%s\"", filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     p_ply_element element = nullptr;
@@ -188,7 +632,7 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     if (vertexCount == 0 || faceCount == 0) {
         Error("%s: PLY file is invalid! No face/vertex elements found!",
               filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     CallbackContext context;
@@ -203,7 +647,7 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     } else {
         Error("%s: Vertex coordinate property not found!",
               filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     if (ply_set_read_cb(ply, "vertex", "nx", rply_vertex_callback, &context,
@@ -249,44 +693,20 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
         Error("%s: unable to read the contents of PLY file",
               filename.c_str());
         ply_close(ply);
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     ply_close(ply);
 
-    if (context.error) return std::vector<std::shared_ptr<Shape>>();
-
-    // Look up an alpha texture, if applicable
-    std::shared_ptr<Texture<Float>> alphaTex;
-    std::string alphaTexName = params.FindTexture("alpha");
-    if (alphaTexName != "") {
-        if (floatTextures->find(alphaTexName) != floatTextures->end())
-            alphaTex = (*floatTextures)[alphaTexName];
-        else
-            Error("Couldn't find float texture \"%s\" for \"alpha\" parameter",
-                  alphaTexName.c_str());
-    } else if (params.FindOneFloat("alpha", 1.f) == 0.f) {
-        alphaTex.reset(new ConstantTexture<Float>(0.f));
-    }
-
-    std::shared_ptr<Texture<Float>> shadowAlphaTex;
-    std::string shadowAlphaTexName = params.FindTexture("shadowalpha");
-    if (shadowAlphaTexName != "") {
-        if (floatTextures->find(shadowAlphaTexName) != floatTextures->end())
-            shadowAlphaTex = (*floatTextures)[shadowAlphaTexName];
-        else
-            Error(
-                "Couldn't find float texture \"%s\" for \"shadowalpha\" "
-                "parameter",
-                shadowAlphaTexName.c_str());
-    } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
-        shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
+    if (context.error) return nullptr;
 
-    return CreateTriangleMesh(o2w, w2o, reverseOrientation,
-                              context.indexCtr / 3, context.indices,
-                              vertexCount, context.p, nullptr, context.n,
-                              context.uv, alphaTex, shadowAlphaTex,
-                              context.faceIndices);
+    // Look up alpha textures, if applicable
+    std::shared_ptr<Texture<Float>> alphaTex, shadowAlphaTex;
+    FindAlphaTextures(params, floatTextures, &alphaTex, &shadowAlphaTex);
+    return std::make_shared<TriangleMesh>(
+        *o2w, context.indexCtr / 3, context.indices, vertexCount, context.p,
+        nullptr, context.n, context.uv, alphaTex, shadowAlphaTex,
+        context.faceIndices);
 }
 
 }  // namespace pbrt
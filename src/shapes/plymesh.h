@@ -48,6 +48,12 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     const ParamSet &params,
     std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures =
         nullptr);
+// Reads the mesh of a "plymesh" shape without creating its _Triangle_s;
+// returns _nullptr_ if the file can't be read.
+std::shared_ptr<TriangleMesh> ReadPLYMesh(
+    const Transform *o2w, const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures =
+        nullptr);
 
 }  // namespace pbrt
 
@@ -37,179 +37,38 @@
 #include "paramset.h"
 #include "sampling.h"
 #include "efloat.h"
+#include "raybatch.h"
 #include "ext/rply.h"
 #include <array>
+#ifdef PBRT_HAVE_SSE
+#include <xmmintrin.h>
+#endif
 
 namespace pbrt {
 
 STAT_PERCENT("Intersections/Ray-triangle intersection tests", nHits, nTests);
 
 // Triangle Local Definitions
-static void PlyErrorCallback(p_ply, const char *message) {
-    Error("PLY writing error: %s", message);
-}
-
-// Triangle Method Definitions
-STAT_RATIO("Scene/Triangles per triangle mesh", nTris, nMeshes);
-TriangleMesh::TriangleMesh(
-    const Transform &ObjectToWorld, int nTriangles, const int *vertexIndices,
-    int nVertices, const Point3f *P, const Vector3f *S, const Normal3f *N,
-    const Point2f *UV, const std::shared_ptr<Texture<Float>> &alphaMask,
-    const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-    const int *fIndices)
-    : nTriangles(nTriangles),
-      nVertices(nVertices),
-      vertexIndices(vertexIndices, vertexIndices + 3 * nTriangles),
-      alphaMask(alphaMask),
-      shadowAlphaMask(shadowAlphaMask) {
-    ++nMeshes;
-    nTris += nTriangles;
-    triMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
-                    nVertices * (sizeof(*P) + (N ? sizeof(*N) : 0) +
-                                 (S ? sizeof(*S) : 0) + (UV ? sizeof(*UV) : 0) +
-                                 (fIndices ? sizeof(*fIndices) : 0));
-
-    // Transform mesh vertices to world space
-    p.reset(new Point3f[nVertices]);
-    for (int i = 0; i < nVertices; ++i) p[i] = ObjectToWorld(P[i]);
-
-    // Copy _UV_, _N_, and _S_ vertex data, if present
-    if (UV) {
-        uv.reset(new Point2f[nVertices]);
-        memcpy(uv.get(), UV, nVertices * sizeof(Point2f));
-    }
-    if (N) {
-        n.reset(new Normal3f[nVertices]);
-        for (int i = 0; i < nVertices; ++i) n[i] = ObjectToWorld(N[i]);
-    }
-    if (S) {
-        s.reset(new Vector3f[nVertices]);
-        for (int i = 0; i < nVertices; ++i) s[i] = ObjectToWorld(S[i]);
-    }
-
-    if (fIndices)
-        faceIndices = std::vector<int>(fIndices, fIndices + nTriangles);
-}
-
-std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
-    const Transform *ObjectToWorld, const Transform *WorldToObject,
-    bool reverseOrientation, int nTriangles, const int *vertexIndices,
-    int nVertices, const Point3f *p, const Vector3f *s, const Normal3f *n,
-    const Point2f *uv, const std::shared_ptr<Texture<Float>> &alphaMask,
-    const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-    const int *faceIndices) {
-    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
-        *ObjectToWorld, nTriangles, vertexIndices, nVertices, p, s, n, uv,
-        alphaMask, shadowAlphaMask, faceIndices);
-    std::vector<std::shared_ptr<Shape>> tris;
-    tris.reserve(nTriangles);
-    for (int i = 0; i < nTriangles; ++i)
-        tris.push_back(std::make_shared<Triangle>(ObjectToWorld, WorldToObject,
-                                                  reverseOrientation, mesh, i));
-    return tris;
-}
-
-bool WritePlyFile(const std::string &filename, int nTriangles,
-                  const int *vertexIndices, int nVertices, const Point3f *P,
-                  const Vector3f *S, const Normal3f *N, const Point2f *UV,
-                  const int *faceIndices) {
-    p_ply plyFile =
-        ply_create(filename.c_str(), PLY_DEFAULT, PlyErrorCallback, 0, nullptr);
-    if (plyFile == nullptr)
-        return false;
-
-    ply_add_element(plyFile, "vertex", nVertices);
-    ply_add_scalar_property(plyFile, "x", PLY_FLOAT);
-    ply_add_scalar_property(plyFile, "y", PLY_FLOAT);
-    ply_add_scalar_property(plyFile, "z", PLY_FLOAT);
-    if (N) {
-        ply_add_scalar_property(plyFile, "nx", PLY_FLOAT);
-        ply_add_scalar_property(plyFile, "ny", PLY_FLOAT);
-        ply_add_scalar_property(plyFile, "nz", PLY_FLOAT);
-    }
-    if (UV) {
-        ply_add_scalar_property(plyFile, "u", PLY_FLOAT);
-        ply_add_scalar_property(plyFile, "v", PLY_FLOAT);
-    }
-    if (S)
-        Warning("%s: PLY mesh will be missing tangent vectors \"S\".",
-                filename.c_str());
-
-    ply_add_element(plyFile, "face", nTriangles);
-    ply_add_list_property(plyFile, "vertex_indices", PLY_UINT8, PLY_INT);
-    if (faceIndices)
-        ply_add_scalar_property(plyFile, "face_indices", PLY_INT);
-    ply_write_header(plyFile);
-
-    for (int i = 0; i < nVertices; ++i) {
-        ply_write(plyFile, P[i].x);
-        ply_write(plyFile, P[i].y);
-        ply_write(plyFile, P[i].z);
-        if (N) {
-            ply_write(plyFile, N[i].x);
-            ply_write(plyFile, N[i].y);
-            ply_write(plyFile, N[i].z);
-        }
-        if (UV) {
-            ply_write(plyFile, UV[i].x);
-            ply_write(plyFile, UV[i].y);
-        }
-    }
-
-    for (int i = 0; i < nTriangles; ++i) {
-        ply_write(plyFile, 3);
-        ply_write(plyFile, vertexIndices[3 * i]);
-        ply_write(plyFile, vertexIndices[3 * i + 1]);
-        ply_write(plyFile, vertexIndices[3 * i + 2]);
-        if (faceIndices)
-            ply_write(plyFile, faceIndices[i]);
-    }
-    ply_close(plyFile);
-    return true;
-}
-
-Bounds3f Triangle::ObjectBound() const {
-    // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
-    return Union(Bounds3f((*WorldToObject)(p0), (*WorldToObject)(p1)),
-                 (*WorldToObject)(p2));
-}
-
-Bounds3f Triangle::WorldBound() const {
-    // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
-    return Union(Bounds3f(p0, p1), p2);
-}
-
-bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
-                         bool testAlphaTexture) const {
-    ProfilePhase p(Prof::TriIntersect);
-    ++nTests;
-    // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
-
-    // Perform ray--triangle intersection test
-
+// Watertight ray--triangle test shared by the scalar and batched
+// intersection routines; returns the hit's $t$ value and barycentrics.
+static inline bool IntersectTriangle(const Point3f &p0, const Point3f &p1,
+                                     const Point3f &p2, const Point3f &o,
+                                     const Vector3f &dir, Float tMax,
+                                     Float *tHit, Float b[3]) {
     // Transform triangle vertices to ray coordinate space
 
     // Translate vertices based on ray origin
-    Point3f p0t = p0 - Vector3f(ray.o);
-    Point3f p1t = p1 - Vector3f(ray.o);
-    Point3f p2t = p2 - Vector3f(ray.o);
+    Point3f p0t = p0 - Vector3f(o);
+    Point3f p1t = p1 - Vector3f(o);
+    Point3f p2t = p2 - Vector3f(o);
 
     // Permute components of triangle vertices and ray direction
-    int kz = MaxDimension(Abs(ray.d));
+    int kz = MaxDimension(Abs(dir));
     int kx = kz + 1;
     if (kx == 3) kx = 0;
     int ky = kx + 1;
     if (ky == 3) ky = 0;
-    Vector3f d = Permute(ray.d, kx, ky, kz);
+    Vector3f d = Permute(dir, kx, ky, kz);
     p0t = Permute(p0t, kx, ky, kz);
     p1t = Permute(p1t, kx, ky, kz);
     p2t = Permute(p2t, kx, ky, kz);
@@ -255,16 +114,16 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     p1t.z *= Sz;
     p2t.z *= Sz;
     Float tScaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
-    if (det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det))
+    if (det < 0 && (tScaled >= 0 || tScaled < tMax * det))
         return false;
-    else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
+    else if (det > 0 && (tScaled <= 0 || tScaled > tMax * det))
         return false;
 
     // Compute barycentric coordinates and $t$ value for triangle intersection
     Float invDet = 1 / det;
-    Float b0 = e0 * invDet;
-    Float b1 = e1 * invDet;
-    Float b2 = e2 * invDet;
+    b[0] = e0 * invDet;
+    b[1] = e1 * invDet;
+    b[2] = e2 * invDet;
     Float t = tScaled * invDet;
 
     // Ensure that computed triangle $t$ is conservatively greater than zero
@@ -289,11 +148,40 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
                    std::abs(invDet);
     if (t <= deltaT) return false;
+    *tHit = t;
+    return true;
+}
+
+static void GetUVs(const TriangleMesh &mesh, const int *v, Point2f uv[3]) {
+    if (mesh.uv) {
+        uv[0] = mesh.uv[v[0]];
+        uv[1] = mesh.uv[v[1]];
+        uv[2] = mesh.uv[v[2]];
+    } else {
+        uv[0] = Point2f(0, 0);
+        uv[1] = Point2f(1, 0);
+        uv[2] = Point2f(1, 1);
+    }
+}
+
+// Computes the _SurfaceInteraction_ for a hit with barycentric coordinates
+// _b_ on the triangle with vertex indices _v_; returns false if the hit is
+// rejected by the alpha texture or the triangle is degenerate.
+static bool TriangleInteraction(const TriangleMesh &mesh, const int *v,
+                                int faceIndex, const Shape *shape,
+                                const Ray &ray, const Float b[3],
+                                SurfaceInteraction *isect,
+                                bool testAlphaTexture) {
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
+    Float b0 = b[0], b1 = b[1], b2 = b[2];
 
     // Compute triangle partial derivatives
     Vector3f dpdu, dpdv;
     Point2f uv[3];
-    GetUVs(uv);
+    GetUVs(mesh, v, uv);
 
     // Compute deltas for triangle partial derivatives
     Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
@@ -330,27 +218,27 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
 
     // Test intersection against alpha texture, if present
-    if (testAlphaTexture && mesh->alphaMask) {
+    if (testAlphaTexture && mesh.alphaMask) {
         SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
                                       dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask->Evaluate(isectLocal) == 0) return false;
+                                      Normal3f(0, 0, 0), ray.time, shape);
+        if (mesh.alphaMask->Evaluate(isectLocal) == 0) return false;
     }
 
     // Fill in _SurfaceInteraction_ from triangle hit
     *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
                                 Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time,
-                                this, faceIndex);
+                                shape, faceIndex);
 
     // Override surface normal in _isect_ for triangle
     isect->n = isect->shading.n = Normal3f(Normalize(Cross(dp02, dp12)));
-    if (mesh->n || mesh->s) {
+    if (mesh.n || mesh.s) {
         // Initialize _Triangle_ shading geometry
 
         // Compute shading normal _ns_ for triangle
         Normal3f ns;
-        if (mesh->n) {
-            ns = (b0 * mesh->n[v[0]] + b1 * mesh->n[v[1]] + b2 * mesh->n[v[2]]);
+        if (mesh.n) {
+            ns = (b0 * mesh.n[v[0]] + b1 * mesh.n[v[1]] + b2 * mesh.n[v[2]]);
             if (ns.LengthSquared() > 0)
                 ns = Normalize(ns);
             else
@@ -360,8 +248,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute shading tangent _ss_ for triangle
         Vector3f ss;
-        if (mesh->s) {
-            ss = (b0 * mesh->s[v[0]] + b1 * mesh->s[v[1]] + b2 * mesh->s[v[2]]);
+        if (mesh.s) {
+            ss = (b0 * mesh.s[v[0]] + b1 * mesh.s[v[1]] + b2 * mesh.s[v[2]]);
             if (ss.LengthSquared() > 0)
                 ss = Normalize(ss);
             else
@@ -379,12 +267,12 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute $\dndu$ and $\dndv$ for triangle shading geometry
         Normal3f dndu, dndv;
-        if (mesh->n) {
+        if (mesh.n) {
             // Compute deltas for triangle partial derivatives of normal
             Vector2f duv02 = uv[0] - uv[2];
             Vector2f duv12 = uv[1] - uv[2];
-            Normal3f dn1 = mesh->n[v[0]] - mesh->n[v[2]];
-            Normal3f dn2 = mesh->n[v[1]] - mesh->n[v[2]];
+            Normal3f dn1 = mesh.n[v[0]] - mesh.n[v[2]];
+            Normal3f dn2 = mesh.n[v[1]] - mesh.n[v[2]];
             Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
             bool degenerateUV = std::abs(determinant) < 1e-8;
             if (degenerateUV) {
@@ -394,8 +282,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                 // (rather than giving up) so that ray differentials for
                 // rays reflected from triangles with degenerate
                 // parameterizations are still reasonable.
-                Vector3f dn = Cross(Vector3f(mesh->n[v[2]] - mesh->n[v[0]]),
-                                    Vector3f(mesh->n[v[1]] - mesh->n[v[0]]));
+                Vector3f dn = Cross(Vector3f(mesh.n[v[2]] - mesh.n[v[0]]),
+                                    Vector3f(mesh.n[v[1]] - mesh.n[v[0]]));
                 if (dn.LengthSquared() == 0)
                     dndu = dndv = Normal3f(0, 0, 0);
                 else {
@@ -415,163 +303,348 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     }
 
     // Ensure correct orientation of the geometric normal
-    if (mesh->n)
+    if (mesh.n)
         isect->n = Faceforward(isect->n, isect->shading.n);
-    else if (reverseOrientation ^ transformSwapsHandedness)
+    else if (shape->reverseOrientation ^ shape->transformSwapsHandedness)
         isect->n = isect->shading.n = -isect->n;
-    *tHit = t;
-    ++nHits;
     return true;
 }
 
-bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
-    ProfilePhase p(Prof::TriIntersectP);
-    ++nTests;
+// Returns false if a shadow ray hit at _b_ is masked out by the mesh's
+// alpha textures.
+static bool TriangleShadowAlphaTest(const TriangleMesh &mesh, const int *v,
+                                    const Shape *shape, const Ray &ray,
+                                    const Float b[3]) {
     // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
-
-    // Perform ray--triangle intersection test
-
-    // Transform triangle vertices to ray coordinate space
-
-    // Translate vertices based on ray origin
-    Point3f p0t = p0 - Vector3f(ray.o);
-    Point3f p1t = p1 - Vector3f(ray.o);
-    Point3f p2t = p2 - Vector3f(ray.o);
-
-    // Permute components of triangle vertices and ray direction
-    int kz = MaxDimension(Abs(ray.d));
-    int kx = kz + 1;
-    if (kx == 3) kx = 0;
-    int ky = kx + 1;
-    if (ky == 3) ky = 0;
-    Vector3f d = Permute(ray.d, kx, ky, kz);
-    p0t = Permute(p0t, kx, ky, kz);
-    p1t = Permute(p1t, kx, ky, kz);
-    p2t = Permute(p2t, kx, ky, kz);
-
-    // Apply shear transformation to translated vertex positions
-    Float Sx = -d.x / d.z;
-    Float Sy = -d.y / d.z;
-    Float Sz = 1.f / d.z;
-    p0t.x += Sx * p0t.z;
-    p0t.y += Sy * p0t.z;
-    p1t.x += Sx * p1t.z;
-    p1t.y += Sy * p1t.z;
-    p2t.x += Sx * p2t.z;
-    p2t.y += Sy * p2t.z;
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
+    Float b0 = b[0], b1 = b[1], b2 = b[2];
 
-    // Compute edge function coefficients _e0_, _e1_, and _e2_
-    Float e0 = p1t.x * p2t.y - p1t.y * p2t.x;
-    Float e1 = p2t.x * p0t.y - p2t.y * p0t.x;
-    Float e2 = p0t.x * p1t.y - p0t.y * p1t.x;
+    // Compute triangle partial derivatives
+    Vector3f dpdu, dpdv;
+    Point2f uv[3];
+    GetUVs(mesh, v, uv);
 
-    // Fall back to double precision test at triangle edges
-    if (sizeof(Float) == sizeof(float) &&
-        (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)) {
-        double p2txp1ty = (double)p2t.x * (double)p1t.y;
-        double p2typ1tx = (double)p2t.y * (double)p1t.x;
-        e0 = (float)(p2typ1tx - p2txp1ty);
-        double p0txp2ty = (double)p0t.x * (double)p2t.y;
-        double p0typ2tx = (double)p0t.y * (double)p2t.x;
-        e1 = (float)(p0typ2tx - p0txp2ty);
-        double p1txp0ty = (double)p1t.x * (double)p0t.y;
-        double p1typ0tx = (double)p1t.y * (double)p0t.x;
-        e2 = (float)(p1typ0tx - p1txp0ty);
+    // Compute deltas for triangle partial derivatives
+    Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
+    Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
+    Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
+    bool degenerateUV = std::abs(determinant) < 1e-8;
+    if (!degenerateUV) {
+        Float invdet = 1 / determinant;
+        dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
+        dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
     }
+    if (degenerateUV || Cross(dpdu, dpdv).LengthSquared() == 0) {
+        // Handle zero determinant for triangle partial derivative matrix
+        Vector3f ng = Cross(p2 - p0, p1 - p0);
+        if (ng.LengthSquared() == 0)
+            // The triangle is actually degenerate; the intersection is
+            // bogus.
+            return false;
 
-    // Perform triangle edge and determinant tests
-    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
-        return false;
-    Float det = e0 + e1 + e2;
-    if (det == 0) return false;
+        CoordinateSystem(Normalize(Cross(p2 - p0, p1 - p0)), &dpdu, &dpdv);
+    }
 
-    // Compute scaled hit distance to triangle and test against ray $t$ range
-    p0t.z *= Sz;
-    p1t.z *= Sz;
-    p2t.z *= Sz;
-    Float tScaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
-    if (det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det))
+    // Interpolate $(u,v)$ parametric coordinates and hit point
+    Point3f pHit = b0 * p0 + b1 * p1 + b2 * p2;
+    Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
+    SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
+                                  dpdu, dpdv, Normal3f(0, 0, 0),
+                                  Normal3f(0, 0, 0), ray.time, shape);
+    if (mesh.alphaMask && mesh.alphaMask->Evaluate(isectLocal) == 0)
         return false;
-    else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
+    if (mesh.shadowAlphaMask &&
+        mesh.shadowAlphaMask->Evaluate(isectLocal) == 0)
         return false;
+    return true;
+}
 
-    // Compute barycentric coordinates and $t$ value for triangle intersection
-    Float invDet = 1 / det;
-    Float b0 = e0 * invDet;
-    Float b1 = e1 * invDet;
-    Float b2 = e2 * invDet;
-    Float t = tScaled * invDet;
-
-    // Ensure that computed triangle $t$ is conservatively greater than zero
-
-    // Compute $\delta_z$ term for triangle $t$ error bounds
-    Float maxZt = MaxComponent(Abs(Vector3f(p0t.z, p1t.z, p2t.z)));
-    Float deltaZ = gamma(3) * maxZt;
+static void PlyErrorCallback(p_ply, const char *message) {
+    Error("PLY writing error: %s", message);
+}
 
-    // Compute $\delta_x$ and $\delta_y$ terms for triangle $t$ error bounds
-    Float maxXt = MaxComponent(Abs(Vector3f(p0t.x, p1t.x, p2t.x)));
-    Float maxYt = MaxComponent(Abs(Vector3f(p0t.y, p1t.y, p2t.y)));
-    Float deltaX = gamma(5) * (maxXt + maxZt);
-    Float deltaY = gamma(5) * (maxYt + maxZt);
+// Triangle Method Definitions
+STAT_RATIO("Scene/Triangles per triangle mesh", nTris, nMeshes);
+TriangleMesh::TriangleMesh(
+    const Transform &ObjectToWorld, int nTriangles, const int *vertexIndices,
+    int nVertices, const Point3f *P, const Vector3f *S, const Normal3f *N,
+    const Point2f *UV, const std::shared_ptr<Texture<Float>> &alphaMask,
+    const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+    const int *fIndices)
+    : nTriangles(nTriangles),
+      nVertices(nVertices),
+      vertexIndices(vertexIndices, vertexIndices + 3 * nTriangles),
+      alphaMask(alphaMask),
+      shadowAlphaMask(shadowAlphaMask) {
+    ++nMeshes;
+    nTris += nTriangles;
+    triMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
+                    nVertices * (sizeof(*P) + (N ? sizeof(*N) : 0) +
+                                 (S ? sizeof(*S) : 0) + (UV ? sizeof(*UV) : 0) +
+                                 (fIndices ? sizeof(*fIndices) : 0));
 
-    // Compute $\delta_e$ term for triangle $t$ error bounds
-    Float deltaE =
-        2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+    // Transform mesh vertices to world space
+    p.reset(new Point3f[nVertices]);
+    for (int i = 0; i < nVertices; ++i) p[i] = ObjectToWorld(P[i]);
 
-    // Compute $\delta_t$ term for triangle $t$ error bounds and check _t_
-    Float maxE = MaxComponent(Abs(Vector3f(e0, e1, e2)));
-    Float deltaT = 3 *
-                   (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
-                   std::abs(invDet);
-    if (t <= deltaT) return false;
+    // Copy _UV_, _N_, and _S_ vertex data, if present
+    if (UV) {
+        uv.reset(new Point2f[nVertices]);
+        memcpy(uv.get(), UV, nVertices * sizeof(Point2f));
+    }
+    if (N) {
+        n.reset(new Normal3f[nVertices]);
+        for (int i = 0; i < nVertices; ++i) n[i] = ObjectToWorld(N[i]);
+    }
+    if (S) {
+        s.reset(new Vector3f[nVertices]);
+        for (int i = 0; i < nVertices; ++i) s[i] = ObjectToWorld(S[i]);
+    }
 
-    // Test shadow ray intersection against alpha texture, if present
-    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask)) {
-        // Compute triangle partial derivatives
-        Vector3f dpdu, dpdv;
-        Point2f uv[3];
-        GetUVs(uv);
-
-        // Compute deltas for triangle partial derivatives
-        Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
-        Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
-        Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
-        bool degenerateUV = std::abs(determinant) < 1e-8;
-        if (!degenerateUV) {
-            Float invdet = 1 / determinant;
-            dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
-            dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
+    if (fIndices)
+        faceIndices = std::vector<int>(fIndices, fIndices + nTriangles);
+}
+
+TriangleMesh::TriangleMesh(
+    const Transform &ObjectToWorld, std::vector<int> vertexIndices,
+    int nVertices, std::unique_ptr<Point3f[]> P, std::unique_ptr<Normal3f[]> N,
+    std::unique_ptr<Point2f[]> UV,
+    const std::shared_ptr<Texture<Float>> &alphaMask,
+    const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+    std::vector<int> fIndices)
+    : nTriangles(vertexIndices.size() / 3),
+      nVertices(nVertices),
+      vertexIndices(std::move(vertexIndices)),
+      p(std::move(P)),
+      n(std::move(N)),
+      uv(std::move(UV)),
+      alphaMask(alphaMask),
+      shadowAlphaMask(shadowAlphaMask),
+      faceIndices(std::move(fIndices)) {
+    ++nMeshes;
+    nTris += nTriangles;
+    triMeshBytes += sizeof(*this) +
+                    this->vertexIndices.size() * sizeof(int) +
+                    nVertices * (sizeof(p[0]) + (n ? sizeof(n[0]) : 0) +
+                                 (uv ? sizeof(uv[0]) : 0)) +
+                    faceIndices.size() * sizeof(int);
+
+    // Transform mesh vertices to world space
+    for (int i = 0; i < nVertices; ++i) p[i] = ObjectToWorld(p[i]);
+    if (n)
+        for (int i = 0; i < nVertices; ++i) n[i] = ObjectToWorld(n[i]);
+}
+
+std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, int nTriangles, const int *vertexIndices,
+    int nVertices, const Point3f *p, const Vector3f *s, const Normal3f *n,
+    const Point2f *uv, const std::shared_ptr<Texture<Float>> &alphaMask,
+    const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+    const int *faceIndices) {
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
+        *ObjectToWorld, nTriangles, vertexIndices, nVertices, p, s, n, uv,
+        alphaMask, shadowAlphaMask, faceIndices);
+    return CreateTriangles(ObjectToWorld, WorldToObject, reverseOrientation,
+                           mesh);
+}
+
+std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, std::vector<int> vertexIndices, int nVertices,
+    std::unique_ptr<Point3f[]> p, std::unique_ptr<Normal3f[]> n,
+    std::unique_ptr<Point2f[]> uv,
+    const std::shared_ptr<Texture<Float>> &alphaMask,
+    const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+    std::vector<int> faceIndices) {
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
+        *ObjectToWorld, std::move(vertexIndices), nVertices, std::move(p),
+        std::move(n), std::move(uv), alphaMask, shadowAlphaMask,
+        std::move(faceIndices));
+    return CreateTriangles(ObjectToWorld, WorldToObject, reverseOrientation,
+                           mesh);
+}
+
+std::vector<std::shared_ptr<Shape>> CreateTriangles(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, const std::shared_ptr<TriangleMesh> &mesh) {
+    std::vector<std::shared_ptr<Shape>> tris;
+    tris.reserve(mesh->nTriangles);
+    for (int i = 0; i < mesh->nTriangles; ++i)
+        tris.push_back(std::make_shared<Triangle>(ObjectToWorld, WorldToObject,
+                                                  reverseOrientation, mesh, i));
+    return tris;
+}
+
+bool WritePlyFile(const std::string &filename, int nTriangles,
+                  const int *vertexIndices, int nVertices, const Point3f *P,
+                  const Vector3f *S, const Normal3f *N, const Point2f *UV,
+                  const int *faceIndices) {
+    p_ply plyFile =
+        ply_create(filename.c_str(), PLY_DEFAULT, PlyErrorCallback, 0, nullptr);
+    if (plyFile == nullptr)
+        return false;
+
+    ply_add_element(plyFile, "vertex", nVertices);
+    ply_add_scalar_property(plyFile, "x", PLY_FLOAT);
+    ply_add_scalar_property(plyFile, "y", PLY_FLOAT);
+    ply_add_scalar_property(plyFile, "z", PLY_FLOAT);
+    if (N) {
+        ply_add_scalar_property(plyFile, "nx", PLY_FLOAT);
+        ply_add_scalar_property(plyFile, "ny", PLY_FLOAT);
+        ply_add_scalar_property(plyFile, "nz", PLY_FLOAT);
+    }
+    if (UV) {
+        ply_add_scalar_property(plyFile, "u", PLY_FLOAT);
+        ply_add_scalar_property(plyFile, "v", PLY_FLOAT);
+    }
+    if (S)
+        Warning("%s: PLY mesh will be missing tangent vectors \"S\".",
+                filename.c_str());
+
+    ply_add_element(plyFile, "face", nTriangles);
+    ply_add_list_property(plyFile, "vertex_indices", PLY_UINT8, PLY_INT);
+    if (faceIndices)
+        ply_add_scalar_property(plyFile, "face_indices", PLY_INT);
+    ply_write_header(plyFile);
+
+    for (int i = 0; i < nVertices; ++i) {
+        ply_write(plyFile, P[i].x);
+        ply_write(plyFile, P[i].y);
+        ply_write(plyFile, P[i].z);
+        if (N) {
+            ply_write(plyFile, N[i].x);
+            ply_write(plyFile, N[i].y);
+            ply_write(plyFile, N[i].z);
         }
-        if (degenerateUV || Cross(dpdu, dpdv).LengthSquared() == 0) {
-            // Handle zero determinant for triangle partial derivative matrix
-            Vector3f ng = Cross(p2 - p0, p1 - p0);
-            if (ng.LengthSquared() == 0)
-                // The triangle is actually degenerate; the intersection is
-                // bogus.
-                return false;
-
-            CoordinateSystem(Normalize(Cross(p2 - p0, p1 - p0)), &dpdu, &dpdv);
+        if (UV) {
+            ply_write(plyFile, UV[i].x);
+            ply_write(plyFile, UV[i].y);
         }
+    }
 
-        // Interpolate $(u,v)$ parametric coordinates and hit point
-        Point3f pHit = b0 * p0 + b1 * p1 + b2 * p2;
-        Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
-        SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
-                                      dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask && mesh->alphaMask->Evaluate(isectLocal) == 0)
-            return false;
-        if (mesh->shadowAlphaMask &&
-            mesh->shadowAlphaMask->Evaluate(isectLocal) == 0)
-            return false;
+    for (int i = 0; i < nTriangles; ++i) {
+        ply_write(plyFile, 3);
+        ply_write(plyFile, vertexIndices[3 * i]);
+        ply_write(plyFile, vertexIndices[3 * i + 1]);
+        ply_write(plyFile, vertexIndices[3 * i + 2]);
+        if (faceIndices)
+            ply_write(plyFile, faceIndices[i]);
     }
+    ply_close(plyFile);
+    return true;
+}
+
+Bounds3f Triangle::ObjectBound() const {
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+    return Union(Bounds3f((*WorldToObject)(p0), (*WorldToObject)(p1)),
+                 (*WorldToObject)(p2));
+}
+
+Bounds3f Triangle::WorldBound() const {
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+    return Union(Bounds3f(p0, p1), p2);
+}
+
+bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                         bool testAlphaTexture) const {
+    ProfilePhase p(Prof::TriIntersect);
+    ++nTests;
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+
+    // Perform ray--triangle intersection test
+    Float t, b[3];
+    if (!IntersectTriangle(p0, p1, p2, ray.o, ray.d, ray.tMax, &t, b))
+        return false;
+    if (!TriangleInteraction(*mesh, v, faceIndex, this, ray, b, isect,
+                             testAlphaTexture))
+        return false;
+    *tHit = t;
+    ++nHits;
+    return true;
+}
+
+bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+    ProfilePhase p(Prof::TriIntersectP);
+    ++nTests;
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+
+    // Perform ray--triangle intersection test
+    Float t, b[3];
+    if (!IntersectTriangle(p0, p1, p2, ray.o, ray.d, ray.tMax, &t, b))
+        return false;
+
+    // Test shadow ray intersection against alpha texture, if present
+    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask) &&
+        !TriangleShadowAlphaTest(*mesh, v, this, ray, b))
+        return false;
     ++nHits;
     return true;
 }
 
+void Triangle::IntersectBatch(RayBatch &rays, SurfaceInteraction *isects,
+                              RayMask *hits, bool testAlphaTexture) const {
+    ProfilePhase p(Prof::TriIntersect);
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+    rays.active.ForEach([&](int i) {
+        ++nTests;
+        Float t, b[3];
+        if (!IntersectTriangle(p0, p1, p2,
+                               Point3f(rays.ox[i], rays.oy[i], rays.oz[i]),
+                               Vector3f(rays.dx[i], rays.dy[i], rays.dz[i]),
+                               rays.tMax[i], &t, b))
+            return;
+        if (!TriangleInteraction(*mesh, v, faceIndex, this, rays.GetRay(i), b,
+                                 &isects[i], testAlphaTexture))
+            return;
+        rays.tMax[i] = t;
+        hits->Set(i);
+        ++nHits;
+    });
+}
+
+void Triangle::IntersectPBatch(const RayBatch &rays, RayMask *hits,
+                               bool testAlphaTexture) const {
+    ProfilePhase p(Prof::TriIntersectP);
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+    bool alphaTest =
+        testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask);
+    rays.active.ForEach([&](int i) {
+        ++nTests;
+        Float t, b[3];
+        if (!IntersectTriangle(p0, p1, p2,
+                               Point3f(rays.ox[i], rays.oy[i], rays.oz[i]),
+                               Vector3f(rays.dx[i], rays.dy[i], rays.dz[i]),
+                               rays.tMax[i], &t, b))
+            return;
+        if (alphaTest &&
+            !TriangleShadowAlphaTest(*mesh, v, this, rays.GetRay(i), b))
+            return;
+        hits->Set(i);
+        ++nHits;
+    });
+}
+
 Float Triangle::Area() const {
     // Get triangle vertices in _p0_, _p1_, and _p2_
     const Point3f &p0 = mesh->p[v[0]];
@@ -645,10 +718,512 @@ Float Triangle::SolidAngle(const Point3f &p, int nSamples) const {
         std::acos(Clamp(Dot(cross20, -cross01), -1, 1)) - Pi);
 }
 
+// TriangleMeshPrimitive Method Definitions
+Bounds3f TriangleMeshPrimitive::WorldBound() const {
+    Bounds3f bounds;
+    for (int i = 0; i < mesh->nVertices; ++i)
+        bounds = Union(bounds, mesh->p[i]);
+    return bounds;
+}
+
+bool TriangleMeshPrimitive::Intersect(const Ray &r,
+                                      SurfaceInteraction *isect) const {
+    ProfilePhase p(Prof::TriIntersect);
+    bool hit = false;
+    for (int i = 0; i < mesh->nTriangles; ++i) {
+        ++nTests;
+        if (Intersect(i, r, isect)) {
+            ++nHits;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+bool TriangleMeshPrimitive::IntersectP(const Ray &r) const {
+    ProfilePhase p(Prof::TriIntersectP);
+    for (int i = 0; i < mesh->nTriangles; ++i) {
+        ++nTests;
+        if (IntersectP(i, r)) {
+            ++nHits;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TriangleMeshPrimitive::Intersect(int triIndex, const Ray &r,
+                                      SurfaceInteraction *isect) const {
+    const int *v = &mesh->vertexIndices[3 * triIndex];
+    Float t, b[3];
+    return IntersectTriangle(mesh->p[v[0]], mesh->p[v[1]], mesh->p[v[2]], r.o,
+                             r.d, r.tMax, &t, b) &&
+           AcceptHit(triIndex, r, t, b, isect);
+}
+
+bool TriangleMeshPrimitive::IntersectP(int triIndex, const Ray &r) const {
+    const int *v = &mesh->vertexIndices[3 * triIndex];
+    Float t, b[3];
+    return IntersectTriangle(mesh->p[v[0]], mesh->p[v[1]], mesh->p[v[2]], r.o,
+                             r.d, r.tMax, &t, b) &&
+           AcceptShadowHit(triIndex, r, b);
+}
+
+bool TriangleMeshPrimitive::AcceptHit(int triIndex, const Ray &r, Float t,
+                                      const Float b[3],
+                                      SurfaceInteraction *isect) const {
+    const int *v = &mesh->vertexIndices[3 * triIndex];
+    int faceIndex = mesh->faceIndices.size() ? mesh->faceIndices[triIndex] : 0;
+    if (!TriangleInteraction(*mesh, v, faceIndex, shape.get(), r, b, isect,
+                             true))
+        return false;
+    r.tMax = t;
+    isect->primitive = this;
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+    // Initialize _SurfaceInteraction::mediumInterface_ as
+    // _GeometricPrimitive_ does
+    if (mediumInterface.IsMediumTransition())
+        isect->mediumInterface = mediumInterface;
+    else
+        isect->mediumInterface = MediumInterface(r.medium);
+    return true;
+}
+
+bool TriangleMeshPrimitive::AcceptShadowHit(int triIndex, const Ray &r,
+                                            const Float b[3]) const {
+    const int *v = &mesh->vertexIndices[3 * triIndex];
+    return !(mesh->alphaMask || mesh->shadowAlphaMask) ||
+           TriangleShadowAlphaTest(*mesh, v, shape.get(), r, b);
+}
+
+void TriangleMeshPrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction *isect, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctions(isect, arena, mode,
+                                             allowMultipleLobes);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+}
+
+std::shared_ptr<TriangleMeshPrimitive> CreateTriangleMeshPrimitive(
+    const std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface) {
+    if (shapes.empty()) return nullptr;
+    const Triangle *first = dynamic_cast<const Triangle *>(shapes[0].get());
+    if (!first) return nullptr;
+    std::shared_ptr<TriangleMesh> mesh = first->GetMesh();
+    if ((int)shapes.size() != mesh->nTriangles) return nullptr;
+    for (const std::shared_ptr<Shape> &s : shapes) {
+        const Triangle *tri = dynamic_cast<const Triangle *>(s.get());
+        if (!tri || tri->GetMesh() != mesh) return nullptr;
+    }
+    return std::make_shared<TriangleMeshPrimitive>(mesh, shapes[0], material,
+                                                   mediumInterface);
+}
+
+std::shared_ptr<TriangleMeshPrimitive> CreateTriangleMeshPrimitive(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const std::shared_ptr<TriangleMesh> &mesh,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface) {
+    if (mesh->nTriangles == 0) return nullptr;
+    std::shared_ptr<Shape> shape =
+        std::make_shared<Triangle>(o2w, w2o, reverseOrientation, mesh, 0);
+    return std::make_shared<TriangleMeshPrimitive>(mesh, shape, material,
+                                                   mediumInterface);
+}
+
+// TriangleGroup Local Definitions
+// The results of _IntersectTriangle()_'s tests for four pairs of a ray and
+// a triangle. _hits_ has a bit set for each pair that intersects, except
+// for those in _uncertain_, which have a zero edge function and need the
+// scalar test's double precision fallback.
+struct TriangleHits4 {
+    // Returns whether the hit in _lane_ is still within the ray's $t$
+    // range once its _tMax_ has been reduced to _tMax_.
+    bool InRange(int lane, Float tMax) const {
+        return !(det[lane] < 0 ? tScaled[lane] < tMax * det[lane]
+                               : tScaled[lane] > tMax * det[lane]);
+    }
+    int hits, uncertain;
+    alignas(16) Float t[4];
+    alignas(16) Float b[3][4];
+    alignas(16) Float tScaled[4], det[4];
+};
+
+#ifdef PBRT_HAVE_SSE
+// Performs the remainder of _IntersectTriangle()_ for four pairs at once,
+// given their vertices translated to the rays' origins, permuted, and with
+// the shear applied to $x$ and $y$. The operations are the scalar code's,
+// in the same order, so the results match it exactly.
+static inline void IntersectTriangles4(const __m128 x[3], const __m128 y[3],
+                                       const __m128 z[3], __m128 Sz,
+                                       __m128 tMax, TriangleHits4 *h) {
+    // Compute edge functions and flag lanes needing the fallback test
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[1], y[2]), _mm_mul_ps(y[1], x[2]));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[2], y[0]), _mm_mul_ps(y[2], x[0]));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[0], y[1]), _mm_mul_ps(y[0], x[1]));
+    const __m128 zero = _mm_setzero_ps();
+    h->uncertain = _mm_movemask_ps(
+        _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(e0, zero), _mm_cmpeq_ps(e1, zero)),
+                  _mm_cmpeq_ps(e2, zero)));
+
+    // Perform edge, determinant, and $t$ range tests
+    __m128 anyNeg =
+        _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)),
+                  _mm_cmplt_ps(e2, zero));
+    __m128 anyPos =
+        _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)),
+                  _mm_cmpgt_ps(e2, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    __m128 zs[3] = {_mm_mul_ps(z[0], Sz), _mm_mul_ps(z[1], Sz),
+                    _mm_mul_ps(z[2], Sz)};
+    __m128 tScaled =
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, zs[0]), _mm_mul_ps(e1, zs[1])),
+                   _mm_mul_ps(e2, zs[2]));
+    __m128 tMaxDet = _mm_mul_ps(tMax, det);
+    __m128 rejectNeg = _mm_and_ps(
+        _mm_cmplt_ps(det, zero),
+        _mm_or_ps(_mm_cmpge_ps(tScaled, zero), _mm_cmplt_ps(tScaled, tMaxDet)));
+    __m128 rejectPos = _mm_and_ps(
+        _mm_cmpgt_ps(det, zero),
+        _mm_or_ps(_mm_cmple_ps(tScaled, zero), _mm_cmpgt_ps(tScaled, tMaxDet)));
+    __m128 reject = _mm_or_ps(
+        _mm_or_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpeq_ps(det, zero)),
+        _mm_or_ps(rejectNeg, rejectPos));
+
+    // Compute barycentric coordinates and $t$ value for the hits
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1), det);
+    __m128 t = _mm_mul_ps(tScaled, invDet);
+    _mm_store_ps(h->b[0], _mm_mul_ps(e0, invDet));
+    _mm_store_ps(h->b[1], _mm_mul_ps(e1, invDet));
+    _mm_store_ps(h->b[2], _mm_mul_ps(e2, invDet));
+    _mm_store_ps(h->t, t);
+    _mm_store_ps(h->tScaled, tScaled);
+    _mm_store_ps(h->det, det);
+
+    // Ensure that computed triangle $t$ is conservatively greater than zero
+    const __m128 signBit = _mm_set1_ps(-0.f);
+    auto maxAbs = [&](const __m128 v[3]) {
+        return _mm_max_ps(_mm_andnot_ps(signBit, v[0]),
+                          _mm_max_ps(_mm_andnot_ps(signBit, v[1]),
+                                     _mm_andnot_ps(signBit, v[2])));
+    };
+    __m128 maxZt = maxAbs(zs), maxXt = maxAbs(x), maxYt = maxAbs(y);
+    __m128 deltaZ = _mm_mul_ps(_mm_set1_ps(gamma(3)), maxZt);
+    __m128 deltaX = _mm_mul_ps(_mm_set1_ps(gamma(5)), _mm_add_ps(maxXt, maxZt));
+    __m128 deltaY = _mm_mul_ps(_mm_set1_ps(gamma(5)), _mm_add_ps(maxYt, maxZt));
+    __m128 deltaE = _mm_mul_ps(
+        _mm_set1_ps(2),
+        _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(gamma(2)), maxXt),
+                                  maxYt),
+                       _mm_mul_ps(deltaY, maxXt)),
+            _mm_mul_ps(deltaX, maxYt)));
+    __m128 e[3] = {e0, e1, e2};
+    __m128 maxE = maxAbs(e);
+    __m128 deltaT = _mm_mul_ps(
+        _mm_mul_ps(
+            _mm_set1_ps(3),
+            _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(gamma(3)), maxE),
+                                      maxZt),
+                           _mm_mul_ps(deltaE, maxZt)),
+                _mm_mul_ps(deltaZ, maxE))),
+        _mm_andnot_ps(signBit, invDet));
+    reject = _mm_or_ps(reject, _mm_cmple_ps(t, deltaT));
+    h->hits = ~_mm_movemask_ps(reject) & ~h->uncertain & 0xf;
+}
+#endif  // PBRT_HAVE_SSE
+
+// Tests _ray_ against all of _group_'s triangles. Without SSE, all of them
+// are reported as uncertain, so that they get the scalar test.
+static void IntersectGroup(const TriangleGroup &group, const Ray &ray,
+                           TriangleHits4 *h) {
+    int validMask = (1 << group.nTriangles) - 1;
+#ifdef PBRT_HAVE_SSE
+    static_assert(TriangleGroup::Width == 4,
+                  "SSE triangle test assumes four lanes");
+    // Permute components of ray direction as in _IntersectTriangle()_
+    int kz = MaxDimension(Abs(ray.d));
+    int kx = kz + 1;
+    if (kx == 3) kx = 0;
+    int ky = kx + 1;
+    if (ky == 3) ky = 0;
+    Float Sx = -ray.d[kx] / ray.d[kz];
+    Float Sy = -ray.d[ky] / ray.d[kz];
+    Float Sz = 1.f / ray.d[kz];
+
+    // Translate, permute, and shear vertices of all four triangles
+    __m128 x[3], y[3], z[3];
+    for (int i = 0; i < 3; ++i) {
+        x[i] = _mm_sub_ps(_mm_loadu_ps(group.p[i][kx]),
+                          _mm_set1_ps(ray.o[kx]));
+        y[i] = _mm_sub_ps(_mm_loadu_ps(group.p[i][ky]),
+                          _mm_set1_ps(ray.o[ky]));
+        z[i] = _mm_sub_ps(_mm_loadu_ps(group.p[i][kz]),
+                          _mm_set1_ps(ray.o[kz]));
+        x[i] = _mm_add_ps(x[i], _mm_mul_ps(_mm_set1_ps(Sx), z[i]));
+        y[i] = _mm_add_ps(y[i], _mm_mul_ps(_mm_set1_ps(Sy), z[i]));
+    }
+    IntersectTriangles4(x, y, z, _mm_set1_ps(Sz), _mm_set1_ps(ray.tMax), h);
+    h->hits &= validMask;
+    h->uncertain &= validMask;
+#else
+    h->hits = 0;
+    h->uncertain = validMask;
+#endif  // PBRT_HAVE_SSE
+}
+
+#ifdef PBRT_HAVE_SSE
+// Tests the active rays of _rays_ against the triangles of _groups_ in
+// order, four rays at a time. _resolve(group, lane, r, h, i)_ is called
+// for each ray _r_ that may hit triangle _lane_ of _group_, where _h_
+// holds the results for the four rays and _i_ is _r_'s lane in it; it
+// returns true if _r_ needs no further tests.
+template <typename F>
+static void IntersectGroupsBatch(const TriangleGroup *groups, int nGroups,
+                                 const RayBatch &rays, F resolve) {
+    // Sort the rays by the direction component that _IntersectTriangle()_
+    // permutes to $z$, so that each set of four shares the permutation
+    int rayIndex[3][MaxRayBatchSize], nRays[3] = {0, 0, 0};
+    rays.active.ForEach([&](int r) {
+        int kz = MaxDimension(Abs(Vector3f(rays.dx[r], rays.dy[r],
+                                           rays.dz[r])));
+        rayIndex[kz][nRays[kz]++] = r;
+    });
+    const Float *o[3] = {rays.ox, rays.oy, rays.oz};
+    const Float *d[3] = {rays.dx, rays.dy, rays.dz};
+    for (int kz = 0; kz < 3; ++kz) {
+        int kx = kz + 1;
+        if (kx == 3) kx = 0;
+        int ky = kx + 1;
+        if (ky == 3) ky = 0;
+        for (int first = 0; first < nRays[kz]; first += 4) {
+            // Gather the origins and shear constants of up to four rays;
+            // unused lanes repeat the first ray and are ignored
+            int r[4];
+            alignas(16) Float o4[3][4], S4[3][4];
+            for (int i = 0; i < 4; ++i) {
+                r[i] = rayIndex[kz][first + i < nRays[kz] ? first + i : first];
+                o4[0][i] = o[kx][r[i]];
+                o4[1][i] = o[ky][r[i]];
+                o4[2][i] = o[kz][r[i]];
+                S4[0][i] = -d[kx][r[i]] / d[kz][r[i]];
+                S4[1][i] = -d[ky][r[i]] / d[kz][r[i]];
+                S4[2][i] = 1.f / d[kz][r[i]];
+            }
+            __m128 ox = _mm_load_ps(o4[0]), oy = _mm_load_ps(o4[1]),
+                   oz = _mm_load_ps(o4[2]);
+            __m128 Sx = _mm_load_ps(S4[0]), Sy = _mm_load_ps(S4[1]),
+                   Sz = _mm_load_ps(S4[2]);
+            int pending = (1 << std::min(4, nRays[kz] - first)) - 1;
+
+            // Test the rays against each triangle in turn, with the _tMax_
+            // values left by the previous ones
+            for (int g = 0; g < nGroups && pending; ++g) {
+                const TriangleGroup &group = groups[g];
+                for (int lane = 0; lane < group.nTriangles && pending;
+                     ++lane) {
+                    __m128 x[3], y[3], z[3];
+                    for (int i = 0; i < 3; ++i) {
+                        x[i] = _mm_sub_ps(_mm_set1_ps(group.p[i][kx][lane]),
+                                          ox);
+                        y[i] = _mm_sub_ps(_mm_set1_ps(group.p[i][ky][lane]),
+                                          oy);
+                        z[i] = _mm_sub_ps(_mm_set1_ps(group.p[i][kz][lane]),
+                                          oz);
+                        x[i] = _mm_add_ps(x[i], _mm_mul_ps(Sx, z[i]));
+                        y[i] = _mm_add_ps(y[i], _mm_mul_ps(Sy, z[i]));
+                    }
+                    __m128 tMax =
+                        _mm_setr_ps(rays.tMax[r[0]], rays.tMax[r[1]],
+                                    rays.tMax[r[2]], rays.tMax[r[3]]);
+                    TriangleHits4 h;
+                    IntersectTriangles4(x, y, z, Sz, tMax, &h);
+                    for (int m = pending; m != 0; m &= m - 1) ++nTests;
+                    for (int m = (h.hits | h.uncertain) & pending; m != 0;
+                         m &= m - 1) {
+                        int i = CountTrailingZeros(m);
+                        if (resolve(group, lane, r[i], h, i))
+                            pending &= ~(1 << i);
+                    }
+                }
+            }
+        }
+    }
+}
+#endif  // PBRT_HAVE_SSE
+
+// TriangleGroup Method Definitions
+void TriangleGroup::Clear() {
+    for (int lane = 0; lane < Width; ++lane) {
+        for (int i = 0; i < 3; ++i)
+            for (int a = 0; a < 3; ++a) p[i][a][lane] = 0;
+        meshIndex[lane] = triIndex[lane] = -1;
+    }
+    nTriangles = 0;
+}
+
+void TriangleGroup::SetTriangle(int lane, int mIndex,
+                                const TriangleMeshPrimitive &mesh,
+                                int tIndex) {
+    CHECK_EQ(lane, nTriangles);
+    CHECK_LT(lane, Width);
+    for (int i = 0; i < 3; ++i) {
+        const Point3f &v = mesh.Vertex(tIndex, i);
+        for (int a = 0; a < 3; ++a) p[i][a][lane] = v[a];
+    }
+    meshIndex[lane] = mIndex;
+    triIndex[lane] = tIndex;
+    ++nTriangles;
+}
+
+bool TriangleGroup::Intersect(
+    const Ray &ray, SurfaceInteraction *isect,
+    const std::shared_ptr<TriangleMeshPrimitive> *meshes) const {
+    ProfilePhase prof(Prof::TriIntersect);
+    nTests += nTriangles;
+    // Resolve hits in lane order, as if the triangles were tested one by
+    // one, so that later ones are compared against the reduced _tMax_
+    bool hit = false;
+    TriangleHits4 h;
+    IntersectGroup(*this, ray, &h);
+    for (int mask = h.hits | h.uncertain; mask != 0; mask &= mask - 1) {
+        int lane = CountTrailingZeros(mask);
+        const TriangleMeshPrimitive &mesh = *meshes[meshIndex[lane]];
+        bool laneHit;
+        if (h.uncertain & (1 << lane))
+            laneHit = mesh.Intersect(triIndex[lane], ray, isect);
+        else {
+            Float b[3] = {h.b[0][lane], h.b[1][lane], h.b[2][lane]};
+            laneHit = h.InRange(lane, ray.tMax) &&
+                      mesh.AcceptHit(triIndex[lane], ray, h.t[lane], b, isect);
+        }
+        if (laneHit) {
+            ++nHits;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+bool TriangleGroup::IntersectP(
+    const Ray &ray,
+    const std::shared_ptr<TriangleMeshPrimitive> *meshes) const {
+    ProfilePhase prof(Prof::TriIntersectP);
+    nTests += nTriangles;
+    TriangleHits4 h;
+    IntersectGroup(*this, ray, &h);
+    for (int mask = h.hits | h.uncertain; mask != 0; mask &= mask - 1) {
+        int lane = CountTrailingZeros(mask);
+        const TriangleMeshPrimitive &mesh = *meshes[meshIndex[lane]];
+        bool laneHit;
+        if (h.uncertain & (1 << lane))
+            laneHit = mesh.IntersectP(triIndex[lane], ray);
+        else {
+            Float b[3] = {h.b[0][lane], h.b[1][lane], h.b[2][lane]};
+            laneHit = mesh.AcceptShadowHit(triIndex[lane], ray, b);
+        }
+        if (laneHit) {
+            ++nHits;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TriangleGroup::IntersectBatch(
+    const TriangleGroup *groups, int nGroups, RayBatch &rays,
+    SurfaceInteraction *isects,
+    const std::shared_ptr<TriangleMeshPrimitive> *meshes) {
+    ProfilePhase prof(Prof::TriIntersect);
+#ifdef PBRT_HAVE_SSE
+    IntersectGroupsBatch(groups, nGroups, rays, [&](
+        const TriangleGroup &group, int lane, int r, const TriangleHits4 &h,
+        int i) {
+        const TriangleMeshPrimitive &mesh = *meshes[group.meshIndex[lane]];
+        Ray ray = rays.GetRay(r);
+        bool hit;
+        if (h.uncertain & (1 << i))
+            hit = mesh.Intersect(group.triIndex[lane], ray, &isects[r]);
+        else {
+            Float b[3] = {h.b[0][i], h.b[1][i], h.b[2][i]};
+            hit = mesh.AcceptHit(group.triIndex[lane], ray, h.t[i], b,
+                                 &isects[r]);
+        }
+        if (hit) {
+            ++nHits;
+            rays.tMax[r] = ray.tMax;
+            rays.hit.Set(r);
+        }
+        return false;
+    });
+#else
+    rays.active.ForEach([&](int r) {
+        Ray ray = rays.GetRay(r);
+        bool hit = false;
+        for (int g = 0; g < nGroups; ++g)
+            if (groups[g].Intersect(ray, &isects[r], meshes)) hit = true;
+        if (hit) {
+            rays.tMax[r] = ray.tMax;
+            rays.hit.Set(r);
+        }
+    });
+#endif  // PBRT_HAVE_SSE
+}
+
+void TriangleGroup::IntersectPBatch(
+    const TriangleGroup *groups, int nGroups, RayBatch &rays,
+    const std::shared_ptr<TriangleMeshPrimitive> *meshes) {
+    ProfilePhase prof(Prof::TriIntersectP);
+#ifdef PBRT_HAVE_SSE
+    IntersectGroupsBatch(groups, nGroups, rays, [&](
+        const TriangleGroup &group, int lane, int r, const TriangleHits4 &h,
+        int i) {
+        const TriangleMeshPrimitive &mesh = *meshes[group.meshIndex[lane]];
+        Ray ray = rays.GetRay(r);
+        bool hit;
+        if (h.uncertain & (1 << i))
+            hit = mesh.IntersectP(group.triIndex[lane], ray);
+        else {
+            Float b[3] = {h.b[0][i], h.b[1][i], h.b[2][i]};
+            hit = mesh.AcceptShadowHit(group.triIndex[lane], ray, b);
+        }
+        if (!hit) return false;
+        ++nHits;
+        rays.hit.Set(r);
+        rays.active.Unset(r);
+        return true;
+    });
+#else
+    rays.active.ForEach([&](int r) {
+        Ray ray = rays.GetRay(r);
+        for (int g = 0; g < nGroups; ++g)
+            if (groups[g].IntersectP(ray, meshes)) {
+                rays.hit.Set(r);
+                rays.active.Unset(r);
+                return;
+            }
+    });
+#endif  // PBRT_HAVE_SSE
+}
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
     std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
+    std::shared_ptr<TriangleMesh> mesh =
+        CreateTriangleMeshData(o2w, params, floatTextures);
+    if (!mesh) return std::vector<std::shared_ptr<Shape>>();
+    return CreateTriangles(o2w, w2o, reverseOrientation, mesh);
+}
+
+std::shared_ptr<TriangleMesh> CreateTriangleMeshData(
+    const Transform *o2w, const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
     int nvi, npi, nuvi, nsi, nni;
     const int *vi = params.FindInt("indices", &nvi);
     const Point3f *P = params.FindPoint3f("P", &npi);
@@ -682,11 +1257,11 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     if (!vi) {
         Error(
             "Vertex indices \"indices\" not provided with triangle mesh shape");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
     if (!P) {
         Error("Vertex positions \"P\" not provided with triangle mesh shape");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
     const Vector3f *S = params.FindVector3f("S", &nsi);
     if (S && nsi != npi) {
@@ -704,7 +1279,7 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
                 "trianglemesh has out of-bounds vertex index %d (%d \"P\" "
                 "values were given",
                 vi[i], npi);
-            return std::vector<std::shared_ptr<Shape>>();
+            return nullptr;
         }
 
     int nfi;
@@ -739,8 +1314,9 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
         shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
 
-    return CreateTriangleMesh(o2w, w2o, reverseOrientation, nvi / 3, vi, npi, P,
-                              S, N, uvs, alphaTex, shadowAlphaTex, faceIndices);
+    return std::make_shared<TriangleMesh>(*o2w, nvi / 3, vi, npi, P, S, N, uvs,
+                                          alphaTex, shadowAlphaTex,
+                                          faceIndices);
 }
 
 }  // namespace pbrt
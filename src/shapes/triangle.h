@@ -40,6 +40,7 @@
 
 // shapes/triangle.h*
 #include "shape.h"
+#include "primitive.h"
 #include "stats.h"
 #include <map>
 
@@ -56,6 +57,15 @@ struct TriangleMesh {
                  const std::shared_ptr<Texture<Float>> &alphaMask,
                  const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
                  const int *faceIndices);
+    // Creates a mesh that takes ownership of its vertex data; _P_ and _N_
+    // are transformed to world space in place
+    TriangleMesh(const Transform &ObjectToWorld,
+                 std::vector<int> vertexIndices, int nVertices,
+                 std::unique_ptr<Point3f[]> P, std::unique_ptr<Normal3f[]> N,
+                 std::unique_ptr<Point2f[]> uv,
+                 const std::shared_ptr<Texture<Float>> &alphaMask,
+                 const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+                 std::vector<int> faceIndices);
 
     // TriangleMesh Data
     const int nTriangles, nVertices;
@@ -84,6 +94,10 @@ class Triangle : public Shape {
     bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    bool testAlphaTexture = true) const;
     bool IntersectP(const Ray &ray, bool testAlphaTexture = true) const;
+    void IntersectBatch(RayBatch &rays, SurfaceInteraction *isects,
+                        RayMask *hits, bool testAlphaTexture = true) const;
+    void IntersectPBatch(const RayBatch &rays, RayMask *hits,
+                         bool testAlphaTexture = true) const;
     Float Area() const;
 
     using Shape::Sample;  // Bring in the other Sample() overload.
@@ -92,27 +106,104 @@ class Triangle : public Shape {
     // Returns the solid angle subtended by the triangle w.r.t. the given
     // reference point p.
     Float SolidAngle(const Point3f &p, int nSamples = 0) const;
+    std::shared_ptr<TriangleMesh> GetMesh() const { return mesh; }
 
   private:
-    // Triangle Private Methods
-    void GetUVs(Point2f uv[3]) const {
-        if (mesh->uv) {
-            uv[0] = mesh->uv[v[0]];
-            uv[1] = mesh->uv[v[1]];
-            uv[2] = mesh->uv[v[2]];
-        } else {
-            uv[0] = Point2f(0, 0);
-            uv[1] = Point2f(1, 0);
-            uv[2] = Point2f(1, 1);
-        }
-    }
-
     // Triangle Private Data
     std::shared_ptr<TriangleMesh> mesh;
     const int *v;
     int faceIndex;
 };
 
+// TriangleMeshPrimitive Declarations
+// A _TriangleMeshPrimitive_ stands in for the per-triangle
+// _GeometricPrimitive_s of a whole mesh. _BVHAccel_ recognizes it and
+// stores (mesh, triangle) references in _TriangleGroup_ leaves, so that no
+// _Triangle_ or _GeometricPrimitive_ objects need to be kept around during
+// rendering. Its own _Intersect()_ methods test every triangle and are
+// only meant as a fallback.
+class TriangleMeshPrimitive : public Primitive {
+  public:
+    // TriangleMeshPrimitive Public Methods
+    TriangleMeshPrimitive(const std::shared_ptr<TriangleMesh> &mesh,
+                          const std::shared_ptr<Shape> &shape,
+                          const std::shared_ptr<Material> &material,
+                          const MediumInterface &mediumInterface)
+        : mesh(mesh),
+          shape(shape),
+          material(material),
+          mediumInterface(mediumInterface) {}
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &r) const;
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return material.get(); }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const;
+    int NumTriangles() const { return mesh->nTriangles; }
+    const Point3f &Vertex(int triIndex, int i) const {
+        return mesh->p[mesh->vertexIndices[3 * triIndex + i]];
+    }
+    Bounds3f TriangleBound(int triIndex) const {
+        return Union(Bounds3f(Vertex(triIndex, 0), Vertex(triIndex, 1)),
+                     Vertex(triIndex, 2));
+    }
+    // Single-triangle tests; unlike the methods above, these don't update
+    // the intersection statistics.
+    bool Intersect(int triIndex, const Ray &r,
+                   SurfaceInteraction *isect) const;
+    bool IntersectP(int triIndex, const Ray &r) const;
+    // Complete the tests above for a hit at _t_ with barycentrics _b_ that
+    // has already been found; they return false if the alpha texture
+    // rejects the hit.
+    bool AcceptHit(int triIndex, const Ray &r, Float t, const Float b[3],
+                   SurfaceInteraction *isect) const;
+    bool AcceptShadowHit(int triIndex, const Ray &r, const Float b[3]) const;
+
+  private:
+    // TriangleMeshPrimitive Private Data
+    std::shared_ptr<TriangleMesh> mesh;
+    // Any one of the mesh's _Triangle_s; hits report it as their _Shape_.
+    std::shared_ptr<Shape> shape;
+    std::shared_ptr<Material> material;
+    MediumInterface mediumInterface;
+};
+
+// TriangleGroup Declarations
+// Up to _Width_ triangles, possibly from different meshes, with their
+// world-space vertices stored SoA so that a ray can be tested against all
+// of them at once. Hits are found from these vertices; the meshes are
+// only used to compute the hits' _SurfaceInteraction_s.
+struct TriangleGroup {
+    // TriangleGroup Public Methods
+    void Clear();
+    void SetTriangle(int lane, int meshIndex, const TriangleMeshPrimitive &mesh,
+                     int triIndex);
+    bool Intersect(const Ray &ray, SurfaceInteraction *isect,
+                   const std::shared_ptr<TriangleMeshPrimitive> *meshes) const;
+    bool IntersectP(const Ray &ray,
+                    const std::shared_ptr<TriangleMeshPrimitive> *meshes) const;
+    // Test the active rays of _rays_ against all of the triangles of
+    // _groups_, with the results that the methods above would give for each
+    // ray. Rays are tested four at a time against each triangle in turn;
+    // occluded rays are removed from _rays.active_ by _IntersectPBatch()_.
+    static void IntersectBatch(
+        const TriangleGroup *groups, int nGroups, RayBatch &rays,
+        SurfaceInteraction *isects,
+        const std::shared_ptr<TriangleMeshPrimitive> *meshes);
+    static void IntersectPBatch(
+        const TriangleGroup *groups, int nGroups, RayBatch &rays,
+        const std::shared_ptr<TriangleMeshPrimitive> *meshes);
+
+    // TriangleGroup Public Data
+    static PBRT_CONSTEXPR int Width = 4;
+    Float p[3][3][Width];  // [vertex][axis][lane]
+    int32_t meshIndex[Width];
+    int32_t triIndex[Width];
+    int nTriangles;
+};
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     int nTriangles, const int *vertexIndices, int nVertices, const Point3f *p,
@@ -120,11 +211,42 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const std::shared_ptr<Texture<Float>> &alphaTexture,
     const std::shared_ptr<Texture<Float>> &shadowAlphaTexture,
     const int *faceIndices = nullptr);
+std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    std::vector<int> vertexIndices, int nVertices, std::unique_ptr<Point3f[]> p,
+    std::unique_ptr<Normal3f[]> n, std::unique_ptr<Point2f[]> uv,
+    const std::shared_ptr<Texture<Float>> &alphaTexture,
+    const std::shared_ptr<Texture<Float>> &shadowAlphaTexture,
+    std::vector<int> faceIndices);
+// Returns a _Triangle_ for each of _mesh_'s triangles.
+std::vector<std::shared_ptr<Shape>> CreateTriangles(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const std::shared_ptr<TriangleMesh> &mesh);
 std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
     std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures =
         nullptr);
+// Returns the mesh of a "trianglemesh" shape without creating its
+// _Triangle_s, or _nullptr_ if its parameters are invalid.
+std::shared_ptr<TriangleMesh> CreateTriangleMeshData(
+    const Transform *o2w, const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures =
+        nullptr);
+
+// Returns a _TriangleMeshPrimitive_ for _shapes_ if they are exactly the
+// _Triangle_s of a single mesh, and _nullptr_ otherwise.
+std::shared_ptr<TriangleMeshPrimitive> CreateTriangleMeshPrimitive(
+    const std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface);
+// Returns a _TriangleMeshPrimitive_ for all of _mesh_'s triangles, or
+// _nullptr_ if it has none. Only its first _Triangle_ is created.
+std::shared_ptr<TriangleMeshPrimitive> CreateTriangleMeshPrimitive(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const std::shared_ptr<TriangleMesh> &mesh,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface);
 
 bool WritePlyFile(const std::string &filename, int nTriangles,
                   const int *vertexIndices, int nVertices, const Point3f *P,
@@ -0,0 +1,621 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "tests/parallelscope.h"
+#include "primitive.h"
+#include "raybatch.h"
+#include "sampling.h"
+#include "accelerators/bvh.h"
+#include "accelerators/instances.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+
+using namespace pbrt;
+
+static Transform identity;
+
+// Returns a soup of small random triangles with a few long, thin ones mixed
+// in.
+static std::vector<std::shared_ptr<Shape>> RandomTriangleMesh(RNG &rng,
+                                                              int nTris) {
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < nTris; ++i) {
+        Point3f c(Lerp(rng.UniformFloat(), -10, 10),
+                  Lerp(rng.UniformFloat(), -10, 10),
+                  Lerp(rng.UniformFloat(), -10, 10));
+        Float size = (i % 17 == 0) ? 8 : .5;
+        for (int v = 0; v < 3; ++v) {
+            indices.push_back(p.size());
+            p.push_back(c + size * Vector3f(rng.UniformFloat() - .5f,
+                                            rng.UniformFloat() - .5f,
+                                            rng.UniformFloat() - .5f));
+        }
+    }
+    return CreateTriangleMesh(&identity, &identity, false, nTris,
+                              indices.data(), p.size(), p.data(), nullptr,
+                              nullptr, nullptr, nullptr, nullptr);
+}
+
+static std::vector<std::shared_ptr<Primitive>> RandomTriangles(RNG &rng,
+                                                               int nTris) {
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &tri : RandomTriangleMesh(rng, nTris))
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+static Ray RandomRay(RNG &rng) {
+    Point3f o(Lerp(rng.UniformFloat(), -15, 15),
+              Lerp(rng.UniformFloat(), -15, 15),
+              Lerp(rng.UniformFloat(), -15, 15));
+    Vector3f d = UniformSampleSphere(
+        Point2f(rng.UniformFloat(), rng.UniformFloat()));
+    // Exercise axis-aligned directions, which give infinite _invDir_
+    // components.
+    if (rng.UniformUInt32(8) == 0) d = Vector3f(0, 0, d.z > 0 ? 1 : -1);
+    return Ray(o, d);
+}
+
+// Checks that _accel_ finds exactly the same closest hits as a brute-force
+// loop over _prims_.
+static void CheckAgainstBruteForce(
+    const Primitive &accel, const std::vector<std::shared_ptr<Primitive>> &prims,
+    RNG &rng, int nRays) {
+    for (int i = 0; i < nRays; ++i) {
+        Ray r = RandomRay(rng);
+        Ray rBrute = r;
+        SurfaceInteraction isect, isectBrute;
+        bool hitBrute = false;
+        for (const auto &prim : prims)
+            if (prim->Intersect(rBrute, &isectBrute)) hitBrute = true;
+
+        EXPECT_EQ(hitBrute, accel.IntersectP(r));
+        EXPECT_EQ(hitBrute, accel.Intersect(r, &isect));
+        EXPECT_EQ(rBrute.tMax, r.tMax);
+        if (hitBrute) {
+            EXPECT_EQ(isectBrute.p, isect.p);
+        }
+    }
+}
+
+TEST(BVH, MatchesBruteForce) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 2000);
+    for (int width : {2, 4, 8}) {
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width);
+        CheckAgainstBruteForce(bvh, prims, rng, 2000);
+    }
+}
+
+TEST(BVH, WideBounds) {
+    RNG rng(4);
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 500);
+    BVHAccel binary(prims, 4, BVHAccel::SplitMethod::SAH, 2);
+    for (int width : {4, 8}) {
+        BVHAccel wide(prims, 4, BVHAccel::SplitMethod::SAH, width);
+        EXPECT_EQ(binary.WorldBound(), wide.WorldBound());
+    }
+}
+
+TEST(BVH, QuantizedNodes) {
+    RNG rng(6);
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 2000);
+    // Add a quad in the $z=1$ plane, which gives nodes that are flat in $z$
+    static Transform quadToWorld = Translate(Vector3f(0, 0, 1));
+    static Transform worldToQuad = Inverse(quadToWorld);
+    int indices[6] = {0, 1, 2, 0, 2, 3};
+    Point3f p[4] = {Point3f(-3, -3, 0), Point3f(3, -3, 0), Point3f(3, 3, 0),
+                    Point3f(-3, 3, 0)};
+    for (const auto &tri :
+         CreateTriangleMesh(&quadToWorld, &worldToQuad, false, 2, indices, 4, p,
+                            nullptr, nullptr, nullptr, nullptr, nullptr))
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+
+    for (int width : {4, 8}) {
+        BVHAccel full(prims, 4, BVHAccel::SplitMethod::SAH, width);
+        BVHAccel quantized(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                           BVHAccel::NodeFormat::Quantized);
+        EXPECT_EQ(full.WorldBound(), quantized.WorldBound());
+        CheckAgainstBruteForce(quantized, prims, rng, 2000);
+
+        std::vector<std::shared_ptr<Primitive>> single(prims.end() - 1,
+                                                       prims.end());
+        BVHAccel singleQuantized(single, 4, BVHAccel::SplitMethod::SAH, width,
+                                 BVHAccel::NodeFormat::Quantized);
+        CheckAgainstBruteForce(singleQuantized, single, rng, 200);
+    }
+}
+
+TEST(BVH, CoincidentCentroids) {
+    // Concentric spheres can't be separated by their centroids, so the
+    // builders put them all in one leaf; it must be split so that its
+    // primitive count fits the node layouts.
+    RNG rng(12);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (int i = 0; i < 40000; ++i) {
+        Float radius = .5f + 9.5f * i / 40000;
+        std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+            &identity, &identity, false, radius, -radius, radius, 360);
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            sphere, nullptr, nullptr, MediumInterface()));
+    }
+    for (int width : {4, 8}) {
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                     BVHAccel::NodeFormat::Quantized);
+        CheckAgainstBruteForce(bvh, prims, rng, 20);
+    }
+}
+
+TEST(BVH, SinglePrimitive) {
+    RNG rng(7);
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 1);
+    for (int width : {2, 4, 8}) {
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width);
+        CheckAgainstBruteForce(bvh, prims, rng, 200);
+    }
+}
+
+TEST(BVH, ParallelBuild) {
+    RNG rng(3);
+    // Enough primitives that both subtree builds and binning run in
+    // parallel.
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomTriangles(rng, 150000);
+    BVHAccel serial(prims, 4, BVHAccel::SplitMethod::SAH);
+
+    ParallelScope threads(4);
+    BVHAccel parallel(prims, 4, BVHAccel::SplitMethod::SAH);
+
+    EXPECT_EQ(serial.WorldBound(), parallel.WorldBound());
+    for (int i = 0; i < 10000; ++i) {
+        Ray r = RandomRay(rng), rp = r;
+        SurfaceInteraction isect, isectp;
+        EXPECT_EQ(serial.Intersect(r, &isect), parallel.Intersect(rp, &isectp));
+        EXPECT_EQ(r.tMax, rp.tMax);
+    }
+}
+
+// Checks that batched traversal of _bvh_ gives the same results as tracing
+// the rays one at a time.
+static void CheckBatchAgainstScalar(const BVHAccel &bvh, RNG &rng) {
+    std::unique_ptr<RayBatch> batch(new RayBatch);
+    std::unique_ptr<SurfaceInteraction[]> isects(
+        new SurfaceInteraction[MaxRayBatchSize]);
+    for (int b = 0; b < 20; ++b) {
+        // Alternate between large coherent batches from a shared origin,
+        // which are traced as packets, and incoherent ones; leave a few
+        // rays inactive.
+        batch->Clear();
+        Ray base = RandomRay(rng);
+        Vector3f baseDir(base.d.x < 0 ? -1 : 1, base.d.y < 0 ? -1 : 1,
+                         base.d.z < 0 ? -1 : 1);
+        std::vector<Ray> rays;
+        int nRays = (b & 1) ? 80 + rng.UniformUInt32(MaxRayBatchSize - 79)
+                            : 1 + rng.UniformUInt32(MaxRayBatchSize);
+        for (int i = 0; i < nRays; ++i) {
+            Ray r = RandomRay(rng);
+            if (b & 1) r = Ray(base.o, Normalize(baseDir + .5f * r.d));
+            rays.push_back(r);
+            batch->Add(r);
+            if (i % 13 == 5) batch->active.Unset(i);
+        }
+        RayMask active = batch->active;
+
+        bvh.IntersectPBatch(*batch);
+        for (int i = 0; i < nRays; ++i) {
+            bool occluded = active.IsSet(i) && bvh.IntersectP(rays[i]);
+            EXPECT_EQ(occluded, batch->hit.IsSet(i));
+            EXPECT_EQ(active.IsSet(i) && !occluded, batch->active.IsSet(i));
+        }
+
+        batch->active = active;
+        batch->hit.Clear();
+        bvh.IntersectBatch(*batch, isects.get());
+        EXPECT_EQ(active.Count(), batch->active.Count());
+        for (int i = 0; i < nRays; ++i) {
+            SurfaceInteraction isect;
+            bool hit = active.IsSet(i) && bvh.Intersect(rays[i], &isect);
+            EXPECT_EQ(hit, batch->hit.IsSet(i));
+            EXPECT_EQ(rays[i].tMax, batch->tMax[i]);
+            if (hit) {
+                EXPECT_EQ(isect.p, isects[i].p);
+                EXPECT_EQ(isect.primitive, isects[i].primitive);
+            }
+        }
+    }
+}
+
+TEST(BVH, BatchMatchesScalar) {
+    RNG rng(11);
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 2000);
+    for (int width : {2, 4}) {
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width);
+        CheckBatchAgainstScalar(bvh, rng);
+    }
+}
+
+TEST(BVH, TriangleMeshLeaves) {
+    RNG rng(5);
+    std::vector<std::shared_ptr<Shape>> tris = RandomTriangleMesh(rng, 2000);
+    std::shared_ptr<Primitive> mesh =
+        CreateTriangleMeshPrimitive(tris, nullptr, MediumInterface());
+    ASSERT_TRUE(mesh != nullptr);
+    EXPECT_TRUE(CreateTriangleMeshPrimitive({tris[0]}, nullptr,
+                                            MediumInterface()) == nullptr);
+
+    // Add a sphere so that some leaves mix triangles and other primitives
+    static Transform sphereToWorld = Translate(Vector3f(2, -1, 3));
+    static Transform worldToSphere = Inverse(sphereToWorld);
+    std::shared_ptr<Primitive> sphere = std::make_shared<GeometricPrimitive>(
+        std::make_shared<Sphere>(&sphereToWorld, &worldToSphere, false, 1.5f,
+                                 -1.5f, 1.5f, 360.f),
+        nullptr, nullptr, MediumInterface());
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &tri : tris)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    prims.push_back(sphere);
+
+    for (int width : {2, 4, 8})
+        for (int maxPrims : {4, 64})
+            for (BVHAccel::SplitMethod splitMethod :
+                 {BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::HLBVH}) {
+                BVHAccel bvh({mesh, sphere}, maxPrims, splitMethod, width);
+                EXPECT_EQ(Union(mesh->WorldBound(), sphere->WorldBound()),
+                          bvh.WorldBound());
+                CheckAgainstBruteForce(bvh, prims, rng, 1000);
+                if (width == 2) CheckBatchAgainstScalar(bvh, rng);
+            }
+
+    // The scene parser creates mesh primitives from the mesh alone, without
+    // a _Triangle_ for each of its triangles
+    std::shared_ptr<TriangleMesh> triMesh =
+        std::static_pointer_cast<Triangle>(tris[0])->GetMesh();
+    std::shared_ptr<Primitive> meshOnly = CreateTriangleMeshPrimitive(
+        &identity, &identity, false, triMesh, nullptr, MediumInterface());
+    ASSERT_TRUE(meshOnly != nullptr);
+    EXPECT_EQ(mesh->WorldBound(), meshOnly->WorldBound());
+    BVHAccel bvh({meshOnly, sphere}, 4);
+    CheckAgainstBruteForce(bvh, prims, rng, 1000);
+    CheckBatchAgainstScalar(bvh, rng);
+}
+
+TEST(BVH, TriangleGroupEdges) {
+    // A grid of triangles, layered so that rays cross several of them,
+    // and rays through its shared vertices and edges, where the batched
+    // triangle test falls back to the scalar one
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    int n = 6;
+    for (int layer = 0; layer < 3; ++layer) {
+        int first = p.size();
+        for (int y = 0; y <= n; ++y)
+            for (int x = 0; x <= n; ++x)
+                p.push_back(Point3f(x, y, layer * .25f));
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x) {
+                int v = first + y * (n + 1) + x;
+                for (int i : {v, v + 1, v + n + 2, v, v + n + 2, v + n + 1})
+                    indices.push_back(i);
+            }
+    }
+    std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+        &identity, &identity, false, indices.size() / 3, indices.data(),
+        p.size(), p.data(), nullptr, nullptr, nullptr, nullptr, nullptr);
+    std::shared_ptr<Primitive> mesh =
+        CreateTriangleMeshPrimitive(tris, nullptr, MediumInterface());
+    ASSERT_TRUE(mesh != nullptr);
+    BVHAccel bvh({mesh}, 8, BVHAccel::SplitMethod::SAH);
+
+    RNG rng(6);
+    for (int i = 0; i < 5000; ++i) {
+        // Aim at a vertex, the middle of an edge, or a random point
+        Point3f target(rng.UniformUInt32(2 * n + 1) * .5f,
+                       rng.UniformUInt32(2 * n + 1) * .5f, .25f);
+        if (i % 3 == 0)
+            target = Point3f(n * rng.UniformFloat(), n * rng.UniformFloat(),
+                             .25f);
+        Point3f o(target.x + 2 * (rng.UniformFloat() - .5f),
+                  target.y + 2 * (rng.UniformFloat() - .5f),
+                  rng.UniformFloat() < .5f ? -2 : 2);
+        Ray r(o, target - o), rBrute = r;
+        SurfaceInteraction isect, isectBrute;
+        bool hitBrute = false;
+        for (const std::shared_ptr<Shape> &tri : tris) {
+            Float tHit;
+            if (tri->Intersect(rBrute, &tHit, &isectBrute)) {
+                rBrute.tMax = tHit;
+                hitBrute = true;
+            }
+        }
+        EXPECT_EQ(hitBrute, bvh.IntersectP(r));
+        ASSERT_EQ(hitBrute, bvh.Intersect(r, &isect));
+        EXPECT_EQ(rBrute.tMax, r.tMax);
+        // Rays through shared vertices and edges hit several triangles at
+        // the same $t$; which of them is reported depends on the order
+        // that they are tested in, but not the point that is hit
+        if (hitBrute) {
+            EXPECT_EQ(isectBrute.p, isect.p);
+            EXPECT_EQ(isectBrute.n, isect.n);
+        }
+    }
+
+    // Batches of such rays that all travel in the same octant are traced
+    // as packets, with the triangle groups tested four rays at a time
+    std::unique_ptr<RayBatch> batch(new RayBatch);
+    std::unique_ptr<SurfaceInteraction[]> isects(
+        new SurfaceInteraction[MaxRayBatchSize]);
+    for (int b = 0; b < 20; ++b) {
+        batch->Clear();
+        std::vector<Ray> rays;
+        for (int i = 0; i < MaxRayBatchSize; ++i) {
+            Point3f target(rng.UniformUInt32(2 * n + 1) * .5f,
+                           rng.UniformUInt32(2 * n + 1) * .5f, .25f);
+            Point3f o(target.x - .1f - rng.UniformFloat(),
+                      target.y - .1f - rng.UniformFloat(), -2);
+            rays.push_back(Ray(o, target - o));
+            batch->Add(rays.back());
+        }
+        bvh.IntersectPBatch(*batch);
+        for (int i = 0; i < MaxRayBatchSize; ++i)
+            EXPECT_EQ(bvh.IntersectP(rays[i]), batch->hit.IsSet(i));
+
+        batch->active.Clear();
+        batch->hit.Clear();
+        for (int i = 0; i < MaxRayBatchSize; ++i) batch->active.Set(i);
+        bvh.IntersectBatch(*batch, isects.get());
+        for (int i = 0; i < MaxRayBatchSize; ++i) {
+            SurfaceInteraction isect;
+            bool hit = bvh.Intersect(rays[i], &isect);
+            ASSERT_EQ(hit, batch->hit.IsSet(i));
+            EXPECT_EQ(rays[i].tMax, batch->tMax[i]);
+            if (hit) {
+                EXPECT_EQ(isect.p, isects[i].p);
+                EXPECT_EQ(isect.n, isects[i].n);
+            }
+        }
+    }
+}
+
+TEST(BVH, SpatialSplits) {
+    RNG rng(8);
+    // Long, thin triangles that cross the scene diagonally, plus a sphere
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    int nTris = 1000;
+    for (int i = 0; i < nTris; ++i) {
+        Point3f c(Lerp(rng.UniformFloat(), -10, 10),
+                  Lerp(rng.UniformFloat(), -10, 10),
+                  Lerp(rng.UniformFloat(), -10, 10));
+        Vector3f d(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                   rng.UniformFloat() - .5f);
+        indices.insert(indices.end(), {(int)p.size(), (int)p.size() + 1,
+                                       (int)p.size() + 2});
+        p.push_back(c + 20 * d);
+        p.push_back(c - 20 * d);
+        p.push_back(c + Vector3f(.1f, .1f, .1f));
+    }
+    std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+        &identity, &identity, false, nTris, indices.data(), p.size(), p.data(),
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+    static Transform sphereToWorld = Translate(Vector3f(2, -1, 3));
+    static Transform worldToSphere = Inverse(sphereToWorld);
+    std::shared_ptr<Primitive> sphere = std::make_shared<GeometricPrimitive>(
+        std::make_shared<Sphere>(&sphereToWorld, &worldToSphere, false, 4.f,
+                                 -4.f, 4.f, 360.f),
+        nullptr, nullptr, MediumInterface());
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &tri : tris)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    prims.push_back(sphere);
+    std::shared_ptr<Primitive> mesh =
+        CreateTriangleMeshPrimitive(tris, nullptr, MediumInterface());
+
+    for (int width : {2, 4, 8})
+        for (Float budget : {0.f, .3f, 4.f}) {
+            BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SBVH, width,
+                         BVHAccel::NodeFormat::Full, budget);
+            EXPECT_EQ(Union(mesh->WorldBound(), sphere->WorldBound()),
+                      bvh.WorldBound());
+            CheckAgainstBruteForce(bvh, prims, rng, 1000);
+            BVHAccel meshBVH({mesh, sphere}, 4, BVHAccel::SplitMethod::SBVH,
+                             width, BVHAccel::NodeFormat::Full, budget);
+            CheckAgainstBruteForce(meshBVH, prims, rng, 1000);
+            if (width == 2) CheckBatchAgainstScalar(meshBVH, rng);
+        }
+}
+
+TEST(BVH, TreeletRestructuring) {
+    RNG rng(9);
+    std::vector<std::shared_ptr<Shape>> tris = RandomTriangleMesh(rng, 3000);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &tri : tris)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    std::shared_ptr<Primitive> mesh =
+        CreateTriangleMeshPrimitive(tris, nullptr, MediumInterface());
+
+    for (int width : {2, 4})
+        for (BVHAccel::SplitMethod splitMethod :
+             {BVHAccel::SplitMethod::HLBVH, BVHAccel::SplitMethod::SAH}) {
+            BVHAccel bvh(prims, 4, splitMethod, width,
+                         BVHAccel::NodeFormat::Full, .3f, 3);
+            EXPECT_EQ(mesh->WorldBound(), bvh.WorldBound());
+            CheckAgainstBruteForce(bvh, prims, rng, 1000);
+            BVHAccel meshBVH({mesh}, 4, splitMethod, width,
+                             BVHAccel::NodeFormat::Full, .3f, 3);
+            CheckAgainstBruteForce(meshBVH, prims, rng, 1000);
+            if (width == 2) CheckBatchAgainstScalar(meshBVH, rng);
+        }
+}
+
+TEST(BVH, ClusteredLayout) {
+    RNG rng(10);
+    std::vector<std::shared_ptr<Shape>> tris = RandomTriangleMesh(rng, 5000);
+    std::shared_ptr<Primitive> mesh =
+        CreateTriangleMeshPrimitive(tris, nullptr, MediumInterface());
+    static Transform sphereToWorld = Translate(Vector3f(2, -1, 3));
+    static Transform worldToSphere = Inverse(sphereToWorld);
+    std::shared_ptr<Primitive> sphere = std::make_shared<GeometricPrimitive>(
+        std::make_shared<Sphere>(&sphereToWorld, &worldToSphere, false, 1.5f,
+                                 -1.5f, 1.5f, 360.f),
+        nullptr, nullptr, MediumInterface());
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 1000);
+    std::vector<std::shared_ptr<Primitive>> all = prims;
+    for (const auto &tri : tris)
+        all.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    all.push_back(sphere);
+    prims.push_back(mesh);
+    prims.push_back(sphere);
+    Bounds3f bounds;
+    for (const auto &prim : all) bounds = Union(bounds, prim->WorldBound());
+
+    for (int width : {2, 4, 8})
+        for (BVHAccel::NodeFormat nodeFormat :
+             {BVHAccel::NodeFormat::Full, BVHAccel::NodeFormat::Quantized}) {
+            if (width == 2 && nodeFormat == BVHAccel::NodeFormat::Quantized)
+                continue;
+            BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                         nodeFormat, .3f, 0, BVHAccel::NodeLayout::Clustered);
+            EXPECT_EQ(bounds, bvh.WorldBound());
+            CheckAgainstBruteForce(bvh, all, rng, 1000);
+            if (width == 2) CheckBatchAgainstScalar(bvh, rng);
+
+            // Benchmark mode must not change the results
+            BVHAccel benchmark(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                               nodeFormat, .3f, 0,
+                               BVHAccel::NodeLayout::Clustered, true);
+            CheckAgainstBruteForce(benchmark, all, rng, 200);
+        }
+}
+
+TEST(BVH, Cache) {
+    RNG rng(11);
+    std::vector<std::shared_ptr<Shape>> tris = RandomTriangleMesh(rng, 2000);
+    std::shared_ptr<Primitive> mesh =
+        CreateTriangleMeshPrimitive(tris, nullptr, MediumInterface());
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 500);
+    std::vector<std::shared_ptr<Primitive>> all = prims;
+    for (const auto &tri : tris)
+        all.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    prims.push_back(mesh);
+
+    for (int width : {2, 4, 8})
+        for (BVHAccel::NodeFormat nodeFormat :
+             {BVHAccel::NodeFormat::Full, BVHAccel::NodeFormat::Quantized}) {
+            if (width == 2 && nodeFormat == BVHAccel::NodeFormat::Quantized)
+                continue;
+            BVHAccel built(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                           nodeFormat, .3f, 0, BVHAccel::NodeLayout::Clustered,
+                           false, ".");
+            EXPECT_FALSE(built.LoadedFromCache());
+            BVHAccel cached(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                            nodeFormat, .3f, 0, BVHAccel::NodeLayout::Clustered,
+                            false, ".");
+            EXPECT_TRUE(cached.LoadedFromCache());
+            EXPECT_EQ(built.CacheFilename(), cached.CacheFilename());
+            EXPECT_EQ(built.WorldBound(), cached.WorldBound());
+            CheckAgainstBruteForce(cached, all, rng, 1000);
+            if (width == 2) CheckBatchAgainstScalar(cached, rng);
+
+            // A cache with corrupt nodes must be rebuilt rather than used;
+            // the nodes start at byte 128, after the header.
+            FILE *f = fopen(built.CacheFilename().c_str(), "r+b");
+            ASSERT_TRUE(f != nullptr);
+            std::vector<uint8_t> garbage(256, 0xff);
+            EXPECT_EQ(0, fseek(f, 128, SEEK_SET));
+            EXPECT_EQ(garbage.size(),
+                      fwrite(garbage.data(), 1, garbage.size(), f));
+            EXPECT_EQ(0, fclose(f));
+            BVHAccel rebuilt(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                             nodeFormat, .3f, 0,
+                             BVHAccel::NodeLayout::Clustered, false, ".");
+            EXPECT_FALSE(rebuilt.LoadedFromCache());
+            CheckAgainstBruteForce(rebuilt, all, rng, 200);
+
+            // Different parameters or geometry must not use the cached BVH
+            BVHAccel otherParams(prims, 2, BVHAccel::SplitMethod::SAH, width,
+                                 nodeFormat, .3f, 0,
+                                 BVHAccel::NodeLayout::Clustered, false, ".");
+            EXPECT_FALSE(otherParams.LoadedFromCache());
+            std::vector<std::shared_ptr<Primitive>> fewer(prims.begin() + 1,
+                                                          prims.end());
+            BVHAccel otherPrims(fewer, 4, BVHAccel::SplitMethod::SAH, width,
+                                nodeFormat, .3f, 0,
+                                BVHAccel::NodeLayout::Clustered, false, ".");
+            EXPECT_FALSE(otherPrims.LoadedFromCache());
+            for (const BVHAccel *bvh : {&built, &otherParams, &otherPrims})
+                EXPECT_EQ(0, remove(bvh->CacheFilename().c_str()));
+        }
+}
+
+TEST(InstanceAccel, MatchesTransformedPrimitives) {
+    RNG rng(12);
+    std::vector<std::shared_ptr<Primitive>> objects;
+    objects.push_back(std::make_shared<BVHAccel>(RandomTriangles(rng, 200)));
+    static Transform identityTransform;
+    objects.push_back(std::make_shared<GeometricPrimitive>(
+        std::make_shared<Sphere>(&identityTransform, &identityTransform,
+                                 false, .5f, -.5f, .5f, 360.f),
+        nullptr, nullptr, MediumInterface()));
+
+    // Random instances; every third one shares its transformation with the
+    // previous instance
+    auto randomTransform = [&]() {
+        return Translate(Vector3f(Lerp(rng.UniformFloat(), -10, 10),
+                                  Lerp(rng.UniformFloat(), -10, 10),
+                                  Lerp(rng.UniformFloat(), -10, 10))) *
+               RotateZ(360 * rng.UniformFloat()) *
+               Scale(.1f, .1f, .1f) *
+               Scale(Lerp(rng.UniformFloat(), .5f, 2), 1, 1);
+    };
+    std::vector<Transform> instanceToWorld;
+    std::vector<InstanceAccel::Instance> instances;
+    for (int i = 0; i < 500; ++i) {
+        if (i % 3 != 2) instanceToWorld.push_back(randomTransform());
+        instances.push_back(
+            {int32_t(rng.UniformUInt32(objects.size())),
+             int32_t(instanceToWorld.size() - 1)});
+    }
+    auto transformedPrims = [&]() {
+        std::vector<std::shared_ptr<Primitive>> prims;
+        for (const InstanceAccel::Instance &instance : instances) {
+            const Transform *t = &instanceToWorld[instance.transformIndex];
+            prims.push_back(std::make_shared<TransformedPrimitive>(
+                objects[instance.objectIndex],
+                AnimatedTransform(t, 0, t, 1)));
+        }
+        return prims;
+    };
+    std::vector<Transform> worldToInstance;
+    for (const Transform &t : instanceToWorld)
+        worldToInstance.push_back(Inverse(t));
+
+    InstanceAccel accel(objects, worldToInstance, instances);
+    std::vector<std::shared_ptr<Primitive>> prims = transformedPrims();
+    Bounds3f bounds;
+    for (const auto &prim : prims) bounds = Union(bounds, prim->WorldBound());
+    EXPECT_EQ(bounds, accel.WorldBound());
+    CheckAgainstBruteForce(accel, prims, rng, 2000);
+
+    // Move some of the instances and refit the top-level BVH
+    for (size_t i = 0; i < instanceToWorld.size(); i += 4) {
+        instanceToWorld[i] = randomTransform();
+        accel.SetTransform(i, Inverse(instanceToWorld[i]));
+    }
+    accel.Refit();
+    prims = transformedPrims();
+    bounds = Bounds3f();
+    for (const auto &prim : prims) bounds = Union(bounds, prim->WorldBound());
+    EXPECT_EQ(bounds, accel.WorldBound());
+    CheckAgainstBruteForce(accel, prims, rng, 2000);
+}
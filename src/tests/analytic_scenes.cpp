@@ -27,6 +27,7 @@
 #include "samplers/zerotwosequence.h"
 #include "scene.h"
 #include "shapes/sphere.h"
+#include "shapes/triangle.h"
 #include "spectrum.h"
 #include "textures/constant.h"
 
@@ -438,3 +439,250 @@ TEST_P(RenderTest, RadianceMatches) {
 
 INSTANTIATE_TEST_CASE_P(AnalyticTestScenes, RenderTest,
                         testing::ValuesIn(GetIntegrators()));
+
+// Renders the first test scene with the path tracer and the given sampler
+// (a stratified one by default) with the given options and returns the
+// image. Small tiles give
+// idle threads a chance to split them. With a box filter of radius 1/2,
+// each pixel's value is the sum of its own samples, so images are equal
+// exactly if the same samples were taken and added in the same order.
+static std::unique_ptr<RGBSpectrum[]> RenderTestImage(
+    const Options &options, std::shared_ptr<Sampler> sampler = nullptr) {
+    Options savedOptions = PbrtOptions;
+    pbrtInit(options);
+    Point2i resolution(32, 32);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., "determinism.pfm", 1.,
+                          Infinity, 4);
+    static Transform id;
+    AnimatedTransform identity(&id, 0, &id, 1);
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    if (!sampler) sampler = std::make_shared<StratifiedSampler>(4, 4, true, 8);
+    std::unique_ptr<Integrator> integrator(new PathIntegrator(
+        5, camera, sampler, film->croppedPixelBounds));
+    integrator->Render(*GetScenes()[0].scene);
+    integrator.reset();
+    pbrtCleanup();
+    PbrtOptions = savedOptions;
+
+    Point2i readResolution;
+    std::unique_ptr<RGBSpectrum[]> image =
+        ReadImage("determinism.pfm", &readResolution);
+    EXPECT_EQ(resolution, readResolution);
+    EXPECT_EQ(0, remove("determinism.pfm"));
+    return image;
+}
+
+TEST(Render, IndependentOfThreadCount) {
+    // Tiles split off to other threads must be sampled just like they are
+    // when a single thread renders them
+    Options options;
+    options.quiet = true;
+    options.nThreads = 1;
+    std::unique_ptr<RGBSpectrum[]> single = RenderTestImage(options);
+    ASSERT_TRUE(single.get() != nullptr);
+    options.nThreads = 4;
+    for (int run = 0; run < 3; ++run) {
+        std::unique_ptr<RGBSpectrum[]> multi = RenderTestImage(options);
+        ASSERT_TRUE(multi.get() != nullptr);
+        for (int i = 0; i < 32 * 32; ++i)
+            EXPECT_EQ(single[i], multi[i]) << "pixel " << i;
+    }
+}
+
+// A Halton sampler that doesn't let the integrator look ahead at later
+// pixels' samples, so camera rays are batched one pixel at a time.
+class PerPixelHaltonSampler : public HaltonSampler {
+  public:
+    using HaltonSampler::HaltonSampler;
+    bool RepeatsPixelSamples() const { return false; }
+    std::unique_ptr<Sampler> Clone(int seed) {
+        return std::unique_ptr<Sampler>(new PerPixelHaltonSampler(*this));
+    }
+};
+
+TEST(Render, CameraRaysBatchedAcrossPixels) {
+    // Tracing camera rays for several pixels at once must not change the
+    // samples any pixel takes
+    Options options;
+    options.quiet = true;
+    options.nThreads = 1;
+    Bounds2i sampleBounds(Point2i(0, 0), Point2i(32, 32));
+    std::unique_ptr<RGBSpectrum[]> acrossPixels = RenderTestImage(
+        options, std::make_shared<HaltonSampler>(16, sampleBounds));
+    ASSERT_TRUE(acrossPixels.get() != nullptr);
+    std::unique_ptr<RGBSpectrum[]> perPixel = RenderTestImage(
+        options, std::make_shared<PerPixelHaltonSampler>(16, sampleBounds));
+    ASSERT_TRUE(perPixel.get() != nullptr);
+    for (int i = 0; i < 32 * 32; ++i)
+        EXPECT_EQ(perPixel[i], acrossPixels[i]) << "pixel " << i;
+}
+
+TEST(Render, ResumeMatchesUninterrupted) {
+    Options options;
+    options.quiet = true;
+    options.nThreads = 4;
+    options.progressive = true;
+    auto startTime = std::chrono::steady_clock::now();
+    std::unique_ptr<RGBSpectrum[]> uninterrupted = RenderTestImage(options);
+    ASSERT_TRUE(uninterrupted.get() != nullptr);
+    Float seconds = std::chrono::duration<Float>(
+                        std::chrono::steady_clock::now() - startTime)
+                        .count();
+
+    // Stop renders part of the way through, possibly in the middle of a
+    // pass, and then finish them from their checkpoints
+    for (Float fraction : {.2f, .5f}) {
+        options.timeLimit = fraction * seconds;
+        options.resume = false;
+        RenderTestImage(options);
+        FILE *checkpoint = fopen("determinism.pfm.checkpoint", "rb");
+        EXPECT_TRUE(checkpoint != nullptr);
+        if (checkpoint) fclose(checkpoint);
+
+        options.timeLimit = 0;
+        options.resume = true;
+        std::unique_ptr<RGBSpectrum[]> resumed = RenderTestImage(options);
+        ASSERT_TRUE(resumed.get() != nullptr);
+        for (int i = 0; i < 32 * 32; ++i)
+            EXPECT_EQ(uninterrupted[i], resumed[i]) << "pixel " << i;
+    }
+}
+
+// Writes a square of the given size, centered at the origin, to a binary
+// PLY file and returns the parameters of a "trianglemesh" shape with the
+// same vertices.
+static std::string WriteTestSquare(const std::string &filename, Float size) {
+    Float h = size / 2;
+    Point3f p[4] = {Point3f(-h, -h, 0), Point3f(h, -h, 0), Point3f(h, h, 0),
+                    Point3f(-h, h, 0)};
+    Point2f uv[4] = {Point2f(0, 0), Point2f(1, 0), Point2f(1, 1),
+                     Point2f(0, 1)};
+    int indices[6] = {0, 1, 2, 0, 2, 3};
+    EXPECT_TRUE(WritePlyFile(filename, 2, indices, 4, p, nullptr, nullptr, uv,
+                             nullptr));
+    std::string params = "\"integer indices\" [0 1 2 0 2 3] \"point P\" [";
+    for (const Point3f &v : p)
+        params += StringPrintf(" %.9g %.9g %.9g", v.x, v.y, v.z);
+    return params + "] \"point2 uv\" [0 0 1 0 1 1 0 1]";
+}
+
+// Renders a scene of PLY meshes, declared with _shape(i)_ for file _i_, and
+// returns the image.
+static std::unique_ptr<RGBSpectrum[]> RenderLoadingScene(
+    int nThreads, std::function<std::string(int)> shape) {
+    Options options;
+    options.quiet = true;
+    options.nThreads = nThreads;
+    Options savedOptions = PbrtOptions;
+    pbrtInit(options);
+    // The first mesh's alpha texture is redefined after the AttributeEnd
+    // that follows it, which must not affect the mesh. The second and third
+    // ones coincide, so the order of their primitives decides which one is
+    // seen. The last mesh is instanced around a mesh outside the instance.
+    // The image is a single tile that isn't split, so that pixels don't sum
+    // samples from several film tiles in an order that varies between runs.
+    pbrtParseString(
+        "LookAt 0 0 -5  0 0 0  0 1 0\n"
+        "Camera \"perspective\" \"float fov\" 60\n"
+        "Film \"image\" \"integer xresolution\" 32 "
+        "\"integer yresolution\" 32 \"string filename\" \"loading.pfm\" "
+        "\"integer tilesize\" 32 \"bool splittiles\" \"false\"\n"
+        "Sampler \"halton\" \"integer pixelsamples\" 4\n"
+        "Integrator \"directlighting\"\n"
+        "WorldBegin\n"
+        "LightSource \"point\" \"point from\" [0 0 -4] \"rgb I\" [20 20 20]\n"
+        "Texture \"kd\" \"spectrum\" \"imagemap\" "
+        "\"string filename\" \"loading-kd.png\"\n"
+        "Texture \"mask\" \"float\" \"imagemap\" "
+        "\"string filename\" \"loading-mask.png\"\n"
+        "AttributeBegin\n"
+        "  Translate -1.25 0 0\n"
+        "  Material \"matte\" \"texture Kd\" \"kd\"\n"
+        "  " + shape(0) + " \"texture alpha\" \"mask\"\n"
+        "AttributeEnd\n"
+        "Texture \"mask\" \"float\" \"constant\" \"float value\" 0\n"
+        "AttributeBegin\n"
+        "  Translate 1.25 0 0\n"
+        "  Material \"matte\" \"rgb Kd\" [.8 .2 .2]\n"
+        "  " + shape(1) + "\n"
+        "  Material \"matte\" \"rgb Kd\" [.2 .8 .2]\n"
+        "  " + shape(1) + "\n"
+        "AttributeEnd\n"
+        "ObjectBegin \"square\"\n"
+        "  Material \"matte\" \"rgb Kd\" [.2 .2 .8]\n"
+        "  " + shape(2) + "\n"
+        "ObjectEnd\n"
+        "AttributeBegin\n"
+        "  Translate 0 1.25 0\n"
+        "  ObjectInstance \"square\"\n"
+        "AttributeEnd\n"
+        "AttributeBegin\n"
+        "  Translate 0 -1.25 0\n"
+        "  " + shape(0) + "\n"
+        "AttributeEnd\n"
+        "AttributeBegin\n"
+        "  Translate 0 -1.25 -.5\n"
+        "  ObjectInstance \"square\"\n"
+        "AttributeEnd\n"
+        "WorldEnd\n");
+    pbrtCleanup();
+    PbrtOptions = savedOptions;
+
+    Point2i resolution;
+    std::unique_ptr<RGBSpectrum[]> image =
+        ReadImage("loading.pfm", &resolution);
+    EXPECT_EQ(Point2i(32, 32), resolution);
+    EXPECT_EQ(0, remove("loading.pfm"));
+    return image;
+}
+
+TEST(SceneLoading, PLYMeshesMatchSynchronousLoading) {
+    // A checkerboard diffuse texture and an alpha mask that cuts away the
+    // square's right half
+    std::vector<Float> kd, mask;
+    for (int y = 0; y < 4; ++y)
+        for (int x = 0; x < 4; ++x)
+            for (int c = 0; c < 3; ++c) {
+                kd.push_back((x + y) % 2 ? .9f : .3f);
+                mask.push_back(x < 2 ? 1 : 0);
+            }
+    WriteImage("loading-kd.png", kd.data(), Bounds2i({0, 0}, {4, 4}),
+               Point2i(4, 4));
+    WriteImage("loading-mask.png", mask.data(), Bounds2i({0, 0}, {4, 4}),
+               Point2i(4, 4));
+    std::string meshParams[3];
+    for (int i = 0; i < 3; ++i)
+        meshParams[i] = WriteTestSquare(StringPrintf("loading-%d.ply", i),
+                                        1 - .25f * i);
+
+    // Meshes given inline are created while the scene is parsed, and with
+    // a single thread, loading tasks run right away as well
+    std::unique_ptr<RGBSpectrum[]> expected =
+        RenderLoadingScene(1, [&](int i) {
+            return "Shape \"trianglemesh\" " + meshParams[i];
+        });
+    ASSERT_TRUE(expected.get() != nullptr);
+    Float sum = 0;
+    for (int i = 0; i < 32 * 32; ++i) sum += expected[i].y();
+    EXPECT_GT(sum, 0);
+
+    for (int run = 0; run < 3; ++run) {
+        std::unique_ptr<RGBSpectrum[]> loaded =
+            RenderLoadingScene(4, [](int i) {
+                return StringPrintf(
+                    "Shape \"plymesh\" \"string filename\" \"loading-%d.ply\"",
+                    i);
+            });
+        ASSERT_TRUE(loaded.get() != nullptr);
+        for (int i = 0; i < 32 * 32; ++i)
+            EXPECT_EQ(expected[i], loaded[i]) << "pixel " << i;
+    }
+
+    for (const char *file : {"loading-kd.png", "loading-mask.png",
+                             "loading-0.ply", "loading-1.ply", "loading-2.ply"})
+        EXPECT_EQ(0, remove(file));
+}
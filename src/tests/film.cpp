@@ -0,0 +1,459 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "film.h"
+#include "filters/box.h"
+#include "imageio.h"
+#include "parallel.h"
+#include "tests/parallelscope.h"
+#include "integrator.h"
+#include "rng.h"
+#ifndef PBRT_IS_WINDOWS
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace pbrt;
+
+TEST(Film, ConcurrentTilesAndSplats) {
+    ParallelScope threads(4);
+
+    const Point2i res(16, 16);
+    const int splatsPerPixel = 37;
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film film(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)), std::move(filter),
+              35.f, "filmtest.pfm", 1.f);
+
+    // Merge 4x4 pixel tiles, each giving its pixels a single sample
+    ParallelFor2D([&](Point2i t) {
+        Bounds2i sampleBounds(4 * t, 4 * t + Vector2i(4, 4));
+        std::unique_ptr<FilmTile> tile = film.GetFilmTile(sampleBounds);
+        for (Point2i p : sampleBounds)
+            tile->AddSample(Point2f(p) + Vector2f(.5f, .5f), Spectrum(.5f));
+        film.MergeFilmTile(std::move(tile));
+    }, Point2i(4, 4));
+
+    // Splat enough values from all threads that the batches are flushed
+    // while other threads are still adding to theirs
+    ParallelFor([&](int64_t i) {
+        int offset = i % (res.x * res.y);
+        Point2f p(offset % res.x + .5f, offset / res.x + .5f);
+        film.AddSplat(p, Spectrum(1.f));
+    }, splatsPerPixel * res.x * res.y, 64);
+    film.WriteImage();
+
+    Point2i readRes;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage("filmtest.pfm", &readRes);
+    ASSERT_TRUE(image.get() != nullptr);
+    EXPECT_EQ(res, readRes);
+    for (int i = 0; i < res.x * res.y; ++i) {
+        Float rgb[3];
+        image[i].ToRGB(rgb);
+        for (int c = 0; c < 3; ++c)
+            EXPECT_NEAR(.5f + splatsPerPixel, rgb[c], 1e-2f) << i;
+    }
+    EXPECT_EQ(0, remove("filmtest.pfm"));
+}
+
+TEST(Film, TileSchedulerCoversImage) {
+    ParallelScope threads(4);
+
+    for (TileOrder order :
+         {TileOrder::Scanline, TileOrder::Hilbert, TileOrder::Spiral}) {
+        std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+        Film film(Point2i(75, 41), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                  std::move(filter), 35.f, "unused.pfm", 1.f, Infinity, 8,
+                  order);
+        Bounds2i sampleBounds = film.GetSampleBounds();
+        std::vector<std::atomic<int>> counts(sampleBounds.Area());
+        for (std::atomic<int> &c : counts) c = 0;
+
+        // Every sample pixel should be rendered exactly once, even if
+        // tiles are split
+        TileScheduler scheduler(&film, sampleBounds);
+        std::atomic<int> nCalls{0};
+        scheduler.ForEachTile([&](ImageTile &tile) {
+            ++nCalls;
+            Bounds2i tileBounds = tile.bounds;
+            for (Point2i p : tileBounds) {
+                if (!tile.Owns(p)) break;
+                Vector2i offset = p - sampleBounds.pMin;
+                ++counts[offset.y * sampleBounds.Diagonal().x + offset.x];
+            }
+        });
+        EXPECT_GE(nCalls, ((75 + 7) / 8) * ((41 + 7) / 8));
+        for (const std::atomic<int> &c : counts) EXPECT_EQ(1, c);
+    }
+}
+
+#ifndef PBRT_IS_WINDOWS
+TEST(Film, SpoolTakesOverDeadClaims) {
+    ParallelScope threads(2);
+    const std::string spool = "spooltest";
+    ASSERT_EQ(0, mkdir(spool.c_str(), 0755));
+    Options savedOptions = PbrtOptions;
+    PbrtOptions.spoolDirectory = spool;
+    PbrtOptions.quiet = true;
+
+    // Claims record the claimer's host and process ID; a child process
+    // that has exited gives the ID of a process that has died
+    char host[256] = {};
+    gethostname(host, sizeof(host) - 1);
+    pid_t deadPid = fork();
+    if (deadPid == 0) _exit(0);
+    ASSERT_GT(deadPid, 0);
+    waitpid(deadPid, nullptr, 0);
+    auto writeClaim = [&](const std::string &filename, int pid) {
+        FILE *f = fopen((spool + "/" + filename).c_str(), "w");
+        ASSERT_TRUE(f != nullptr);
+        fprintf(f, "%s %d\n", host, pid);
+        fclose(f);
+    };
+    auto exists = [&](const std::string &filename) {
+        FILE *f = fopen((spool + "/" + filename).c_str(), "rb");
+        if (f) fclose(f);
+        return f != nullptr;
+    };
+
+    // Give each sample pixel a single sample whose value identifies it
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film film(Point2i(40, 24), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 35.f, "spooltest.pfm", 1.f, Infinity, 8);
+    auto value = [](const Point2i &p) { return Float(1 + p.x + 40 * p.y); };
+    auto renderTile = [&](ImageTile &tile) {
+        std::unique_ptr<FilmTile> filmTile = film.GetFilmTile(tile.bounds);
+        Bounds2i tileBounds = tile.bounds;
+        for (Point2i p : tileBounds) {
+            if (!tile.Owns(p)) break;
+            filmTile->AddSample(Point2f(p.x + .5f, p.y + .5f),
+                                Spectrum(value(p)));
+        }
+        film.MergeFilmTile(std::move(filmTile));
+    };
+
+    // Unit 0 was claimed by a process that died and unit 1 by one that is
+    // still running, so the image isn't finished
+    writeClaim("unit-0000.claim", deadPid);
+    writeClaim("unit-0001.claim", getpid());
+    TileScheduler first(&film, film.GetSampleBounds());
+    first.ForEachTile(renderTile);
+    EXPECT_TRUE(exists("unit-0000.claim.1"));
+    EXPECT_TRUE(exists("unit-0000.film"));
+    EXPECT_FALSE(exists("unit-0001.film"));
+    EXPECT_TRUE(exists("unit-0002.film"));
+    EXPECT_FALSE(first.MergeSpool());
+
+    // Once unit 1's claimer has died, another process renders it and
+    // merges all of the units
+    writeClaim("unit-0001.claim", deadPid);
+    TileScheduler second(&film, film.GetSampleBounds());
+    second.ForEachTile(renderTile);
+    EXPECT_TRUE(exists("unit-0001.film"));
+    ASSERT_TRUE(second.MergeSpool());
+    EXPECT_FALSE(first.MergeSpool());
+    film.WriteImage();
+
+    Point2i res;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage("spooltest.pfm", &res);
+    ASSERT_TRUE(image.get() != nullptr);
+    EXPECT_EQ(Point2i(40, 24), res);
+    for (Point2i p : Bounds2i(Point2i(0, 0), res)) {
+        Float rgb[3];
+        image[p.y * res.x + p.x].ToRGB(rgb);
+        EXPECT_NEAR(value(p), rgb[1], 1e-3f * value(p)) << p;
+    }
+
+    EXPECT_EQ(0, remove("spooltest.pfm"));
+    for (int unit = 0; unit < 15; ++unit)
+        for (const char *suffix : {".claim", ".claim.1", ".film"})
+            remove(StringPrintf("%s/unit-%04d%s", spool.c_str(), unit,
+                                suffix).c_str());
+    EXPECT_EQ(0, remove((spool + "/merge.claim").c_str()));
+    EXPECT_EQ(0, rmdir(spool.c_str()));
+    PbrtOptions = savedOptions;
+}
+#endif  // !PBRT_IS_WINDOWS
+
+TEST(Film, ProgressivePasses) {
+    bool progressive = PbrtOptions.progressive;
+    int checkpointPasses = PbrtOptions.checkpointPasses;
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film film(Point2i(8, 8), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 35.f, "unused.pfm", 1.f);
+
+    PbrtOptions.progressive = false;
+    RenderPasses single(&film, 10, false);
+    EXPECT_TRUE(single.Next());
+    EXPECT_EQ(0, single.start);
+    EXPECT_EQ(10, single.end);
+    EXPECT_FALSE(single.CheckpointDue());
+    EXPECT_FALSE(single.Next());
+
+    // Passes double the number of samples taken so far; checkpoints are
+    // due after every other pass, except for the last one
+    PbrtOptions.progressive = true;
+    PbrtOptions.checkpointPasses = 2;
+    RenderPasses passes(&film, 10, false);
+    int64_t expected[][2] = {{0, 1}, {1, 2}, {2, 4}, {4, 8}, {8, 10}};
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_TRUE(passes.Next());
+        EXPECT_EQ(expected[i][0], passes.start);
+        EXPECT_EQ(expected[i][1], passes.end);
+        EXPECT_EQ(i == 1 || i == 3, passes.CheckpointDue()) << i;
+    }
+    EXPECT_FALSE(passes.Next());
+
+    PbrtOptions.progressive = progressive;
+    PbrtOptions.checkpointPasses = checkpointPasses;
+}
+
+TEST(Film, AdaptivePassesSkipConvergedPixels) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film film(Point2i(8, 8), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 35.f, "unused.pfm", 1.f, Infinity, 16,
+              TileOrder::Hilbert, true, .05f, 4);
+    Bounds2i sampleBounds = film.GetSampleBounds();
+    // Adds four samples to each pixel: the left half's are all equal,
+    // while the right half's vary
+    auto addSamples = [&](bool leftVaries) {
+        std::unique_ptr<FilmTile> tile = film.GetFilmTile(sampleBounds);
+        for (Point2i p : sampleBounds)
+            for (int i = 0; i < 4; ++i) {
+                bool varies = (p.x < 4) == leftVaries;
+                Float L = varies ? 2 * (i & 1) : 1;
+                tile->AddSample(Point2f(p.x + .5f, p.y + .5f), Spectrum(L));
+            }
+        film.MergeFilmTile(std::move(tile));
+    };
+
+    RenderPasses passes(&film, 16, true);
+    ASSERT_TRUE(passes.Next());
+    EXPECT_EQ(0, passes.start);
+    EXPECT_EQ(4, passes.end);
+    for (Point2i p : sampleBounds) EXPECT_EQ(0, passes.FirstSample(p));
+    addSamples(false);
+
+    // Converged pixels are skipped for the whole pass, even if samples are
+    // added to them before it ends
+    ASSERT_TRUE(passes.Next());
+    EXPECT_EQ(4, passes.start);
+    EXPECT_EQ(8, passes.end);
+    addSamples(true);
+    for (Point2i p : sampleBounds)
+        EXPECT_EQ(p.x < 4 ? 8 : 4, passes.FirstSample(p)) << p;
+}
+
+TEST(Film, SampleSplitPasses) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film film(Point2i(8, 8), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 35.f, "unused.pfm", 1.f);
+
+    // Each part should take its range of samples in a single pass
+    PbrtOptions.nSampleSplits = 3;
+    int64_t expected[][2] = {{0, 3}, {3, 6}, {6, 10}};
+    for (int k = 0; k < 3; ++k) {
+        PbrtOptions.sampleSplit = k;
+        RenderPasses passes(&film, 10, false);
+        EXPECT_TRUE(passes.Next());
+        EXPECT_EQ(expected[k][0], passes.start);
+        EXPECT_EQ(expected[k][1], passes.end);
+        EXPECT_EQ(10, passes.ImageSamples());
+        EXPECT_FALSE(passes.Next());
+    }
+
+    // Parts may have no samples to take at all
+    PbrtOptions.sampleSplit = 0;
+    RenderPasses empty(&film, 2, false);
+    EXPECT_FALSE(empty.Next());
+
+    PbrtOptions.sampleSplit = PbrtOptions.nSampleSplits = 0;
+}
+
+TEST(Film, CheckpointRoundTrip) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(1.f, 1.f)));
+    Film film(Point2i(12, 10), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 35.f, "filmtest.pfm", 1.f);
+    RNG rng;
+    std::unique_ptr<FilmTile> tile = film.GetFilmTile(film.GetSampleBounds());
+    for (int i = 0; i < 500; ++i) {
+        Point2f p(12 * rng.UniformFloat(), 10 * rng.UniformFloat());
+        tile->AddSample(p, Spectrum(rng.UniformFloat()));
+        film.AddSplat(p, Spectrum(rng.UniformFloat()));
+    }
+    film.MergeFilmTile(std::move(tile));
+
+    Bounds2i sampleBounds = film.GetSampleBounds();
+    std::vector<int64_t> pixelSamples(sampleBounds.Area());
+    for (size_t i = 0; i < pixelSamples.size(); ++i)
+        pixelSamples[i] = 4 + i % 3;
+    ASSERT_TRUE(film.WriteCheckpoint("filmtest.checkpoint", 8, 4,
+                                     pixelSamples));
+
+    // A film with the same parameters should read back the same state,
+    // but the checkpoint shouldn't be used with a different sample count
+    std::unique_ptr<Filter> filter2(new BoxFilter(Vector2f(1.f, 1.f)));
+    Film resumed(Point2i(12, 10), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                 std::move(filter2), 35.f, "filmtest2.pfm", 1.f);
+    int64_t samplesTaken;
+    std::vector<int64_t> readSamples;
+    EXPECT_FALSE(resumed.ReadCheckpoint("filmtest.checkpoint", 16,
+                                        &samplesTaken, &readSamples));
+    ASSERT_TRUE(resumed.ReadCheckpoint("filmtest.checkpoint", 8,
+                                       &samplesTaken, &readSamples));
+    EXPECT_EQ(4, samplesTaken);
+    EXPECT_EQ(pixelSamples, readSamples);
+
+    film.WriteImage(.25f);
+    resumed.WriteImage(.25f);
+    Point2i res, res2;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage("filmtest.pfm", &res);
+    std::unique_ptr<RGBSpectrum[]> image2 = ReadImage("filmtest2.pfm", &res2);
+    ASSERT_TRUE(image && image2);
+    EXPECT_EQ(res, res2);
+    for (int i = 0; i < res.x * res.y; ++i) EXPECT_EQ(image[i], image2[i]);
+
+    EXPECT_EQ(0, remove("filmtest.checkpoint"));
+    EXPECT_EQ(0, remove("filmtest.pfm"));
+    EXPECT_EQ(0, remove("filmtest2.pfm"));
+}
+
+TEST(Film, ReusedTilesStartEmpty) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film film(Point2i(8, 8), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 35.f, "filmtest.pfm", 1.f);
+    std::unique_ptr<FilmTile> tile = film.GetFilmTile(film.GetSampleBounds());
+    for (Point2i p : film.GetSampleBounds())
+        tile->AddSample(Point2f(p) + Vector2f(.5f, .5f), Spectrum(1.f));
+    const FilmTile *merged = tile.get();
+    film.MergeFilmTile(std::move(tile));
+
+    // A merged tile's storage is reused for later tiles, whatever their
+    // bounds, without any of its samples
+    Bounds2i sampleBounds(Point2i(2, 3), Point2i(5, 7));
+    tile = film.GetFilmTile(sampleBounds);
+    EXPECT_EQ(merged, tile.get());
+    EXPECT_TRUE(Inside(sampleBounds.pMin, tile->GetPixelBounds()));
+    EXPECT_LT(tile->GetPixelBounds().Area(), 8 * 8);
+    for (Point2i p : tile->GetPixelBounds()) {
+        EXPECT_EQ(0, tile->GetPixel(p).filterWeightSum);
+        EXPECT_TRUE(tile->GetPixel(p).contribSum.IsBlack());
+    }
+}
+
+TEST(Film, VarianceEstimator) {
+    RNG rng;
+    VarianceEstimator all, a, b;
+    std::vector<Float> values;
+    for (int i = 0; i < 1000; ++i) {
+        Float v = rng.UniformFloat() * (i % 7);
+        values.push_back(v);
+        all.Add(v);
+        (i < 300 ? a : b).Add(v);
+    }
+    Float mean = 0, variance = 0;
+    for (Float v : values) mean += v / values.size();
+    for (Float v : values)
+        variance += (v - mean) * (v - mean) / (values.size() - 1);
+
+    EXPECT_NEAR(mean, all.mean, 1e-4);
+    EXPECT_NEAR(variance, all.Variance(), 1e-3);
+    a.Merge(b);
+    EXPECT_EQ(all.n, a.n);
+    EXPECT_NEAR(all.mean, a.mean, 1e-4);
+    EXPECT_NEAR(all.Variance(), a.Variance(), 1e-3);
+}
+
+TEST(Film, PartialFilmMerge) {
+    auto makeFilm = [](const char *filename) {
+        std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(1.f, 1.f)));
+        return std::unique_ptr<Film>(
+            new Film(Point2i(20, 12), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                     std::move(filter), 35.f, filename, 1.f));
+    };
+    std::unique_ptr<Film> whole = makeFilm("filmtest.pfm");
+    std::unique_ptr<Film> left = makeFilm("unused.pfm");
+    std::unique_ptr<Film> right = makeFilm("unused.pfm");
+    std::unique_ptr<Film> merged = makeFilm("filmtest2.pfm");
+
+    // Render the left and right halves of the image into separate films,
+    // with all of the splats going to the left half's
+    Bounds2i halves[2] = {Bounds2i(Point2i(0, 0), Point2i(10, 12)),
+                          Bounds2i(Point2i(10, 0), Point2i(20, 12))};
+    RNG rng;
+    for (int i = 0; i < 2; ++i) {
+        std::unique_ptr<FilmTile> tile = whole->GetFilmTile(halves[i]);
+        std::unique_ptr<FilmTile> halfTile =
+            (i == 0 ? left : right)->GetFilmTile(halves[i]);
+        for (int j = 0; j < 300; ++j) {
+            Point2f p = Bounds2f(halves[i]).Lerp(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()));
+            Spectrum L(rng.UniformFloat());
+            tile->AddSample(p, L);
+            halfTile->AddSample(p, L);
+        }
+        whole->MergeFilmTile(std::move(tile));
+        (i == 0 ? left : right)->MergeFilmTile(std::move(halfTile));
+    }
+    for (int i = 0; i < 100; ++i) {
+        Point2f p(20 * rng.UniformFloat(), 12 * rng.UniformFloat());
+        Spectrum v(rng.UniformFloat());
+        whole->AddSplat(p, v);
+        left->AddSplat(p, v);
+    }
+
+    // The merged partial films should give exactly the same image
+    ASSERT_TRUE(left->WritePartialFilm("filmtest.left", halves[0]));
+    ASSERT_TRUE(right->WritePartialFilm(
+        "filmtest.right", Bounds2i(Point2i(8, 0), Point2i(20, 12))));
+    EXPECT_TRUE(merged->MergePartialFilm("filmtest.left"));
+    EXPECT_TRUE(merged->MergePartialFilm("filmtest.right"));
+    whole->WriteImage(.5f);
+    merged->WriteImage(.5f);
+    Point2i res, res2;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage("filmtest.pfm", &res);
+    std::unique_ptr<RGBSpectrum[]> image2 = ReadImage("filmtest2.pfm", &res2);
+    ASSERT_TRUE(image && image2);
+    EXPECT_EQ(res, res2);
+    for (int i = 0; i < res.x * res.y; ++i) EXPECT_EQ(image[i], image2[i]);
+
+    // Without --samplesplit, a partial film holds part 0 of 1
+    Point2i resolution;
+    Bounds2f cropWindow;
+    Float scale, splatScale;
+    int sampleSplit, nSampleSplits;
+    ASSERT_TRUE(ReadPartialFilmInfo("filmtest.left", &resolution,
+                                    &cropWindow, &scale, &splatScale,
+                                    &sampleSplit, &nSampleSplits));
+    EXPECT_EQ(0, sampleSplit);
+    EXPECT_EQ(1, nSampleSplits);
+
+    // A film made from a partial film's information should have the same
+    // bounds, even with a crop window
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film cropped(Point2i(37, 23), Bounds2f(Point2f(.1f, .3f), Point2f(.7f, 1)),
+                 std::move(filter), 35.f, "unused.pfm", 2.f);
+    Options savedOptions = PbrtOptions;
+    PbrtOptions.sampleSplit = 2;
+    PbrtOptions.nSampleSplits = 3;
+    ASSERT_TRUE(cropped.WritePartialFilm("filmtest.cropped",
+                                         cropped.croppedPixelBounds, .25f));
+    PbrtOptions = savedOptions;
+    ASSERT_TRUE(ReadPartialFilmInfo("filmtest.cropped", &resolution,
+                                    &cropWindow, &scale, &splatScale,
+                                    &sampleSplit, &nSampleSplits));
+    EXPECT_EQ(2, sampleSplit);
+    EXPECT_EQ(3, nSampleSplits);
+    std::unique_ptr<Filter> filter2(new BoxFilter(Vector2f(.5f, .5f)));
+    Film info(resolution, cropWindow, std::move(filter2), 35.f, "unused.pfm",
+              scale);
+    EXPECT_EQ(cropped.croppedPixelBounds, info.croppedPixelBounds);
+    EXPECT_EQ(2.f, scale);
+    EXPECT_EQ(.25f, splatScale);
+    EXPECT_TRUE(info.MergePartialFilm("filmtest.cropped"));
+
+    EXPECT_EQ(0, remove("filmtest.cropped"));
+    EXPECT_EQ(0, remove("filmtest.left"));
+    EXPECT_EQ(0, remove("filmtest.right"));
+    EXPECT_EQ(0, remove("filmtest.pfm"));
+    EXPECT_EQ(0, remove("filmtest2.pfm"));
+}
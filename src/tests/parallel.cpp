@@ -2,6 +2,8 @@
 #include "tests/gtest/gtest.h"
 #include "pbrt.h"
 #include "parallel.h"
+#include "tests/parallelscope.h"
+#include "memory.h"
 #include <atomic>
 
 using namespace pbrt;
@@ -37,3 +39,78 @@ TEST(Parallel, DoNothing) {
 
     ParallelCleanup();
 }
+
+TEST(Parallel, Nested) {
+    // Make sure there are worker threads even on single-core machines.
+    ParallelScope threads(4);
+
+    std::atomic<int> counter{0};
+    ParallelFor([&](int64_t) {
+        ParallelFor([&](int64_t) {
+            ParallelFor([&](int64_t) { ++counter; }, 10);
+        }, 10);
+    }, 10);
+    EXPECT_EQ(1000, counter);
+}
+
+// Sums _[start, end)_ by recursively splitting the range into tasks.
+static int64_t TaskSum(int64_t start, int64_t end) {
+    if (end - start <= 16) {
+        int64_t sum = 0;
+        for (int64_t i = start; i < end; ++i) sum += i;
+        return sum;
+    }
+    int64_t mid = (start + end) / 2, upper;
+    TaskGroup group;
+    group.Spawn([&]() { upper = TaskSum(mid, end); });
+    int64_t lower = TaskSum(start, mid);
+    group.Wait();
+    return lower + upper;
+}
+
+TEST(Parallel, TaskGroup) {
+    ParallelScope threads(4);
+
+    EXPECT_EQ(int64_t(99999) * 100000 / 2, TaskSum(0, 100000));
+
+    // Every iteration runs exactly once, also when loops are nested in
+    // tasks
+    std::vector<std::atomic<int>> visits(10007);
+    for (std::atomic<int> &v : visits) v = 0;
+    TaskGroup group;
+    for (int t = 0; t < 3; ++t)
+        group.Spawn([&]() {
+            ParallelFor([&](int64_t i) { ++visits[i]; }, visits.size(), 7);
+        });
+    group.Wait();
+    for (const std::atomic<int> &v : visits) EXPECT_EQ(3, v);
+}
+
+TEST(Parallel, MemoryArenaPool) {
+    ParallelScope threads(4);
+
+    // Each task should have its thread's arena to itself, and the arenas
+    // shouldn't need more blocks once they have served the largest task
+    MemoryArenaPool pool;
+    std::atomic<int> failures{0};
+    ParallelFor([&](int64_t i) {
+        MemoryArena &arena = pool.ThreadArena();
+        int n = 1000 + (i % 7) * 20000;
+        int *values = arena.Alloc<int>(n, false);
+        for (int j = 0; j < n; ++j) values[j] = i + j;
+        for (int j = 0; j < n; ++j)
+            if (values[j] != i + j) ++failures;
+        arena.Reset();
+    }, 200, 1);
+    EXPECT_EQ(0, failures);
+
+    MemoryArena &arena = pool.ThreadArena();
+    EXPECT_EQ(0u, (uintptr_t)&arena % PBRT_L1_CACHE_LINE_SIZE);
+    size_t allocated = arena.TotalAllocated();
+    for (int i = 0; i < 100; ++i) {
+        arena.Alloc(100000);
+        arena.Alloc(200000);
+        arena.Reset();
+    }
+    EXPECT_LE(arena.TotalAllocated(), std::max<size_t>(allocated, 600000));
+}
@@ -0,0 +1,31 @@
+#ifndef PBRT_TESTS_PARALLELSCOPE_H
+#define PBRT_TESTS_PARALLELSCOPE_H
+
+#include "pbrt.h"
+#include "parallel.h"
+
+namespace pbrt {
+
+// Starts _nThreads_ worker threads for the rest of the enclosing scope.
+// The threads are shut down and the previous thread count is restored
+// when the scope is left, including when a failed ASSERT returns early.
+class ParallelScope {
+  public:
+    explicit ParallelScope(int nThreads) : savedThreads(PbrtOptions.nThreads) {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+    }
+    ~ParallelScope() {
+        ParallelCleanup();
+        PbrtOptions.nThreads = savedThreads;
+    }
+
+  private:
+    ParallelScope(const ParallelScope &) = delete;
+    ParallelScope &operator=(const ParallelScope &) = delete;
+    const int savedThreads;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_TESTS_PARALLELSCOPE_H
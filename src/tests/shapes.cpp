@@ -11,8 +11,10 @@
 #include "shapes/cylinder.h"
 #include "shapes/disk.h"
 #include "shapes/paraboloid.h"
+#include "shapes/plymesh.h"
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
+#include "paramset.h"
 
 using namespace pbrt;
 
@@ -557,3 +559,126 @@ TEST(Triangle, BadCases) {
     SurfaceInteraction isect;
     EXPECT_FALSE(mesh[0]->Intersect(ray, &thit, &isect));
 }
+
+// Writes a PLY file in _format_ whose vertices have float positions and
+// normals, an int "flags" property, and double $(s,t)$s, and whose faces
+// have a uchar/int "vertex_indices" list followed by an int "material".
+static void WriteTestPLY(const std::string &filename, const char *format,
+                         const std::vector<Point3f> &p,
+                         const std::vector<std::vector<int>> &faces) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f,
+            "ply\nformat %s 1.0\ncomment test\nelement vertex %d\n"
+            "property float x\nproperty float y\nproperty float z\n"
+            "property float nx\nproperty float ny\nproperty float nz\n"
+            "property int flags\nproperty double s\nproperty double t\n"
+            "element face %d\nproperty list uchar int vertex_indices\n"
+            "property int material\nend_header\n",
+            format, (int)p.size(), (int)faces.size());
+    bool ascii = !strcmp(format, "ascii");
+    bool swap = !strcmp(format, "binary_big_endian");
+    auto write = [&](const void *value, size_t size) {
+        uint8_t bytes[8];
+        memcpy(bytes, value, size);
+        if (swap) std::reverse(bytes, bytes + size);
+        fwrite(bytes, size, 1, f);
+    };
+    for (size_t i = 0; i < p.size(); ++i) {
+        float v[6] = {(float)p[i].x, (float)p[i].y, (float)p[i].z, 0, 0, 1};
+        int flags = 7;
+        double st[2] = {0.25 * i, 1. / (i + 1)};
+        if (ascii)
+            fprintf(f, "%.9g %.9g %.9g %g %g %g %d %.17g %.17g\n", v[0], v[1],
+                    v[2], v[3], v[4], v[5], flags, st[0], st[1]);
+        else {
+            for (float c : v) write(&c, sizeof(c));
+            write(&flags, sizeof(flags));
+            for (double c : st) write(&c, sizeof(c));
+        }
+    }
+    for (size_t i = 0; i < faces.size(); ++i) {
+        uint8_t count = faces[i].size();
+        int material = i;
+        if (ascii) {
+            fprintf(f, "%d", count);
+            for (int v : faces[i]) fprintf(f, " %d", v);
+            fprintf(f, " %d\n", material);
+        } else {
+            write(&count, sizeof(count));
+            for (int v : faces[i]) write(&v, sizeof(v));
+            write(&material, sizeof(material));
+        }
+    }
+    fclose(f);
+}
+
+static std::shared_ptr<TriangleMesh> ReadTestPLY(const std::string &filename) {
+    ParamSet params;
+    std::unique_ptr<std::string[]> name(new std::string[1]);
+    name[0] = filename;
+    params.AddString("filename", std::move(name), 1);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> shapes =
+        CreatePLYMesh(&identity, &identity, false, params);
+    if (shapes.empty()) return nullptr;
+    return std::dynamic_pointer_cast<Triangle>(shapes[0])->GetMesh();
+}
+
+TEST(PLYMesh, BinaryMatchesASCII) {
+    // Binary little-endian files are converted directly from memory, while
+    // ASCII and big-endian ones are read with rply; all should give the
+    // same mesh, with the quad and ignored five-sided face handled alike.
+    RNG rng;
+    std::vector<Point3f> p;
+    for (int i = 0; i < 7; ++i)
+        p.push_back(Point3f(rng.UniformFloat(), rng.UniformFloat(),
+                            rng.UniformFloat()));
+    std::vector<std::vector<int>> faces = {
+        {0, 1, 2}, {1, 3, 4, 2}, {0, 1, 2, 3, 4}, {6, 5, 4}};
+    const char *formats[] = {"ascii", "binary_little_endian",
+                             "binary_big_endian"};
+    std::shared_ptr<TriangleMesh> meshes[3];
+    for (int i = 0; i < 3; ++i) {
+        WriteTestPLY("test.tmp.ply", formats[i], p, faces);
+        meshes[i] = ReadTestPLY("test.tmp.ply");
+        ASSERT_TRUE(meshes[i] != nullptr) << formats[i];
+        EXPECT_EQ(0, remove("test.tmp.ply"));
+    }
+
+    EXPECT_EQ(4, meshes[0]->nTriangles);
+    std::vector<int> indices = {0, 1, 2, 1, 3, 4, 2, 1, 4, 6, 5, 4};
+    EXPECT_EQ(indices, meshes[0]->vertexIndices);
+    for (int i = 1; i < 3; ++i) {
+        const TriangleMesh &a = *meshes[0], &b = *meshes[i];
+        EXPECT_EQ(a.nVertices, b.nVertices);
+        EXPECT_EQ(a.vertexIndices, b.vertexIndices);
+        ASSERT_TRUE(b.n && b.uv);
+        for (int v = 0; v < a.nVertices; ++v) {
+            EXPECT_EQ(a.p[v], b.p[v]);
+            EXPECT_EQ(a.n[v], b.n[v]);
+            EXPECT_EQ(a.uv[v], b.uv[v]);
+        }
+    }
+}
+
+TEST(PLYMesh, BinaryErrors) {
+    std::vector<Point3f> p(3, Point3f(0, 0, 0));
+
+    // Out-of-range vertex index
+    WriteTestPLY("test.tmp.ply", "binary_little_endian", p, {{0, 1, 3}});
+    EXPECT_TRUE(ReadTestPLY("test.tmp.ply") == nullptr);
+
+    // Truncated file
+    WriteTestPLY("test.tmp.ply", "binary_little_endian", p, {{0, 1, 2}});
+    FILE *f = fopen("test.tmp.ply", "rb");
+    ASSERT_TRUE(f != nullptr);
+    std::vector<char> contents(1 << 16);
+    contents.resize(fread(contents.data(), 1, contents.size(), f));
+    fclose(f);
+    f = fopen("test.tmp.ply", "wb");
+    fwrite(contents.data(), 1, contents.size() - 2, f);
+    fclose(f);
+    EXPECT_TRUE(ReadTestPLY("test.tmp.ply") == nullptr);
+    EXPECT_EQ(0, remove("test.tmp.ply"));
+}
@@ -0,0 +1,272 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "mipmap.h"
+#include "parallel.h"
+#include "tests/parallelscope.h"
+#include "rng.h"
+#include "texcache.h"
+#include "imageio.h"
+#include "interaction.h"
+#include "textures/imagemap.h"
+#include <atomic>
+
+using namespace pbrt;
+
+TEST(TextureTileCache, MatchesMIPMap) {
+    ParallelScope threads(4);
+
+    // Build a MIP map with enough texels that its top level has several
+    // tiles, and a tiled copy of it read through a cache that only has
+    // room for a few of them
+    Point2i res(300, 170);
+    std::vector<RGBSpectrum> image(res.x * res.y);
+    RNG rng;
+    for (RGBSpectrum &texel : image) {
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        texel = RGBSpectrum::FromRGB(rgb);
+    }
+    MIPMap<RGBSpectrum> mipmap(res, image.data());
+    ASSERT_TRUE(mipmap.WriteTiled("tiled.tmp.tex", 17));
+    std::unique_ptr<TextureTileCache> cache(
+        new TextureTileCache(64 * 64 * 3 * sizeof(float) * 8));
+    EXPECT_TRUE(cache->AddTexture("tiled.tmp.tex", 3, 18) == nullptr);
+    EXPECT_TRUE(cache->AddTexture("tiled.tmp.tex", 1, 17) == nullptr);
+    std::shared_ptr<const TiledTexture> tiles =
+        cache->AddTexture("tiled.tmp.tex", 3, 17);
+    ASSERT_TRUE(tiles != nullptr);
+    MIPMap<RGBSpectrum> tiledMIPMap(tiles);
+    ASSERT_EQ(mipmap.Levels(), tiledMIPMap.Levels());
+
+    // Compare texels, including ones that wrap around, and filtered
+    // lookups from all of the threads at once
+    std::atomic<int> mismatches{0};
+    for (int level = 0; level < mipmap.Levels(); ++level) {
+        Point2i levelRes = tiles->LevelResolution(level);
+        ParallelFor([&](int64_t t) {
+            for (int s = -2; s < levelRes.x + 2; ++s)
+                if (mipmap.Texel(level, s, t) !=
+                    tiledMIPMap.Texel(level, s, t))
+                    ++mismatches;
+        }, levelRes.y, 8);
+    }
+    ParallelFor([&](int64_t i) {
+        RNG rng(i);
+        for (int j = 0; j < 100; ++j) {
+            Point2f st(rng.UniformFloat(), rng.UniformFloat());
+            Vector2f dst0(.01f * rng.UniformFloat(), 0);
+            Vector2f dst1(0, .002f * rng.UniformFloat());
+            if (mipmap.Lookup(st, dst0, dst1) !=
+                tiledMIPMap.Lookup(st, dst0, dst1))
+                ++mismatches;
+        }
+    }, 64);
+    EXPECT_EQ(0, mismatches);
+
+    cache.reset();
+    EXPECT_EQ(0, remove("tiled.tmp.tex"));
+}
+
+// Reads and overwrites the offset of _level_'s tiles in the tiled texture
+// _filename_. The offsets follow the 32-byte header and each level's
+// resolution.
+static uint64_t TiledLevelOffset(const char *filename, int level) {
+    uint64_t offset = 0;
+    FILE *f = fopen(filename, "rb");
+    EXPECT_TRUE(f != nullptr);
+    if (!f) return 0;
+    EXPECT_EQ(0, fseek(f, 32 + 16 * level + 8, SEEK_SET));
+    EXPECT_EQ(1u, fread(&offset, sizeof(offset), 1, f));
+    fclose(f);
+    return offset;
+}
+
+static void SetTiledLevelOffset(const char *filename, int level,
+                                uint64_t offset) {
+    FILE *f = fopen(filename, "r+b");
+    ASSERT_TRUE(f != nullptr);
+    EXPECT_EQ(0, fseek(f, 32 + 16 * level + 8, SEEK_SET));
+    EXPECT_EQ(1u, fwrite(&offset, sizeof(offset), 1, f));
+    EXPECT_EQ(0, fclose(f));
+}
+
+TEST(TextureTileCache, CorruptLevelOffsets) {
+    // Files whose levels other than the last lie past the end of the file
+    // shouldn't be used
+    Point2i res(150, 100);
+    std::vector<Float> image(res.x * res.y, .5f);
+    MIPMap<Float> mipmap(res, image.data());
+    ASSERT_GT(mipmap.Levels(), 2);
+    TextureTileCache cache(1 << 20);
+    ASSERT_TRUE(mipmap.WriteTiled("tiled.tmp.tex", 3));
+    ASSERT_TRUE(cache.AddTexture("tiled.tmp.tex", 1, 3) != nullptr);
+    SetTiledLevelOffset("tiled.tmp.tex", 0, uint64_t(1) << 40);
+    EXPECT_TRUE(cache.AddTexture("tiled.tmp.tex", 1, 3) == nullptr);
+    SetTiledLevelOffset("tiled.tmp.tex", 0, ~uint64_t(0) - 100);
+    EXPECT_TRUE(cache.AddTexture("tiled.tmp.tex", 1, 3) == nullptr);
+    EXPECT_EQ(0, remove("tiled.tmp.tex"));
+}
+
+TEST(TextureTileCache, MapCorruptFiles) {
+    // Tiled files given directly in scenes are mapped into memory, so
+    // ones whose levels overlap the header or each other, or that end
+    // early, must be rejected before their tiles are read
+    Point2i res(150, 100);
+    std::vector<Float> image(res.x * res.y, .5f);
+    MIPMap<Float> mipmap(res, image.data());
+    ASSERT_TRUE(mipmap.WriteTiled("tiled.tmp.tex", 0));
+    ASSERT_TRUE(MapTiledTexture("tiled.tmp.tex") != nullptr);
+    uint64_t offset0 = TiledLevelOffset("tiled.tmp.tex", 0);
+    uint64_t offset1 = TiledLevelOffset("tiled.tmp.tex", 1);
+    ASSERT_LT(offset0, offset1);
+
+    SetTiledLevelOffset("tiled.tmp.tex", 1, offset0);
+    EXPECT_TRUE(MapTiledTexture("tiled.tmp.tex") == nullptr);
+    SetTiledLevelOffset("tiled.tmp.tex", 1, offset1);
+    SetTiledLevelOffset("tiled.tmp.tex", 0, 0);
+    EXPECT_TRUE(MapTiledTexture("tiled.tmp.tex") == nullptr);
+    SetTiledLevelOffset("tiled.tmp.tex", 0, offset0);
+    EXPECT_TRUE(MapTiledTexture("tiled.tmp.tex") != nullptr);
+
+    // Copy all but the last level's tiles
+    std::vector<char> bytes(offset1);
+    FILE *f = fopen("tiled.tmp.tex", "rb");
+    ASSERT_TRUE(f != nullptr);
+    EXPECT_EQ(bytes.size(), fread(bytes.data(), 1, bytes.size(), f));
+    fclose(f);
+    f = fopen("tiled.tmp.tex", "wb");
+    ASSERT_TRUE(f != nullptr);
+    EXPECT_EQ(bytes.size(), fwrite(bytes.data(), 1, bytes.size(), f));
+    fclose(f);
+    EXPECT_TRUE(MapTiledTexture("tiled.tmp.tex") == nullptr);
+    EXPECT_EQ(0, remove("tiled.tmp.tex"));
+}
+
+TEST(TextureTileCache, EncodedTexels) {
+    ParallelScope threads(4);
+
+    // Write half and 8-bit copies of a MIP map and check that both the
+    // memory-mapped files and the tile cache return the expected texels
+    Point2i res(100, 80);
+    std::vector<Float> image(res.x * res.y);
+    RNG rng;
+    for (Float &texel : image) texel = rng.UniformFloat();
+    MIPMap<Float> mipmap(res, image.data());
+    std::unique_ptr<TextureTileCache> cache(new TextureTileCache(1 << 20));
+    for (TexelEncoding encoding :
+         {TexelEncoding::Half, TexelEncoding::SRGB8}) {
+        ASSERT_TRUE(mipmap.WriteTiled("tiled.tmp.tex", 0, encoding));
+        std::shared_ptr<const TiledTexture> mapped =
+            MapTiledTexture("tiled.tmp.tex");
+        std::shared_ptr<const TiledTexture> cached =
+            cache->AddTexture("tiled.tmp.tex");
+        ASSERT_TRUE(mapped != nullptr && cached != nullptr);
+        EXPECT_EQ(1, mapped->Channels());
+        EXPECT_TRUE(mapped->Encoding() == encoding);
+        MIPMap<Float> mappedMIPMap(mapped), cachedMIPMap(cached);
+        for (int level = 0; level < mipmap.Levels(); ++level) {
+            Point2i levelRes = mapped->LevelResolution(level);
+            for (int t = 0; t < levelRes.y; ++t)
+                for (int s = 0; s < levelRes.x; ++s) {
+                    Float v = mipmap.Texel(level, s, t);
+                    Float mv = mappedMIPMap.Texel(level, s, t);
+                    EXPECT_EQ(mv, cachedMIPMap.Texel(level, s, t));
+                    // Half floats have 11 bits of precision; the step
+                    // between 8-bit sRGB values is at most 1/80 or so, and
+                    // resampling may have made texels greater than one
+                    if (encoding == TexelEncoding::Half)
+                        EXPECT_NEAR(v, mv, v * (1.f / 2048));
+                    else
+                        EXPECT_NEAR(std::min<Float>(v, 1), mv, 1.f / 150);
+                }
+        }
+        EXPECT_EQ(0, remove("tiled.tmp.tex"));
+    }
+
+    cache.reset();
+}
+
+TEST(TextureTileCache, CompactMIPMap) {
+    ParallelScope threads(4);
+
+    // MIP maps that store their texels as half floats or 8-bit sRGB
+    // should closely match one that stores floats
+    Point2i res(90, 130);
+    std::vector<RGBSpectrum> image(res.x * res.y);
+    RNG rng;
+    for (RGBSpectrum &texel : image) {
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        texel = RGBSpectrum::FromRGB(rgb);
+    }
+    MIPMap<RGBSpectrum> mipmap(res, image.data());
+    for (TexelEncoding encoding :
+         {TexelEncoding::Half, TexelEncoding::SRGB8}) {
+        MIPMap<RGBSpectrum> compact(res, image.data(), false, 8.f,
+                                    ImageWrap::Repeat, encoding);
+        ASSERT_EQ(mipmap.Levels(), compact.Levels());
+        Float tolerance =
+            encoding == TexelEncoding::Half ? 1.f / 1024 : 1.f / 150;
+        for (int level = 0; level < mipmap.Levels(); ++level) {
+            Point2i levelRes(mipmap.Width() >> level, mipmap.Height() >> level);
+            for (int t = 0; t < std::max(1, levelRes.y); ++t)
+                for (int s = -1; s < std::max(1, levelRes.x) + 1; ++s) {
+                    RGBSpectrum v = mipmap.Texel(level, s, t);
+                    RGBSpectrum cv = compact.Texel(level, s, t);
+                    // Only 8-bit sRGB clamps resampling overshoot
+                    if (encoding == TexelEncoding::SRGB8)
+                        v = v.Clamp(0, 1);
+                    for (int c = 0; c < 3; ++c)
+                        EXPECT_NEAR(v[c], cv[c], tolerance);
+                }
+        }
+        for (int i = 0; i < 100; ++i) {
+            Point2f st(rng.UniformFloat(), rng.UniformFloat());
+            Vector2f dst0(.02f * rng.UniformFloat(), 0);
+            Vector2f dst1(0, .005f * rng.UniformFloat());
+            RGBSpectrum v = mipmap.Lookup(st, dst0, dst1);
+            RGBSpectrum cv = compact.Lookup(st, dst0, dst1);
+            for (int c = 0; c < 3; ++c) EXPECT_NEAR(v[c], cv[c], tolerance);
+        }
+    }
+}
+
+TEST(TextureTileCache, HalfConversion) {
+    EXPECT_EQ(0, HalfToFloat(FloatToHalf(0.f)));
+    EXPECT_EQ(1, HalfToFloat(FloatToHalf(1.f)));
+    EXPECT_EQ(-2.5f, HalfToFloat(FloatToHalf(-2.5f)));
+    EXPECT_EQ(65504, HalfToFloat(FloatToHalf(65504.f)));
+    EXPECT_TRUE(std::isinf(HalfToFloat(FloatToHalf(70000.f))));
+    EXPECT_TRUE(std::isnan(HalfToFloat(FloatToHalf(std::nanf("")))));
+    // Smallest denormalized half, and rounding to nearest even
+    EXPECT_EQ(std::ldexp(1.f, -24),
+              HalfToFloat(FloatToHalf(std::ldexp(1.f, -24))));
+    EXPECT_EQ(1, HalfToFloat(FloatToHalf(1 + std::ldexp(1.f, -11))));
+    EXPECT_EQ(1 + std::ldexp(1.f, -9),
+              HalfToFloat(FloatToHalf(1 + 3 * std::ldexp(1.f, -11))));
+
+    // Every half value should survive a round trip through float
+    for (int h = 0; h < 65536; ++h) {
+        float f = HalfToFloat(h);
+        if (!std::isnan(f)) {
+            EXPECT_EQ(h, FloatToHalf(f));
+        }
+    }
+}
+
+TEST(ImageTexture, ScaledTexelsKeepTheirRange) {
+    // Texels are scaled before they are encoded, so scaled 8-bit images
+    // must not be stored as half floats, which would overflow here
+    std::vector<Float> rgb(4 * 4 * 3, 1.f);
+    WriteImage("scaled.tmp.png", rgb.data(), Bounds2i({0, 0}, {4, 4}),
+               Point2i(4, 4));
+    Float scale = 1e5f;
+    ImageTexture<Float, Float> texture(
+        std::unique_ptr<TextureMapping2D>(new UVMapping2D), "scaled.tmp.png",
+        false, 8.f, ImageWrap::Repeat, scale, false);
+    SurfaceInteraction si;
+    si.uv = Point2f(.5f, .5f);
+    EXPECT_NEAR(scale, texture.Evaluate(si), scale * 1e-5f);
+    ImageTexture<Float, Float>::ClearCache();
+    EXPECT_EQ(0, remove("scaled.tmp.png"));
+}
@@ -33,11 +33,31 @@
 
 // textures/imagemap.cpp*
 #include "textures/imagemap.h"
+#include "api.h"
+#include "fileutil.h"
 #include "imageio.h"
 #include "stats.h"
+#include "texcache.h"
 
 namespace pbrt {
 
+// ImageTexture Utility Functions
+
+// Returns the most compact encoding that can hold the texels of an image in
+// _filename_'s format: 8-bit sRGB for 8-bit images whose values are
+// sRGB-encoded, and half floats for other 8-bit images and for OpenEXR
+// images, which pbrt reads as half floats. Texels are scaled before they
+// are encoded, so scaled textures keep full floats: a scale could push
+// texels past the largest half float or below its precision.
+static TexelEncoding ImageTexelEncoding(const std::string &filename,
+                                        Float scale, bool gamma) {
+    if (scale != 1) return TexelEncoding::Float;
+    if (HasExtension(filename, ".png") || HasExtension(filename, ".tga"))
+        return gamma ? TexelEncoding::SRGB8 : TexelEncoding::Half;
+    if (HasExtension(filename, ".exr")) return TexelEncoding::Half;
+    return TexelEncoding::Float;
+}
+
 // ImageTexture Method Definitions
 template <typename Tmemory, typename Treturn>
 ImageTexture<Tmemory, Treturn>::ImageTexture(
@@ -50,19 +70,74 @@ ImageTexture<Tmemory, Treturn>::ImageTexture(
 }
 
 template <typename Tmemory, typename Treturn>
-MIPMap<Tmemory> *ImageTexture<Tmemory, Treturn>::GetTexture(
-    const std::string &filename, bool doTrilinear, Float maxAniso,
-    ImageWrap wrap, Float scale, bool gamma) {
+const std::unique_ptr<MIPMap<Tmemory>> *
+ImageTexture<Tmemory, Treturn>::GetTexture(const std::string &filename,
+                                           bool doTrilinear, Float maxAniso,
+                                           ImageWrap wrap, Float scale,
+                                           bool gamma) {
     // Return _MIPMap_ from texture cache if present
     TexInfo texInfo(filename, doTrilinear, maxAniso, wrap, scale, gamma);
-    if (textures.find(texInfo) != textures.end())
-        return textures[texInfo].get();
+    auto iter = textures.find(texInfo);
+    if (iter != textures.end()) return &iter->second;
 
-    // Create _MIPMap_ for _filename_
+    // Create _MIPMap_ for _filename_ while the rest of the scene is parsed
+    std::unique_ptr<MIPMap<Tmemory>> *mipmap = &textures[texInfo];
+    RunSceneLoadingTask([=]() {
+        mipmap->reset(
+            LoadMIPMap(filename, doTrilinear, maxAniso, wrap, scale, gamma));
+    });
+    return mipmap;
+}
+
+template <typename Tmemory, typename Treturn>
+MIPMap<Tmemory> *ImageTexture<Tmemory, Treturn>::LoadMIPMap(
+    const std::string &filename, bool doTrilinear, Float maxAniso,
+    ImageWrap wrap, Float scale, bool gamma) {
     ProfilePhase _(Prof::TextureLoading);
+    MIPMap<Tmemory> *mipmap = nullptr;
+    TextureTileCache *tileCache = GetTextureTileCache();
+    bool isTiled = HasExtension(filename, ".tiled");
+    if (isTiled) {
+        // Use the pre-filtered pyramid of a tiled MIP file directly, either
+        // through the tile cache or mapped into memory
+        if (gamma)
+            Warning("%s: ignoring \"gamma\" for tiled texture; its texels "
+                    "are linear", filename.c_str());
+        std::shared_ptr<const TiledTexture> tiles =
+            tileCache ? tileCache->AddTexture(filename)
+                      : MapTiledTexture(filename);
+        if (tiles) {
+            mipmap = new MIPMap<Tmemory>(tiles, doTrilinear, maxAniso, wrap,
+                                         scale);
+            return mipmap;
+        }
+        Error("%s: unable to read tiled texture", filename.c_str());
+    }
+    TexelEncoding encoding = ImageTexelEncoding(filename, scale, gamma);
+    std::string tiledFilename;
+    uint64_t stamp = 0;
+    if (tileCache && !isTiled) {
+        // Read the texture through the tile cache if it has already been
+        // converted to a tiled MIP file
+        int nChannels = TiledChannels((Tmemory *)nullptr);
+        tiledFilename = TiledTextureCacheFilename(StringPrintf(
+            "%s %d %f %d %d %d", AbsolutePath(filename).c_str(), nChannels,
+            scale, (int)gamma, (int)wrap, (int)encoding));
+        stamp = TextureSourceStamp(filename);
+        std::shared_ptr<const TiledTexture> tiles =
+            tileCache->AddTexture(tiledFilename, nChannels, stamp);
+        if (tiles) {
+            LOG(INFO) << "Using tiled texture " << tiledFilename << " for " <<
+                filename;
+            mipmap = new MIPMap<Tmemory>(tiles, doTrilinear, maxAniso, wrap);
+            return mipmap;
+        }
+    }
     Point2i resolution;
-    std::unique_ptr<RGBSpectrum[]> texels = ReadImage(filename, &resolution);
+    std::unique_ptr<RGBSpectrum[]> texels;
+    if (!isTiled) texels = ReadImage(filename, &resolution);
     if (!texels) {
+        encoding = TexelEncoding::Float;
         Warning("Creating a constant grey texture to replace \"%s\".",
                 filename.c_str());
         resolution.x = resolution.y = 1;
@@ -80,21 +155,35 @@ MIPMap<Tmemory> *ImageTexture<Tmemory, Treturn>::GetTexture(
             std::swap(texels[o1], texels[o2]);
         }
 
-    MIPMap<Tmemory> *mipmap = nullptr;
     if (texels) {
-        // Convert texels to type _Tmemory_ and create _MIPMap_
+        // Convert texels to type _Tmemory_ and create _MIPMap_, storing its
+        // texels with no more precision than the image has
         std::unique_ptr<Tmemory[]> convertedTexels(
             new Tmemory[resolution.x * resolution.y]);
         for (int i = 0; i < resolution.x * resolution.y; ++i)
             convertIn(texels[i], &convertedTexels[i], scale, gamma);
         mipmap = new MIPMap<Tmemory>(resolution, convertedTexels.get(),
-                                     doTrilinear, maxAniso, wrap);
+                                     doTrilinear, maxAniso, wrap, encoding);
+
+        // Replace the _MIPMap_ with one that reads a tiled copy of it
+        // through the tile cache, if one can be written
+        if (tileCache && resolution.x * resolution.y > 1 &&
+            mipmap->WriteTiled(tiledFilename, stamp, encoding)) {
+            std::shared_ptr<const TiledTexture> tiles = tileCache->AddTexture(
+                tiledFilename, TiledChannels((Tmemory *)nullptr), stamp);
+            if (tiles) {
+                LOG(INFO) << "Wrote tiled texture " << tiledFilename <<
+                    " for " << filename;
+                delete mipmap;
+                mipmap =
+                    new MIPMap<Tmemory>(tiles, doTrilinear, maxAniso, wrap);
+            }
+        }
     } else {
         // Create one-valued _MIPMap_
         Tmemory oneVal = scale;
         mipmap = new MIPMap<Tmemory>(Point2i(1, 1), &oneVal);
     }
-    textures[texInfo].reset(mipmap);
     return mipmap;
 }
 
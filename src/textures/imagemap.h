@@ -87,7 +87,7 @@ class ImageTexture : public Texture<Treturn> {
     Treturn Evaluate(const SurfaceInteraction &si) const {
         Vector2f dstdx, dstdy;
         Point2f st = mapping->Map(si, &dstdx, &dstdy);
-        Tmemory mem = mipmap->Lookup(st, dstdx, dstdy);
+        Tmemory mem = (*mipmap)->Lookup(st, dstdx, dstdy);
         Treturn ret;
         convertOut(mem, &ret);
         return ret;
@@ -95,7 +95,10 @@ class ImageTexture : public Texture<Treturn> {
 
   private:
     // ImageTexture Private Methods
-    static MIPMap<Tmemory> *GetTexture(const std::string &filename,
+    static const std::unique_ptr<MIPMap<Tmemory>> *GetTexture(
+        const std::string &filename, bool doTrilinear, Float maxAniso,
+        ImageWrap wm, Float scale, bool gamma);
+    static MIPMap<Tmemory> *LoadMIPMap(const std::string &filename,
                                        bool doTrilinear, Float maxAniso,
                                        ImageWrap wm, Float scale, bool gamma);
     static void convertIn(const RGBSpectrum &from, RGBSpectrum *to, Float scale,
@@ -116,7 +119,9 @@ class ImageTexture : public Texture<Treturn> {
 
     // ImageTexture Private Data
     std::unique_ptr<TextureMapping2D> mapping;
-    MIPMap<Tmemory> *mipmap;
+    // The _MIPMap_ is owned by _textures_; it may be loaded by a scene
+    // loading task and isn't available until those have finished
+    const std::unique_ptr<MIPMap<Tmemory>> *mipmap;
     static std::map<TexInfo, std::unique_ptr<MIPMap<Tmemory>>> textures;
 };
 
@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <algorithm>
 #include "fileutil.h"
+#include "film.h"
+#include "filters/box.h"
 #include "imageio.h"
 #include "pbrt.h"
 #include "spectrum.h"
@@ -31,7 +33,7 @@ static void usage(const char *msg = nullptr, ...) {
     }
     fprintf(stderr, R"(usage: imgtool <command> [options] <filenames...>
 
-commands: assemble, cat, convert, diff, info, makesky
+commands: assemble, cat, convert, diff, info, makesky, merge
 
 assemble option:
     --outfile          Output image filename.
@@ -80,6 +82,11 @@ makesky options:
                        (Horizontal resolution is twice this value.)
                        Default: 2048
 
+merge option:
+    --outfile <name>   Filename of the image to write after adding up the
+                       partial films written by "pbrt --samplesplit".
+                       Each of the parts 0 to n-1 must be given once.
+
 )");
     exit(1);
 }
@@ -761,6 +768,72 @@ int convert(int argc, char *argv[]) {
     return 0;
 }
 
+int merge(int argc, char *argv[]) {
+    const char *outfile = nullptr;
+    std::vector<const char *> infiles;
+    for (int i = 0; i < argc; ++i) {
+        if (!strcmp(argv[i], "--outfile") || !strcmp(argv[i], "-outfile")) {
+            if (i + 1 == argc)
+                usage("missing filename for %s parameter", argv[i]);
+            outfile = argv[++i];
+        } else if (!strncmp(argv[i], "--outfile=", 10)) {
+            outfile = &argv[i][10];
+        } else
+            infiles.push_back(argv[i]);
+    }
+    if (infiles.empty()) usage("no filenames provided to \"merge\"?");
+    if (!outfile) usage("--outfile not provided for \"merge\"");
+
+    // Make a film for the image that the partial films were written for;
+    // its filter doesn't matter, since no samples are added to it
+    Point2i resolution;
+    Bounds2f cropWindow;
+    Float scale, splatScale;
+    int sampleSplit, nSampleSplits;
+    if (!ReadPartialFilmInfo(infiles[0], &resolution, &cropWindow, &scale,
+                             &splatScale, &sampleSplit, &nSampleSplits))
+        return 1;
+    if (nSampleSplits < 1) {
+        fprintf(stderr, "%s: invalid number of parts %d\n", infiles[0],
+                nSampleSplits);
+        return 1;
+    }
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    Film film(resolution, cropWindow, std::move(filter), 35.f, outfile,
+              scale);
+
+    // Each of the image's parts must be merged exactly once
+    std::vector<bool> merged(nSampleSplits, false);
+    for (const char *file : infiles) {
+        Point2i res;
+        Bounds2f crop;
+        Float s, ss;
+        int split, nSplits;
+        if (!ReadPartialFilmInfo(file, &res, &crop, &s, &ss, &split, &nSplits))
+            return 1;
+        if (nSplits != nSampleSplits || split < 0 || split >= nSplits) {
+            fprintf(stderr, "%s: part %d of %d, but %s is one of %d parts\n",
+                    file, split, nSplits, infiles[0], nSampleSplits);
+            return 1;
+        }
+        if (merged[split]) {
+            fprintf(stderr, "%s: part %d of %d was already merged\n", file,
+                    split, nSplits);
+            return 1;
+        }
+        merged[split] = true;
+        if (!film.MergePartialFilm(file)) return 1;
+    }
+    for (int split = 0; split < nSampleSplits; ++split)
+        if (!merged[split]) {
+            fprintf(stderr, "%s: part %d of %d is missing\n", outfile, split,
+                    nSampleSplits);
+            return 1;
+        }
+    film.WriteImage(splatScale);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     google::InitGoogleLogging(argv[0]);
     FLAGS_stderrthreshold = 1; // Warning and above.
@@ -779,6 +852,8 @@ int main(int argc, char *argv[]) {
         return info(argc - 2, argv + 2);
     else if (!strcmp(argv[1], "makesky"))
         return makesky(argc - 2, argv + 2);
+    else if (!strcmp(argv[1], "merge"))
+        return merge(argc - 2, argv + 2);
     else
         usage("unknown command \"%s\"", argv[1]);
 
@@ -0,0 +1,151 @@
+//
+// maketx.cpp
+//
+// Converts images to tiled MIP files: pre-filtered MIP pyramids that image
+// textures use directly, without resampling and filtering the image when
+// the scene is loaded.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fileutil.h"
+#include "imageio.h"
+#include "mipmap.h"
+#include "parallel.h"
+#include "pbrt.h"
+#include "spectrum.h"
+#include "texcache.h"
+#include <glog/logging.h>
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr, ...) {
+    if (msg) {
+        va_list args;
+        va_start(args, msg);
+        fprintf(stderr, "maketx: ");
+        vfprintf(stderr, msg, args);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, R"(usage: maketx [options] <image> <output.tiled>
+
+Writes the MIP pyramid of <image> to a tiled MIP file. Image textures whose
+"filename" is a .tiled file use its pyramid as is; their "scale" applies
+when texels are looked up and "gamma" is ignored, since the stored texels
+are linear.
+
+options:
+    --8bit             Store texels as 8-bit sRGB-encoded values. Values
+                       outside [0,1] are clamped.
+    --gamma            Treat the image's values as sRGB-encoded and convert
+                       them to linear. Default: only for PNG and TGA images.
+    --half             Store texels as 16-bit floats.
+    --luminance        Store only the luminance of each texel, for textures
+                       that are used as "float" textures.
+    --nogamma          Treat the image's values as linear.
+    --wrap <mode>      Wrap mode used when resampling the image to a power
+                       of two resolution: "repeat", "black", or "clamp".
+                       Should match the textures' "wrap". Default: repeat
+)");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_stderrthreshold = 1; // Warning and above.
+
+    TexelEncoding encoding = TexelEncoding::Float;
+    ImageWrap wrapMode = ImageWrap::Repeat;
+    int gamma = -1;
+    bool luminance = false;
+    std::vector<const char *> filenames;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--8bit") || !strcmp(argv[i], "-8bit"))
+            encoding = TexelEncoding::SRGB8;
+        else if (!strcmp(argv[i], "--half") || !strcmp(argv[i], "-half"))
+            encoding = TexelEncoding::Half;
+        else if (!strcmp(argv[i], "--gamma") || !strcmp(argv[i], "-gamma"))
+            gamma = 1;
+        else if (!strcmp(argv[i], "--nogamma") ||
+                 !strcmp(argv[i], "-nogamma"))
+            gamma = 0;
+        else if (!strcmp(argv[i], "--luminance") ||
+                 !strcmp(argv[i], "-luminance"))
+            luminance = true;
+        else if (!strcmp(argv[i], "--wrap") || !strcmp(argv[i], "-wrap")) {
+            if (i + 1 == argc) usage("missing value after --wrap argument");
+            const char *wrap = argv[++i];
+            if (!strcmp(wrap, "repeat"))
+                wrapMode = ImageWrap::Repeat;
+            else if (!strcmp(wrap, "black"))
+                wrapMode = ImageWrap::Black;
+            else if (!strcmp(wrap, "clamp"))
+                wrapMode = ImageWrap::Clamp;
+            else
+                usage("unknown wrap mode \"%s\"", wrap);
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-help") ||
+                   !strcmp(argv[i], "-h"))
+            usage();
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+            usage("unknown option \"%s\"", argv[i]);
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (filenames.size() != 2)
+        usage("expected an input image and an output filename");
+    std::string inFilename = filenames[0], outFilename = filenames[1];
+    if (!HasExtension(outFilename, ".tiled"))
+        usage("output filename \"%s\" must have a .tiled extension",
+              outFilename.c_str());
+    if (gamma == -1)
+        gamma = HasExtension(inFilename, ".tga") ||
+                HasExtension(inFilename, ".png");
+
+    Point2i res;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage(inFilename, &res);
+    if (!image) return 1;
+
+    // Flip the image in y and convert it to linear values the same way
+    // that _ImageTexture_ does
+    int nTexels = res.x * res.y;
+    std::unique_ptr<RGBSpectrum[]> texels(new RGBSpectrum[nTexels]);
+    std::unique_ptr<Float[]> y(new Float[nTexels]);
+    bool clamped = false;
+    for (int t = 0; t < res.y; ++t)
+        for (int s = 0; s < res.x; ++s) {
+            const RGBSpectrum &texel = image[(res.y - 1 - t) * res.x + s];
+            int offset = t * res.x + s;
+            Float rgb[3];
+            texel.ToRGB(rgb);
+            for (int c = 0; c < 3; ++c) {
+                if (gamma) rgb[c] = InverseGammaCorrect(rgb[c]);
+                clamped |= rgb[c] > 1;
+            }
+            texels[offset] = RGBSpectrum::FromRGB(rgb);
+            y[offset] = gamma ? InverseGammaCorrect(texel.y()) : texel.y();
+        }
+    if (clamped && encoding == TexelEncoding::SRGB8)
+        Warning("%s: clamping values greater than one to store them in 8 "
+                "bits", inFilename.c_str());
+
+    // Build the MIP pyramid and write it
+    ParallelInit();
+    bool writeOK;
+    int nLevels;
+    if (luminance) {
+        MIPMap<Float> mipmap(res, y.get(), false, 8.f, wrapMode);
+        writeOK = mipmap.WriteTiled(outFilename, 0, encoding);
+        nLevels = mipmap.Levels();
+    } else {
+        MIPMap<RGBSpectrum> mipmap(res, texels.get(), false, 8.f, wrapMode);
+        writeOK = mipmap.WriteTiled(outFilename, 0, encoding);
+        nLevels = mipmap.Levels();
+    }
+    ParallelCleanup();
+    if (!writeOK) return 1;
+    printf("%s: %d x %d, %d MIP levels\n", outFilename.c_str(), res.x, res.y,
+           nLevels);
+    return 0;
+}